@@ -0,0 +1,268 @@
+#include "batched_mesh.h"
+#include "drawable.h"
+#include <algorithm>
+
+static const unsigned int s_floatsPerDraw = sizeof(InstanceData) / sizeof(float);
+
+// bound of the batch is the union of every draw's bound placed by its model matrix
+class BatchedBoundingBoxCallback : public osg::Drawable::ComputeBoundingBoxCallback
+{
+public:
+	BatchedBoundingBoxCallback(osg::FloatArray* draws) :
+		m_draws(draws) {}
+
+	void addDrawBound(const osg::BoundingBox& bb) { m_drawBounds.push_back(bb); }
+	// removed draws get an invalid bound and no longer extend the batch
+	void setDrawBound(int id, const osg::BoundingBox& bb) { m_drawBounds[id] = bb; }
+	const osg::BoundingBox& getDrawBound(int id) const { return m_drawBounds[id]; }
+
+	virtual osg::BoundingBox computeBound(const osg::Drawable&) const override {
+		osg::BoundingBox bb;
+		auto draws = reinterpret_cast<const InstanceData*>(m_draws->asVector().data());
+		unsigned int count = std::min<unsigned int>(m_drawBounds.size(), m_draws->size() / s_floatsPerDraw);
+		for (unsigned int i = 0; i < count; ++i) {
+			if (!m_drawBounds[i].valid()) {
+				continue;
+			}
+			for (unsigned int c = 0; c < 8; ++c) {
+				bb.expandBy(m_drawBounds[i].corner(c) * draws[i].model);
+			}
+		}
+		return bb;
+	}
+
+protected:
+	std::vector<osg::BoundingBox> m_drawBounds;
+	osg::ref_ptr<osg::FloatArray> m_draws;
+};
+
+BatchedMesh::BatchedMesh(osg::Program* program) :
+	m_numDraws(0)
+{
+	m_vertexArray = new osg::Vec3Array;
+	m_normalArray = new osg::Vec3Array;
+	m_drawElements = new osg::MultiDrawElementsIndirectUInt(GL_TRIANGLES);
+	m_commands = new osg::DefaultIndirectCommandDrawElements;
+	m_drawElements->setIndirectCommandArray(m_commands);
+
+	m_geometry = new osg::Geometry;
+	m_geometry->setUseDisplayList(false);
+	m_geometry->setUseVertexBufferObjects(true);
+	m_geometry->setVertexAttribArray(Drawable::Vertex, m_vertexArray, osg::Array::BIND_PER_VERTEX);
+	m_geometry->setVertexAttribArray(Drawable::Normal, m_normalArray, osg::Array::BIND_PER_VERTEX);
+	m_geometry->addPrimitiveSet(m_drawElements);
+	m_geometry->getOrCreateStateSet()->setAttributeAndModes(program, osg::StateAttribute::ON);
+
+	m_drawArray = new osg::FloatArray;
+	m_binding = new osg::ShaderStorageBufferBinding(INSTANCE_SSBO_BINDING, m_drawArray.get());
+	m_boundCallback = new BatchedBoundingBoxCallback(m_drawArray.get());
+	m_geometry->setComputeBoundingBoxCallback(m_boundCallback);
+
+	m_geode = new osg::Geode;
+	m_geode->addDrawable(m_geometry);
+	m_geode->getOrCreateStateSet()->setAttributeAndModes(m_binding, osg::StateAttribute::ON);
+	// lets the shared depth-only programs (shadow passes) index the draw matrices by gl_DrawIDARB
+	m_geode->getOrCreateStateSet()->addUniform(new osg::Uniform("useMultiDraw", true));
+	m_geode->setNodeMask(0);
+}
+
+BatchedMesh::~BatchedMesh()
+{
+
+}
+
+int BatchedMesh::addDraw(const ModelData& modelData, const osg::Matrixf& matrix, int materialIndex)
+{
+	if (!modelData.m_vertexArray.valid() || modelData.m_vertexArray->empty()) {
+		return -1;
+	}
+	if (modelData.m_drawElement.valid() && modelData.m_drawElement->getMode() != GL_TRIANGLES) {
+		return -1;
+	}
+
+	unsigned int baseVertex = m_vertexArray->size();
+	unsigned int firstIndex = m_drawElements->size();
+	unsigned int numVertices = modelData.m_vertexArray->size();
+	m_vertexArray->insert(m_vertexArray->end(), modelData.m_vertexArray->begin(), modelData.m_vertexArray->end());
+	if (modelData.m_normalArray.valid() && modelData.m_normalArray->size() == numVertices) {
+		m_normalArray->insert(m_normalArray->end(), modelData.m_normalArray->begin(), modelData.m_normalArray->end());
+	}
+	else {
+		m_normalArray->resize(m_vertexArray->size(), osg::Vec3(0.0, 0.0, 1.0));
+	}
+	if (modelData.m_drawElement.valid()) {
+		m_drawElements->insert(m_drawElements->end(), modelData.m_drawElement->begin(), modelData.m_drawElement->end());
+	}
+	else {
+		for (unsigned int i = 0; i < numVertices; ++i) {
+			m_drawElements->push_back(i);
+		}
+	}
+
+	osg::DrawElementsIndirectCommand command;
+	command.count = m_drawElements->size() - firstIndex;
+	command.instanceCount = 1;
+	command.firstIndex = firstIndex;
+	command.baseVertex = baseVertex;
+	command.baseInstance = 0;
+	m_commands->push_back(command);
+
+	osg::BoundingBox bb;
+	for (const auto& vertex : *modelData.m_vertexArray) {
+		bb.expandBy(vertex);
+	}
+	m_boundCallback->addDrawBound(bb);
+
+	int id = m_numDraws;
+	m_numDraws++;
+	m_visible.push_back(true);
+	m_drawArray->resize(m_numDraws * s_floatsPerDraw, 0.0f);
+	data()[id].index = osg::Vec4i(materialIndex, 0, 0, 0);
+	m_binding->setSize(m_drawArray->getTotalDataSize());
+
+	m_vertexArray->dirty();
+	m_normalArray->dirty();
+	m_drawElements->dirty();
+	m_commands->dirty();
+	// an empty storage buffer can't be bound, the first draw makes the geode visible
+	m_geode->setNodeMask(~0u);
+
+	setMatrix(id, matrix);
+	return id;
+}
+
+void BatchedMesh::setMatrix(int id, const osg::Matrixf& matrix)
+{
+	if (id < 0 || static_cast<unsigned int>(id) >= m_numDraws) {
+		return;
+	}
+	InstanceData& draw = data()[id];
+	draw.model = matrix;
+	osg::Matrixf normal = osg::Matrixf::inverse(matrix);
+	normal.transpose(normal);
+	draw.normal = normal;
+	m_drawArray->dirty();
+	m_geometry->dirtyBound();
+}
+
+void BatchedMesh::setMaterialIndex(int id, int materialIndex)
+{
+	if (id < 0 || static_cast<unsigned int>(id) >= m_numDraws) {
+		return;
+	}
+	data()[id].index.x() = materialIndex;
+	m_drawArray->dirty();
+}
+
+void BatchedMesh::setVisible(int id, bool visible)
+{
+	if (id < 0 || static_cast<unsigned int>(id) >= m_numDraws || !m_boundCallback->getDrawBound(id).valid()) {
+		return;
+	}
+	m_visible[id] = visible;
+	m_commands->instanceCount(id) = visible ? 1 : 0;
+	m_commands->dirty();
+}
+
+void BatchedMesh::removeDraw(int id)
+{
+	if (id < 0 || static_cast<unsigned int>(id) >= m_numDraws) {
+		return;
+	}
+	setVisible(id, false);
+	m_boundCallback->setDrawBound(id, osg::BoundingBox());
+	m_geometry->dirtyBound();
+}
+
+// segment parameter of the hit in [0, 1], or a negative value for none (Moller-Trumbore)
+static double intersectTriangle(const osg::Vec3d& start, const osg::Vec3d& dir,
+	const osg::Vec3d& v0, const osg::Vec3d& v1, const osg::Vec3d& v2)
+{
+	osg::Vec3d e1 = v1 - v0;
+	osg::Vec3d e2 = v2 - v0;
+	osg::Vec3d p = dir ^ e2;
+	double det = e1 * p;
+	if (fabs(det) < 1e-12) {
+		return -1.0;
+	}
+	double invDet = 1.0 / det;
+	osg::Vec3d t = start - v0;
+	double u = (t * p) * invDet;
+	if (u < 0.0 || u > 1.0) {
+		return -1.0;
+	}
+	osg::Vec3d q = t ^ e1;
+	double v = (dir * q) * invDet;
+	if (v < 0.0 || u + v > 1.0) {
+		return -1.0;
+	}
+	double r = (e2 * q) * invDet;
+	return r >= 0.0 && r <= 1.0 ? r : -1.0;
+}
+
+static bool intersectBox(const osg::Vec3d& start, const osg::Vec3d& dir, const osg::BoundingBox& bb)
+{
+	double tMin = 0.0, tMax = 1.0;
+	for (int axis = 0; axis < 3; ++axis) {
+		if (fabs(dir[axis]) < 1e-12) {
+			if (start[axis] < bb._min[axis] || start[axis] > bb._max[axis]) {
+				return false;
+			}
+			continue;
+		}
+		double t0 = (bb._min[axis] - start[axis]) / dir[axis];
+		double t1 = (bb._max[axis] - start[axis]) / dir[axis];
+		if (t0 > t1) {
+			std::swap(t0, t1);
+		}
+		tMin = std::max(tMin, t0);
+		tMax = std::min(tMax, t1);
+		if (tMin > tMax) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int BatchedMesh::intersect(const osg::Vec3d& start, const osg::Vec3d& end, double& ratio) const
+{
+	int hit = -1;
+	ratio = 1.0;
+	const InstanceData* draws = data();
+	for (unsigned int id = 0; id < m_numDraws; ++id) {
+		const osg::BoundingBox& bb = m_boundCallback->getDrawBound(id);
+		if (!m_visible[id] || !bb.valid()) {
+			continue;
+		}
+		// the ratio along the segment is the same in the draw's local space
+		osg::Matrixd inverse = osg::Matrixd::inverse(osg::Matrixd(draws[id].model));
+		osg::Vec3d localStart = start * inverse;
+		osg::Vec3d localDir = end * inverse - localStart;
+		if (!intersectBox(localStart, localDir, bb)) {
+			continue;
+		}
+		const osg::DrawElementsIndirectCommand& command = (*m_commands)[id];
+		for (unsigned int i = 0; i + 2 < command.count; i += 3) {
+			const unsigned int* indices = &(*m_drawElements)[command.firstIndex + i];
+			double r = intersectTriangle(localStart, localDir,
+				(*m_vertexArray)[command.baseVertex + indices[0]],
+				(*m_vertexArray)[command.baseVertex + indices[1]],
+				(*m_vertexArray)[command.baseVertex + indices[2]]);
+			if (r >= 0.0 && r < ratio) {
+				ratio = r;
+				hit = static_cast<int>(id);
+			}
+		}
+	}
+	return hit;
+}
+
+InstanceData* BatchedMesh::data()
+{
+	return reinterpret_cast<InstanceData*>(m_drawArray->asVector().data());
+}
+
+const InstanceData* BatchedMesh::data() const
+{
+	return reinterpret_cast<const InstanceData*>(m_drawArray->asVector().data());
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "canvas3d_export.h"
+#include "instanced_mesh.h"
+#include <osg/PrimitiveSetIndirect>
+#include <common/model_data.h>
+
+class BatchedBoundingBoxCallback;
+
+// opaque triangle meshes packed into shared vertex and index buffers and drawn with a single
+// glMultiDrawElementsIndirect call, so the draw count doesn't grow with the number of parts.
+// per-draw transforms and material indices use the InstanceData layout, indexed by gl_DrawIDARB.
+// all methods must run on the render thread.
+class CANVAS_EXPORT BatchedMesh : public osg::Referenced
+{
+public:
+	BatchedMesh(osg::Program* program);
+
+	osg::Geode* getGeode() { return m_geode.get(); }
+	osg::Geometry* getGeometry() { return m_geometry.get(); }
+
+	// returns the draw id, or -1 if the data isn't an indexed or plain triangle list
+	int addDraw(const ModelData& modelData, const osg::Matrixf& matrix, int materialIndex);
+	void setMatrix(int id, const osg::Matrixf& matrix);
+	void setMaterialIndex(int id, int materialIndex);
+
+	// a hidden draw keeps its range but is issued with no instances
+	void setVisible(int id, bool visible);
+	// the range stays allocated as a hole, the id is not reused
+	void removeDraw(int id);
+
+	// nearest visible draw hit by the segment (world space), -1 for none. ratio is along the segment
+	int intersect(const osg::Vec3d& start, const osg::Vec3d& end, double& ratio) const;
+
+	unsigned int getNumDraws() const { return m_numDraws; }
+
+protected:
+	~BatchedMesh();
+
+	InstanceData* data();
+	const InstanceData* data() const;
+
+	osg::ref_ptr<osg::Geode> m_geode;
+	osg::ref_ptr<osg::Geometry> m_geometry;
+	osg::ref_ptr<osg::Vec3Array> m_vertexArray;
+	osg::ref_ptr<osg::Vec3Array> m_normalArray;
+	osg::ref_ptr<osg::MultiDrawElementsIndirectUInt> m_drawElements;
+	osg::ref_ptr<osg::DefaultIndirectCommandDrawElements> m_commands;
+
+	osg::ref_ptr<osg::FloatArray> m_drawArray;
+	osg::ref_ptr<osg::ShaderStorageBufferBinding> m_binding;
+	osg::ref_ptr<BatchedBoundingBoxCallback> m_boundCallback;
+	std::vector<bool> m_visible;
+	unsigned int m_numDraws;
+};
@@ -0,0 +1,137 @@
+#include "billboard_mesh.h"
+#include "shader_manager.h"
+#include <osg/Texture2D>
+#include <osg/Texture2DArray>
+#include <algorithm>
+
+static const unsigned int s_floatsPerBillboard = sizeof(BillboardData) / sizeof(float);
+
+// bound of the sprites, each counted as a box of its height around the bottom centre
+class BillboardBoundingBoxCallback : public osg::Drawable::ComputeBoundingBoxCallback
+{
+public:
+	BillboardBoundingBoxCallback(osg::FloatArray* billboards) : m_billboards(billboards) {}
+
+	virtual osg::BoundingBox computeBound(const osg::Drawable&) const override {
+		osg::BoundingBox bb;
+		auto billboards = reinterpret_cast<const BillboardData*>(m_billboards->asVector().data());
+		unsigned int count = m_billboards->size() / s_floatsPerBillboard;
+		for (unsigned int i = 0; i < count; ++i) {
+			const osg::Vec4f& ps = billboards[i].positionSize;
+			float halfWidth = ps.w() * std::max(billboards[i].params.y(), 1.0f) * 0.5f;
+			osg::Vec3 position(ps.x(), ps.y(), ps.z());
+			bb.expandBy(position - osg::Vec3(halfWidth, halfWidth, 0.0f));
+			bb.expandBy(position + osg::Vec3(halfWidth, halfWidth, ps.w()));
+		}
+		return bb;
+	}
+
+protected:
+	osg::ref_ptr<osg::FloatArray> m_billboards;
+};
+
+static osg::Texture* createWhiteTexture()
+{
+	osg::ref_ptr<osg::Image> image = new osg::Image;
+	image->allocateImage(1, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE);
+	*reinterpret_cast<unsigned int*>(image->data()) = 0xffffffff;
+	return new osg::Texture2D(image);
+}
+
+BillboardMesh::BillboardMesh(osg::Texture* texture) :
+	m_numBillboards(0)
+{
+	osg::ref_ptr<osg::Texture> colorMap = texture ? texture : createWhiteTexture();
+	bool textureArray = dynamic_cast<osg::Texture2DArray*>(colorMap.get()) != nullptr;
+
+	m_billboardArray = new osg::FloatArray;
+	m_binding = new osg::ShaderStorageBufferBinding(BILLBOARD_SSBO_BINDING, m_billboardArray.get());
+
+	// no vertex arrays, the corners come from gl_VertexID
+	m_drawArrays = new osg::DrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	m_geometry = new osg::Geometry;
+	m_geometry->setUseDisplayList(false);
+	m_geometry->setUseVertexBufferObjects(true);
+	m_geometry->addPrimitiveSet(m_drawArrays);
+	m_geometry->setComputeBoundingBoxCallback(new BillboardBoundingBoxCallback(m_billboardArray.get()));
+
+	m_geode = new osg::Geode;
+	m_geode->addDrawable(m_geometry);
+	osg::StateSet* ss = m_geode->getOrCreateStateSet();
+	ss->setAttributeAndModes(ShaderMgr::instance()->getShader(
+		textureArray ? ShaderMgr::s_billboardArrayProgram : ShaderMgr::s_billboardProgram), osg::StateAttribute::ON);
+	ss->setAttributeAndModes(m_binding, osg::StateAttribute::ON);
+	ss->setTextureAttributeAndModes(0, colorMap, osg::StateAttribute::ON);
+	ss->addUniform(new osg::Uniform("colorMap", 0));
+	ss->setMode(GL_CULL_FACE, osg::StateAttribute::OFF);
+	// an empty storage buffer can't be bound, keep the geode hidden until the first sprite exists
+	m_geode->setNodeMask(0);
+}
+
+BillboardMesh::~BillboardMesh()
+{
+
+}
+
+int BillboardMesh::addBillboard(const osg::Vec3& position, float height, float aspect, int layer)
+{
+	int id = m_numBillboards;
+	m_numBillboards++;
+	m_billboardArray->resize(m_numBillboards * s_floatsPerBillboard, 0.0f);
+
+	BillboardData& billboard = data()[id];
+	billboard.positionSize = osg::Vec4f(position, height);
+	billboard.params = osg::Vec4f(static_cast<float>(layer), aspect, 0.0f, 0.0f);
+
+	m_binding->setSize(m_billboardArray->getTotalDataSize());
+	m_drawArrays->setNumInstances(m_numBillboards);
+	m_geode->setNodeMask(~0u);
+	dirty();
+	return id;
+}
+
+void BillboardMesh::setPosition(int id, const osg::Vec3& position)
+{
+	if (id < 0 || static_cast<unsigned int>(id) >= m_numBillboards) {
+		return;
+	}
+	osg::Vec4f& ps = data()[id].positionSize;
+	ps = osg::Vec4f(position, ps.w());
+	dirty();
+}
+
+void BillboardMesh::setSize(int id, float height, float aspect)
+{
+	if (id < 0 || static_cast<unsigned int>(id) >= m_numBillboards) {
+		return;
+	}
+	BillboardData& billboard = data()[id];
+	billboard.positionSize.w() = height;
+	billboard.params.y() = aspect;
+	dirty();
+}
+
+void BillboardMesh::setLayer(int id, int layer)
+{
+	if (id < 0 || static_cast<unsigned int>(id) >= m_numBillboards) {
+		return;
+	}
+	data()[id].params.x() = static_cast<float>(layer);
+	m_billboardArray->dirty();
+}
+
+void BillboardMesh::reserve(unsigned int count)
+{
+	m_billboardArray->reserve(count * s_floatsPerBillboard);
+}
+
+BillboardData* BillboardMesh::data()
+{
+	return reinterpret_cast<BillboardData*>(m_billboardArray->asVector().data());
+}
+
+void BillboardMesh::dirty()
+{
+	m_billboardArray->dirty();
+	m_geometry->dirtyBound();
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "canvas3d_export.h"
+#include <osg/Geode>
+#include <osg/Geometry>
+#include <osg/Texture>
+#include <osg/BufferIndexBinding>
+
+#define BILLBOARD_SSBO_BINDING 6
+
+// std430 layout, must match BillboardData in the billboard program
+struct BillboardData
+{
+	osg::Vec4f positionSize;	// xyz: world position of the bottom centre; w: height
+	osg::Vec4f params;			// x: texture array layer; y: width / height
+};
+
+// camera facing sprites drawn with a single instanced draw of a 4 vertex strip, no geometry shader.
+// sprite positions and sizes live in a shader storage buffer indexed by gl_InstanceID, the eye comes
+// from the view's camera block (CAMERA_UBO_BINDING). a Texture2DArray lets every sprite pick a layer.
+// all methods except the constructor must run on the render thread.
+class CANVAS_EXPORT BillboardMesh : public osg::Referenced
+{
+public:
+	// a 2D texture or a 2D array texture, nullptr draws white quads
+	BillboardMesh(osg::Texture* texture);
+
+	osg::Geode* getGeode() { return m_geode.get(); }
+
+	int addBillboard(const osg::Vec3& position, float height, float aspect = 1.0f, int layer = 0);
+	void setPosition(int id, const osg::Vec3& position);
+	void setSize(int id, float height, float aspect);
+	void setLayer(int id, int layer);
+	// grows the storage once ahead of adding many sprites
+	void reserve(unsigned int count);
+
+	unsigned int getNumBillboards() const { return m_numBillboards; }
+
+protected:
+	~BillboardMesh();
+
+	BillboardData* data();
+	void dirty();
+
+	osg::ref_ptr<osg::Geode> m_geode;
+	osg::ref_ptr<osg::Geometry> m_geometry;
+	osg::ref_ptr<osg::DrawArrays> m_drawArrays;
+	osg::ref_ptr<osg::FloatArray> m_billboardArray;
+	osg::ref_ptr<osg::ShaderStorageBufferBinding> m_binding;
+	unsigned int m_numBillboards;
+};
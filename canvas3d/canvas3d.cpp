@@ -1,16 +1,20 @@
 #include "canvas3d.h"
 #include <common/io/read_stl.h>
 #include "customized_manipulator.h"
+#include "shader_manager.h"
+#include "scene_state.h"
+#include "parallel_cull_viewer.h"
 #include <QOpenGLFunctions>
 #include <QVersionNumber>
 #include <QQuickOpenGLUtils>
 #include <QQuickWindow>
 #include <osgGA/OrbitManipulator>
+#include <osgUtil/IncrementalCompileOperation>
 
 MyRenderer::MyRenderer()
 {
 	m_renderInfo.reset(new RenderInfo);
-	m_renderInfo->m_compositeViewer = new osgViewer::CompositeViewer;
+	m_renderInfo->m_compositeViewer = new ParallelCullViewer;
 	m_renderInfo->m_eventQueue = new osgGA::EventQueue;
 	m_renderInfo->m_eventQueue->getCurrentEventState()->setWindowRectangle(0, 0, 100, 100);
 	osgViewer::GraphicsWindow* gw = new osgViewer::GraphicsWindowEmbedded(0, 0, 100, 100);
@@ -25,6 +29,18 @@ MyRenderer::MyRenderer()
 	m_renderInfo->m_compositeViewer->addView(view);
 	m_renderInfo->m_mainView = view;
 	m_renderInfo->m_compositeViewer->setUpdateOperations(new osg::OperationQueue);
+	m_renderInfo->m_commandQueue = new RenderCommandQueue;
+	m_renderInfo->m_compositeViewer->getUpdateOperations()->add(m_renderInfo->m_commandQueue->createDrainOperation());
+
+	// new parts and shader variants are compiled within the frame budget before they go live
+	osg::ref_ptr<osgUtil::IncrementalCompileOperation> ico = new osgUtil::IncrementalCompileOperation;
+	ico->setTargetFrameRate(60.0);
+	ico->setConservativeTimeRatio(0.5);
+	ico->setMinimumTimeAvailableForGLCompileAndDeletePerFrame(0.001);
+	ico->setMaximumNumOfObjectsToCompilePerFrame(20);
+	m_renderInfo->m_compositeViewer->setIncrementalCompileOperation(ico);
+	// every program of the startup variant compiles before the first part arrives
+	m_renderInfo->addOperationAfterCompile(ShaderMgr::instance()->createWarmUpNode(ShaderMgr::instance()->getVariant()), nullptr);
 
 	osgGA::OrbitManipulator* om = new osgGA::OrbitManipulator;
 	om->setAllowThrow(false);
@@ -55,6 +71,14 @@ void MyRenderer::render() {
 	//	func->glClear(GL_COLOR_BUFFER_BIT);
 	//	func->glUseProgram(0);
 	//}
+	// UI edits of the scene state reach the nodes before anything traverses them
+	auto viewer = m_renderInfo->m_compositeViewer;
+	for (unsigned int i = 0; i < viewer->getNumViews(); ++i) {
+		auto sceneState = ViewInfo::getSceneState(viewer->getView(i));
+		if (sceneState) {
+			sceneState->update();
+		}
+	}
 	m_renderInfo->m_compositeViewer->frame();
 
 	auto gc = m_renderInfo->m_mainView->getCamera()->getGraphicsContext();
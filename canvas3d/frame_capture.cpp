@@ -0,0 +1,247 @@
+#include "frame_capture.h"
+#include "render_info.h"
+#include <osg/FrameBufferObject>
+#include <osgDB/WriteFile>
+#include <QFileInfo>
+#include <QImage>
+#include <QThreadPool>
+#include <cstring>
+
+// runs after whatever final draw callback the camera had before
+class FrameCaptureDrawCallback : public osg::Camera::DrawCallback
+{
+public:
+	FrameCaptureDrawCallback(FrameCapture* capture, osg::Camera::DrawCallback* next) : m_capture(capture), m_next(next) {}
+
+	virtual void operator () (osg::RenderInfo& renderInfo) const override {
+		if (m_next.valid()) {
+			(*m_next)(renderInfo);
+		}
+		m_capture->capture(renderInfo);
+	}
+
+private:
+	osg::ref_ptr<FrameCapture> m_capture;
+	osg::ref_ptr<osg::Camera::DrawCallback> m_next;
+};
+
+static bool isHdrFile(const QString& filePath)
+{
+	return QFileInfo(filePath).suffix().compare("exr", Qt::CaseInsensitive) == 0;
+}
+
+// worker thread, the rows are bottom up as read from GL
+static bool writeImage(const QString& filePath, osg::Image* image, bool hdr)
+{
+	if (hdr) {
+		return osgDB::writeImageFile(*image, filePath.toStdString());
+	}
+	QImage qImage(image->data(), image->s(), image->t(), image->getRowSizeInBytes(), QImage::Format_RGBA8888);
+	return qImage.mirrored().save(filePath, "PNG");
+}
+
+FrameCapture::FrameCapture(osgViewer::View* view) :
+	m_view(view),
+	m_oldest(0),
+	m_inFlight(0),
+	m_fbo(0),
+	m_renderbuffer(0),
+	m_readFbo(0),
+	m_fboWidth(0),
+	m_fboHeight(0),
+	m_fboHdr(false)
+{
+
+}
+
+FrameCapture::~FrameCapture()
+{
+
+}
+
+void FrameCapture::attach(osg::Camera* camera)
+{
+	camera->setFinalDrawCallback(new FrameCaptureDrawCallback(this, camera->getFinalDrawCallback()));
+}
+
+void FrameCapture::setSource(osg::Texture2D* texture)
+{
+	m_source = texture;
+}
+
+void FrameCapture::captureFrame(const QString& filePath, int width, int height, const Callback& callback)
+{
+	std::lock_guard<std::mutex> locker(m_mutex);
+	m_pending.push_back({ filePath, width, height, 0, 0, callback });
+}
+
+void FrameCapture::captureSequence(const QString& filePattern, int frameCount, int width, int height, const Callback& callback)
+{
+	if (frameCount <= 0) {
+		return;
+	}
+	std::lock_guard<std::mutex> locker(m_mutex);
+	m_pending.push_back({ filePattern, width, height, frameCount, 0, callback });
+}
+
+size_t FrameCapture::getPendingCount()
+{
+	std::lock_guard<std::mutex> locker(m_mutex);
+	return m_pending.size();
+}
+
+bool FrameCapture::isIdle()
+{
+	return m_inFlight == 0 && getPendingCount() == 0;
+}
+
+void FrameCapture::capture(osg::RenderInfo& renderInfo)
+{
+	osg::State* state = renderInfo.getState();
+	osg::GLExtensions* ext = state->get<osg::GLExtensions>();
+	collect(ext);
+	if (m_inFlight == FRAME_CAPTURE_BUFFERS) {
+		return;
+	}
+
+	Slot& slot = m_slots[(m_oldest + m_inFlight) % FRAME_CAPTURE_BUFFERS];
+	{
+		std::lock_guard<std::mutex> locker(m_mutex);
+		if (m_pending.empty()) {
+			return;
+		}
+		Request& request = m_pending.front();
+		slot.filePath = request.frames == 0 ? request.filePattern : request.filePattern.arg(request.next, 5, 10, QChar('0'));
+		slot.width = request.width;
+		slot.height = request.height;
+		slot.callback = request.callback;
+		if (request.frames == 0 || ++request.next == request.frames) {
+			m_pending.pop_front();
+		}
+	}
+	slot.hdr = isHdrFile(slot.filePath);
+	if (copy(*state, slot)) {
+		++m_inFlight;
+	}
+	else if (slot.callback) {
+		slot.callback(slot.filePath, false);
+	}
+}
+
+bool FrameCapture::copy(osg::State& state, Slot& slot)
+{
+	osg::GLExtensions* ext = state.get<osg::GLExtensions>();
+	GLint previous = 0;
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING_EXT, &previous);
+
+	// the source as a read framebuffer
+	GLuint source = 0;
+	int sourceWidth = 0;
+	int sourceHeight = 0;
+	if (m_source.valid()) {
+		osg::Texture::TextureObject* textureObject = m_source->getTextureObject(state.getContextID());
+		if (textureObject == nullptr) {
+			return false;
+		}
+		if (m_readFbo == 0) {
+			ext->glGenFramebuffers(1, &m_readFbo);
+		}
+		ext->glBindFramebuffer(GL_READ_FRAMEBUFFER_EXT, m_readFbo);
+		ext->glFramebufferTexture2D(GL_READ_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_TEXTURE_2D, textureObject->id(), 0);
+		source = m_readFbo;
+		sourceWidth = m_source->getTextureWidth();
+		sourceHeight = m_source->getTextureHeight();
+	}
+	else {
+		QOpenGLFramebufferObject* qtFBO = ViewInfo::getQtFBO(m_view);
+		if (qtFBO == nullptr) {
+			return false;
+		}
+		source = qtFBO->handle();
+		sourceWidth = qtFBO->width();
+		sourceHeight = qtFBO->height();
+	}
+	if (slot.width <= 0 || slot.height <= 0) {
+		slot.width = sourceWidth;
+		slot.height = sourceHeight;
+	}
+
+	// scaled into the capture framebuffer, recreated when the size or format changes
+	if (m_fbo == 0) {
+		ext->glGenFramebuffers(1, &m_fbo);
+		ext->glGenRenderbuffers(1, &m_renderbuffer);
+	}
+	ext->glBindFramebuffer(GL_DRAW_FRAMEBUFFER_EXT, m_fbo);
+	if (m_fboWidth != slot.width || m_fboHeight != slot.height || m_fboHdr != slot.hdr) {
+		ext->glBindRenderbuffer(GL_RENDERBUFFER_EXT, m_renderbuffer);
+		ext->glRenderbufferStorage(GL_RENDERBUFFER_EXT, slot.hdr ? GL_RGBA32F_ARB : GL_RGBA8, slot.width, slot.height);
+		ext->glBindRenderbuffer(GL_RENDERBUFFER_EXT, 0);
+		ext->glFramebufferRenderbuffer(GL_DRAW_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_RENDERBUFFER_EXT, m_renderbuffer);
+		m_fboWidth = slot.width;
+		m_fboHeight = slot.height;
+		m_fboHdr = slot.hdr;
+	}
+	ext->glBindFramebuffer(GL_READ_FRAMEBUFFER_EXT, source);
+	bool scaled = sourceWidth != slot.width || sourceHeight != slot.height;
+	ext->glBlitFramebuffer(0, 0, sourceWidth, sourceHeight, 0, 0, slot.width, slot.height, GL_COLOR_BUFFER_BIT, scaled ? GL_LINEAR : GL_NEAREST);
+
+	// into the slot's buffer, the data arrives without blocking
+	ext->glBindFramebuffer(GL_READ_FRAMEBUFFER_EXT, m_fbo);
+	glReadBuffer(GL_COLOR_ATTACHMENT0_EXT);
+	if (slot.pbo == 0) {
+		ext->glGenBuffers(1, &slot.pbo);
+	}
+	GLsizeiptr size = static_cast<GLsizeiptr>(slot.width) * slot.height * 4 * (slot.hdr ? sizeof(GLfloat) : sizeof(GLubyte));
+	ext->glBindBuffer(GL_PIXEL_PACK_BUFFER_ARB, slot.pbo);
+	ext->glBufferData(GL_PIXEL_PACK_BUFFER_ARB, size, nullptr, GL_STREAM_READ_ARB);
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glReadPixels(0, 0, slot.width, slot.height, GL_RGBA, slot.hdr ? GL_FLOAT : GL_UNSIGNED_BYTE, nullptr);
+	ext->glBindBuffer(GL_PIXEL_PACK_BUFFER_ARB, 0);
+	slot.fence = ext->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+	ext->glBindFramebuffer(GL_FRAMEBUFFER_EXT, previous);
+	return true;
+}
+
+void FrameCapture::collect(osg::GLExtensions* ext)
+{
+	while (m_inFlight > 0) {
+		Slot& slot = m_slots[m_oldest];
+		GLenum wait = ext->glClientWaitSync(slot.fence, 0, 0);
+		if (wait != GL_ALREADY_SIGNALED && wait != GL_CONDITION_SATISFIED) {
+			break;
+		}
+		ext->glDeleteSync(slot.fence);
+		slot.fence = nullptr;
+		m_oldest = (m_oldest + 1) % FRAME_CAPTURE_BUFFERS;
+		--m_inFlight;
+
+		// one copy out of the mapping, the encoding happens on the thread pool
+		osg::ref_ptr<osg::Image> image = new osg::Image;
+		image->allocateImage(slot.width, slot.height, 1, GL_RGBA, slot.hdr ? GL_FLOAT : GL_UNSIGNED_BYTE);
+		ext->glBindBuffer(GL_PIXEL_PACK_BUFFER_ARB, slot.pbo);
+		auto pixels = ext->glMapBuffer(GL_PIXEL_PACK_BUFFER_ARB, GL_READ_ONLY_ARB);
+		if (pixels != nullptr) {
+			memcpy(image->data(), pixels, image->getTotalSizeInBytes());
+			ext->glUnmapBuffer(GL_PIXEL_PACK_BUFFER_ARB);
+		}
+		ext->glBindBuffer(GL_PIXEL_PACK_BUFFER_ARB, 0);
+
+		QString filePath = slot.filePath;
+		bool hdr = slot.hdr;
+		Callback callback = slot.callback;
+		slot.callback = nullptr;
+		if (pixels == nullptr) {
+			if (callback) {
+				callback(filePath, false);
+			}
+			continue;
+		}
+		QThreadPool::globalInstance()->start([image, filePath, hdr, callback]() {
+			bool saved = writeImage(filePath, image.get(), hdr);
+			if (callback) {
+				callback(filePath, saved);
+			}
+			});
+	}
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "canvas3d_export.h"
+#include <osg/Camera>
+#include <osg/GLExtensions>
+#include <osg/Texture2D>
+#include <osgViewer/View>
+#include <QString>
+#include <array>
+#include <deque>
+#include <functional>
+#include <mutex>
+
+// pixel buffer objects in flight, a copy is mapped this many frames after it was issued at the latest
+#define FRAME_CAPTURE_BUFFERS 3
+
+// screenshots and frame sequences of a view without stalling it. after the view has drawn, its Qt
+// framebuffer (or a render target set with setSource) is blitted into a capture framebuffer of the
+// requested size and read into one of FRAME_CAPTURE_BUFFERS pixel buffer objects behind a fence.
+// later frames map the copies whose fence has signalled, and the files are encoded on the thread
+// pool: png from 8 bit data, exr (through the osgDB plugin) from float data. when every buffer is
+// still in flight the frame is not captured rather than waited for, sequences then continue with
+// the next frame
+class CANVAS_EXPORT FrameCapture : public osg::Referenced
+{
+public:
+	// runs on a worker thread once the file is written, or failed to
+	typedef std::function<void(const QString& filePath, bool saved)> Callback;
+
+	FrameCapture(osgViewer::View* view);
+
+	// chains onto the camera's final draw callback, render thread
+	void attach(osg::Camera* camera);
+	// a colour render target to capture instead of the view's framebuffer, null to go back. render thread
+	void setSource(osg::Texture2D* texture);
+
+	// any thread. width or height 0 keep the source's size. the suffix picks the format: .exr writes
+	// float data, anything else png
+	void captureFrame(const QString& filePath, int width, int height, const Callback& callback);
+	// the next frameCount captured frames, %1 in filePattern becomes the zero padded frame number
+	void captureSequence(const QString& filePattern, int frameCount, int width, int height, const Callback& callback);
+
+	// requests not started yet, any thread
+	size_t getPendingCount();
+	// nothing pending and no copy in flight, render thread
+	bool isIdle();
+
+protected:
+	~FrameCapture();
+
+	struct Request {
+		QString filePattern;
+		int width;
+		int height;
+		int frames;		// 0 for a single frame, filePattern is its path
+		int next;
+		Callback callback;
+	};
+	struct Slot {
+		GLuint pbo = 0;
+		GLsync fence = nullptr;
+		QString filePath;
+		int width = 0;
+		int height = 0;
+		bool hdr = false;
+		Callback callback;
+	};
+
+	// after the view has drawn: maps finished copies, then issues this frame's copy if one is due
+	void capture(osg::RenderInfo& renderInfo);
+	void collect(osg::GLExtensions* ext);
+	bool copy(osg::State& state, Slot& slot);
+
+	osgViewer::View* m_view;
+	osg::ref_ptr<osg::Texture2D> m_source;
+
+	std::mutex m_mutex;
+	std::deque<Request> m_pending;
+
+	// render thread only
+	std::array<Slot, FRAME_CAPTURE_BUFFERS> m_slots;
+	unsigned int m_oldest;
+	unsigned int m_inFlight;
+	GLuint m_fbo;
+	GLuint m_renderbuffer;
+	GLuint m_readFbo;
+	int m_fboWidth;
+	int m_fboHeight;
+	bool m_fboHdr;
+
+	friend class FrameCaptureDrawCallback;
+};
@@ -0,0 +1,105 @@
+#include "instanced_mesh.h"
+
+static const unsigned int s_floatsPerInstance = sizeof(InstanceData) / sizeof(float);
+
+// bound of the instanced geometry is the union of the base bound placed by every instance
+class InstancedBoundingBoxCallback : public osg::Drawable::ComputeBoundingBoxCallback
+{
+public:
+	InstancedBoundingBoxCallback(const osg::BoundingBox& baseBB, osg::FloatArray* instances) :
+		m_baseBB(baseBB), m_instances(instances) {}
+
+	virtual osg::BoundingBox computeBound(const osg::Drawable&) const override {
+		osg::BoundingBox bb;
+		if (!m_baseBB.valid()) {
+			return bb;
+		}
+		auto instances = reinterpret_cast<const InstanceData*>(m_instances->asVector().data());
+		unsigned int count = m_instances->size() / s_floatsPerInstance;
+		for (unsigned int i = 0; i < count; ++i) {
+			for (unsigned int c = 0; c < 8; ++c) {
+				bb.expandBy(m_baseBB.corner(c) * instances[i].model);
+			}
+		}
+		return bb;
+	}
+
+protected:
+	osg::BoundingBox m_baseBB;
+	osg::ref_ptr<osg::FloatArray> m_instances;
+};
+
+InstancedMesh::InstancedMesh(osg::Geometry* geometry, osg::Program* program) :
+	m_geometry(geometry),
+	m_numInstances(0)
+{
+	m_instanceArray = new osg::FloatArray;
+	m_binding = new osg::ShaderStorageBufferBinding(INSTANCE_SSBO_BINDING, m_instanceArray.get());
+
+	m_geometry->setComputeBoundingBoxCallback(new InstancedBoundingBoxCallback(m_geometry->getBoundingBox(), m_instanceArray.get()));
+	m_geometry->getOrCreateStateSet()->setAttributeAndModes(program, osg::StateAttribute::ON);
+
+	m_geode = new osg::Geode;
+	m_geode->addDrawable(m_geometry);
+	m_geode->getOrCreateStateSet()->setAttributeAndModes(m_binding, osg::StateAttribute::ON);
+	// lets the shared depth-only programs (shadow passes) pick up the instance matrices as well
+	m_geode->getOrCreateStateSet()->addUniform(new osg::Uniform("useInstancing", true));
+	m_geode->setNodeMask(0);
+}
+
+InstancedMesh::~InstancedMesh()
+{
+
+}
+
+int InstancedMesh::addInstance(const osg::Matrixf& matrix, int materialIndex)
+{
+	int id = m_numInstances;
+	m_instanceArray->resize((m_numInstances + 1) * s_floatsPerInstance, 0.0f);
+	m_numInstances++;
+
+	InstanceData& instance = data()[id];
+	instance.index = osg::Vec4i(materialIndex, 0, 0, 0);
+	updateInstanceCount();
+	setMatrix(id, matrix);
+	return id;
+}
+
+void InstancedMesh::setMatrix(int id, const osg::Matrixf& matrix)
+{
+	if (id < 0 || static_cast<unsigned int>(id) >= m_numInstances) {
+		return;
+	}
+	InstanceData& instance = data()[id];
+	instance.model = matrix;
+	osg::Matrixf normal = osg::Matrixf::inverse(matrix);
+	normal.transpose(normal);
+	instance.normal = normal;
+	m_instanceArray->dirty();
+	m_geometry->dirtyBound();
+}
+
+void InstancedMesh::setMaterialIndex(int id, int materialIndex)
+{
+	if (id < 0 || static_cast<unsigned int>(id) >= m_numInstances) {
+		return;
+	}
+	data()[id].index.x() = materialIndex;
+	m_instanceArray->dirty();
+}
+
+InstanceData* InstancedMesh::data()
+{
+	return reinterpret_cast<InstanceData*>(m_instanceArray->asVector().data());
+}
+
+void InstancedMesh::updateInstanceCount()
+{
+	m_binding->setSize(m_instanceArray->getTotalDataSize());
+	for (unsigned int i = 0; i < m_geometry->getNumPrimitiveSets(); ++i) {
+		m_geometry->getPrimitiveSet(i)->setNumInstances(m_numInstances);
+	}
+	// an empty storage buffer can't be bound, keep the geode hidden until the first instance exists
+	m_geode->setNodeMask(m_numInstances > 0 ? ~0u : 0u);
+	m_geometry->dirtyBound();
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "canvas3d_export.h"
+#include <osg/Geode>
+#include <osg/Geometry>
+#include <osg/BufferIndexBinding>
+
+#define INSTANCE_SSBO_BINDING 1
+
+// std430 layout, must match InstanceData in the instanced mesh program
+struct InstanceData
+{
+	osg::Matrixf model;
+	osg::Matrixf normal;	// inverse transpose of model
+	osg::Vec4i index;		// x: material index
+};
+
+// one geometry drawn with a single glDraw*Instanced call for every instance.
+// per-instance matrices and material indices live in a shader storage buffer
+// indexed by gl_InstanceID. all methods except the constructor must run on the render thread.
+class CANVAS_EXPORT InstancedMesh : public osg::Referenced
+{
+public:
+	InstancedMesh(osg::Geometry* geometry, osg::Program* program);
+
+	osg::Geode* getGeode() { return m_geode.get(); }
+	osg::Geometry* getGeometry() { return m_geometry.get(); }
+
+	int addInstance(const osg::Matrixf& matrix, int materialIndex);
+	void setMatrix(int id, const osg::Matrixf& matrix);
+	void setMaterialIndex(int id, int materialIndex);
+
+	unsigned int getNumInstances() const { return m_numInstances; }
+
+protected:
+	~InstancedMesh();
+
+	InstanceData* data();
+	void updateInstanceCount();
+
+	osg::ref_ptr<osg::Geode> m_geode;
+	osg::ref_ptr<osg::Geometry> m_geometry;
+	osg::ref_ptr<osg::FloatArray> m_instanceArray;
+	osg::ref_ptr<osg::ShaderStorageBufferBinding> m_binding;
+	unsigned int m_numInstances;
+};
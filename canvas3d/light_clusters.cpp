@@ -0,0 +1,310 @@
+#include "light_clusters.h"
+#include <algorithm>
+#include <cfloat>
+
+static const unsigned int s_headerFloats = 4;	// ivec4 count ahead of the lights
+static const unsigned int s_floatsPerPointLight = sizeof(PointLightMaterial) / sizeof(float);
+static const unsigned int s_floatsPerSpotLight = sizeof(SpotLightMaterial) / sizeof(float);
+static const unsigned int s_numClusters = LIGHT_CLUSTERS_X * LIGHT_CLUSTERS_Y * LIGHT_CLUSTERS_Z;
+
+template<typename T>
+static T* getLights(osg::FloatArray* array)
+{
+	return reinterpret_cast<T*>(array->asVector().data() + s_headerFloats);
+}
+
+static bool isBlack(const osg::Vec4& color)
+{
+	return color.x() <= 0.0f && color.y() <= 0.0f && color.z() <= 0.0f;
+}
+
+LightClusters::LightClusters() :
+	m_numPointLights(0),
+	m_numSpotLights(0),
+	m_bDirty(true),
+	m_near(0.1f),
+	m_far(1000.0f)
+{
+	m_pointLights = new osg::FloatArray(s_headerFloats);
+	m_spotLights = new osg::FloatArray(s_headerFloats);
+	m_grid = new osg::UIntArray(s_numClusters * 4);
+	m_indices = new osg::UIntArray(1);
+	m_pointBinding = new osg::ShaderStorageBufferBinding(POINT_LIGHT_SSBO_BINDING, m_pointLights.get(), 0, m_pointLights->getTotalDataSize());
+	m_spotBinding = new osg::ShaderStorageBufferBinding(SPOT_LIGHT_SSBO_BINDING, m_spotLights.get(), 0, m_spotLights->getTotalDataSize());
+	m_gridBinding = new osg::ShaderStorageBufferBinding(LIGHT_GRID_SSBO_BINDING, m_grid.get(), 0, m_grid->getTotalDataSize());
+	m_indexBinding = new osg::ShaderStorageBufferBinding(LIGHT_INDEX_SSBO_BINDING, m_indices.get(), 0, m_indices->getTotalDataSize());
+	m_paramsUniform = new osg::Uniform("lightClusterParams", osg::Vec4());
+
+	m_bounds.resize(s_numClusters);
+	m_pointLists.resize(s_numClusters);
+	m_spotLists.resize(s_numClusters);
+}
+
+LightClusters::~LightClusters()
+{
+
+}
+
+PointLightMaterial& LightClusters::getPointLight(int index)
+{
+	if (static_cast<unsigned int>(index) >= m_numPointLights) {
+		unsigned int oldCount = m_numPointLights;
+		m_numPointLights = index + 1;
+		resizeLights(m_pointLights.get(), m_pointBinding.get(), m_numPointLights, s_floatsPerPointLight);
+		for (unsigned int i = oldCount; i < m_numPointLights; ++i) {
+			getLights<PointLightMaterial>(m_pointLights.get())[i].shadow = osg::Vec4(-1.0, 0.0, 0.0, 0.0);
+		}
+	}
+	return getLights<PointLightMaterial>(m_pointLights.get())[index];
+}
+
+SpotLightMaterial& LightClusters::getSpotLight(int index)
+{
+	if (static_cast<unsigned int>(index) >= m_numSpotLights) {
+		m_numSpotLights = index + 1;
+		resizeLights(m_spotLights.get(), m_spotBinding.get(), m_numSpotLights, s_floatsPerSpotLight);
+	}
+	return getLights<SpotLightMaterial>(m_spotLights.get())[index];
+}
+
+void LightClusters::dirtyPointLights()
+{
+	m_pointLights->dirty();
+	m_bDirty = true;
+}
+
+void LightClusters::dirtySpotLights()
+{
+	m_spotLights->dirty();
+	m_bDirty = true;
+}
+
+void LightClusters::applyTo(osg::StateSet* stateSet)
+{
+	stateSet->setAttributeAndModes(m_pointBinding);
+	stateSet->setAttributeAndModes(m_spotBinding);
+	stateSet->setAttributeAndModes(m_gridBinding);
+	stateSet->setAttributeAndModes(m_indexBinding);
+	stateSet->addUniform(m_paramsUniform);
+}
+
+void LightClusters::resizeLights(osg::FloatArray* array, osg::ShaderStorageBufferBinding* binding, unsigned int count, unsigned int floatsPerLight)
+{
+	array->resize(s_headerFloats + count * floatsPerLight, 0.0f);
+	*reinterpret_cast<osg::Vec4i*>(array->asVector().data()) = osg::Vec4i(count, 0, 0, 0);
+	binding->setSize(array->getTotalDataSize());
+	array->dirty();
+	m_bDirty = true;
+}
+
+float LightClusters::getPointLightRange(const PointLightMaterial& light)
+{
+	const float cutOff = 256.0f;
+	float brightness = std::max(light.color.x(), std::max(light.color.y(), light.color.z()));
+	float constant = light.param.x();
+	float linear = light.param.y();
+	float quadratic = light.param.z();
+
+	// phong: brightness / (constant + linear * d + quadratic * d * d) = 1 / 256
+	float phongRange = 0.0f;
+	float target = brightness * cutOff - constant;
+	if (target > 0.0f) {
+		if (quadratic > 0.0f) {
+			phongRange = (-linear + sqrtf(linear * linear + 4.0f * quadratic * target)) / (2.0f * quadratic);
+		}
+		else if (linear > 0.0f) {
+			phongRange = target / linear;
+		}
+		else {
+			phongRange = FLT_MAX;
+		}
+	}
+	// pbr: brightness * 300 / (d * d) = 1 / 256
+	float pbrRange = sqrtf(brightness * 300.0f * cutOff);
+	return std::max(phongRange, pbrRange);
+}
+
+void LightClusters::update(const osg::Camera* camera)
+{
+	const osg::Matrix& viewMatrix = camera->getViewMatrix();
+	const osg::Matrix& projection = camera->getProjectionMatrix();
+	bool projectionChanged = projection != m_projection;
+	if (!m_bDirty && !projectionChanged && viewMatrix == m_viewMatrix) {
+		return;
+	}
+	if (projectionChanged) {
+		updateClusterBounds(projection);
+	}
+	m_viewMatrix = viewMatrix;
+	m_bDirty = false;
+
+	for (unsigned int i = 0; i < s_numClusters; ++i) {
+		m_pointLists[i].clear();
+		m_spotLists[i].clear();
+	}
+	binPointLights(viewMatrix);
+	binSpotLights(viewMatrix);
+	writeGrid();
+}
+
+// view space bounds of every cluster. slices are spaced exponentially between the near and far plane,
+// the same spacing the fragment shader uses to find its slice from the view depth
+void LightClusters::updateClusterBounds(const osg::Matrix& projection)
+{
+	m_projection = projection;
+	double fovy, aspect, left, right, bottom, top, zNear = 0.1, zFar = 1000.0;
+	if (!projection.getPerspective(fovy, aspect, zNear, zFar)) {
+		projection.getOrtho(left, right, bottom, top, zNear, zFar);
+	}
+	m_near = std::max(zNear, 0.1);
+	m_far = std::max<float>(zFar, m_near * 2.0f);
+	float logScale = LIGHT_CLUSTERS_Z / logf(m_far / m_near);
+	m_paramsUniform->set(osg::Vec4(m_near, logScale, 0.0f, 0.0f));
+
+	// near and far plane points of every tile corner, points of a given depth are interpolated between them
+	osg::Matrix inverse = osg::Matrix::inverse(projection);
+	const unsigned int numCorners = (LIGHT_CLUSTERS_X + 1) * (LIGHT_CLUSTERS_Y + 1);
+	std::vector<osg::Vec3d> nearPoints(numCorners), farPoints(numCorners);
+	for (unsigned int y = 0; y <= LIGHT_CLUSTERS_Y; ++y) {
+		for (unsigned int x = 0; x <= LIGHT_CLUSTERS_X; ++x) {
+			double ndcX = -1.0 + 2.0 * x / LIGHT_CLUSTERS_X;
+			double ndcY = -1.0 + 2.0 * y / LIGHT_CLUSTERS_Y;
+			unsigned int corner = x + y * (LIGHT_CLUSTERS_X + 1);
+			nearPoints[corner] = osg::Vec3d(ndcX, ndcY, -1.0) * inverse;
+			farPoints[corner] = osg::Vec3d(ndcX, ndcY, 1.0) * inverse;
+		}
+	}
+
+	for (unsigned int z = 0; z < LIGHT_CLUSTERS_Z; ++z) {
+		double sliceNear = m_near * pow(m_far / m_near, static_cast<double>(z) / LIGHT_CLUSTERS_Z);
+		double sliceFar = m_near * pow(m_far / m_near, static_cast<double>(z + 1) / LIGHT_CLUSTERS_Z);
+		for (unsigned int y = 0; y < LIGHT_CLUSTERS_Y; ++y) {
+			for (unsigned int x = 0; x < LIGHT_CLUSTERS_X; ++x) {
+				osg::BoundingBox bb;
+				for (unsigned int c = 0; c < 4; ++c) {
+					unsigned int corner = (x + (c & 1)) + (y + (c >> 1)) * (LIGHT_CLUSTERS_X + 1);
+					const osg::Vec3d& pn = nearPoints[corner];
+					const osg::Vec3d& pf = farPoints[corner];
+					double depthRange = pn.z() - pf.z();
+					for (double depth : { sliceNear, sliceFar }) {
+						double t = depthRange != 0.0 ? (depth + pn.z()) / depthRange : 0.0;
+						bb.expandBy(pn + (pf - pn) * t);
+					}
+				}
+				ClusterBound& bound = m_bounds[x + y * LIGHT_CLUSTERS_X + z * LIGHT_CLUSTERS_X * LIGHT_CLUSTERS_Y];
+				bound.min = bb._min;
+				bound.max = bb._max;
+				bound.center = bb.center();
+				bound.radius = bb.radius();
+			}
+		}
+	}
+}
+
+void LightClusters::binPointLights(const osg::Matrix& viewMatrix)
+{
+	float logScale = LIGHT_CLUSTERS_Z / logf(m_far / m_near);
+	auto sliceOf = [this, logScale](float depth) {
+		if (depth <= m_near) {
+			return 0;
+		}
+		return osg::clampBetween(static_cast<int>(logf(depth / m_near) * logScale), 0, LIGHT_CLUSTERS_Z - 1);
+	};
+
+	const PointLightMaterial* lights = getLights<PointLightMaterial>(m_pointLights.get());
+	for (unsigned int i = 0; i < m_numPointLights; ++i) {
+		const PointLightMaterial& light = lights[i];
+		if (isBlack(light.color)) {
+			continue;
+		}
+		float range = getPointLightRange(light);
+		osg::Vec3 center = osg::Vec3(light.position.x(), light.position.y(), light.position.z()) * viewMatrix;
+		float depthMin = -center.z() - range;
+		float depthMax = -center.z() + range;
+		if (depthMax < m_near || depthMin > m_far) {
+			continue;
+		}
+		int zMin = sliceOf(depthMin);
+		int zMax = sliceOf(depthMax);
+		float rangeSquared = range * range;
+		for (int z = zMin; z <= zMax; ++z) {
+			for (unsigned int xy = 0; xy < LIGHT_CLUSTERS_X * LIGHT_CLUSTERS_Y; ++xy) {
+				unsigned int cluster = xy + z * LIGHT_CLUSTERS_X * LIGHT_CLUSTERS_Y;
+				const ClusterBound& bound = m_bounds[cluster];
+				// squared distance from the light to the cluster box
+				float distanceSquared = 0.0f;
+				for (int axis = 0; axis < 3; ++axis) {
+					float v = center[axis];
+					if (v < bound.min[axis]) {
+						distanceSquared += (bound.min[axis] - v) * (bound.min[axis] - v);
+					}
+					else if (v > bound.max[axis]) {
+						distanceSquared += (v - bound.max[axis]) * (v - bound.max[axis]);
+					}
+				}
+				if (distanceSquared <= rangeSquared) {
+					m_pointLists[cluster].push_back(i);
+				}
+			}
+		}
+	}
+}
+
+// spot lights aren't attenuated, a cluster is lit when its bounding sphere touches the infinite cone
+void LightClusters::binSpotLights(const osg::Matrix& viewMatrix)
+{
+	const SpotLightMaterial* lights = getLights<SpotLightMaterial>(m_spotLights.get());
+	for (unsigned int i = 0; i < m_numSpotLights; ++i) {
+		const SpotLightMaterial& light = lights[i];
+		if (isBlack(light.color)) {
+			continue;
+		}
+		osg::Vec3 apex = osg::Vec3(light.position.x(), light.position.y(), light.position.z()) * viewMatrix;
+		osg::Vec3 dir = osg::Matrix::transform3x3(osg::Vec3(light.direction.x(), light.direction.y(), light.direction.z()), viewMatrix);
+		dir.normalize();
+		// the shaders light everything whose cosine to the spot direction is above cutOff.y
+		float cosAngle = osg::clampBetween(light.cutOff.y(), -1.0f, 1.0f);
+		float sinAngle = sqrtf(1.0f - cosAngle * cosAngle);
+		for (unsigned int cluster = 0; cluster < s_numClusters; ++cluster) {
+			const ClusterBound& bound = m_bounds[cluster];
+			osg::Vec3 v = bound.center - apex;
+			float lengthSquared = v.length2();
+			float along = v * dir;
+			float closest = cosAngle * sqrtf(std::max(lengthSquared - along * along, 0.0f)) - along * sinAngle;
+			if (closest > bound.radius) {
+				continue;
+			}
+			if (cosAngle > 0.0f && along < -bound.radius) {
+				continue;
+			}
+			m_spotLists[cluster].push_back(i);
+		}
+	}
+}
+
+void LightClusters::writeGrid()
+{
+	unsigned int total = 0;
+	for (unsigned int i = 0; i < s_numClusters; ++i) {
+		total += m_pointLists[i].size() + m_spotLists[i].size();
+	}
+	// an empty storage buffer can't be bound
+	m_indices->resize(std::max(total, 1u));
+
+	unsigned int offset = 0;
+	for (unsigned int i = 0; i < s_numClusters; ++i) {
+		(*m_grid)[i * 4 + 0] = offset;
+		(*m_grid)[i * 4 + 1] = m_pointLists[i].size();
+		(*m_grid)[i * 4 + 2] = m_spotLists[i].size();
+		(*m_grid)[i * 4 + 3] = 0;
+		for (unsigned int index : m_pointLists[i]) {
+			(*m_indices)[offset++] = index;
+		}
+		for (unsigned int index : m_spotLists[i]) {
+			(*m_indices)[offset++] = index;
+		}
+	}
+	m_indexBinding->setSize(m_indices->getTotalDataSize());
+	m_grid->dirty();
+	m_indices->dirty();
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "canvas3d_export.h"
+#include "render_info.h"
+#include <osg/BufferIndexBinding>
+#include <osg/Camera>
+#include <osg/Uniform>
+
+#define POINT_LIGHT_SSBO_BINDING 2
+#define SPOT_LIGHT_SSBO_BINDING 3
+#define LIGHT_GRID_SSBO_BINDING 4
+#define LIGHT_INDEX_SSBO_BINDING 5
+
+// must match the cluster grid in the mesh shaders
+#define LIGHT_CLUSTERS_X 16
+#define LIGHT_CLUSTERS_Y 9
+#define LIGHT_CLUSTERS_Z 24
+
+// point and spot lights of a view, stored in shader storage buffers without a fixed cap.
+// before the view draws, the lights are binned into clusters: LIGHT_CLUSTERS_X x LIGHT_CLUSTERS_Y
+// screen tiles times LIGHT_CLUSTERS_Z exponential depth slices. each cluster holds an offset and
+// counts into a shared index list, so a fragment only iterates over the lights reaching its cluster.
+// all methods must run on the render thread.
+class CANVAS_EXPORT LightClusters : public osg::Referenced
+{
+public:
+	LightClusters();
+
+	// the buffers grow to hold the index, call dirty*Lights after editing
+	PointLightMaterial& getPointLight(int index);
+	SpotLightMaterial& getSpotLight(int index);
+	void dirtyPointLights();
+	void dirtySpotLights();
+
+	// storage buffer bindings and the cluster parameter uniform
+	void applyTo(osg::StateSet* stateSet);
+
+	// bins the lights for the camera's current matrices, skipped while nothing changed
+	void update(const osg::Camera* camera);
+
+	// distance at which a point light's contribution falls below 1/256, for both phong and pbr attenuation
+	static float getPointLightRange(const PointLightMaterial& light);
+
+protected:
+	~LightClusters();
+
+	struct ClusterBound {
+		osg::Vec3 min;
+		osg::Vec3 max;
+		osg::Vec3 center;
+		float radius;
+	};
+
+	void resizeLights(osg::FloatArray* array, osg::ShaderStorageBufferBinding* binding, unsigned int count, unsigned int floatsPerLight);
+	void updateClusterBounds(const osg::Matrix& projection);
+	void binPointLights(const osg::Matrix& viewMatrix);
+	void binSpotLights(const osg::Matrix& viewMatrix);
+	void writeGrid();
+
+	osg::ref_ptr<osg::FloatArray> m_pointLights;
+	osg::ref_ptr<osg::FloatArray> m_spotLights;
+	osg::ref_ptr<osg::UIntArray> m_grid;
+	osg::ref_ptr<osg::UIntArray> m_indices;
+	osg::ref_ptr<osg::ShaderStorageBufferBinding> m_pointBinding;
+	osg::ref_ptr<osg::ShaderStorageBufferBinding> m_spotBinding;
+	osg::ref_ptr<osg::ShaderStorageBufferBinding> m_gridBinding;
+	osg::ref_ptr<osg::ShaderStorageBufferBinding> m_indexBinding;
+	osg::ref_ptr<osg::Uniform> m_paramsUniform;
+	unsigned int m_numPointLights;
+	unsigned int m_numSpotLights;
+
+	bool m_bDirty;
+	osg::Matrix m_viewMatrix;
+	osg::Matrix m_projection;
+	float m_near;
+	float m_far;
+	std::vector<ClusterBound> m_bounds;
+	std::vector<std::vector<unsigned int>> m_pointLists;
+	std::vector<std::vector<unsigned int>> m_spotLists;
+};
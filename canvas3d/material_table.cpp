@@ -0,0 +1,134 @@
+#include "material_table.h"
+#include <osg/GLExtensions>
+#include <algorithm>
+
+static const unsigned int s_floatsPerMaterial = sizeof(MaterialData) / sizeof(float);
+
+MaterialTable::MaterialTable() :
+	m_count(0),
+	m_dirtyBegin(0),
+	m_dirtyEnd(0),
+	m_nextIndex(1)
+{
+	m_array = new osg::FloatArray;
+	resize(1);
+	// slot 0 is reserved for the default material, so the buffer is never empty
+	data()[0] = defaultMaterial();
+	m_binding = new osg::ShaderStorageBufferBinding(MATERIAL_SSBO_BINDING, m_array.get(), 0, sizeof(MaterialData));
+}
+
+MaterialTable::~MaterialTable()
+{
+
+}
+
+MaterialData MaterialTable::defaultMaterial()
+{
+	MaterialData material;
+	material.ambient = osg::Vec4(0.5, 0.5, 0.5, 32.0);
+	material.diffuse = osg::Vec4(0.5, 0.5, 0.5, 1.0);
+	material.specular = osg::Vec4(0.5, 0.5, 0.5, 1.0);
+	material.pbr = osg::Vec4(0.0, 0.0, 1.0, 0.0);
+	return material;
+}
+
+int MaterialTable::allocate()
+{
+	std::lock_guard<std::mutex> locker(m_mutex);
+	if (!m_freeIndices.empty()) {
+		int index = m_freeIndices.back();
+		m_freeIndices.pop_back();
+		return index;
+	}
+	return m_nextIndex++;
+}
+
+void MaterialTable::release(int index)
+{
+	if (index <= 0) {
+		return;
+	}
+	std::lock_guard<std::mutex> locker(m_mutex);
+	m_freeIndices.push_back(index);
+}
+
+void MaterialTable::set(int index, const MaterialData& material)
+{
+	if (index < 0) {
+		return;
+	}
+	if (static_cast<unsigned int>(index) >= m_count) {
+		resize(index + 1);
+	}
+	data()[index] = material;
+	if (m_dirtyBegin >= m_dirtyEnd) {
+		m_dirtyBegin = index;
+		m_dirtyEnd = index + 1;
+	}
+	else {
+		m_dirtyBegin = std::min<unsigned int>(m_dirtyBegin, index);
+		m_dirtyEnd = std::max<unsigned int>(m_dirtyEnd, index + 1);
+	}
+}
+
+void MaterialTable::upload(osg::State& state)
+{
+	if (m_dirtyBegin >= m_dirtyEnd) {
+		return;
+	}
+	unsigned int begin = m_dirtyBegin;
+	unsigned int end = m_dirtyEnd;
+	m_dirtyBegin = m_dirtyEnd = 0;
+
+	osg::BufferObject* bo = m_array->getBufferObject();
+	if (bo == nullptr) {
+		return;
+	}
+	osg::GLBufferObject* glBO = bo->getOrCreateGLBufferObject(state.getContextID());
+	// not compiled yet or resized, the whole table goes up when the binding is applied
+	if (glBO == nullptr || glBO->isDirty() || glBO->getGLObjectID() == 0) {
+		m_array->dirty();
+		return;
+	}
+
+	GLintptr offset = glBO->getOffset(m_array->getBufferIndex()) + begin * sizeof(MaterialData);
+	GLsizeiptr size = (end - begin) * sizeof(MaterialData);
+	state.bindVertexBufferObject(glBO);
+	state.get<osg::GLExtensions>()->glBufferSubData(glBO->getProfile()._target, offset, size, data() + begin);
+	state.unbindVertexBufferObject();
+}
+
+const MaterialData& MaterialTable::get(int index) const
+{
+	auto materials = reinterpret_cast<const MaterialData*>(m_array->asVector().data());
+	if (index < 0 || static_cast<unsigned int>(index) >= m_count) {
+		return materials[0];
+	}
+	return materials[index];
+}
+
+MaterialData* MaterialTable::data()
+{
+	return reinterpret_cast<MaterialData*>(m_array->asVector().data());
+}
+
+void MaterialTable::resize(unsigned int count)
+{
+	// grow geometrically so a burst of imports doesn't reallocate the buffer every time
+	unsigned int capacity = m_count > 0 ? m_count : 1;
+	while (capacity < count) {
+		capacity *= 2;
+	}
+	unsigned int oldCount = m_count;
+	m_array->resize(capacity * s_floatsPerMaterial, 0.0f);
+	m_count = capacity;
+	for (unsigned int i = oldCount; i < m_count; ++i) {
+		data()[i] = defaultMaterial();
+	}
+	if (m_binding.valid()) {
+		m_binding->setSize(m_array->getTotalDataSize());
+	}
+	// the buffer object is reallocated, no sub-range upload this frame
+	m_array->dirty();
+	m_dirtyBegin = m_dirtyEnd = 0;
+}
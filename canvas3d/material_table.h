@@ -0,0 +1,56 @@
+#pragma once
+
+#include "canvas3d_export.h"
+#include <osg/BufferIndexBinding>
+#include <osg/State>
+#include <mutex>
+
+#define MATERIAL_SSBO_BINDING 0
+
+// std430 layout, must match MaterialData in mesh shaders
+struct MaterialData
+{
+	osg::Vec4 ambient;	// w: shininess
+	osg::Vec4 diffuse;
+	osg::Vec4 specular;
+	osg::Vec4 pbr;		// x: metallic; y: roughness; z: ao
+};
+
+// scene-wide material storage, bound as a shader storage buffer on the view camera.
+// allocate/release can be called from any thread, set and upload must run on the render thread.
+// edits only mark their slot dirty, upload then writes the changed range with glBufferSubData
+// instead of re-uploading the whole table.
+class CANVAS_EXPORT MaterialTable : public osg::Referenced
+{
+public:
+	MaterialTable();
+
+	static MaterialData defaultMaterial();
+
+	int allocate();
+	void release(int index);
+
+	void set(int index, const MaterialData& material);
+	const MaterialData& get(int index) const;
+
+	osg::ShaderStorageBufferBinding* getBinding() { return m_binding.get(); }
+
+	// called before the view camera draws
+	void upload(osg::State& state);
+
+protected:
+	~MaterialTable();
+
+	MaterialData* data();
+	void resize(unsigned int count);
+
+	osg::ref_ptr<osg::FloatArray> m_array;
+	osg::ref_ptr<osg::ShaderStorageBufferBinding> m_binding;
+	unsigned int m_count;
+	unsigned int m_dirtyBegin;
+	unsigned int m_dirtyEnd;
+
+	std::mutex m_mutex;
+	std::vector<int> m_freeIndices;
+	int m_nextIndex;
+};
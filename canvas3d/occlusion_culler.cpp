@@ -0,0 +1,277 @@
+#include "occlusion_culler.h"
+#include <osg/BufferObject>
+#include <osg/GLExtensions>
+#include <osg/Switch>
+#include <osg/Timer>
+#include <osgUtil/CullVisitor>
+#include <algorithm>
+
+class OcclusionCullCallback : public osg::NodeCallback
+{
+public:
+	OcclusionCullCallback(OcclusionCuller* culler, osg::Camera* mainCamera) : m_culler(culler), m_mainCamera(mainCamera) {}
+
+	virtual void operator()(osg::Node* node, osg::NodeVisitor* nv) override {
+		auto cv = nv->asCullVisitor();
+		osg::ref_ptr<osg::Camera> mainCamera;
+		std::shared_ptr<const OcclusionCuller::Pyramid> pyramid;
+		if (cv != nullptr && m_culler->isEnabled() && m_mainCamera.lock(mainCamera)) {
+			// shadow cameras look from the lights, only passes from the main viewpoint may reuse its depth
+			osg::Camera* camera = cv->getCurrentCamera();
+			if (camera == mainCamera || (camera != nullptr && camera->getViewMatrix() == mainCamera->getViewMatrix())) {
+				pyramid = m_culler->getPyramid();
+			}
+		}
+		osg::Switch* group = node->asSwitch();
+		if (!pyramid || group == nullptr) {
+			traverse(node, nv);
+			return;
+		}
+
+		for (unsigned int i = 0; i < group->getNumChildren(); ++i) {
+			if (!group->getValue(i)) {
+				continue;
+			}
+			osg::Node* child = group->getChild(i);
+			const osg::BoundingSphere& bs = child->getBound();
+			if (bs.valid()) {
+				osg::BoundingBox bb;
+				bb.expandBy(bs);
+				bool occluded = pyramid->isOccluded(bb);
+				m_culler->count(occluded);
+				if (occluded) {
+					continue;
+				}
+			}
+			child->accept(*nv);
+		}
+	}
+
+private:
+	osg::ref_ptr<OcclusionCuller> m_culler;
+	osg::observer_ptr<osg::Camera> m_mainCamera;
+};
+
+OcclusionCuller::OcclusionCuller() :
+	m_enabled(false),
+	m_pboWidth(0),
+	m_pboHeight(0),
+	m_frame(0),
+	m_tested(0),
+	m_occluded(0)
+{
+	m_pbos[0] = m_pbos[1] = 0;
+	m_fences[0] = m_fences[1] = nullptr;
+}
+
+OcclusionCuller::~OcclusionCuller()
+{
+
+}
+
+void OcclusionCuller::setEnabled(bool enable)
+{
+	m_enabled = enable;
+}
+
+OcclusionCuller::Stats OcclusionCuller::getStats() const
+{
+	std::lock_guard<std::mutex> locker(m_mutex);
+	return m_stats;
+}
+
+osg::NodeCallback* OcclusionCuller::createCullCallback(osg::Camera* mainCamera)
+{
+	return new OcclusionCullCallback(this, mainCamera);
+}
+
+std::shared_ptr<const OcclusionCuller::Pyramid> OcclusionCuller::getPyramid() const
+{
+	std::lock_guard<std::mutex> locker(m_mutex);
+	return m_pyramid;
+}
+
+void OcclusionCuller::count(bool occluded)
+{
+	m_tested++;
+	if (occluded) {
+		m_occluded++;
+	}
+}
+
+void OcclusionCuller::readDepth(osg::RenderInfo& renderInfo)
+{
+	osg::Timer_t start = osg::Timer::instance()->tick();
+	{
+		std::lock_guard<std::mutex> locker(m_mutex);
+		m_stats.tested = m_tested.exchange(0);
+		m_stats.occluded = m_occluded.exchange(0);
+		if (!m_enabled) {
+			m_pyramid.reset();
+		}
+	}
+
+	osg::State* state = renderInfo.getState();
+	osg::Camera* camera = renderInfo.getCurrentCamera();
+	osg::GLExtensions* ext = state->get<osg::GLExtensions>();
+	if (camera == nullptr || camera->getViewport() == nullptr) {
+		return;
+	}
+	if (!m_enabled) {
+		if (m_pbos[0] != 0) {
+			for (int i = 0; i < 2; ++i) {
+				if (m_fences[i] != nullptr) {
+					ext->glDeleteSync(m_fences[i]);
+					m_fences[i] = nullptr;
+				}
+			}
+			ext->glDeleteBuffers(2, m_pbos);
+			m_pbos[0] = m_pbos[1] = 0;
+			m_pboWidth = m_pboHeight = 0;
+		}
+		return;
+	}
+
+	const osg::Viewport* viewport = camera->getViewport();
+	int width = static_cast<int>(viewport->width());
+	int height = static_cast<int>(viewport->height());
+	GLsizeiptr size = static_cast<GLsizeiptr>(width) * height * sizeof(float);
+	if (m_pbos[0] == 0) {
+		ext->glGenBuffers(2, m_pbos);
+	}
+	if (width != m_pboWidth || height != m_pboHeight) {
+		for (int i = 0; i < 2; ++i) {
+			if (m_fences[i] != nullptr) {
+				ext->glDeleteSync(m_fences[i]);
+				m_fences[i] = nullptr;
+			}
+			ext->glBindBuffer(GL_PIXEL_PACK_BUFFER_ARB, m_pbos[i]);
+			ext->glBufferData(GL_PIXEL_PACK_BUFFER_ARB, size, nullptr, GL_STREAM_READ_ARB);
+		}
+		m_pboWidth = width;
+		m_pboHeight = height;
+	}
+
+	// queue this frame's depth
+	int write = m_frame % 2;
+	ext->glBindBuffer(GL_PIXEL_PACK_BUFFER_ARB, m_pbos[write]);
+	glReadPixels(static_cast<GLint>(viewport->x()), static_cast<GLint>(viewport->y()), width, height, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+	if (m_fences[write] != nullptr) {
+		ext->glDeleteSync(m_fences[write]);
+	}
+	m_fences[write] = ext->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	m_pboViewProjections[write] = camera->getViewMatrix() * camera->getProjectionMatrix();
+
+	// reduce the previous one if the copy has finished, otherwise keep last pyramid
+	int read = 1 - write;
+	if (m_fences[read] != nullptr) {
+		GLenum result = ext->glClientWaitSync(m_fences[read], 0, 0);
+		if (result == GL_ALREADY_SIGNALED || result == GL_CONDITION_SATISFIED) {
+			ext->glDeleteSync(m_fences[read]);
+			m_fences[read] = nullptr;
+			ext->glBindBuffer(GL_PIXEL_PACK_BUFFER_ARB, m_pbos[read]);
+			auto depth = static_cast<const float*>(ext->glMapBuffer(GL_PIXEL_PACK_BUFFER_ARB, GL_READ_ONLY_ARB));
+			if (depth != nullptr) {
+				buildPyramid(depth, width, height, m_pboViewProjections[read]);
+				ext->glUnmapBuffer(GL_PIXEL_PACK_BUFFER_ARB);
+			}
+		}
+	}
+	ext->glBindBuffer(GL_PIXEL_PACK_BUFFER_ARB, 0);
+	m_frame++;
+
+	std::lock_guard<std::mutex> locker(m_mutex);
+	m_stats.readbackMs = osg::Timer::instance()->delta_m(start, osg::Timer::instance()->tick());
+}
+
+void OcclusionCuller::buildPyramid(const float* depth, int width, int height, const osg::Matrix& viewProjection)
+{
+	auto pyramid = std::make_shared<Pyramid>();
+	pyramid->viewProjection = viewProjection;
+	pyramid->width = width;
+	pyramid->height = height;
+
+	// level 0, the farthest depth of each HIZ_REDUCTION block
+	int w = (width + HIZ_REDUCTION - 1) / HIZ_REDUCTION;
+	int h = (height + HIZ_REDUCTION - 1) / HIZ_REDUCTION;
+	std::vector<float> level(w * h, 0.0f);
+	for (int y = 0; y < height; ++y) {
+		const float* row = depth + y * width;
+		float* dst = level.data() + (y / HIZ_REDUCTION) * w;
+		for (int x = 0; x < width; ++x) {
+			float& d = dst[x / HIZ_REDUCTION];
+			d = std::max(d, row[x]);
+		}
+	}
+	pyramid->levels.push_back(std::move(level));
+	pyramid->sizes.push_back(osg::Vec2i(w, h));
+
+	// halve down to a single texel, odd edges round up so every texel stays covered
+	while (w > 1 || h > 1) {
+		const std::vector<float>& src = pyramid->levels.back();
+		int srcW = w, srcH = h;
+		w = (w + 1) / 2;
+		h = (h + 1) / 2;
+		std::vector<float> dst(w * h);
+		for (int y = 0; y < h; ++y) {
+			int y0 = y * 2, y1 = std::min(y * 2 + 1, srcH - 1);
+			for (int x = 0; x < w; ++x) {
+				int x0 = x * 2, x1 = std::min(x * 2 + 1, srcW - 1);
+				dst[y * w + x] = std::max(std::max(src[y0 * srcW + x0], src[y0 * srcW + x1]),
+					std::max(src[y1 * srcW + x0], src[y1 * srcW + x1]));
+			}
+		}
+		pyramid->levels.push_back(std::move(dst));
+		pyramid->sizes.push_back(osg::Vec2i(w, h));
+	}
+
+	std::lock_guard<std::mutex> locker(m_mutex);
+	m_pyramid = pyramid;
+}
+
+bool OcclusionCuller::Pyramid::isOccluded(const osg::BoundingBox& bb) const
+{
+	double minX = 1.0, minY = 1.0, maxX = -1.0, maxY = -1.0, minZ = 1.0;
+	for (int i = 0; i < 8; ++i) {
+		osg::Vec4d clip = osg::Vec4d(bb.corner(i), 1.0) * viewProjection;
+		// crosses the eye plane, always drawn
+		if (clip.w() <= 1e-6) {
+			return false;
+		}
+		double invW = 1.0 / clip.w();
+		minX = std::min(minX, clip.x() * invW);
+		maxX = std::max(maxX, clip.x() * invW);
+		minY = std::min(minY, clip.y() * invW);
+		maxY = std::max(maxY, clip.y() * invW);
+		minZ = std::min(minZ, clip.z() * invW);
+	}
+	// outside last frame's view, nothing is known about it
+	if (maxX < -1.0 || minX > 1.0 || maxY < -1.0 || minY > 1.0 || minZ < -1.0) {
+		return false;
+	}
+	float nearest = static_cast<float>(minZ * 0.5 + 0.5);
+
+	// level 0 texels covered by the box
+	auto toTexel = [](double ndc, int pixels) {
+		double pixel = osg::clampBetween((ndc * 0.5 + 0.5) * pixels, 0.0, pixels - 1.0);
+		return static_cast<int>(pixel) / HIZ_REDUCTION;
+	};
+	int x0 = toTexel(minX, width), x1 = toTexel(maxX, width);
+	int y0 = toTexel(minY, height), y1 = toTexel(maxY, height);
+
+	// coarsest level where the box still spans at most 4 x 4 texels
+	size_t lod = 0;
+	while (lod + 1 < levels.size() && ((x1 >> lod) - (x0 >> lod) > 3 || (y1 >> lod) - (y0 >> lod) > 3)) {
+		++lod;
+	}
+	const std::vector<float>& level = levels[lod];
+	int levelWidth = sizes[lod].x();
+	for (int y = y0 >> lod; y <= (y1 >> lod); ++y) {
+		for (int x = x0 >> lod; x <= (x1 >> lod); ++x) {
+			if (nearest <= level[y * levelWidth + x]) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
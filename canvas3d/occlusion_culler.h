@@ -0,0 +1,81 @@
+#pragma once
+
+#include "canvas3d_export.h"
+#include <osg/Camera>
+#include <osg/GLExtensions>
+#include <osg/NodeCallback>
+#include <osg/RenderInfo>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// level 0 of the pyramid keeps the farthest depth of HIZ_REDUCTION x HIZ_REDUCTION pixels
+#define HIZ_REDUCTION 4
+
+// occlusion culling of the model group's children against last frame's depth.
+// at the end of the main camera's draw the depth buffer is read into a pixel buffer object, the
+// readback of the frame before is mapped (only once its fence has signalled, so the draw never
+// stalls) and reduced into a max-depth mip pyramid. during cull a child whose bounding box lies
+// behind the pyramid in last frame's view is skipped; objects uncovered by camera motion show up
+// one frame late.
+class CANVAS_EXPORT OcclusionCuller : public osg::Referenced
+{
+public:
+	struct Stats {
+		unsigned int tested = 0;
+		unsigned int occluded = 0;
+		double readbackMs = 0.0;	// map and pyramid build on the render thread
+	};
+
+	OcclusionCuller();
+
+	// any thread, takes effect next frame
+	void setEnabled(bool enable);
+	bool isEnabled() const { return m_enabled; }
+
+	// counters of the last completed frame
+	Stats getStats() const;
+
+	// cull callback for the model group, tests its children for cameras sharing the main camera's view
+	osg::NodeCallback* createCullCallback(osg::Camera* mainCamera);
+
+	// render thread, after the main camera has drawn
+	void readDepth(osg::RenderInfo& renderInfo);
+
+protected:
+	~OcclusionCuller();
+
+	struct Pyramid {
+		osg::Matrix viewProjection;
+		int width;		// of the depth buffer
+		int height;
+		std::vector<std::vector<float>> levels;
+		std::vector<osg::Vec2i> sizes;
+
+		bool isOccluded(const osg::BoundingBox& bb) const;
+	};
+
+	void buildPyramid(const float* depth, int width, int height, const osg::Matrix& viewProjection);
+	std::shared_ptr<const Pyramid> getPyramid() const;
+	void count(bool occluded);
+
+	std::atomic<bool> m_enabled;
+
+	mutable std::mutex m_mutex;
+	std::shared_ptr<const Pyramid> m_pyramid;
+
+	// two pixel buffers in flight, one written this frame and one mapped from the frame before
+	GLuint m_pbos[2];
+	GLsync m_fences[2];
+	int m_pboWidth;
+	int m_pboHeight;
+	osg::Matrix m_pboViewProjections[2];
+	unsigned int m_frame;
+
+	std::atomic<unsigned int> m_tested;
+	std::atomic<unsigned int> m_occluded;
+	Stats m_stats;
+
+	friend class OcclusionCullCallback;
+};
@@ -0,0 +1,112 @@
+#include "parallel_cull_viewer.h"
+#include <QSemaphore>
+#include <QThread>
+#include <algorithm>
+#include <vector>
+
+ParallelCullRenderer::ParallelCullRenderer(osg::Camera* camera) :
+	osgViewer::Renderer(camera),
+	m_bCulledAhead(false)
+{
+
+}
+
+ParallelCullRenderer::~ParallelCullRenderer()
+{
+
+}
+
+void ParallelCullRenderer::cullAhead()
+{
+	osgViewer::Renderer::cull();
+	m_bCulledAhead = true;
+}
+
+void ParallelCullRenderer::cull()
+{
+	if (m_bCulledAhead) {
+		m_bCulledAhead = false;
+		return;
+	}
+	osgViewer::Renderer::cull();
+}
+
+ParallelCullViewer::ParallelCullViewer() :
+	m_bParallelCull(true),
+	m_lastFrameTick(0)
+{
+	// the Qt render thread owns the context, none of the viewer's own threads may draw
+	setThreadingModel(osgViewer::ViewerBase::SingleThreaded);
+	m_cullPool.setMaxThreadCount(std::max(1, QThread::idealThreadCount() - 1));
+}
+
+ParallelCullViewer::~ParallelCullViewer()
+{
+	m_cullPool.waitForDone();
+}
+
+ParallelCullViewer::Stats ParallelCullViewer::getStats() const
+{
+	std::lock_guard<std::mutex> locker(m_statsMutex);
+	return m_stats;
+}
+
+void ParallelCullViewer::renderingTraversals()
+{
+	osg::Timer* timer = osg::Timer::instance();
+	osg::Timer_t start = timer->tick();
+
+	Cameras cameras;
+	getCameras(cameras);
+	std::vector<ParallelCullRenderer*> renderers;
+	for (auto camera : cameras) {
+		auto renderer = dynamic_cast<ParallelCullRenderer*>(camera->getRenderer());
+		if (renderer) {
+			renderers.push_back(renderer);
+		}
+	}
+	bool parallel = m_bParallelCull && renderers.size() > 1 && !done();
+	for (auto renderer : renderers) {
+		renderer->setGraphicsThreadDoesCull(!parallel);
+	}
+
+	double cullMs = 0.0;
+	if (parallel) {
+		// bounds are computed lazily, finish them before several threads traverse the scenes
+		Scenes scenes;
+		getScenes(scenes);
+		for (auto scene : scenes) {
+			if (scene->getSceneData()) {
+				scene->getSceneData()->getBound();
+			}
+		}
+
+		QSemaphore culled;
+		for (size_t i = 1; i < renderers.size(); ++i) {
+			ParallelCullRenderer* renderer = renderers[i];
+			m_cullPool.start([renderer, &culled]() {
+				renderer->cullAhead();
+				culled.release();
+				});
+		}
+		renderers[0]->cullAhead();
+		culled.acquire(static_cast<int>(renderers.size() - 1));
+		cullMs = timer->delta_m(start, timer->tick());
+	}
+
+	osgViewer::CompositeViewer::renderingTraversals();
+
+	osg::Timer_t end = timer->tick();
+	std::lock_guard<std::mutex> locker(m_statsMutex);
+	m_stats.views = getNumViews();
+	m_stats.parallel = parallel;
+	m_stats.cullMs = cullMs;
+	m_stats.renderMs = timer->delta_m(start, end);
+	if (m_lastFrameTick != 0) {
+		double frameS = timer->delta_s(m_lastFrameTick, start);
+		if (frameS > 0.0) {
+			m_stats.fps = m_stats.fps > 0.0 ? m_stats.fps * 0.9 + 0.1 / frameS : 1.0 / frameS;
+		}
+	}
+	m_lastFrameTick = start;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "canvas3d_export.h"
+#include <osgViewer/CompositeViewer>
+#include <osgViewer/Renderer>
+#include <osg/Timer>
+#include <QThreadPool>
+#include <atomic>
+#include <mutex>
+
+// a camera's renderer whose cull can run ahead of the viewer's rendering traversal on another
+// thread. the viewer's own cull of that frame is skipped, the draw takes the culled scene view
+class CANVAS_EXPORT ParallelCullRenderer : public osgViewer::Renderer
+{
+public:
+	ParallelCullRenderer(osg::Camera* camera);
+
+	// any thread, only while the graphics thread doesn't cull
+	void cullAhead();
+
+	virtual void cull() override;
+
+protected:
+	~ParallelCullRenderer();
+
+	bool m_bCulledAhead;
+};
+
+// all views draw into the one embedded context on the Qt render thread, so the viewer stays single
+// threaded. with more than one view the cameras are culled at once on a thread pool before the
+// rendering traversal, then drawn in view order sharing the context, its state and the ShaderMgr
+// programs. cull callbacks below the shared scene must be safe to run for several cameras at once,
+// passes bound to the main view carry MAIN_VIEW_ONLY_MASK and are culled by it alone
+class CANVAS_EXPORT ParallelCullViewer : public osgViewer::CompositeViewer
+{
+public:
+	struct Stats {
+		unsigned int views = 0;
+		bool parallel = false;
+		double cullMs = 0.0;		// wall time of the cull of all views
+		double renderMs = 0.0;		// cull and draw of all views
+		double fps = 0.0;			// smoothed over the last frames
+	};
+
+	ParallelCullViewer();
+
+	// any thread, takes effect next frame
+	void setParallelCull(bool enable) { m_bParallelCull = enable; }
+	bool isParallelCull() const { return m_bParallelCull; }
+
+	Stats getStats() const;
+
+	virtual void renderingTraversals() override;
+
+protected:
+	~ParallelCullViewer();
+
+	std::atomic<bool> m_bParallelCull;
+	QThreadPool m_cullPool;
+	osg::Timer_t m_lastFrameTick;
+
+	mutable std::mutex m_statsMutex;
+	Stats m_stats;
+};
@@ -0,0 +1,208 @@
+#include "render_command_queue.h"
+#include <osg/Timer>
+#include <algorithm>
+
+// commands handed back by the render thread, taken as a whole by the next producer that runs dry.
+// pushing a list and exchanging the whole stack are both free of the ABA problem. the pool lives as
+// long as the process
+static std::atomic<RenderCommand*> s_free(nullptr);
+
+// a producer's private part of the pool, returned when its thread ends
+struct RenderCommandCache
+{
+	~RenderCommandCache() {
+		if (head) {
+			RenderCommand* last = head;
+			while (RenderCommand* next = last->next.load(std::memory_order_relaxed)) {
+				last = next;
+			}
+			RenderCommand* top = s_free.load(std::memory_order_relaxed);
+			do {
+				last->next.store(top, std::memory_order_relaxed);
+			} while (!s_free.compare_exchange_weak(top, head, std::memory_order_release, std::memory_order_relaxed));
+		}
+	}
+
+	RenderCommand* head = nullptr;
+};
+static thread_local RenderCommandCache t_cache;
+
+class DrainCommandsOperation : public osg::Operation
+{
+public:
+	DrainCommandsOperation(RenderCommandQueue* queue) : osg::Operation("drain render commands", true), m_queue(queue) {}
+
+	virtual void operator () (osg::Object* obj) override {
+		m_queue->drain(m_queue->getBudget());
+	}
+
+protected:
+	osg::ref_ptr<RenderCommandQueue> m_queue;
+};
+
+RenderCommandQueue::RenderCommandQueue() :
+	m_tail(&m_stub),
+	m_depth(0),
+	m_budgetMs(2.0),
+	m_head(&m_stub),
+	m_pendingBegin(0)
+{
+	m_stub.next.store(nullptr, std::memory_order_relaxed);
+	m_stub.object = nullptr;
+	m_stub.cancelled = false;
+}
+
+RenderCommandQueue::~RenderCommandQueue()
+{
+	// whatever is left is dropped without running
+	while (RenderCommand* command = pop()) {
+		m_pending.push_back(command);
+	}
+	for (size_t i = m_pendingBegin; i < m_pending.size(); ++i) {
+		m_pending[i]->destroy(m_pending[i]->callable);
+		release(m_pending[i], m_pending[i]);
+	}
+}
+
+RenderCommand* RenderCommandQueue::allocate()
+{
+	RenderCommandCache& cache = t_cache;
+	if (cache.head == nullptr) {
+		cache.head = s_free.exchange(nullptr, std::memory_order_acquire);
+	}
+	if (cache.head == nullptr) {
+		RenderCommand* chunk = new RenderCommand[RENDER_COMMAND_CHUNK];
+		for (int i = 0; i < RENDER_COMMAND_CHUNK; ++i) {
+			chunk[i].next.store(i + 1 < RENDER_COMMAND_CHUNK ? &chunk[i + 1] : nullptr, std::memory_order_relaxed);
+		}
+		cache.head = chunk;
+	}
+	RenderCommand* command = cache.head;
+	cache.head = command->next.load(std::memory_order_relaxed);
+	return command;
+}
+
+void RenderCommandQueue::release(RenderCommand* first, RenderCommand* last)
+{
+	RenderCommand* top = s_free.load(std::memory_order_relaxed);
+	do {
+		last->next.store(top, std::memory_order_relaxed);
+	} while (!s_free.compare_exchange_weak(top, first, std::memory_order_release, std::memory_order_relaxed));
+}
+
+void RenderCommandQueue::push(RenderCommand* command)
+{
+	if (command != &m_stub) {
+		m_depth.fetch_add(1, std::memory_order_relaxed);
+	}
+	command->next.store(nullptr, std::memory_order_relaxed);
+	RenderCommand* previous = m_tail.exchange(command, std::memory_order_acq_rel);
+	previous->next.store(command, std::memory_order_release);
+}
+
+RenderCommand* RenderCommandQueue::pop()
+{
+	RenderCommand* head = m_head;
+	RenderCommand* next = head->next.load(std::memory_order_acquire);
+	if (head == &m_stub) {
+		if (next == nullptr) {
+			return nullptr;
+		}
+		m_head = next;
+		head = next;
+		next = next->next.load(std::memory_order_acquire);
+	}
+	if (next) {
+		m_head = next;
+		return head;
+	}
+	if (head != m_tail.load(std::memory_order_acquire)) {
+		return nullptr;
+	}
+	// the last command can only go once something follows it
+	push(&m_stub);
+	next = head->next.load(std::memory_order_acquire);
+	if (next) {
+		m_head = next;
+		return head;
+	}
+	return nullptr;
+}
+
+void RenderCommandQueue::drain(double budgetMs)
+{
+	osg::Timer* timer = osg::Timer::instance();
+	osg::Timer_t start = timer->tick();
+
+	// everything submitted so far joins the pending commands, a newer command cancels the waiting one
+	// of its key
+	unsigned int coalesced = 0;
+	while (RenderCommand* command = pop()) {
+		if (command->object) {
+			RenderCommand*& latest = m_latest[Key{ command->object, command->property }];
+			if (latest) {
+				latest->cancelled = true;
+				++coalesced;
+			}
+			latest = command;
+		}
+		m_pending.push_back(command);
+	}
+
+	unsigned int executed = 0;
+	unsigned int released = 0;
+	RenderCommand* first = nullptr;
+	RenderCommand* last = nullptr;
+	size_t i = m_pendingBegin;
+	for (; i < m_pending.size(); ++i) {
+		RenderCommand* command = m_pending[i];
+		if (!command->cancelled) {
+			if (executed > 0 && timer->delta_m(start, timer->tick()) >= budgetMs) {
+				break;
+			}
+			if (command->object) {
+				m_latest.erase(Key{ command->object, command->property });
+			}
+			command->invoke(command->callable);
+			++executed;
+		}
+		command->destroy(command->callable);
+		command->next.store(first, std::memory_order_relaxed);
+		first = command;
+		last = last ? last : command;
+		++released;
+	}
+	m_pendingBegin = i;
+	if (m_pendingBegin == m_pending.size()) {
+		m_pending.clear();
+		m_pendingBegin = 0;
+	}
+	else if (m_pendingBegin > m_pending.size() / 2) {
+		m_pending.erase(m_pending.begin(), m_pending.begin() + m_pendingBegin);
+		m_pendingBegin = 0;
+	}
+	if (first) {
+		release(first, last);
+	}
+	m_depth.fetch_sub(released, std::memory_order_relaxed);
+
+	std::lock_guard<std::mutex> locker(m_statsMutex);
+	m_stats.executed = executed;
+	m_stats.coalesced = coalesced;
+	m_stats.deferred = static_cast<unsigned int>(m_pending.size() - m_pendingBegin);
+	m_stats.drainMs = timer->delta_m(start, timer->tick());
+	m_stats.maxDrainMs = std::max(m_stats.maxDrainMs, m_stats.drainMs);
+}
+
+osg::Operation* RenderCommandQueue::createDrainOperation()
+{
+	return new DrainCommandsOperation(this);
+}
+
+RenderCommandQueue::Stats RenderCommandQueue::getStats() const
+{
+	std::lock_guard<std::mutex> locker(m_statsMutex);
+	Stats stats = m_stats;
+	stats.depth = m_depth.load(std::memory_order_relaxed);
+	return stats;
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include "canvas3d_export.h"
+#include <osg/OperationThread>
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// bytes of captured state a command holds without a heap allocation
+#define RENDER_COMMAND_STORAGE 192
+// commands allocated at once when the pool runs dry
+#define RENDER_COMMAND_CHUNK 256
+
+// a pooled command, callables up to RENDER_COMMAND_STORAGE bytes are constructed in place
+struct RenderCommand
+{
+	std::atomic<RenderCommand*> next;
+	const void* object;		// key of a coalescing command, nullptr for the others
+	unsigned int property;
+	bool cancelled;
+	void* callable;
+	void (*invoke)(void*);
+	void (*destroy)(void*);
+	alignas(std::max_align_t) unsigned char storage[RENDER_COMMAND_STORAGE];
+};
+
+// commands from the UI and worker threads to the render thread, replacing one LambdaOperation and
+// an OperationQueue mutex per change.
+// submit is lock free: commands come from a thread local pool and are linked into an intrusive
+// multi producer single consumer list. a command keyed by (object, property) replaces the one of the
+// same key still waiting, so a slider drag costs one execution per frame however many values it
+// sends. the render thread drains the queue in submission order at the start of the update
+// traversal until the frame's time budget is spent, the rest waits for the next frame
+class CANVAS_EXPORT RenderCommandQueue : public osg::Referenced
+{
+public:
+	struct Stats {
+		unsigned int depth = 0;			// waiting, including the ones submitted since the last drain
+		unsigned int executed = 0;		// by the last drain
+		unsigned int coalesced = 0;		// dropped by the last drain for a newer one of their key
+		unsigned int deferred = 0;		// left over by the last drain's budget
+		double drainMs = 0.0;
+		double maxDrainMs = 0.0;		// of any drain so far
+	};
+
+	RenderCommandQueue();
+
+	// any thread
+	template<class Func>
+	void submit(Func&& func) {
+		push(create(nullptr, 0, std::forward<Func>(func)));
+	}
+	// any thread, replaces a waiting command of the same object and property
+	template<class Func>
+	void submit(const void* object, unsigned int property, Func&& func) {
+		push(create(object, property, std::forward<Func>(func)));
+	}
+
+	// render thread. at least one command runs however small the budget
+	void drain(double budgetMs);
+	// the operation draining the queue each frame, for the viewer's update operations
+	osg::Operation* createDrainOperation();
+
+	// any thread, takes effect next drain
+	void setBudget(double budgetMs) { m_budgetMs = budgetMs; }
+	double getBudget() const { return m_budgetMs; }
+	Stats getStats() const;
+
+protected:
+	~RenderCommandQueue();
+
+	template<class Func>
+	static RenderCommand* create(const void* object, unsigned int property, Func&& func) {
+		typedef typename std::decay<Func>::type Callable;
+		RenderCommand* command = allocate();
+		command->object = object;
+		command->property = property;
+		command->cancelled = false;
+		if constexpr (sizeof(Callable) <= RENDER_COMMAND_STORAGE && alignof(Callable) <= alignof(std::max_align_t)) {
+			command->callable = new (command->storage) Callable(std::forward<Func>(func));
+			command->destroy = [](void* callable) { static_cast<Callable*>(callable)->~Callable(); };
+		}
+		else {
+			command->callable = new Callable(std::forward<Func>(func));
+			command->destroy = [](void* callable) { delete static_cast<Callable*>(callable); };
+		}
+		command->invoke = [](void* callable) { (*static_cast<Callable*>(callable))(); };
+		return command;
+	}
+	static RenderCommand* allocate();
+	static void release(RenderCommand* first, RenderCommand* last);
+
+	void push(RenderCommand* command);
+	// the oldest submitted command, nullptr when empty or a producer is half way through push
+	RenderCommand* pop();
+
+	struct Key {
+		const void* object;
+		unsigned int property;
+		bool operator == (const Key& other) const { return object == other.object && property == other.property; }
+	};
+	struct KeyHash {
+		size_t operator () (const Key& key) const {
+			return std::hash<const void*>()(key.object) ^ (static_cast<size_t>(key.property) * 0x9e3779b97f4a7c15ull);
+		}
+	};
+
+	// producers
+	std::atomic<RenderCommand*> m_tail;
+	std::atomic<unsigned int> m_depth;
+	std::atomic<double> m_budgetMs;
+
+	// render thread
+	RenderCommand* m_head;
+	RenderCommand m_stub;
+	std::vector<RenderCommand*> m_pending;
+	size_t m_pendingBegin;
+	std::unordered_map<Key, RenderCommand*, KeyHash> m_latest;
+
+	mutable std::mutex m_statsMutex;
+	Stats m_stats;
+};
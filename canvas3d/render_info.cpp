@@ -1,6 +1,16 @@
 #include "render_info.h"
+#include "material_table.h"
+#include "light_clusters.h"
+#include "occlusion_culler.h"
+#include "parallel_cull_viewer.h"
+#include "customized_manipulator.h"
+#include "operation.h"
+#include "scene_state.h"
+#include "shader_manager.h"
 #include <osgViewer/ViewerEventHandlers>
 #include <osg/BufferIndexBinding>
+#include <osgUtil/IncrementalCompileOperation>
+#include <algorithm>
 
 class ViewUserData : public osg::Referenced
 {
@@ -8,6 +18,13 @@ public:
 	osg::ref_ptr<osg::Switch> m_root;
 	osg::ref_ptr<osg::Switch> m_model;
 	osg::ref_ptr<osg::Switch> m_other;
+	osg::ref_ptr<MaterialTable> m_materialTable;
+	osg::ref_ptr<LightClusters> m_lightClusters;
+	osg::ref_ptr<OcclusionCuller> m_occlusionCuller;
+	osg::ref_ptr<SceneState> m_sceneState;
+	osg::ref_ptr<osg::Group> m_shadowAtlas;
+	osg::ref_ptr<osg::FloatArray> m_cameraData;
+	unsigned int m_sceneRevision = 0;
 	QOpenGLFramebufferObject* m_qtFBO = nullptr;
 };
 
@@ -23,51 +40,86 @@ osg::ref_ptr<osgViewer::View> ViewInfo::createView()
 	root->addChild(model);
 	root->addChild(other);
 	view->setSceneData(root);
+	view->getCamera()->setRenderer(new ParallelCullRenderer(view->getCamera()));
 
 	ViewUserData* vud = new ViewUserData;
 	vud->m_root = root;
 	vud->m_model = model;
 	vud->m_other = other;
+	vud->m_materialTable = new MaterialTable;
+	vud->m_lightClusters = new LightClusters;
+	vud->m_occlusionCuller = new OcclusionCuller;
+	vud->m_sceneState = new SceneState(vud->m_materialTable);
 	view->setUserData(vud);
 
-	// vieport uniform
-	osg::Uniform* viewportUniform = new osg::Uniform("viewport", osg::Vec4());
-	class ViewportUniformUpdateCallback : public osg::UniformCallback
+	// directional light ubo
+	osg::FloatArray* directionalLightData = new osg::FloatArray;
+	directionalLightData->resize(sizeof(DirectionalLightUBuffer), 0.0f);
+	osg::UniformBufferBinding* directionalLightUBuffer = new osg::UniformBufferBinding(0, directionalLightData);
+	view->getCamera()->getOrCreateStateSet()->setAttributeAndModes(directionalLightUBuffer);
+	// point and spot lights, binned into view clusters before the view draws
+	vud->m_lightClusters->applyTo(view->getCamera()->getOrCreateStateSet());
+	// camera ubo
+	vud->m_cameraData = new osg::FloatArray;
+	vud->m_cameraData->resize(sizeof(CameraUBuffer) / sizeof(float), 0.0f);
+	osg::UniformBufferBinding* cameraUBuffer = new osg::UniformBufferBinding(CAMERA_UBO_BINDING, vud->m_cameraData.get(), 0, sizeof(CameraUBuffer));
+	view->getCamera()->getOrCreateStateSet()->setAttributeAndModes(cameraUBuffer);
+
+	// material ssbo, edited slots are uploaded before anything of the view is drawn.
+	// the light clusters are rebuilt at the same point, with the matrices of the frame being drawn,
+	// and cached program binaries are loaded before the mesh programs link. the camera block gets
+	// the matrices of the frame being drawn. linked views run the same callback with their camera
+	class ViewInitialDrawCallback : public osg::Camera::DrawCallback
 	{
 	public:
-		virtual void operator () (osg::Uniform* uniform, osg::NodeVisitor* nv) override {
-			osgUtil::UpdateVisitor* uv = nv->asUpdateVisitor();
-			const osg::NodePath& nodePath = nv->getNodePath();
-			const osg::Camera* camera = nodePath.front()->asCamera();
+		ViewInitialDrawCallback(MaterialTable* table, LightClusters* clusters, osg::FloatArray* cameraData) :
+			m_table(table), m_clusters(clusters), m_cameraData(cameraData) {}
+		virtual void operator () (osg::RenderInfo& renderInfo) const override {
+			// the views share the buffer bindings, applying them again uploads what the view before left
+			renderInfo.getState()->dirtyAllAttributes();
+			m_table->upload(*renderInfo.getState());
+			ShaderMgr::instance()->updateProgramBinaries(*renderInfo.getState());
+			const osg::Camera* camera = renderInfo.getCurrentCamera();
+			if (camera) {
+				m_clusters->update(camera);
+				updateCamera(camera);
+			}
+		}
+	protected:
+		void updateCamera(const osg::Camera* camera) const {
+			auto data = reinterpret_cast<CameraUBuffer*>(m_cameraData->asVector().data());
+			data->view = camera->getViewMatrix();
+			data->projection = camera->getProjectionMatrix();
+			data->viewProjection = camera->getViewMatrix() * camera->getProjectionMatrix();
+			data->position = osg::Vec4(camera->getInverseViewMatrix().getTrans(), 1.0f);
 			const osg::Viewport* viewport = camera->getViewport();
-			osg::Vec4 vec(viewport->x(), viewport->y(), viewport->width(), viewport->height());
-			uniform->set(vec);
+			if (viewport) {
+				data->viewport = osg::Vec4(viewport->x(), viewport->y(), viewport->width(), viewport->height());
+			}
+			m_cameraData->dirty();
 		}
+
+		osg::ref_ptr<MaterialTable> m_table;
+		osg::ref_ptr<LightClusters> m_clusters;
+		osg::ref_ptr<osg::FloatArray> m_cameraData;
 	};
-	viewportUniform->setUpdateCallback(new ViewportUniformUpdateCallback);
-	view->getCamera()->getOrCreateStateSet()->addUniform(viewportUniform);
+	view->getCamera()->getOrCreateStateSet()->setAttributeAndModes(vud->m_materialTable->getBinding());
+	view->getCamera()->setInitialDrawCallback(new ViewInitialDrawCallback(vud->m_materialTable, vud->m_lightClusters, vud->m_cameraData));
+	view->getCamera()->getOrCreateStateSet()->addUniform(new osg::Uniform("nodeMaterialIndex", 0));
 
-	// shader mode uniform
-	view->getCamera()->getOrCreateStateSet()->addUniform(new osg::Uniform("shaderMode", static_cast<int>(ShaderMode::PreviewMaterial)));
-	
-	// directional light ubo
-	osg::FloatArray* directionalLightData = new osg::FloatArray;
-	directionalLightData->resize(sizeof(DirectionalLightUBuffer), 0.0f);
-	osg::UniformBufferBinding* directionalLightUBuffer = new osg::UniformBufferBinding(0, directionalLightData);
-	view->getCamera()->getOrCreateStateSet()->setAttributeAndModes(directionalLightUBuffer);
-	// point light ubo
-	osg::FloatArray* pointLightData = new osg::FloatArray;
-	pointLightData->resize(sizeof(PointLightUBuffer), 0.0f);
-	osg::UniformBufferBinding* pointLightUBuffer = new osg::UniformBufferBinding(1, pointLightData);
-	view->getCamera()->getOrCreateStateSet()->setAttributeAndModes(pointLightUBuffer);
-	// spot light ubo
-	osg::FloatArray* spotLightData = new osg::FloatArray;
-	spotLightData->resize(sizeof(SpotLightUBuffer), 0.0f);
-	osg::UniformBufferBinding* spotLightUBuffer = new osg::UniformBufferBinding(2, spotLightData);
-	view->getCamera()->getOrCreateStateSet()->setAttributeAndModes(spotLightUBuffer);
-
-	// shadow uniform
-	view->getCamera()->getOrCreateStateSet()->addUniform(new osg::Uniform("useShadow", true));
+	// occlusion culling of the model group against the depth read back after the view draws
+	class ViewFinalDrawCallback : public osg::Camera::DrawCallback
+	{
+	public:
+		ViewFinalDrawCallback(OcclusionCuller* culler) : m_culler(culler) {}
+		virtual void operator () (osg::RenderInfo& renderInfo) const override {
+			m_culler->readDepth(renderInfo);
+		}
+	protected:
+		osg::ref_ptr<OcclusionCuller> m_culler;
+	};
+	model->setCullCallback(vud->m_occlusionCuller->createCullCallback(view->getCamera()));
+	view->getCamera()->setFinalDrawCallback(new ViewFinalDrawCallback(vud->m_occlusionCuller));
 
 	// other mode
 	view->getCamera()->getOrCreateStateSet()->setMode(GL_BLEND, osg::StateAttribute::OFF);
@@ -78,6 +130,26 @@ osg::ref_ptr<osgViewer::View> ViewInfo::createView()
 	return view;
 }
 
+osg::ref_ptr<osgViewer::View> ViewInfo::createLinkedView(osgViewer::View* mainView)
+{
+	osg::ref_ptr<osgViewer::View> view = new osgViewer::View;
+	// one scene, so the update traversal runs once however many views show it
+	view->setSceneData(mainView->getSceneData());
+	view->setUserData(mainView->getUserData());
+
+	osg::Camera* mainCamera = mainView->getCamera();
+	osg::Camera* camera = view->getCamera();
+	camera->setGraphicsContext(mainCamera->getGraphicsContext());
+	camera->setClearColor(mainCamera->getClearColor());
+	camera->setProjectionMatrix(mainCamera->getProjectionMatrix());
+	camera->setStateSet(mainCamera->getOrCreateStateSet());
+	camera->setInitialDrawCallback(mainCamera->getInitialDrawCallback());
+	camera->setCullMask(~MAIN_VIEW_ONLY_MASK);
+	camera->setRenderer(new ParallelCullRenderer(camera));
+	view->setCameraManipulator(new CustomizedManipulator);
+	return view;
+}
+
 void ViewInfo::setQtFBO(osgViewer::View* view, QOpenGLFramebufferObject* qtFBO)
 {
 	if (view == nullptr) {
@@ -140,6 +212,102 @@ osg::Switch* ViewInfo::getOtherGroup(osgViewer::View* view)
 	return vud->m_other;
 }
 
+MaterialTable* ViewInfo::getMaterialTable(osgViewer::View* view)
+{
+	if (view == nullptr) {
+		return nullptr;
+	}
+	auto vud = dynamic_cast<ViewUserData*>(view->getUserData());
+	if (vud == nullptr) {
+		return nullptr;
+	}
+	return vud->m_materialTable;
+}
+
+LightClusters* ViewInfo::getLightClusters(osgViewer::View* view)
+{
+	if (view == nullptr) {
+		return nullptr;
+	}
+	auto vud = dynamic_cast<ViewUserData*>(view->getUserData());
+	if (vud == nullptr) {
+		return nullptr;
+	}
+	return vud->m_lightClusters;
+}
+
+SceneState* ViewInfo::getSceneState(osgViewer::View* view)
+{
+	if (view == nullptr) {
+		return nullptr;
+	}
+	auto vud = dynamic_cast<ViewUserData*>(view->getUserData());
+	if (vud == nullptr) {
+		return nullptr;
+	}
+	return vud->m_sceneState;
+}
+
+osg::Group* ViewInfo::getShadowAtlas(osgViewer::View* view)
+{
+	if (view == nullptr) {
+		return nullptr;
+	}
+	auto vud = dynamic_cast<ViewUserData*>(view->getUserData());
+	if (vud == nullptr) {
+		return nullptr;
+	}
+	return vud->m_shadowAtlas;
+}
+
+void ViewInfo::setShadowAtlas(osgViewer::View* view, osg::Group* atlas)
+{
+	if (view == nullptr) {
+		return;
+	}
+	auto vud = dynamic_cast<ViewUserData*>(view->getUserData());
+	if (vud == nullptr) {
+		return;
+	}
+	vud->m_shadowAtlas = atlas;
+}
+
+OcclusionCuller* ViewInfo::getOcclusionCuller(osgViewer::View* view)
+{
+	if (view == nullptr) {
+		return nullptr;
+	}
+	auto vud = dynamic_cast<ViewUserData*>(view->getUserData());
+	if (vud == nullptr) {
+		return nullptr;
+	}
+	return vud->m_occlusionCuller;
+}
+
+void ViewInfo::dirtySceneRevision(osgViewer::View* view)
+{
+	if (view == nullptr) {
+		return;
+	}
+	auto vud = dynamic_cast<ViewUserData*>(view->getUserData());
+	if (vud == nullptr) {
+		return;
+	}
+	vud->m_sceneRevision++;
+}
+
+unsigned int ViewInfo::getSceneRevision(osgViewer::View* view)
+{
+	if (view == nullptr) {
+		return 0;
+	}
+	auto vud = dynamic_cast<ViewUserData*>(view->getUserData());
+	if (vud == nullptr) {
+		return 0;
+	}
+	return vud->m_sceneRevision;
+}
+
 RenderInfo::RenderInfo()
 {
 
@@ -148,7 +316,8 @@ RenderInfo::RenderInfo()
 RenderInfo::RenderInfo(const RenderInfo& other) :
 	m_compositeViewer(other.m_compositeViewer),
 	m_mainView(other.m_mainView),
-	m_eventQueue(other.m_eventQueue)
+	m_eventQueue(other.m_eventQueue),
+	m_commandQueue(other.m_commandQueue)
 {
 
 }
@@ -156,7 +325,8 @@ RenderInfo::RenderInfo(const RenderInfo& other) :
 RenderInfo::RenderInfo(const RenderInfo&& other) :
 	m_compositeViewer(other.m_compositeViewer),
 	m_mainView(other.m_mainView),
-	m_eventQueue(other.m_eventQueue)
+	m_eventQueue(other.m_eventQueue),
+	m_commandQueue(other.m_commandQueue)
 {
 
 }
@@ -177,10 +347,155 @@ RenderInfo RenderInfo::operator=(const RenderInfo& other) const
 	renderInfo.m_compositeViewer = other.m_compositeViewer;
 	renderInfo.m_mainView = other.m_mainView;
 	renderInfo.m_eventQueue = other.m_eventQueue;
+	renderInfo.m_commandQueue = other.m_commandQueue;
 	return renderInfo;
 }
 
+void RenderInfo::enableOcclusionCulling(bool enable)
+{
+	auto culler = ViewInfo::getOcclusionCuller(m_mainView);
+	if (culler) {
+		culler->setEnabled(enable);
+	}
+}
+
+QVariantMap RenderInfo::getOcclusionStats() const
+{
+	QVariantMap stats;
+	auto culler = ViewInfo::getOcclusionCuller(m_mainView);
+	if (culler) {
+		OcclusionCuller::Stats s = culler->getStats();
+		stats["enabled"] = culler->isEnabled();
+		stats["tested"] = s.tested;
+		stats["occluded"] = s.occluded;
+		stats["readbackMs"] = s.readbackMs;
+	}
+	return stats;
+}
+
+QVariantMap RenderInfo::getCommandQueueStats() const
+{
+	RenderCommandQueue::Stats s = m_commandQueue->getStats();
+	QVariantMap stats;
+	stats["depth"] = s.depth;
+	stats["executed"] = s.executed;
+	stats["coalesced"] = s.coalesced;
+	stats["deferred"] = s.deferred;
+	stats["drainMs"] = s.drainMs;
+	stats["maxDrainMs"] = s.maxDrainMs;
+	stats["budgetMs"] = m_commandQueue->getBudget();
+	return stats;
+}
+
+// main view first at the left, the others split the rest of the context's current size
+static void layoutViews(osgViewer::CompositeViewer* viewer)
+{
+	// x, y, width, height in fractions of the context, y up
+	static const float layouts[MAX_VIEWS][MAX_VIEWS][4] = {
+		{ { 0.0f, 0.0f, 1.0f, 1.0f } },
+		{ { 0.0f, 0.0f, 0.5f, 1.0f }, { 0.5f, 0.0f, 0.5f, 1.0f } },
+		{ { 0.0f, 0.0f, 0.5f, 1.0f }, { 0.5f, 0.5f, 0.5f, 0.5f }, { 0.5f, 0.0f, 0.5f, 0.5f } },
+		{ { 0.0f, 0.5f, 0.5f, 0.5f }, { 0.5f, 0.5f, 0.5f, 0.5f }, { 0.0f, 0.0f, 0.5f, 0.5f }, { 0.5f, 0.0f, 0.5f, 0.5f } }
+	};
+	unsigned int count = std::min(viewer->getNumViews(), static_cast<unsigned int>(MAX_VIEWS));
+	for (unsigned int i = 0; i < count; ++i) {
+		osg::Camera* camera = viewer->getView(i)->getCamera();
+		const osg::GraphicsContext::Traits* traits = camera->getGraphicsContext() ? camera->getGraphicsContext()->getTraits() : nullptr;
+		if (traits == nullptr) {
+			continue;
+		}
+		const float* rect = layouts[count - 1][i];
+		double width = std::max(1.0, traits->width * rect[2]);
+		double height = std::max(1.0, traits->height * rect[3]);
+		camera->setViewport(traits->width * rect[0], traits->height * rect[1], width, height);
+		double fovy, aspect, zNear, zFar;
+		if (camera->getProjectionMatrixAsPerspective(fovy, aspect, zNear, zFar)) {
+			camera->setProjectionMatrixAsPerspective(fovy, width / height, zNear, zFar);
+		}
+	}
+}
+
+void RenderInfo::setViewCount(int count)
+{
+	unsigned int viewCount = static_cast<unsigned int>(osg::clampBetween(count, 1, MAX_VIEWS));
+	osg::ref_ptr<osgViewer::CompositeViewer> viewer = m_compositeViewer;
+	osg::ref_ptr<osgViewer::View> mainView = m_mainView;
+	addOperation(new LambdaOperation([viewer, mainView, viewCount]() {
+		while (viewer->getNumViews() > viewCount) {
+			viewer->removeView(viewer->getView(viewer->getNumViews() - 1));
+		}
+		while (viewer->getNumViews() < viewCount) {
+			viewer->addView(ViewInfo::createLinkedView(mainView));
+		}
+		layoutViews(viewer);
+		}));
+}
+
+void RenderInfo::enableParallelCull(bool enable)
+{
+	auto viewer = dynamic_cast<ParallelCullViewer*>(m_compositeViewer.get());
+	if (viewer) {
+		viewer->setParallelCull(enable);
+	}
+}
+
+QVariantMap RenderInfo::getViewStats() const
+{
+	QVariantMap stats;
+	auto viewer = dynamic_cast<ParallelCullViewer*>(m_compositeViewer.get());
+	if (viewer) {
+		ParallelCullViewer::Stats s = viewer->getStats();
+		stats["views"] = s.views;
+		stats["parallel"] = s.parallel;
+		stats["cullMs"] = s.cullMs;
+		stats["renderMs"] = s.renderMs;
+		stats["fps"] = s.fps;
+	}
+	return stats;
+}
+
+// one queue keeps operations and keyed commands in submission order
+static void queueOperation(RenderCommandQueue* queue, osgViewer::CompositeViewer* viewer, osg::ref_ptr<osg::Operation> op)
+{
+	queue->submit([op, viewer]() {
+		(*op)(viewer);
+		});
+}
+
 void RenderInfo::addOperation(osg::ref_ptr<osg::Operation> op)
 {
-	m_compositeViewer->getUpdateOperations()->add(op);
+	queueOperation(m_commandQueue, m_compositeViewer, op);
+}
+
+void RenderInfo::addOperationAfterCompile(osg::ref_ptr<osg::Node> node, osg::ref_ptr<osg::Operation> op)
+{
+	osgUtil::IncrementalCompileOperation* ico = m_compositeViewer->getIncrementalCompileOperation();
+	if (ico == nullptr || !node.valid()) {
+		if (op.valid()) {
+			addOperation(op);
+		}
+		return;
+	}
+
+	// runs on the render thread once the last object is compiled, the node is attached by the
+	// update operation instead of the operation's own merge
+	class QueueOperationCallback : public osgUtil::IncrementalCompileOperation::CompileCompletedCallback
+	{
+	public:
+		QueueOperationCallback(RenderCommandQueue* queue, osgViewer::CompositeViewer* viewer, osg::Operation* op) :
+			m_queue(queue), m_viewer(viewer), m_op(op) {}
+		virtual bool compileCompleted(osgUtil::IncrementalCompileOperation::CompileSet* compileSet) override {
+			if (m_op.valid()) {
+				queueOperation(m_queue, m_viewer, m_op);
+			}
+			return true;
+		}
+	protected:
+		osg::ref_ptr<RenderCommandQueue> m_queue;
+		osgViewer::CompositeViewer* m_viewer;
+		osg::ref_ptr<osg::Operation> m_op;
+	};
+	auto compileSet = new osgUtil::IncrementalCompileOperation::CompileSet(node);
+	compileSet->_compileCompletedCallback = new QueueOperationCallback(m_commandQueue, m_compositeViewer, op);
+	ico->add(compileSet);
 }
@@ -1,8 +1,10 @@
 #pragma once
 
 #include "canvas3d_export.h"
+#include "render_command_queue.h"
 #include <osgViewer/CompositeViewer>
 #include <QObject>
+#include <QVariantMap>
 #include <QOpenGLFramebufferObject>
 
 enum ShaderMode
@@ -13,13 +15,19 @@ enum ShaderMode
 };
 
 #define DIRECTIONAL_LIGHTS_MAX 10
-#define POINT_LIGHTS_MAX 10
-#define SPOT_LIGHTS_MAX 10
+#define DIRECTIONAL_CASCADES_MAX 4
 
+// directional lights use a std140 uniform block, point and spot lights std430 storage buffers
+// (see LightClusters). layouts must match the light blocks in the mesh shaders.
+// shadow rects are atlas uv rects, xy: offset; zw: size
 struct DirectionalLightMaterial
 {
 	osg::Vec4 color;
 	osg::Vec4 direction;
+	osg::Matrixf cascadeVPs[DIRECTIONAL_CASCADES_MAX];
+	osg::Vec4 cascadeRects[DIRECTIONAL_CASCADES_MAX];
+	osg::Vec4 cascadeSplits;	// view space far distance of each cascade
+	osg::Vec4i shadow;			// x: cascade count, 0 without shadow; y: Light::ShadowFilter
 };
 struct DirectionalLightUBuffer
 {
@@ -31,34 +39,64 @@ struct PointLightMaterial
 {
 	osg::Vec4 color;
 	osg::Vec4 position;
-	osg::Vec4 param;
+	osg::Vec4 param;	// x: constant; y: linear; z: quadratic
+	osg::Vec4 shadow;	// x: slot in the cube face array, -1 without shadow; y: shadow radius
 };
-struct PointLightUBuffer
-{
-	osg::Vec4i count;
-	PointLightMaterial mats[POINT_LIGHTS_MAX];
-};
-
 struct SpotLightMaterial
 {
 	osg::Vec4 color;
 	osg::Vec4 position;
 	osg::Vec4 direction;
 	osg::Vec4 cutOff;	// x: inner cutOff(cos(angle)); y: outer cutOff(cos(angle))
+	osg::Matrixf shadowVP;
+	osg::Vec4 shadowRect;
+	osg::Vec4 shadow;	// x: 1 with shadow; y: near plane; z: far plane; w: Light::ShadowFilter
 };
-struct SpotLightUBuffer
+
+#define CAMERA_UBO_BINDING 1
+
+// node mask bit of the passes bound to the main view (shadow atlas, G-buffer, id picking, view
+// datum), linked views cull without it
+#define MAIN_VIEW_ONLY_MASK 0x1
+#define MAX_VIEWS 4
+
+// std140 block written before the view draws, shared by programs that don't use the osg_ matrices
+struct CameraUBuffer
 {
-	osg::Vec4i count;
-	SpotLightMaterial mats[SPOT_LIGHTS_MAX];
+	osg::Matrixf view;
+	osg::Matrixf projection;
+	osg::Matrixf viewProjection;
+	osg::Vec4 position;		// world space eye
+	osg::Vec4 viewport;
 };
 
+class MaterialTable;
+class LightClusters;
+class OcclusionCuller;
+class SceneState;
+
 class CANVAS_EXPORT ViewInfo
 {
 public:
 	static osg::ref_ptr<osgViewer::View> createView();
+	// another camera on the main view's scene, drawn into the same context. shares the main view's
+	// scene data, user data and camera state, so everything looked up through ViewInfo is the main view's
+	static osg::ref_ptr<osgViewer::View> createLinkedView(osgViewer::View* mainView);
 	static osg::Switch* getRoot(osgViewer::View* view);
 	static osg::Switch* getModelGroup(osgViewer::View* view);
 	static osg::Switch* getOtherGroup(osgViewer::View* view);
+	static MaterialTable* getMaterialTable(osgViewer::View* view);
+	static LightClusters* getLightClusters(osgViewer::View* view);
+	static OcclusionCuller* getOcclusionCuller(osgViewer::View* view);
+	// transforms, materials, visibility and light parameters the UI hands to the render thread
+	static SceneState* getSceneState(osgViewer::View* view);
+	// the view's shadow atlas, owned by the view and set by whoever creates it on first use
+	static osg::Group* getShadowAtlas(osgViewer::View* view);
+	static void setShadowAtlas(osgViewer::View* view, osg::Group* atlas);
+	// bumped on the render thread whenever a shadow caster moves or the model group changes,
+	// cached shadow maps compare against it
+	static void dirtySceneRevision(osgViewer::View* view);
+	static unsigned int getSceneRevision(osgViewer::View* view);
 	static void setQtFBO(osgViewer::View* view, QOpenGLFramebufferObject* qtFBO);
 	static QOpenGLFramebufferObject* getQtFBO(osgViewer::View* view);
 };
@@ -76,10 +114,32 @@ public:
 
 	Q_INVOKABLE void getInfo();
 
+	// hi-z occlusion culling of the main view's model group, off by default
+	Q_INVOKABLE void enableOcclusionCulling(bool enable);
+	// tested / occluded children of the last frame and the readback cost in ms
+	Q_INVOKABLE QVariantMap getOcclusionStats() const;
+
+	// depth and drain time of the command queue
+	Q_INVOKABLE QVariantMap getCommandQueueStats() const;
+
+	// splits the canvas into count viewports (1 to MAX_VIEWS), the first one is the main view
+	Q_INVOKABLE void setViewCount(int count);
+	// culls the views at once on a thread pool, on by default
+	Q_INVOKABLE void enableParallelCull(bool enable);
+	// views, cull and render time of the last frame and the frame rate
+	Q_INVOKABLE QVariantMap getViewStats() const;
+
+	// queued on m_commandQueue, keyed changes go through m_commandQueue->submit directly
 	void addOperation(osg::ref_ptr<osg::Operation> op);
+	// compiles the node's programs, textures and buffers on the render thread within the per-frame
+	// budget of the viewer's incremental compile operation, then queues op like addOperation.
+	// attach the node to the scene in op, so it never draws before its GL objects exist
+	void addOperationAfterCompile(osg::ref_ptr<osg::Node> node, osg::ref_ptr<osg::Operation> op);
 
 	osg::ref_ptr<osgViewer::CompositeViewer> m_compositeViewer;
 	osg::ref_ptr<osgViewer::View> m_mainView;
 	osg::ref_ptr<osgGA::EventQueue> m_eventQueue;
+	// everything the UI changes in the scene, drained on the render thread each frame
+	osg::ref_ptr<RenderCommandQueue> m_commandQueue;
 };
 Q_DECLARE_METATYPE(RenderInfo*)
\ No newline at end of file
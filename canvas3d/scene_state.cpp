@@ -0,0 +1,196 @@
+#include "scene_state.h"
+
+void SceneState::Buffer::resize(size_t count)
+{
+	transforms.resize(count);
+	visible.resize(count, 1);
+	materialIndices.resize(count, -1);
+	materials.resize(count, MaterialTable::defaultMaterial());
+	lights.resize(count);
+	targets.resize(count);
+}
+
+void SceneState::Buffer::copy(const Buffer& other, int slot)
+{
+	transforms[slot] = other.transforms[slot];
+	visible[slot] = other.visible[slot];
+	materialIndices[slot] = other.materialIndices[slot];
+	materials[slot] = other.materials[slot];
+	lights[slot] = other.lights[slot];
+	targets[slot] = other.targets[slot];
+}
+
+SceneState::SceneState(MaterialTable* materialTable) :
+	m_materialTable(materialTable),
+	m_front(0)
+{
+
+}
+
+SceneState::~SceneState()
+{
+
+}
+
+int SceneState::allocate(const SceneStateTarget& target, const osg::Matrix& transform, bool visible)
+{
+	std::lock_guard<std::mutex> locker(m_mutex);
+	Buffer& back = m_buffers[1 - m_front];
+	int slot;
+	if (!m_freeSlots.empty()) {
+		slot = m_freeSlots.back();
+		m_freeSlots.pop_back();
+	}
+	else {
+		slot = static_cast<int>(back.transforms.size());
+		back.resize(slot + 1);
+		m_backDirty.resize(slot + 1, 0);
+	}
+	// the transform only seeds what getTransform returns, the node already has it
+	back.transforms[slot] = transform;
+	back.visible[slot] = visible;
+	back.materialIndices[slot] = -1;
+	back.lights[slot] = SceneLight();
+	back.targets[slot] = std::make_shared<const SceneStateTarget>(target);
+	dirty(slot, VisibleDirty);
+	return slot;
+}
+
+void SceneState::release(int slot)
+{
+	std::lock_guard<std::mutex> locker(m_mutex);
+	Buffer& back = m_buffers[1 - m_front];
+	if (slot < 0 || slot >= static_cast<int>(back.targets.size())) {
+		return;
+	}
+	back.targets[slot] = nullptr;
+	back.visible[slot] = 0;
+	back.materialIndices[slot] = -1;
+	// the sync copies the cleared slot to the other buffer
+	dirty(slot, VisibleDirty);
+	m_freeSlots.push_back(slot);
+}
+
+void SceneState::setTransform(int slot, const osg::Matrix& transform)
+{
+	std::lock_guard<std::mutex> locker(m_mutex);
+	Buffer& back = m_buffers[1 - m_front];
+	if (slot < 0 || slot >= static_cast<int>(back.transforms.size())) {
+		return;
+	}
+	back.transforms[slot] = transform;
+	dirty(slot, TransformDirty);
+}
+
+void SceneState::setVisible(int slot, bool visible)
+{
+	std::lock_guard<std::mutex> locker(m_mutex);
+	Buffer& back = m_buffers[1 - m_front];
+	if (slot < 0 || slot >= static_cast<int>(back.visible.size())) {
+		return;
+	}
+	back.visible[slot] = visible;
+	dirty(slot, VisibleDirty);
+}
+
+void SceneState::setMaterial(int slot, int materialIndex, const MaterialData& material)
+{
+	std::lock_guard<std::mutex> locker(m_mutex);
+	Buffer& back = m_buffers[1 - m_front];
+	if (slot < 0 || slot >= static_cast<int>(back.materials.size())) {
+		return;
+	}
+	back.materialIndices[slot] = materialIndex;
+	back.materials[slot] = material;
+	dirty(slot, MaterialDirty);
+}
+
+void SceneState::setLight(int slot, const SceneLight& light)
+{
+	std::lock_guard<std::mutex> locker(m_mutex);
+	Buffer& back = m_buffers[1 - m_front];
+	if (slot < 0 || slot >= static_cast<int>(back.lights.size())) {
+		return;
+	}
+	back.lights[slot] = light;
+	dirty(slot, LightDirty);
+}
+
+osg::Matrix SceneState::getTransform(int slot) const
+{
+	std::lock_guard<std::mutex> locker(m_mutex);
+	const Buffer& back = m_buffers[1 - m_front];
+	if (slot < 0 || slot >= static_cast<int>(back.transforms.size())) {
+		return osg::Matrix();
+	}
+	return back.transforms[slot];
+}
+
+void SceneState::dirty(int slot, unsigned char flags)
+{
+	if (m_backDirty[slot] == 0) {
+		m_backDirtySlots.push_back(slot);
+	}
+	m_backDirty[slot] |= flags;
+}
+
+void SceneState::update()
+{
+	{
+		std::lock_guard<std::mutex> locker(m_mutex);
+		if (m_backDirtySlots.empty()) {
+			return;
+		}
+		m_front = 1 - m_front;
+		const Buffer& front = m_buffers[m_front];
+		Buffer& back = m_buffers[1 - m_front];
+		// the flags of the last sync are all clear again
+		m_frontDirty.swap(m_backDirty);
+		m_frontDirtySlots.swap(m_backDirtySlots);
+		m_backDirty.resize(m_frontDirty.size(), 0);
+		m_backDirtySlots.clear();
+		back.resize(front.transforms.size());
+		for (int slot : m_frontDirtySlots) {
+			back.copy(front, slot);
+		}
+	}
+
+	const Buffer& front = m_buffers[m_front];
+	for (int slot : m_frontDirtySlots) {
+		unsigned char flags = m_frontDirty[slot];
+		m_frontDirty[slot] = 0;
+		if ((flags & MaterialDirty) && front.materialIndices[slot] >= 0) {
+			m_materialTable->set(front.materialIndices[slot], front.materials[slot]);
+		}
+		const SceneStateTarget* target = front.targets[slot].get();
+		if (target == nullptr) {
+			continue;
+		}
+		if ((flags & TransformDirty) && target->transform.valid()) {
+			target->transform->setMatrix(front.transforms[slot]);
+		}
+		if ((flags & VisibleDirty) && target->visible) {
+			target->visible(front.visible[slot] != 0);
+		}
+		if ((flags & LightDirty) && target->light) {
+			osg::Matrix transform = target->transform.valid() ? target->transform->getMatrix() : front.transforms[slot];
+			publishTransform(slot, transform);
+			target->light(transform, front.lights[slot]);
+		}
+	}
+	m_frontDirtySlots.clear();
+}
+
+void SceneState::publishTransform(int slot, const osg::Matrix& transform)
+{
+	std::lock_guard<std::mutex> locker(m_mutex);
+	Buffer& front = m_buffers[m_front];
+	Buffer& back = m_buffers[1 - m_front];
+	if (slot < 0 || slot >= static_cast<int>(front.transforms.size())) {
+		return;
+	}
+	front.transforms[slot] = transform;
+	if (slot < static_cast<int>(back.transforms.size()) && !(m_backDirty[slot] & TransformDirty)) {
+		back.transforms[slot] = transform;
+	}
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "canvas3d_export.h"
+#include "material_table.h"
+#include <osg/MatrixTransform>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// light parameters of a slot, what they mean is up to the light's sync function
+struct SceneLight
+{
+	osg::Vec4 color;
+	osg::Vec4 param;
+};
+
+// where the front values of a slot go on the render thread, unset members are skipped
+struct SceneStateTarget
+{
+	typedef std::function<void(const osg::Matrix&, const SceneLight&)> LightSync;
+
+	// receives the slot's transform. a light's transform is read back from it, since draggers move
+	// the node on the render thread
+	osg::ref_ptr<osg::MatrixTransform> transform;
+	std::function<void(bool)> visible;
+	// called when the light parameters changed, with the transform they apply at
+	LightSync light;
+};
+
+// double buffered per object state between the UI and the render thread: transforms, materials,
+// visibility and light parameters in flat arrays indexed by slot.
+// the UI writes the back buffer under a short lock and marks the slot dirty. at frame start the
+// render thread swaps the buffers, copies the dirty slots into the new back buffer so it stays
+// complete, and syncs the osg nodes from the front buffer in one pass over the dirty slots. outside
+// the swap the front buffer and the nodes belong to the render thread, so update and cull never see
+// a half written value and the UI never reads a matrix the render thread is writing.
+// transforms changed on the render thread (physics, draggers) are published back, a pending UI
+// write wins over them
+class CANVAS_EXPORT SceneState : public osg::Referenced
+{
+public:
+	SceneState(MaterialTable* materialTable);
+
+	// UI thread
+	int allocate(const SceneStateTarget& target, const osg::Matrix& transform, bool visible);
+	void release(int slot);
+
+	void setTransform(int slot, const osg::Matrix& transform);
+	void setVisible(int slot, bool visible);
+	// materialIndex is the slot of the view's material table
+	void setMaterial(int slot, int materialIndex, const MaterialData& material);
+	void setLight(int slot, const SceneLight& light);
+
+	// the latest transform, of the UI or published by the render thread
+	osg::Matrix getTransform(int slot) const;
+
+	// render thread
+	// swaps the buffers and syncs the nodes of the dirty slots
+	void update();
+	void publishTransform(int slot, const osg::Matrix& transform);
+
+protected:
+	~SceneState();
+
+	enum Dirty
+	{
+		TransformDirty = 1,
+		VisibleDirty = 2,
+		MaterialDirty = 4,
+		LightDirty = 8
+	};
+
+	struct Buffer
+	{
+		void resize(size_t count);
+		void copy(const Buffer& other, int slot);
+
+		std::vector<osg::Matrix> transforms;
+		std::vector<unsigned char> visible;
+		std::vector<int> materialIndices;
+		std::vector<MaterialData> materials;
+		std::vector<SceneLight> lights;
+		std::vector<std::shared_ptr<const SceneStateTarget>> targets;
+	};
+
+	void dirty(int slot, unsigned char flags);
+
+	osg::ref_ptr<MaterialTable> m_materialTable;
+
+	mutable std::mutex m_mutex;
+	Buffer m_buffers[2];
+	int m_front;
+	std::vector<unsigned char> m_backDirty;
+	std::vector<int> m_backDirtySlots;
+	std::vector<int> m_freeSlots;
+
+	// render thread
+	std::vector<unsigned char> m_frontDirty;
+	std::vector<int> m_frontDirtySlots;
+};
@@ -1,9 +1,19 @@
 #include "shader_manager.h"
+#include "terrain.h"
+#include <QDir>
+#include <QFile>
+#include <QStandardPaths>
 
 ShaderMgr* ShaderMgr::s_instance = nullptr;
 std::mutex ShaderMgr::s_mtx;
 const std::string ShaderMgr::s_meshProgram = "mesh";
 const std::string ShaderMgr::s_deferedMeshProgram = "defered_mesh";
+const std::string ShaderMgr::s_deferedLightingProgram = "defered_lighting";
+const std::string ShaderMgr::s_instancedMeshProgram = "instanced_mesh";
+const std::string ShaderMgr::s_batchedMeshProgram = "batched_mesh";
+const std::string ShaderMgr::s_billboardProgram = "billboard";
+const std::string ShaderMgr::s_terrainProgram = "terrain";
+const std::string ShaderMgr::s_billboardArrayProgram = "billboard_array";
 
 ShaderMgr::ShaderMgr()
 {
@@ -29,35 +39,99 @@ ShaderMgr* ShaderMgr::instance()
 	return s_instance;
 }
 
-osg::Program* createMeshProgram()
-{
-	const char* vs = R"(
-#version 450 core
+// mesh shaders are compiled once per variant, variant switches are #defines inserted after #version.
+// materials always come from the scene material table. USE_DRAW_DATA reads transforms and the
+// material index from a storage buffer, indexed by gl_InstanceID (USE_INSTANCING) or
+// gl_DrawIDARB (USE_MULTI_DRAW); otherwise the index comes from the nodeMaterialIndex uniform
+static const char* s_meshVertexShader = R"(
+#ifdef USE_MULTI_DRAW
+#extension GL_ARB_shader_draw_parameters : require
+#define INSTANCE_INDEX gl_DrawIDARB
+#else
+#define INSTANCE_INDEX gl_InstanceID
+#endif
 layout(location=0) in vec4 Position;
 layout(location=1) in vec3 Normal;
+invariant gl_Position; // depth equal test after the depth pre-pass
 uniform mat4 osg_ModelViewMatrix;
 uniform mat4 osg_ModelViewProjectionMatrix;
 uniform mat3 osg_NormalMatrix;
 
+#ifdef USE_DRAW_DATA
+struct InstanceData {
+	mat4 model;
+	mat4 normal;
+	ivec4 index; // x: material index
+};
+layout(std430, binding = 1) readonly buffer Instances {
+	InstanceData instances[];
+};
+#else
+uniform int nodeMaterialIndex;
+#endif
+flat out int materialIndex;
+
 out vec3 normal;
 out vec3 position;
 void main() {
-	gl_Position = osg_ModelViewProjectionMatrix * Position;
-	normal = osg_NormalMatrix * Normal;
-	position = vec4(osg_ModelViewMatrix * Position).xyz;
+#ifdef USE_DRAW_DATA
+	InstanceData instance = instances[INSTANCE_INDEX];
+	vec4 localPosition = instance.model * Position;
+	vec3 localNormal = mat3(instance.normal) * Normal;
+	materialIndex = instance.index.x;
+#else
+	vec4 localPosition = Position;
+	vec3 localNormal = Normal;
+	materialIndex = nodeMaterialIndex;
+#endif
+	gl_Position = osg_ModelViewProjectionMatrix * localPosition;
+	normal = osg_NormalMatrix * localNormal;
+	position = vec4(osg_ModelViewMatrix * localPosition).xyz;
 }
 )";
-	const char* fs = R"(
-#version 450 core
 
+// WRITE_GBUFFER writes the deferred G-buffer instead of shading, DEFERRED_LIGHTING shades a full screen
+// pass from the G-buffer with the same lighting code. SHADING_MODE (0: preview; 1: phong; 2: pbr),
+// HAS_*_LIGHTS and USE_SHADOW come from the selected ShaderVariant
+static const char* s_meshFragmentShader = R"(
 // common data
 uniform mat4 osg_ViewMatrix;
 uniform mat4 osg_ViewMatrixInverse;
-uniform int shaderMode; // 0: usePreviewMaterial; 1: phong; 2: pbr
+#ifdef DEFERRED_LIGHTING
+// filled from the G-buffer before shading
+vec3 baseColor;
+vec3 normal;
+vec3 position;
+int materialIndex;
+#else
 uniform vec3 baseColor = vec3(0.5, 0.5, 0.5);
 in vec3 normal;
 in vec3 position;
+flat in int materialIndex;
+#endif
+#ifdef WRITE_GBUFFER
+layout(location = 0) out vec4 gAlbedo;
+layout(location = 1) out vec2 gNormal;
+layout(location = 2) out uint gMaterial;
+#else
 out vec4 FragColor;
+#endif
+
+// octahedral normal encoding, unit vector to [-1, 1]^2
+vec2 octWrap(vec2 v) {
+	return (1.0 - abs(v.yx)) * vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+}
+vec2 encodeOctahedral(vec3 n) {
+	n /= abs(n.x) + abs(n.y) + abs(n.z);
+	return n.z >= 0.0 ? n.xy : octWrap(n.xy);
+}
+vec3 decodeOctahedral(vec2 e) {
+	vec3 n = vec3(e.x, e.y, 1.0 - abs(e.x) - abs(e.y));
+	float t = clamp(-n.z, 0.0, 1.0);
+	n.x += n.x >= 0.0 ? -t : t;
+	n.y += n.y >= 0.0 ? -t : t;
+	return normalize(n);
+}
 
 // for real meterial. note: light's direction points from light source to object
 struct Material {
@@ -66,137 +140,270 @@ struct Material {
 	vec3 specular;
 	float shininess;
 };
-uniform Material material;
+struct MaterialData {
+	vec4 ambient; // w: shininess
+	vec4 diffuse;
+	vec4 specular;
+	vec4 pbr; // x: metallic; y: roughness; z: ao
+};
+layout(std430, binding = 0) readonly buffer Materials {
+	MaterialData materials[];
+};
+Material material;
+float metallic;
+float roughness;
+float ao;
+void loadMaterial() {
+	MaterialData data = materials[materialIndex];
+	material.ambient = data.ambient.rgb;
+	material.diffuse = data.diffuse.rgb;
+	material.specular = data.specular.rgb;
+	material.shininess = data.ambient.w;
+	metallic = data.pbr.x;
+	roughness = data.pbr.y;
+	ao = data.pbr.z;
+}
 
+#define DIRECTIONAL_CASCADES_MAX 4
+// shadow rects are uv rects in the shadow atlas, xy: offset; zw: size
 struct DirectionalLightMaterial {
 	vec4 color;
 	vec4 direction;
+	mat4 cascadeVPs[DIRECTIONAL_CASCADES_MAX];
+	vec4 cascadeRects[DIRECTIONAL_CASCADES_MAX];
+	vec4 cascadeSplits; // view space far distance of each cascade
+	ivec4 shadow; // x: cascade count, 0 without shadow
 };
 struct PointLightMaterial {
 	vec4 color;
 	vec4 position;
 	vec4 param; // x: constant; y: linear; z: quadratic
+	vec4 shadow; // x: slot in the cube face array, -1 without shadow; y: shadow radius
 };
 struct SpotLightMaterial {
 	vec4 color;
 	vec4 position;
 	vec4 direction;
 	vec4 cutOff; // x: inner cutOff(cos(angle)); y: outer cutOff(cos(angle))
+	mat4 shadowVP;
+	vec4 shadowRect;
+	vec4 shadow; // x: 1 with shadow; y: near plane; z: far plane
 };
 #define DIRECTIONAL_LIGHTS_MAX 10
-#define POINT_LIGHTS_MAX 10
-#define SPOT_LIGHTS_MAX 10
 layout(std140, binding = 0) uniform DirectionalLightMat {
 	ivec4 count;
 	DirectionalLightMaterial mats[DIRECTIONAL_LIGHTS_MAX];
 }DirectionalLights;
-layout(std140, binding = 1) uniform PointLightMat {
+layout(std430, binding = 2) readonly buffer PointLightMat {
 	ivec4 count;
-	PointLightMaterial mats[POINT_LIGHTS_MAX];
+	PointLightMaterial mats[];
 }PointLights;
-layout(std140, binding = 2) uniform SpotLightMat {
+layout(std430, binding = 3) readonly buffer SpotLightMat {
 	ivec4 count;
-	SpotLightMaterial mats[SPOT_LIGHTS_MAX];
+	SpotLightMaterial mats[];
 }SpotLights;
-uniform bool useShadow;
-uniform sampler2D directionalLightShadowMap;
-uniform mat4 dLightShadowVP;
-uniform sampler2D spotLightShadowMap;
-uniform mat4 sLightShadowVP;
-uniform float spot_near_plane;
-uniform float spot_far_plane;
-uniform samplerCube pointLightShadowMap;
-uniform float pointLightRadius;
-
-float DirectionalLightShadowCalculation(vec3 viewPos, float bias)
+
+// point and spot lights are binned on the cpu into screen tiles times exponential depth slices
+#define LIGHT_CLUSTERS_X 16
+#define LIGHT_CLUSTERS_Y 9
+#define LIGHT_CLUSTERS_Z 24
+layout(std430, binding = 4) readonly buffer LightGrid {
+	uvec4 clusters[]; // x: offset into lightIndices; y: point light count; z: spot light count
+};
+layout(std430, binding = 5) readonly buffer LightIndices {
+	uint lightIndices[]; // point light indices of a cluster, followed by its spot light indices
+};
+// linked views share the camera state set, the block is written before each of them draws
+layout(std140, binding = 1) uniform Camera {
+	mat4 view;
+	mat4 projection;
+	mat4 viewProjection;
+	vec4 position;
+	vec4 viewport;
+} camera;
+uniform vec4 lightClusterParams; // x: near plane of the first slice; y: slices per log depth unit
+uvec4 getLightCluster()
+{
+	vec2 tile = clamp((gl_FragCoord.xy - camera.viewport.xy) / camera.viewport.zw, vec2(0.0), vec2(0.9999)) * vec2(LIGHT_CLUSTERS_X, LIGHT_CLUSTERS_Y);
+	float depth = max(-position.z, lightClusterParams.x);
+	int slice = clamp(int(log(depth / lightClusterParams.x) * lightClusterParams.y), 0, LIGHT_CLUSTERS_Z - 1);
+	int index = int(tile.x) + int(tile.y) * LIGHT_CLUSTERS_X + slice * LIGHT_CLUSTERS_X * LIGHT_CLUSTERS_Y;
+	return clusters[index];
+}
+uniform sampler2DShadow shadowAtlas;
+uniform sampler2DArrayShadow pointShadowFaces;
+uniform sampler2D shadowMoments;
+
+// per light, Light::ShadowFilter
+#define SHADOW_FILTER_PCF 0
+#define SHADOW_FILTER_VARIANCE 1
+// the moment atlas' mip chain spans all tiles, coarser levels would mix in the neighbouring ones.
+// SHADOW_MOMENTS_LEVELS - 1
+#define SHADOW_MOMENTS_LOD_MAX 3.0
+
+// world size of the pixel, taken once in uniform control flow before the light loops
+float pixelFootprint;
+
+// four hardware compares half a texel apart, each filtering 2x2 texels: a 3x3 tent in 4 fetches.
+// uv is relative to the tile, clamped so the footprint never reaches the neighbouring tile
+float sampleShadowAtlas(vec4 rect, vec2 uv, float depth)
+{
+	vec2 texel = 1.0 / vec2(textureSize(shadowAtlas, 0));
+	vec2 atlasUV = clamp(rect.xy + uv * rect.zw, rect.xy + texel, rect.xy + rect.zw - texel);
+	float lit = texture(shadowAtlas, vec3(atlasUV + vec2(-0.5, -0.5) * texel, depth));
+	lit += texture(shadowAtlas, vec3(atlasUV + vec2(0.5, -0.5) * texel, depth));
+	lit += texture(shadowAtlas, vec3(atlasUV + vec2(-0.5, 0.5) * texel, depth));
+	lit += texture(shadowAtlas, vec3(atlasUV + vec2(0.5, 0.5) * texel, depth));
+	return 1.0 - lit * 0.25;
+}
+
+// shadow texels per world unit at the receiver: the map's x scale over its w
+float shadowTexelsPerUnit(mat4 shadowVP, vec4 lightClipPos, vec4 rect)
 {
+	float scale = length(vec3(shadowVP[0][0], shadowVP[1][0], shadowVP[2][0])) / lightClipPos.w;
+	return 0.5 * scale * rect.z * float(textureSize(shadowMoments, 0).x);
+}
+
+// Chebyshev's upper bound of the lit fraction from the blurred moments, at the mip matching the
+// pixel's footprint. the low end of the bound is cut off, which hides most of the light bleeding
+float sampleShadowMoments(vec4 rect, vec2 uv, float depth, float texelsPerUnit)
+{
+	float lod = clamp(log2(max(pixelFootprint * texelsPerUnit, 1e-6)), 0.0, SHADOW_MOMENTS_LOD_MAX);
+	vec2 margin = exp2(lod) * 0.5 / vec2(textureSize(shadowMoments, 0));
+	vec2 atlasUV = clamp(rect.xy + uv * rect.zw, rect.xy + margin, rect.xy + rect.zw - margin);
+	vec2 moments = textureLod(shadowMoments, atlasUV, lod).rg;
+	if (depth <= moments.x) {
+		return 0.0;
+	}
+	float variance = max(moments.y - moments.x * moments.x, 0.00002);
+	float d = depth - moments.x;
+	float lit = variance / (variance + d * d);
+	return 1.0 - clamp((lit - 0.2) / 0.8, 0.0, 1.0);
+}
+
+float DirectionalLightShadowCalculation(int index, vec3 viewPos, float bias)
+{
+	int cascadeCount = DirectionalLights.mats[index].shadow.x;
+	if (cascadeCount == 0) {
+		return 0.0;
+	}
+	// nearest cascade containing the fragment, nothing beyond the last one is shadowed
+	float viewDepth = -viewPos.z;
+	int cascade = -1;
+	for (int i = 0; i < cascadeCount; ++i) {
+		if (viewDepth < DirectionalLights.mats[index].cascadeSplits[i]) {
+			cascade = i;
+			break;
+		}
+	}
+	if (cascade < 0) {
+		return 0.0;
+	}
+
 	vec4 worldPos = osg_ViewMatrixInverse * vec4(viewPos, 1.0);
-	vec4 lightNDCPos = dLightShadowVP * worldPos;
+	vec4 lightNDCPos = DirectionalLights.mats[index].cascadeVPs[cascade] * worldPos;
 	vec3 ndc = lightNDCPos.xyz / lightNDCPos.w;
+	if(ndc.x < -1 || ndc.x > 1 || ndc.y < -1 || ndc.y > 1) {
+		return 0.0;
+	}
 	vec3 screen = (ndc.xyz + 1) * 0.5;
-
-	//float lightDepth = texture(directionalLightShadowMap, screen.xy).r;
-	//float shadow = (screen.z - bias) > lightDepth ? 1.0 : 0.0;
-	//return shadow;
-
-	float shadow = 0.0;
-	vec2 texelSize = 1.0 / textureSize(directionalLightShadowMap, 0);
-	for(int x = -1; x <= 1; ++x)
-	{
-		for(int y = -1; y <= 1; ++y)
-		{
-			float pcfDepth = texture(directionalLightShadowMap, screen.xy + vec2(x, y) * texelSize).r; 
-			shadow += (screen.z - bias) > pcfDepth ? 1.0 : 0.0;        
-		}    
+	vec4 rect = DirectionalLights.mats[index].cascadeRects[cascade];
+	if (DirectionalLights.mats[index].shadow.y == SHADOW_FILTER_VARIANCE) {
+		// orthographic, the depth is already linear
+		return sampleShadowMoments(rect, screen.xy, screen.z,
+			shadowTexelsPerUnit(DirectionalLights.mats[index].cascadeVPs[cascade], lightNDCPos, rect));
 	}
-	shadow /= 9.0;
-	return shadow;
+	// texels of farther cascades cover more surface
+	float cascadeBias = bias * (cascade + 1);
+	return sampleShadowAtlas(rect, screen.xy, screen.z - cascadeBias);
 }
 
-float LinearizeDepth(float depth)
+float LinearizeDepth(float depth, float near_plane, float far_plane)
 {
     float z = depth * 2.0 - 1.0; // Back to NDC 
-    return (2.0 * spot_near_plane * spot_far_plane) / (spot_far_plane + spot_near_plane - z * (spot_far_plane - spot_near_plane));
+    return (2.0 * near_plane * far_plane) / (far_plane + near_plane - z * (far_plane - near_plane));
 }
 
-float SpotLightShadowCalculation(vec3 viewPos, float bias)
+float DelinearizeDepth(float linearDepth, float near_plane, float far_plane)
 {
+	float z = (far_plane + near_plane - 2.0 * near_plane * far_plane / max(linearDepth, near_plane)) / (far_plane - near_plane);
+	return z * 0.5 + 0.5;
+}
+
+float SpotLightShadowCalculation(int index, vec3 viewPos, float bias)
+{
+	vec4 shadowInfo = SpotLights.mats[index].shadow;
+	if (shadowInfo.x == 0.0) {
+		return 0.0;
+	}
 	vec4 worldPos = osg_ViewMatrixInverse * vec4(viewPos, 1.0);
-	vec4 lightNDCPos = sLightShadowVP * worldPos;
+	vec4 lightNDCPos = SpotLights.mats[index].shadowVP * worldPos;
 	vec3 ndc = lightNDCPos.xyz / lightNDCPos.w;
 	if(ndc.x < -1 || ndc.x > 1 || ndc.y < -1 || ndc.y > 1) {
 		return 0.0;
 	}
 	vec3 screen = (ndc.xyz + 1) * 0.5;
-	float linear_screen_z = LinearizeDepth(screen.z);
-
-	float shadow = 0.0;
-	vec2 texelSize = 1.0 / textureSize(spotLightShadowMap, 0);
-	for(int x = -1; x <= 1; ++x)
-	{
-		for(int y = -1; y <= 1; ++y)
-		{
-			float pcfDepth = texture(spotLightShadowMap, screen.xy + vec2(x, y) * texelSize).r; 
-			float linear_pcfDepth = LinearizeDepth(pcfDepth);
-			shadow += (linear_screen_z - bias) > linear_pcfDepth ? 1.0 : 0.0;        
-		}    
-	}
-	shadow /= 9.0;
-	return shadow;
-}
-
-const vec3 sampleOffsetDirections[20] = vec3[]
-(
-   vec3( 1,  1,  1), vec3( 1, -1,  1), vec3(-1, -1,  1), vec3(-1,  1,  1), 
-   vec3( 1,  1, -1), vec3( 1, -1, -1), vec3(-1, -1, -1), vec3(-1,  1, -1),
-   vec3( 1,  1,  0), vec3( 1, -1,  0), vec3(-1, -1,  0), vec3(-1,  1,  0),
-   vec3( 1,  0,  1), vec3(-1,  0,  1), vec3( 1,  0, -1), vec3(-1,  0, -1),
-   vec3( 0,  1,  1), vec3( 0, -1,  1), vec3( 0, -1, -1), vec3( 0,  1, -1)
-);
-
-float PointLightShadowCalculation(vec3 viewPos, vec3 lightWorldPos, float bias)
+	float linearDepth = LinearizeDepth(screen.z, shadowInfo.y, shadowInfo.z);
+	vec4 rect = SpotLights.mats[index].shadowRect;
+	if (int(shadowInfo.w) == SHADOW_FILTER_VARIANCE) {
+		// the moments hold the linear depth over the camera's range
+		float depth = (linearDepth - shadowInfo.y) / (shadowInfo.z - shadowInfo.y);
+		return sampleShadowMoments(rect, screen.xy, depth,
+			shadowTexelsPerUnit(SpotLights.mats[index].shadowVP, lightNDCPos, rect));
+	}
+	// the bias is in linear depth, moved back into the map's depth once instead of per tap
+	return sampleShadowAtlas(rect, screen.xy, DelinearizeDepth(linearDepth - bias, shadowInfo.y, shadowInfo.z));
+}
+
+// a point light's six faces are consecutive layers in +x, -x, +y, -y, +z, -z order,
+// each rendered by a 90 degree camera looking along the face direction with these up vectors
+const vec3 cubeFaceDirs[6] = vec3[](vec3(1, 0, 0), vec3(-1, 0, 0), vec3(0, 1, 0), vec3(0, -1, 0), vec3(0, 0, 1), vec3(0, 0, -1));
+const vec3 cubeFaceUps[6] = vec3[](vec3(0, -1, 0), vec3(0, -1, 0), vec3(0, 0, 1), vec3(0, 0, -1), vec3(0, -1, 0), vec3(0, -1, 0));
+// same 4 hardware compares as sampleShadowAtlas, the border of a face counts as lit
+float samplePointShadowFaces(int slot, vec3 dir, float depth)
 {
-	vec3 worldPos = vec4(osg_ViewMatrixInverse * vec4(viewPos, 1.0)).xyz;
-	vec3 posToLight = worldPos - lightWorldPos;
-	float currentDepth = length(posToLight);
+	vec3 absDir = abs(dir);
+	int face;
+	if (absDir.x >= absDir.y && absDir.x >= absDir.z) {
+		face = dir.x > 0 ? 0 : 1;
+	}
+	else if (absDir.y >= absDir.z) {
+		face = dir.y > 0 ? 2 : 3;
+	}
+	else {
+		face = dir.z > 0 ? 4 : 5;
+	}
+	vec3 forward = cubeFaceDirs[face];
+	vec3 up = cubeFaceUps[face];
+	vec3 right = cross(forward, up);
+	vec2 uv = vec2(dot(dir, right), dot(dir, up)) / dot(dir, forward) * 0.5 + 0.5;
+	vec2 texel = 1.0 / vec2(textureSize(pointShadowFaces, 0).xy);
+	float layer = float(slot * 6 + face);
+	float lit = texture(pointShadowFaces, vec4(uv + vec2(-0.5, -0.5) * texel, layer, depth));
+	lit += texture(pointShadowFaces, vec4(uv + vec2(0.5, -0.5) * texel, layer, depth));
+	lit += texture(pointShadowFaces, vec4(uv + vec2(-0.5, 0.5) * texel, layer, depth));
+	lit += texture(pointShadowFaces, vec4(uv + vec2(0.5, 0.5) * texel, layer, depth));
+	return 1.0 - lit * 0.25;
+}
 
-	float shadow = 0.0;
-	int samples = 20;
-	float diskRadius = 0.05;
-	for (int i = 0; i < samples; ++i) {
-		float closestDepth = texture(pointLightShadowMap, posToLight + sampleOffsetDirections[i] * diskRadius).r;
-		closestDepth *= pointLightRadius;
-		if ((currentDepth - bias) > closestDepth) {
-			shadow += 1.0;
-		}
+float PointLightShadowCalculation(int index, vec3 viewPos, float bias)
+{
+	PointLightMaterial mat = PointLights.mats[index];
+	if (mat.shadow.x < 0.0) {
+		return 0.0;
 	}
-	shadow /= float(samples);
-	return shadow;
+	int slot = int(mat.shadow.x);
+	vec3 worldPos = vec4(osg_ViewMatrixInverse * vec4(viewPos, 1.0)).xyz;
+	vec3 posToLight = worldPos - mat.position.xyz;
+	// the faces hold the distance to the light over the shadow radius
+	float currentDepth = length(posToLight);
+	return samplePointShadowFaces(slot, posToLight, (currentDepth - bias) / mat.shadow.y);
 }
 
 vec3 computePhongLightAndShadow()
 {
 	vec3 resultColor = vec3(0, 0, 0);
+#if HAS_DIRECTIONAL_LIGHTS
 	for(int i = 0; i < DirectionalLights.count.x; ++i) {
 		DirectionalLightMaterial mat = DirectionalLights.mats[i];
 		vec3 lightDir = normalize(mat3(osg_ViewMatrix) * mat.direction.xyz);
@@ -213,14 +420,21 @@ vec3 computePhongLightAndShadow()
 		vec3 specularColor = material.specular * spec * lightColor;
 
 		float bias = max(0.05 * (1 - dot(normal, -lightDir)), 0.005);
-		float shadow = DirectionalLightShadowCalculation(position, bias);
-		if(!useShadow) {
-			shadow = 0.0;
-		}
+#if USE_SHADOW
+		float shadow = DirectionalLightShadowCalculation(i, position, bias);
+#else
+		float shadow = 0.0;
+#endif
 		resultColor += baseColor * (ambientColor + (1 - shadow) * (diffuseColor + specularColor));
 	}
-
-	for(int i = 0; i < PointLights.count.x; ++i) {
+#endif
+
+#if HAS_POINT_LIGHTS || HAS_SPOT_LIGHTS
+	uvec4 cluster = getLightCluster();
+#endif
+#if HAS_POINT_LIGHTS
+	for(uint n = 0; n < cluster.y; ++n) {
+		int i = int(lightIndices[cluster.x + n]);
 		PointLightMaterial mat = PointLights.mats[i];
 		vec3 lightPos = vec4(osg_ViewMatrix * mat.position).xyz;
 		vec3 tmpDir = position - lightPos;
@@ -240,15 +454,19 @@ vec3 computePhongLightAndShadow()
 		vec3 specularColor = material.specular * spec * lightColor;
 
 		float bias = 0.1;
-		float shadow = PointLightShadowCalculation(position, mat.position.xyz, bias);
-		if(!useShadow) {
-			shadow = 0.0;
-		}
+#if USE_SHADOW
+		float shadow = PointLightShadowCalculation(i, position, bias);
+#else
+		float shadow = 0.0;
+#endif
 
 		float attenuation = 1.0 / (mat.param.x + mat.param.y * distance + mat.param.z * (distance * distance));
 		resultColor += baseColor * (ambientColor + (1 - shadow) * (diffuseColor + specularColor)) * attenuation;
 	}
-	for(int i = 0; i < SpotLights.count.x; ++i) {
+#endif
+#if HAS_SPOT_LIGHTS
+	for(uint n = 0; n < cluster.z; ++n) {
+		int i = int(lightIndices[cluster.x + cluster.y + n]);
 		SpotLightMaterial mat = SpotLights.mats[i];
 		vec3 lightPos = vec4(osg_ViewMatrix * mat.position).xyz;
 		vec3 spotDir = normalize(mat3(osg_ViewMatrix) * mat.direction.xyz);
@@ -271,12 +489,14 @@ vec3 computePhongLightAndShadow()
 		vec3 specularColor = material.specular * spec * lightColor;
 
 		float bias = max(1 * (1 - dot(normal, -lightDir)), 0.5);
-		float shadow = SpotLightShadowCalculation(position, bias);
-		if(!useShadow) {
-			shadow = 0.0;
-		}
+#if USE_SHADOW
+		float shadow = SpotLightShadowCalculation(i, position, bias);
+#else
+		float shadow = 0.0;
+#endif
 		resultColor += baseColor * (ambientColor + (1 - shadow) * (diffuseColor + specularColor)) * intensity;
 	}
+#endif
 	return resultColor;
 }
 
@@ -288,9 +508,6 @@ const float ambientStrengh = 0.5;
 const float specularStrength = 0.5;
 
 // for pbr
-uniform float metallic;
-uniform float roughness;
-uniform float ao;
 const float PI = 3.14159265359;
 // ----------------------------------------------------------------------------
 float DistributionGGX(vec3 N, vec3 H, float roughness)
@@ -348,7 +565,10 @@ vec3 computePBRLightAndShadow()
 
 	// reflectance equation
 	vec3 Lo = vec3(0.0);
-	for(int i = 0; i < PointLights.count.x; ++i) {
+#if HAS_POINT_LIGHTS
+	uvec4 cluster = getLightCluster();
+	for(uint n = 0; n < cluster.y; ++n) {
+		int i = int(lightIndices[cluster.x + n]);
 		PointLightMaterial mat = PointLights.mats[i];
 		vec3 lightPos = vec4(osg_ViewMatrix * mat.position).xyz;
 		vec3 tmpDir = position - lightPos;
@@ -388,6 +608,7 @@ vec3 computePBRLightAndShadow()
 		// add to outgoing radiance Lo
 		Lo += (kD * baseColor / PI + specular) * radiance * NdotL; // note that we already multiplied the BRDF by the Fresnel (kS) so we won't multiply by kS again
 	}
+#endif
 
 	vec3 ambient = vec3(0.03) * baseColor * ao;
 	vec3 color = ambient + Lo;
@@ -398,112 +619,411 @@ vec3 computePBRLightAndShadow()
     color = pow(color, vec3(1.0/2.2)); 
 
 	//float bias = 0.1;
-	//float shadow = PointLightShadowCalculation(position, mat.position.xyz, bias);
+	//float shadow = PointLightShadowCalculation(i, position, bias);
 
 	return color;
 }
 
-void main() {
-	vec3 resultColor = vec3(0.0, 0.0, 0.0);
-	if (shaderMode == 0) {
-		vec3 viewDir = normalize(-position);
-		vec3 reflectDir = reflect(-preview_lightDir, normal);
-		float spec = pow(max(dot(viewDir, reflectDir), 0.0), 32);
-		resultColor = baseColor * (ambientStrengh + diffStrengh * max(dot(normal, preview_lightDir), 0) + specularStrength * spec);
-	}
-	else if (shaderMode == 1) {
-		resultColor = computePhongLightAndShadow();
+#ifdef DEFERRED_LIGHTING
+uniform sampler2D gAlbedoTex;
+uniform sampler2D gNormalTex;
+uniform usampler2D gMaterialTex;
+uniform sampler2D gDepthTex;
+uniform mat4 gBufferProjectionInverse; // projection the G-buffer was rendered with
+uniform mat4 osg_ProjectionMatrix;
+in vec2 uv;
+bool loadGBuffer() {
+	ivec2 texel = ivec2(gl_FragCoord.xy - camera.viewport.xy);
+	float depth = texelFetch(gDepthTex, texel, 0).r;
+	if (depth == 1.0) {
+		return false;
 	}
-	else if(shaderMode == 2) {
-		resultColor = computePBRLightAndShadow();
+	baseColor = texelFetch(gAlbedoTex, texel, 0).rgb;
+	normal = decodeOctahedral(texelFetch(gNormalTex, texel, 0).rg * 2.0 - 1.0);
+	materialIndex = int(texelFetch(gMaterialTex, texel, 0).r);
+	vec4 viewPos = gBufferProjectionInverse * vec4(uv * 2.0 - 1.0, depth * 2.0 - 1.0, 1.0);
+	position = viewPos.xyz / viewPos.w;
+	return true;
+}
+#endif
+
+#ifdef WRITE_GBUFFER
+void main() {
+	gAlbedo = vec4(baseColor, 1.0);
+	gNormal = encodeOctahedral(normalize(normal)) * 0.5 + 0.5;
+	gMaterial = uint(materialIndex);
+}
+#else
+void main() {
+#ifdef DEFERRED_LIGHTING
+	if (!loadGBuffer()) {
+		discard;
 	}
+#endif
+	loadMaterial();
+#if USE_SHADOW
+	pixelFootprint = max(length(dFdx(position)), length(dFdy(position)));
+#endif
+	vec3 resultColor = vec3(0.0, 0.0, 0.0);
+#if SHADING_MODE == 0
+	vec3 viewDir = normalize(-position);
+	vec3 reflectDir = reflect(-preview_lightDir, normal);
+	float spec = pow(max(dot(viewDir, reflectDir), 0.0), 32);
+	resultColor = baseColor * (ambientStrengh + diffStrengh * max(dot(normal, preview_lightDir), 0) + specularStrength * spec);
+#elif SHADING_MODE == 1
+	resultColor = computePhongLightAndShadow();
+#elif SHADING_MODE == 2
+	resultColor = computePBRLightAndShadow();
+#endif
 
 	FragColor = vec4(resultColor, 1.0);
+#ifdef DEFERRED_LIGHTING
+	// depth of the main pass' projection, so the helpers drawn after composite correctly
+	vec4 clipPos = osg_ProjectionMatrix * vec4(position, 1.0);
+	gl_FragDepth = clamp(clipPos.z / clipPos.w * 0.5 + 0.5, 0.0, 1.0);
+#endif
 }
+#endif
 )";
 
-	osg::Program* program = new osg::Program;
-	program->addShader(new osg::Shader(osg::Shader::VERTEX, vs));
-	program->addShader(new osg::Shader(osg::Shader::FRAGMENT, fs));
-	return program;
+// full screen pass shading the G-buffer written by the WRITE_GBUFFER variant
+static const char* s_deferedLightingVertexShader = R"(
+layout(location = 0) in vec4 vPosition;
+layout(location = 1) in vec2 vUV;
+out vec2 uv;
+void main()
+{
+	gl_Position = vPosition;
+	uv = vUV;
 }
+)";
 
-osg::Program* createMeshDeferedProgram()
-{
-	const char* vs = R"(
-#version 450 core
-layout(location=0) in vec4 Position;
-layout(location=1) in vec3 Normal;
-uniform mat4 osg_ModelViewProjectionMatrix;
+// chunks of a Terrain, lit by the mesh fragment shader. the vertex grid (TERRAIN_CHUNK_SIZE + 3)^2
+// comes from gl_VertexID, its outer ring is the skirt dropped below the chunk's border
+static const char* s_terrainVertexShader = R"(
+invariant gl_Position; // depth equal test after the depth pre-pass
 uniform mat4 osg_ModelViewMatrix;
+uniform mat4 osg_ModelViewProjectionMatrix;
 uniform mat3 osg_NormalMatrix;
+uniform sampler2D terrainHeightmap;
+uniform float terrainCellSize;
+uniform vec4 terrainChunk; // xy: first grid point; z: grid points per vertex; w: skirt depth
+uniform int nodeMaterialIndex;
+flat out int materialIndex;
 
 out vec3 normal;
-out vec4 pos;
+out vec3 position;
+
+float sampleHeight(ivec2 point)
+{
+	ivec2 size = textureSize(terrainHeightmap, 0);
+	return texelFetch(terrainHeightmap, clamp(point, ivec2(0), size - 1), 0).r;
+}
+
 void main() {
-	pos = osg_ModelViewMatrix * Position;
-	gl_Position = osg_ModelViewProjectionMatrix * Position;;
+	const int rowVertices = TERRAIN_CHUNK_SIZE + 3;
+	ivec2 grid = ivec2(gl_VertexID % rowVertices, gl_VertexID / rowVertices) - 1;
+	ivec2 cell = clamp(grid, ivec2(0), ivec2(TERRAIN_CHUNK_SIZE));
+	bool skirt = any(notEqual(grid, cell));
+
+	int step = int(terrainChunk.z);
+	// chunks on the far edges are cut off by repeating the last grid point
+	ivec2 point = min(ivec2(terrainChunk.xy) + cell * step, textureSize(terrainHeightmap, 0) - 1);
+	float height = sampleHeight(point) - (skirt ? terrainChunk.w : 0.0);
+	vec4 localPosition = vec4(vec2(point) * terrainCellSize, height, 1.0);
+
+	// central differences at this level's spacing
+	float dx = sampleHeight(point + ivec2(step, 0)) - sampleHeight(point - ivec2(step, 0));
+	float dy = sampleHeight(point + ivec2(0, step)) - sampleHeight(point - ivec2(0, step));
+	vec3 localNormal = normalize(vec3(-dx, -dy, 2.0 * step * terrainCellSize));
+
+	materialIndex = nodeMaterialIndex;
+	gl_Position = osg_ModelViewProjectionMatrix * localPosition;
+	normal = osg_NormalMatrix * localNormal;
+	position = vec4(osg_ModelViewMatrix * localPosition).xyz;
+}
+)";
+
+// camera facing sprites of a BillboardMesh, one instance each. the quad is built from gl_VertexID
+// and turned about the world up axis towards the eye from the per-frame camera block
+static const char* s_billboardVertexShader = R"(
+layout(std140, binding = 1) uniform Camera {
+	mat4 view;
+	mat4 projection;
+	mat4 viewProjection;
+	vec4 position;
+	vec4 viewport;
+} camera;
+
+struct BillboardData {
+	vec4 positionSize; // xyz: bottom centre; w: height
+	vec4 params; // x: texture layer; y: width / height
+};
+layout(std430, binding = 6) readonly buffer Billboards {
+	BillboardData billboards[];
+};
+
+out vec3 texCoord;
 
-	normal = osg_NormalMatrix * Normal;
+void main()
+{
+	BillboardData billboard = billboards[gl_InstanceID];
+	// triangle strip (0, 0) (1, 0) (0, 1) (1, 1)
+	vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);
+
+	vec3 up = vec3(0.0, 0.0, 1.0);
+	vec3 toCamera = camera.position.xyz - billboard.positionSize.xyz;
+	vec3 right = cross(up, toCamera);
+	// straight above or below, take the camera's own right axis
+	right = dot(right, right) > 1e-8 ? normalize(right) : vec3(camera.view[0][0], camera.view[1][0], camera.view[2][0]);
+
+	float height = billboard.positionSize.w;
+	float width = height * billboard.params.y;
+	vec3 pos = billboard.positionSize.xyz + right * (corner.x - 0.5) * width + up * corner.y * height;
+	gl_Position = camera.viewProjection * vec4(pos, 1.0);
+	texCoord = vec3(corner, billboard.params.x);
 }
 )";
-	const char* fs = R"(
-#version 450 core
-uniform vec3 baseColor = vec3(0.5, 0.5, 0.5);
 
-uniform mat4 osg_ProjectionMatrix;
-uniform vec4 viewport;
+// alpha tested instead of blended, sprites need no sorting
+static const char* s_billboardFragmentShader = R"(
+#ifdef USE_TEXTURE_ARRAY
+uniform sampler2DArray colorMap;
+#else
+uniform sampler2D colorMap;
+#endif
 
-in vec3 normal;
-in vec4 pos;
-layout(location = 0) out vec4 FragColor;
-layout(location = 1) out vec4 FragNormal;
-layout(location = 2) out vec4 FragPos;
-layout(location = 3) out vec4 testPos;
-void main() {
-	//vec3 lightColor = baseColor * (0.5 + 0.5 * dot(normal, vec3(0.0, 0.0, 1.0)));
-	FragColor = vec4(baseColor, 1.0);
-	FragNormal = vec4(normal, 1.0);
-	FragPos = pos;
-
-	float depth = gl_FragCoord.z;
-	vec4 ndcPos = vec4((gl_FragCoord.xy - viewport.xy) / viewport.zw * 2.0 - 1.0,
-		depth * 2.0 - 1,
-		1.0);
-	vec4 viewPos = inverse(osg_ProjectionMatrix) * ndcPos;
-	viewPos.xyz /= viewPos.w;
-testPos = viewPos;
+in vec3 texCoord;
+out vec4 fragColor;
+
+void main()
+{
+#ifdef USE_TEXTURE_ARRAY
+	vec4 color = texture(colorMap, texCoord);
+#else
+	vec4 color = texture(colorMap, texCoord.xy);
+#endif
+	if (color.a < 0.5) {
+		discard;
+	}
+	fragColor = color;
 }
 )";
 
-	osg::Program* program = new osg::Program;
-	program->addShader(new osg::Shader(osg::Shader::VERTEX, vs));
-	program->addShader(new osg::Shader(osg::Shader::FRAGMENT, fs));
-	return program;
+// FNV-1a, stable across runs and builds unlike std::hash
+static unsigned long long hashString(const std::string& str)
+{
+	unsigned long long hash = 14695981039346656037ull;
+	for (unsigned char c : str) {
+		hash ^= c;
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+unsigned int ShaderVariant::key() const
+{
+	return static_cast<unsigned int>(shadingMode)
+		| (directionalLights ? 1u << 4 : 0u)
+		| (pointLights ? 1u << 5 : 0u)
+		| (spotLights ? 1u << 6 : 0u)
+		| (shadow ? 1u << 7 : 0u);
+}
+
+std::string ShaderVariant::defines() const
+{
+	return "#define SHADING_MODE " + std::to_string(shadingMode) + "\n"
+		+ "#define HAS_DIRECTIONAL_LIGHTS " + std::to_string(directionalLights ? 1 : 0) + "\n"
+		+ "#define HAS_POINT_LIGHTS " + std::to_string(pointLights ? 1 : 0) + "\n"
+		+ "#define HAS_SPOT_LIGHTS " + std::to_string(spotLights ? 1 : 0) + "\n"
+		+ "#define USE_SHADOW " + std::to_string(shadow ? 1 : 0) + "\n";
 }
 
 void ShaderMgr::init()
 {
 	std::lock_guard<std::mutex> locker(m_mutex);
-	// init shader
-	auto program = createMeshProgram();
-	program->setName(s_meshProgram);
-	m_vecPrograms.push_back(program);
+	m_cacheDir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation).toStdString() + "/shader_cache";
+	QDir().mkpath(QString::fromStdString(m_cacheDir));
+
+	addVariantProgram(s_meshProgram, "", s_meshVertexShader, true);
+	addVariantProgram(s_instancedMeshProgram, "#define USE_DRAW_DATA\n#define USE_INSTANCING\n", s_meshVertexShader, true);
+	addVariantProgram(s_batchedMeshProgram, "#define USE_DRAW_DATA\n#define USE_MULTI_DRAW\n", s_meshVertexShader, true);
+	addVariantProgram(s_deferedMeshProgram, "#define WRITE_GBUFFER\n", s_meshVertexShader, false);
+	addVariantProgram(s_deferedLightingProgram, "#define DEFERRED_LIGHTING\n", s_deferedLightingVertexShader, true);
+	addVariantProgram(s_terrainProgram, "#define TERRAIN_CHUNK_SIZE " + std::to_string(TERRAIN_CHUNK_SIZE) + "\n", s_terrainVertexShader, true);
+	addProgram(s_billboardProgram, "", s_billboardVertexShader, s_billboardFragmentShader);
+	addProgram(s_billboardArrayProgram, "#define USE_TEXTURE_ARRAY\n", s_billboardVertexShader, s_billboardFragmentShader);
+}
+
+void ShaderMgr::addProgram(const std::string& name, const std::string& defines, const char* vertexShader, const char* fragmentShader)
+{
+	const std::string header = std::string("#version 450 core\n") + defines;
+	osg::ref_ptr<osg::Program> program = new osg::Program;
+	program->setName(name);
+	program->addShader(new osg::Shader(osg::Shader::VERTEX, header + vertexShader));
+	program->addShader(new osg::Shader(osg::Shader::FRAGMENT, header + fragmentShader));
+	m_programs[name] = program;
+}
 
-	auto deferedProgram = createMeshDeferedProgram();
-	deferedProgram->setName(s_deferedMeshProgram);
-	m_vecPrograms.push_back(deferedProgram);
+void ShaderMgr::addVariantProgram(const std::string& name, const std::string& vertexFormat, const char* vertexShader, bool lit)
+{
+	VariantProgram vp;
+	vp.program = new osg::Program;
+	vp.program->setName(name);
+	vp.vertexFormat = vertexFormat;
+	vp.vertexShader = vertexShader;
+	vp.lit = lit;
+	applyVariant(vp);
+	m_programs[name] = vp.program;
+	m_variantPrograms.push_back(vp);
 }
 
-osg::Program* ShaderMgr::getShader(const std::string& name)
+const ShaderMgr::ShaderPair& ShaderMgr::getVariantShaders(const VariantProgram& vp, const ShaderVariant& variant, std::string& source)
+{
+	const std::string header = std::string("#version 450 core\n") + vp.vertexFormat
+		+ (vp.lit ? variant : ShaderVariant()).defines();
+	source = header + vp.vertexShader + header + s_meshFragmentShader;
+	auto& shaders = m_variantShaders[vp.program->getName() + "#" + std::to_string(hashString(source))];
+	if (!shaders.first.valid()) {
+		shaders.first = new osg::Shader(osg::Shader::VERTEX, header + vp.vertexShader);
+		shaders.second = new osg::Shader(osg::Shader::FRAGMENT, header + s_meshFragmentShader);
+	}
+	return shaders;
+}
+
+void ShaderMgr::applyVariant(VariantProgram& vp)
+{
+	std::string source;
+	const ShaderPair& shaders = getVariantShaders(vp, m_variant, source);
+	if (source == vp.source) {
+		return;
+	}
+	vp.source = source;
+
+	if (vp.vs.valid()) {
+		vp.program->removeShader(vp.vs);
+		vp.program->removeShader(vp.fs);
+	}
+	vp.vs = shaders.first;
+	vp.fs = shaders.second;
+	vp.program->addShader(vp.vs);
+	vp.program->addShader(vp.fs);
+	vp.program->setProgramBinary(nullptr);
+	vp.binaryState = VariantProgram::Pending;
+}
+
+void ShaderMgr::setVariant(const ShaderVariant& variant)
+{
+	std::lock_guard<std::mutex> locker(m_mutex);
+	if (variant.key() == m_variant.key()) {
+		return;
+	}
+	m_variant = variant;
+	for (auto& vp : m_variantPrograms) {
+		applyVariant(vp);
+	}
+}
+
+ShaderVariant ShaderMgr::getVariant()
 {
 	std::lock_guard<std::mutex> locker(m_mutex);
-	for (auto& program : m_vecPrograms) {
-		if (program->getName() == name) {
-			return program.get();
+	return m_variant;
+}
+
+osg::ref_ptr<osg::Node> ShaderMgr::createWarmUpNode(const ShaderVariant& variant)
+{
+	std::lock_guard<std::mutex> locker(m_mutex);
+	osg::ref_ptr<osg::Group> group = new osg::Group;
+	for (auto& vp : m_variantPrograms) {
+		std::string source;
+		const ShaderPair& shaders = getVariantShaders(vp, variant, source);
+		osg::ref_ptr<osg::Program> program = vp.program;
+		// a stand-in links the shaders of another variant, they stay compiled for the swap
+		if (source != vp.source) {
+			program = new osg::Program;
+			program->addShader(shaders.first);
+			program->addShader(shaders.second);
 		}
+		osg::ref_ptr<osg::Node> node = new osg::Node;
+		node->getOrCreateStateSet()->setAttribute(program);
+		group->addChild(node);
 	}
-	return nullptr;
+	return group;
+}
+
+std::string ShaderMgr::getBinaryPath(const VariantProgram& vp) const
+{
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.bin", hashString(m_driver + vp.source));
+	return m_cacheDir + "/" + name;
+}
+
+void ShaderMgr::updateProgramBinaries(osg::State& state)
+{
+	std::lock_guard<std::mutex> locker(m_mutex);
+	if (m_driver.empty()) {
+		auto glString = [](GLenum name) {
+			const GLubyte* str = glGetString(name);
+			return str ? std::string(reinterpret_cast<const char*>(str)) : std::string();
+		};
+		m_driver = glString(GL_VENDOR) + "|" + glString(GL_RENDERER) + "|" + glString(GL_VERSION);
+	}
+
+	for (auto& vp : m_variantPrograms) {
+		if (vp.binaryState == VariantProgram::Done) {
+			continue;
+		}
+		osg::Program::PerContextProgram* pcp = vp.program->getPCP(state);
+		if (vp.binaryState == VariantProgram::Pending) {
+			// not linked yet, a cached binary skips compiling and linking
+			if (!pcp->isLinked() && pcp->needsLink()) {
+				QFile file(QString::fromStdString(getBinaryPath(vp)));
+				if (file.open(QIODevice::ReadOnly) && file.size() > static_cast<qint64>(sizeof(GLenum))) {
+					QByteArray bytes = file.readAll();
+					GLenum format;
+					memcpy(&format, bytes.constData(), sizeof(GLenum));
+					osg::ref_ptr<osg::ProgramBinary> binary = new osg::ProgramBinary;
+					binary->assign(bytes.size() - sizeof(GLenum), reinterpret_cast<const unsigned char*>(bytes.constData()) + sizeof(GLenum));
+					binary->setFormat(format);
+					vp.program->setProgramBinary(binary);
+					vp.binaryState = VariantProgram::Loaded;
+					continue;
+				}
+			}
+			// linked from source during the last frame, store it for the next start
+			if (pcp->isLinked()) {
+				osg::ref_ptr<osg::ProgramBinary> binary = vp.program->compileProgramBinary(state);
+				if (binary.valid() && binary->getSize() > 0) {
+					QFile file(QString::fromStdString(getBinaryPath(vp)));
+					if (file.open(QIODevice::WriteOnly)) {
+						GLenum format = binary->getFormat();
+						file.write(reinterpret_cast<const char*>(&format), sizeof(GLenum));
+						file.write(reinterpret_cast<const char*>(binary->getData()), binary->getSize());
+					}
+				}
+				vp.binaryState = VariantProgram::Done;
+			}
+		}
+		else if (!pcp->needsLink()) {
+			// a driver update can reject a binary with the same version string, relink from source
+			if (!pcp->isLinked()) {
+				QFile::remove(QString::fromStdString(getBinaryPath(vp)));
+				vp.program->setProgramBinary(nullptr);
+				vp.program->dirtyProgram();
+				vp.binaryState = VariantProgram::Pending;
+			}
+			else {
+				vp.binaryState = VariantProgram::Done;
+			}
+		}
+	}
+}
+
+osg::Program* ShaderMgr::getShader(const std::string& name)
+{
+	std::lock_guard<std::mutex> locker(m_mutex);
+	auto itr = m_programs.find(name);
+	return itr != m_programs.end() ? itr->second.get() : nullptr;
 }
 
 bool ShaderMgr::addShader(osg::Program* p)
@@ -512,12 +1032,10 @@ bool ShaderMgr::addShader(osg::Program* p)
 		return false;
 	}
 	std::lock_guard<std::mutex> locker(m_mutex);
-	for (auto& program : m_vecPrograms) {
-		if (program->getName() == p->getName()) {
-			printf("shader has existed\n");
-			return false;
-		}
+	if (m_programs.count(p->getName()) > 0) {
+		printf("shader has existed\n");
+		return false;
 	}
-	m_vecPrograms.push_back(p);
+	m_programs[p->getName()] = p;
 	return true;
 }
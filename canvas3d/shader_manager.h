@@ -1,14 +1,43 @@
 #pragma once
 
 #include "canvas3d_export.h"
+#include <osg/Node>
 #include <osg/Program>
+#include <osg/State>
 #include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
+// scene dependent part of the mesh programs. compiled in as #defines instead of branching on
+// uniforms, so a scene only runs the shading model and light loops it actually has
+struct CANVAS_EXPORT ShaderVariant
+{
+	int shadingMode = 0;		// ShaderMode
+	bool directionalLights = false;
+	bool pointLights = false;
+	bool spotLights = false;
+	bool shadow = true;
+
+	unsigned int key() const;
+	std::string defines() const;
+};
+
+// programs are looked up by name. the mesh programs are variant programs: one osg::Program per
+// vertex format whose shaders are swapped to the selected ShaderVariant, so geometry keeps its
+// program and every permutation is compiled once. linked permutations are written to a disk cache
+// through glGetProgramBinary, keyed by driver and source hash, and loaded back on the next start.
 class CANVAS_EXPORT ShaderMgr
 {
 public:
 	static const std::string s_meshProgram;
 	static const std::string s_deferedMeshProgram;
+	static const std::string s_deferedLightingProgram;
+	static const std::string s_instancedMeshProgram;
+	static const std::string s_batchedMeshProgram;
+	static const std::string s_billboardProgram;
+	static const std::string s_terrainProgram;
+	static const std::string s_billboardArrayProgram;
 
 	ShaderMgr();
 	~ShaderMgr();
@@ -19,14 +48,51 @@ public:
 	osg::Program* getShader(const std::string& name);
 	bool addShader(osg::Program* program);
 
+	// swaps the mesh programs to the variant, call where the scene graph may be edited
+	void setVariant(const ShaderVariant& variant);
+	ShaderVariant getVariant();
+	// a subgraph holding the programs of the variant, compile it ahead of setVariant
+	// (RenderInfo::addOperationAfterCompile) so the switch doesn't stall a frame
+	osg::ref_ptr<osg::Node> createWarmUpNode(const ShaderVariant& variant);
+
+	// render thread, before the view draws: loads cached binaries of the selected variant and
+	// stores the ones linked since the last call
+	void updateProgramBinaries(osg::State& state);
+
 protected:
 	ShaderMgr(ShaderMgr&) = delete;
 	ShaderMgr(ShaderMgr&&) = delete;
 	ShaderMgr& operator=(const ShaderMgr&) = delete;
 
-	std::vector<osg::ref_ptr<osg::Program>> m_vecPrograms;
+	struct VariantProgram {
+		osg::ref_ptr<osg::Program> program;
+		std::string vertexFormat;	// #defines fixed for this program
+		const char* vertexShader;
+		bool lit;					// follows the variant, the G-buffer writer doesn't shade
+		std::string source;			// of the current permutation, hashed for the binary cache
+		osg::ref_ptr<osg::Shader> vs;
+		osg::ref_ptr<osg::Shader> fs;
+		enum { Pending, Loaded, Done } binaryState;
+	};
+
+	typedef std::pair<osg::ref_ptr<osg::Shader>, osg::ref_ptr<osg::Shader>> ShaderPair;
+
+	void addVariantProgram(const std::string& name, const std::string& vertexFormat, const char* vertexShader, bool lit);
+	// programs that don't follow the scene variant
+	void addProgram(const std::string& name, const std::string& defines, const char* vertexShader, const char* fragmentShader);
+	const ShaderPair& getVariantShaders(const VariantProgram& vp, const ShaderVariant& variant, std::string& source);
+	void applyVariant(VariantProgram& vp);
+	std::string getBinaryPath(const VariantProgram& vp) const;
+
+	std::unordered_map<std::string, osg::ref_ptr<osg::Program>> m_programs;
+	std::vector<VariantProgram> m_variantPrograms;
+	// compiled shaders of every permutation used so far, switching back doesn't recompile
+	std::unordered_map<std::string, ShaderPair> m_variantShaders;
+	ShaderVariant m_variant;
+	std::string m_driver;
+	std::string m_cacheDir;
 	std::mutex m_mutex;
 private:
 	static ShaderMgr* s_instance;
 	static std::mutex s_mtx;
-};
\ No newline at end of file
+};
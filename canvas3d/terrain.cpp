@@ -0,0 +1,213 @@
+#include "terrain.h"
+#include <common/parallel_for.h>
+#include <osg/Geode>
+#include <osg/Geometry>
+#include <osg/LOD>
+#include <osg/Texture2D>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+static float hashNoise(int x, int y, unsigned int seed)
+{
+	unsigned int h = static_cast<unsigned int>(x) * 374761393u + static_cast<unsigned int>(y) * 668265263u + seed * 2246822519u;
+	h = (h ^ (h >> 13)) * 1274126177u;
+	h ^= h >> 16;
+	return static_cast<float>(h & 0xffffff) / static_cast<float>(0xffffff);
+}
+
+static float valueNoise(float x, float y, unsigned int seed)
+{
+	float fx = std::floor(x), fy = std::floor(y);
+	int xi = static_cast<int>(fx), yi = static_cast<int>(fy);
+	float tx = x - fx, ty = y - fy;
+	tx = tx * tx * (3.0f - 2.0f * tx);
+	ty = ty * ty * (3.0f - 2.0f * ty);
+	float h00 = hashNoise(xi, yi, seed), h10 = hashNoise(xi + 1, yi, seed);
+	float h01 = hashNoise(xi, yi + 1, seed), h11 = hashNoise(xi + 1, yi + 1, seed);
+	return (h00 * (1.0f - tx) + h10 * tx) * (1.0f - ty) + (h01 * (1.0f - tx) + h11 * tx) * ty;
+}
+
+Terrain::HeightFunc Terrain::createDefaultHeightFunc(float amplitude, unsigned int seed)
+{
+	return [amplitude, seed](int x, int y) {
+		float height = 0.0f;
+		float octaveAmplitude = 0.5f;
+		float frequency = 1.0f / 256.0f;
+		for (unsigned int octave = 0; octave < 5; ++octave) {
+			height += octaveAmplitude * valueNoise(x * frequency, y * frequency, seed + octave);
+			octaveAmplitude *= 0.5f;
+			frequency *= 2.0f;
+		}
+		return height * amplitude;
+	};
+}
+
+Terrain::Terrain(int width, int height, float cellSize, const HeightFunc& heightFunc, osg::Program* program, float lodRatio) :
+	m_width(std::max(width, 1)),
+	m_height(std::max(height, 1)),
+	m_cellSize(cellSize),
+	m_lodRatio(lodRatio),
+	m_levels(1),
+	m_leafColumns(0),
+	m_leafRows(0)
+{
+	generateHeights(heightFunc);
+
+	while ((TERRAIN_CHUNK_SIZE << (m_levels - 1)) < std::max(m_width, m_height)) {
+		++m_levels;
+	}
+	m_indices = createChunkIndices();
+
+	osg::ref_ptr<osg::Texture2D> heightmap = new osg::Texture2D(m_heightmap);
+	heightmap->setInternalFormat(GL_R32F);
+	heightmap->setResizeNonPowerOfTwoHint(false);
+	heightmap->setFilter(osg::Texture::MIN_FILTER, osg::Texture::NEAREST);
+	heightmap->setFilter(osg::Texture::MAG_FILTER, osg::Texture::NEAREST);
+	heightmap->setWrap(osg::Texture::WRAP_S, osg::Texture::CLAMP_TO_EDGE);
+	heightmap->setWrap(osg::Texture::WRAP_T, osg::Texture::CLAMP_TO_EDGE);
+
+	osg::ref_ptr<osg::Group> chunks = new osg::Group;
+	m_stateSet = chunks->getOrCreateStateSet();
+	m_stateSet->setAttributeAndModes(program, osg::StateAttribute::ON);
+	m_stateSet->setTextureAttributeAndModes(TERRAIN_HEIGHTMAP_UNIT, heightmap, osg::StateAttribute::ON);
+	m_stateSet->addUniform(new osg::Uniform("terrainHeightmap", TERRAIN_HEIGHTMAP_UNIT));
+	m_stateSet->addUniform(new osg::Uniform("terrainCellSize", m_cellSize));
+	chunks->addChild(createChunk(m_levels - 1, 0, 0));
+
+	m_root = new osg::Group;
+	m_root->addChild(chunks);
+}
+
+Terrain::~Terrain()
+{
+
+}
+
+void Terrain::setMaterialIndex(int materialIndex)
+{
+	m_stateSet->addUniform(new osg::Uniform("nodeMaterialIndex", materialIndex));
+}
+
+void Terrain::generateHeights(const HeightFunc& heightFunc)
+{
+	const int columns = m_width + 1;
+	const int rows = m_height + 1;
+	m_heightmap = new osg::Image;
+	m_heightmap->allocateImage(columns, rows, 1, GL_RED, GL_FLOAT);
+	m_heightmap->setInternalTextureFormat(GL_R32F);
+	float* heights = reinterpret_cast<float*>(m_heightmap->data());
+
+	parallelFor(rows, [&](int begin, int end) {
+		for (int y = begin; y < end; ++y) {
+			float* row = heights + static_cast<size_t>(y) * columns;
+			for (int x = 0; x < columns; ++x) {
+				row[x] = heightFunc(x, y);
+			}
+		}
+		});
+
+	// height range of every level 0 chunk, edges included since neighbours share them
+	m_leafColumns = (m_width + TERRAIN_CHUNK_SIZE - 1) / TERRAIN_CHUNK_SIZE;
+	m_leafRows = (m_height + TERRAIN_CHUNK_SIZE - 1) / TERRAIN_CHUNK_SIZE;
+	m_leafRanges.assign(m_leafColumns * m_leafRows, osg::Vec2f(FLT_MAX, -FLT_MAX));
+	parallelFor(m_leafRows, [&](int begin, int end) {
+		for (int cy = begin; cy < end; ++cy) {
+			int y0 = cy * TERRAIN_CHUNK_SIZE, y1 = std::min(y0 + TERRAIN_CHUNK_SIZE, m_height);
+			for (int cx = 0; cx < m_leafColumns; ++cx) {
+				int x0 = cx * TERRAIN_CHUNK_SIZE, x1 = std::min(x0 + TERRAIN_CHUNK_SIZE, m_width);
+				osg::Vec2f& range = m_leafRanges[cy * m_leafColumns + cx];
+				for (int y = y0; y <= y1; ++y) {
+					const float* row = heights + static_cast<size_t>(y) * columns;
+					for (int x = x0; x <= x1; ++x) {
+						range.x() = std::min(range.x(), row[x]);
+						range.y() = std::max(range.y(), row[x]);
+					}
+				}
+			}
+		}
+		});
+}
+
+osg::DrawElementsUShort* Terrain::createChunkIndices()
+{
+	// the patch's vertices plus a one vertex skirt ring, see the terrain vertex shader
+	const unsigned short rowVertices = TERRAIN_CHUNK_SIZE + 3;
+	osg::DrawElementsUShort* indices = new osg::DrawElementsUShort(GL_TRIANGLES);
+	indices->reserve((rowVertices - 1) * (rowVertices - 1) * 6);
+	for (unsigned short j = 0; j + 1 < rowVertices; ++j) {
+		for (unsigned short i = 0; i + 1 < rowVertices; ++i) {
+			unsigned short v = j * rowVertices + i;
+			indices->push_back(v);
+			indices->push_back(v + 1);
+			indices->push_back(v + rowVertices);
+			indices->push_back(v + rowVertices);
+			indices->push_back(v + 1);
+			indices->push_back(v + rowVertices + 1);
+		}
+	}
+	return indices;
+}
+
+osg::BoundingBox Terrain::getChunkBound(int level, int x, int y) const
+{
+	osg::Vec2f range(FLT_MAX, -FLT_MAX);
+	int cx1 = std::min((x + 1) << level, m_leafColumns);
+	int cy1 = std::min((y + 1) << level, m_leafRows);
+	for (int cy = y << level; cy < cy1; ++cy) {
+		for (int cx = x << level; cx < cx1; ++cx) {
+			const osg::Vec2f& leaf = m_leafRanges[cy * m_leafColumns + cx];
+			range.x() = std::min(range.x(), leaf.x());
+			range.y() = std::max(range.y(), leaf.y());
+		}
+	}
+	int span = TERRAIN_CHUNK_SIZE << level;
+	int x0 = x * span, y0 = y * span;
+	int x1 = std::min(x0 + span, m_width), y1 = std::min(y0 + span, m_height);
+	return osg::BoundingBox(x0 * m_cellSize, y0 * m_cellSize, range.x(), x1 * m_cellSize, y1 * m_cellSize, range.y());
+}
+
+osg::Node* Terrain::createChunk(int level, int x, int y)
+{
+	osg::BoundingBox bb = getChunkBound(level, x, y);
+	int step = 1 << level;
+	int span = TERRAIN_CHUNK_SIZE << level;
+	// deep enough to cover the gap to a neighbour one level finer or coarser
+	float skirt = std::max(step * m_cellSize, (bb.zMax() - bb.zMin()) * 0.25f);
+	bb.zMin() -= skirt;
+
+	osg::ref_ptr<osg::Geometry> geometry = new osg::Geometry;
+	geometry->setUseDisplayList(false);
+	geometry->setUseVertexBufferObjects(true);
+	geometry->addPrimitiveSet(m_indices);
+	// no vertex arrays to compute it from
+	geometry->setInitialBound(bb);
+	geometry->getOrCreateStateSet()->addUniform(new osg::Uniform("terrainChunk",
+		osg::Vec4(static_cast<float>(x * span), static_cast<float>(y * span), static_cast<float>(step), skirt)));
+
+	osg::ref_ptr<osg::Geode> geode = new osg::Geode;
+	geode->addDrawable(geometry);
+	if (level == 0) {
+		return geode.release();
+	}
+
+	osg::ref_ptr<osg::Group> children = new osg::Group;
+	int childSpan = span / 2;
+	for (int dy = 0; dy < 2; ++dy) {
+		for (int dx = 0; dx < 2; ++dx) {
+			int cx = x * 2 + dx, cy = y * 2 + dy;
+			if (cx * childSpan < m_width && cy * childSpan < m_height) {
+				children->addChild(createChunk(level - 1, cx, cy));
+			}
+		}
+	}
+
+	osg::ref_ptr<osg::LOD> lod = new osg::LOD;
+	lod->setCenterMode(osg::LOD::USER_DEFINED_CENTER);
+	lod->setCenter(bb.center());
+	lod->setRadius(bb.radius());
+	float switchDistance = m_lodRatio * span * m_cellSize;
+	lod->addChild(geode, switchDistance, FLT_MAX);
+	lod->addChild(children, 0.0f, switchDistance);
+	return lod.release();
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "canvas3d_export.h"
+#include <osg/Group>
+#include <osg/Image>
+#include <osg/PrimitiveSet>
+#include <osg/Program>
+#include <functional>
+#include <vector>
+
+// cells per chunk side at every level, must match the terrain vertex shader
+#define TERRAIN_CHUNK_SIZE 64
+#define TERRAIN_HEIGHTMAP_UNIT 6
+
+// heightmap terrain drawn as a quadtree of chunks. every chunk draws the same shared index grid of
+// (TERRAIN_CHUNK_SIZE + 1)^2 vertices plus a skirt ring hiding cracks between levels; the vertex
+// shader places the vertices from gl_VertexID and reads heights and normals from the heightmap
+// texture, so chunks carry no vertex arrays. chunk level L spans TERRAIN_CHUNK_SIZE * 2^L cells and
+// samples every 2^L-th height, osg::LOD nodes switch to the four children below lodRatio * chunk size.
+// the heights are generated on worker threads in the constructor.
+class CANVAS_EXPORT Terrain : public osg::Referenced
+{
+public:
+	// height of the grid point x, y. must be safe to call from several threads
+	typedef std::function<float(int x, int y)> HeightFunc;
+
+	// width x height cells of cellSize, heights are sampled at the (width + 1) x (height + 1) points
+	Terrain(int width, int height, float cellSize, const HeightFunc& heightFunc, osg::Program* program, float lodRatio = 3.0f);
+
+	// a few octaves of smooth noise in [0, amplitude]
+	static HeightFunc createDefaultHeightFunc(float amplitude, unsigned int seed = 0);
+
+	osg::Group* getRoot() { return m_root.get(); }
+	void setMaterialIndex(int materialIndex);
+
+	int getWidth() const { return m_width; }
+	int getHeight() const { return m_height; }
+
+protected:
+	~Terrain();
+
+	void generateHeights(const HeightFunc& heightFunc);
+	osg::Node* createChunk(int level, int x, int y);
+	osg::BoundingBox getChunkBound(int level, int x, int y) const;
+	static osg::DrawElementsUShort* createChunkIndices();
+
+	int m_width;
+	int m_height;
+	float m_cellSize;
+	float m_lodRatio;
+	int m_levels;
+
+	osg::ref_ptr<osg::Image> m_heightmap;
+	// min / max height of every level 0 chunk
+	std::vector<osg::Vec2f> m_leafRanges;
+	int m_leafColumns;
+	int m_leafRows;
+
+	osg::ref_ptr<osg::DrawElementsUShort> m_indices;
+	osg::ref_ptr<osg::Group> m_root;
+	// program, heightmap and parameters, below the root so its state set stays free for the caller
+	osg::ref_ptr<osg::StateSet> m_stateSet;
+};
@@ -0,0 +1,553 @@
+#include "mesh_bvh.h"
+#include "parallel_for.h"
+#include <algorithm>
+#include <cfloat>
+#include <future>
+#include <numeric>
+#include <thread>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MESH_BVH_SSE
+#include <emmintrin.h>
+#endif
+
+// SAH bins per axis
+#define MESH_BVH_BINS 16
+// ranges at least this large build their halves on two threads
+#define MESH_BVH_PARALLEL_SIZE 65536
+// ranges this deep become leaves whatever their size, bounds the traversal stacks
+#define MESH_BVH_MAX_DEPTH 64
+
+// levels whose two halves are built on separate threads, enough to occupy every core
+static int getParallelDepth()
+{
+	int depth = 0;
+	while ((1u << depth) < std::thread::hardware_concurrency()) {
+		++depth;
+	}
+	return depth;
+}
+
+static float halfArea(const osg::BoundingBox& bb)
+{
+	if (!bb.valid()) {
+		return 0.0f;
+	}
+	osg::Vec3f size = bb._max - bb._min;
+	return size.x() * size.y() + size.y() * size.z() + size.z() * size.x();
+}
+
+struct RayData
+{
+	RayData(const osg::Vec3f& o, const osg::Vec3f& d) {
+		for (int axis = 0; axis < 3; ++axis) {
+			origin[axis] = o[axis];
+			direction[axis] = d[axis];
+			// finite for axis aligned rays, a slab they lie in then gives 0 * big instead of 0 * inf
+			invDirection[axis] = 1.0f / (d[axis] != 0.0f ? d[axis] : 1e-20f);
+		}
+#ifdef MESH_BVH_SSE
+		origin4 = _mm_setr_ps(origin[0], origin[1], origin[2], 0.0f);
+		invDirection4 = _mm_setr_ps(invDirection[0], invDirection[1], invDirection[2], 0.0f);
+#endif
+	}
+
+	float origin[3];
+	float direction[3];
+	float invDirection[3];
+#ifdef MESH_BVH_SSE
+	__m128 origin4;
+	__m128 invDirection4;
+#endif
+};
+
+// entry distance of the ray into the box within [0, tMax], FLT_MAX when it misses
+static inline float intersectBox(const float* min, const float* max, const RayData& ray, float tMax)
+{
+#ifdef MESH_BVH_SSE
+	// the fourth lane holds the node's offset or count, cleared so it can't be a denormal
+	const __m128 xyz = _mm_castsi128_ps(_mm_setr_epi32(-1, -1, -1, 0));
+	__m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_and_ps(_mm_loadu_ps(min), xyz), ray.origin4), ray.invDirection4);
+	__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_and_ps(_mm_loadu_ps(max), xyz), ray.origin4), ray.invDirection4);
+	__m128 tmin = _mm_min_ps(t0, t1);
+	__m128 tmax = _mm_max_ps(t0, t1);
+	tmin = _mm_max_ps(_mm_max_ps(tmin, _mm_shuffle_ps(tmin, tmin, _MM_SHUFFLE(1, 1, 1, 1))), _mm_shuffle_ps(tmin, tmin, _MM_SHUFFLE(2, 2, 2, 2)));
+	tmax = _mm_min_ps(_mm_min_ps(tmax, _mm_shuffle_ps(tmax, tmax, _MM_SHUFFLE(1, 1, 1, 1))), _mm_shuffle_ps(tmax, tmax, _MM_SHUFFLE(2, 2, 2, 2)));
+	float tNear = std::max(_mm_cvtss_f32(tmin), 0.0f);
+	float tFar = std::min(_mm_cvtss_f32(tmax), tMax);
+#else
+	float tNear = 0.0f;
+	float tFar = tMax;
+	for (int axis = 0; axis < 3; ++axis) {
+		float t0 = (min[axis] - ray.origin[axis]) * ray.invDirection[axis];
+		float t1 = (max[axis] - ray.origin[axis]) * ray.invDirection[axis];
+		tNear = std::max(tNear, std::min(t0, t1));
+		tFar = std::min(tFar, std::max(t0, t1));
+	}
+#endif
+	return tNear <= tFar ? tNear : FLT_MAX;
+}
+
+// Moeller-Trumbore on four triangles given as three corners each, missing ones all zero.
+// returns the lane of the nearest hit closer than t and updates t, u, v, or -1
+static inline int intersectTriangles(const osg::Vec3f* corners, const RayData& ray, float& t, float& u, float& v)
+{
+	int nearest = -1;
+#ifdef MESH_BVH_SSE
+	alignas(16) float soa[9][4];
+	for (int lane = 0; lane < 4; ++lane) {
+		for (int corner = 0; corner < 3; ++corner) {
+			const osg::Vec3f& p = corners[lane * 3 + corner];
+			soa[corner * 3][lane] = p.x();
+			soa[corner * 3 + 1][lane] = p.y();
+			soa[corner * 3 + 2][lane] = p.z();
+		}
+	}
+	__m128 v0x = _mm_load_ps(soa[0]), v0y = _mm_load_ps(soa[1]), v0z = _mm_load_ps(soa[2]);
+	__m128 e1x = _mm_sub_ps(_mm_load_ps(soa[3]), v0x), e1y = _mm_sub_ps(_mm_load_ps(soa[4]), v0y), e1z = _mm_sub_ps(_mm_load_ps(soa[5]), v0z);
+	__m128 e2x = _mm_sub_ps(_mm_load_ps(soa[6]), v0x), e2y = _mm_sub_ps(_mm_load_ps(soa[7]), v0y), e2z = _mm_sub_ps(_mm_load_ps(soa[8]), v0z);
+	__m128 dx = _mm_set1_ps(ray.direction[0]), dy = _mm_set1_ps(ray.direction[1]), dz = _mm_set1_ps(ray.direction[2]);
+	// p = d x e2
+	__m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+	__m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+	__m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+	__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+	__m128 invDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+	__m128 sx = _mm_sub_ps(_mm_set1_ps(ray.origin[0]), v0x);
+	__m128 sy = _mm_sub_ps(_mm_set1_ps(ray.origin[1]), v0y);
+	__m128 sz = _mm_sub_ps(_mm_set1_ps(ray.origin[2]), v0z);
+	__m128 u4 = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), invDet);
+	// q = s x e1
+	__m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+	__m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+	__m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+	__m128 v4 = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), invDet);
+	__m128 t4 = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+	// parallel and padding lanes divide by zero, their comparisons with inf or nan fail
+	const __m128 zero = _mm_setzero_ps();
+	__m128 mask = _mm_cmpneq_ps(det, zero);
+	mask = _mm_and_ps(mask, _mm_cmpge_ps(u4, zero));
+	mask = _mm_and_ps(mask, _mm_cmpge_ps(v4, zero));
+	mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(u4, v4), _mm_set1_ps(1.0f)));
+	mask = _mm_and_ps(mask, _mm_cmpge_ps(t4, zero));
+	mask = _mm_and_ps(mask, _mm_cmplt_ps(t4, _mm_set1_ps(t)));
+	int hits = _mm_movemask_ps(mask);
+	if (hits == 0) {
+		return -1;
+	}
+	alignas(16) float ts[4], us[4], vs[4];
+	_mm_store_ps(ts, t4);
+	_mm_store_ps(us, u4);
+	_mm_store_ps(vs, v4);
+	for (int lane = 0; lane < 4; ++lane) {
+		if ((hits & (1 << lane)) && ts[lane] < t) {
+			t = ts[lane];
+			u = us[lane];
+			v = vs[lane];
+			nearest = lane;
+		}
+	}
+#else
+	const osg::Vec3f origin(ray.origin[0], ray.origin[1], ray.origin[2]);
+	const osg::Vec3f direction(ray.direction[0], ray.direction[1], ray.direction[2]);
+	for (int lane = 0; lane < 4; ++lane) {
+		const osg::Vec3f& v0 = corners[lane * 3];
+		osg::Vec3f e1 = corners[lane * 3 + 1] - v0;
+		osg::Vec3f e2 = corners[lane * 3 + 2] - v0;
+		osg::Vec3f p = direction ^ e2;
+		float det = e1 * p;
+		if (det == 0.0f) {
+			continue;
+		}
+		float invDet = 1.0f / det;
+		osg::Vec3f s = origin - v0;
+		float lu = (s * p) * invDet;
+		osg::Vec3f q = s ^ e1;
+		float lv = (direction * q) * invDet;
+		float lt = (e2 * q) * invDet;
+		if (lu >= 0.0f && lv >= 0.0f && lu + lv <= 1.0f && lt >= 0.0f && lt < t) {
+			t = lt;
+			u = lu;
+			v = lv;
+			nearest = lane;
+		}
+	}
+#endif
+	return nearest;
+}
+
+// squared distance of the point to the box, 0 inside
+static inline float boxDistance2(const float* min, const float* max, const osg::Vec3f& point)
+{
+	float distance2 = 0.0f;
+	for (int axis = 0; axis < 3; ++axis) {
+		float d = std::max(std::max(min[axis] - point[axis], point[axis] - max[axis]), 0.0f);
+		distance2 += d * d;
+	}
+	return distance2;
+}
+
+// nearest point of the triangle abc to p, by the voronoi region p lies in
+static osg::Vec3f closestPointOnTriangle(const osg::Vec3f& p, const osg::Vec3f& a, const osg::Vec3f& b, const osg::Vec3f& c)
+{
+	osg::Vec3f ab = b - a, ac = c - a, ap = p - a;
+	float d1 = ab * ap, d2 = ac * ap;
+	if (d1 <= 0.0f && d2 <= 0.0f) {
+		return a;
+	}
+	osg::Vec3f bp = p - b;
+	float d3 = ab * bp, d4 = ac * bp;
+	if (d3 >= 0.0f && d4 <= d3) {
+		return b;
+	}
+	float vc = d1 * d4 - d3 * d2;
+	if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) {
+		return a + ab * (d1 / (d1 - d3));
+	}
+	osg::Vec3f cp = p - c;
+	float d5 = ab * cp, d6 = ac * cp;
+	if (d6 >= 0.0f && d5 <= d6) {
+		return c;
+	}
+	float vb = d5 * d2 - d1 * d6;
+	if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) {
+		return a + ac * (d2 / (d2 - d6));
+	}
+	float va = d3 * d6 - d5 * d4;
+	if (va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f) {
+		return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+	}
+	float denom = 1.0f / (va + vb + vc);
+	return a + ab * (vb * denom) + ac * (vc * denom);
+}
+
+MeshBVH::MeshBVH(const ModelData& data) :
+	m_vertices(data.m_vertexArray.get()),
+	m_indices(data.m_drawElement.get()),
+	m_numTriangles(0),
+	m_built(false)
+{
+	if (m_vertices.valid() && (!m_indices.valid() || m_indices->getMode() == GL_TRIANGLES)) {
+		m_numTriangles = static_cast<unsigned int>((m_indices.valid() ? m_indices->size() : m_vertices->size()) / 3);
+	}
+}
+
+MeshBVH::~MeshBVH()
+{
+
+}
+
+void MeshBVH::getTriangle(unsigned int triangle, osg::Vec3f& v0, osg::Vec3f& v1, osg::Vec3f& v2) const
+{
+	const osg::Vec3Array& vertices = *m_vertices;
+	size_t first = static_cast<size_t>(triangle) * 3;
+	if (m_indices.valid()) {
+		const osg::DrawElementsUInt& indices = *m_indices;
+		v0 = vertices[indices[first]];
+		v1 = vertices[indices[first + 1]];
+		v2 = vertices[indices[first + 2]];
+	}
+	else {
+		v0 = vertices[first];
+		v1 = vertices[first + 1];
+		v2 = vertices[first + 2];
+	}
+}
+
+void MeshBVH::build() const
+{
+	std::call_once(m_buildFlag, [this]() {
+		std::vector<BuildTriangle> triangles(m_numTriangles);
+		parallelFor(m_numTriangles, [&](unsigned int begin, unsigned int end) {
+			osg::Vec3f v0, v1, v2;
+			for (unsigned int i = begin; i < end; ++i) {
+				getTriangle(i, v0, v1, v2);
+				BuildTriangle& triangle = triangles[i];
+				for (int axis = 0; axis < 3; ++axis) {
+					triangle.min[axis] = std::min(std::min(v0[axis], v1[axis]), v2[axis]);
+					triangle.max[axis] = std::max(std::max(v0[axis], v1[axis]), v2[axis]);
+				}
+				triangle.centroid = (triangle.min + triangle.max) * 0.5f;
+			}
+			});
+
+		m_order.resize(m_numTriangles);
+		std::iota(m_order.begin(), m_order.end(), 0u);
+		m_nodes.reserve(std::max(1u, m_numTriangles / 2));
+		buildRange(triangles, 0, m_numTriangles, 0, m_nodes);
+		m_built = true;
+		});
+}
+
+void MeshBVH::buildRange(const std::vector<BuildTriangle>& triangles, unsigned int begin, unsigned int end, int depth, std::vector<Node>& nodes) const
+{
+	osg::BoundingBox bound;
+	osg::BoundingBox centroids;
+	for (unsigned int i = begin; i < end; ++i) {
+		const BuildTriangle& triangle = triangles[m_order[i]];
+		bound.expandBy(triangle.min);
+		bound.expandBy(triangle.max);
+		centroids.expandBy(triangle.centroid);
+	}
+
+	const unsigned int index = static_cast<unsigned int>(nodes.size());
+	nodes.emplace_back();
+	for (int axis = 0; axis < 3; ++axis) {
+		nodes[index].min[axis] = bound._min[axis];
+		nodes[index].max[axis] = bound._max[axis];
+	}
+	const unsigned int count = end - begin;
+	nodes[index].offset = begin;
+	nodes[index].count = count;
+	if (count <= 4 || depth >= MESH_BVH_MAX_DEPTH) {
+		return;
+	}
+
+	// cheapest split between bins of the centroids, on any axis
+	struct Bin {
+		osg::BoundingBox bound;
+		unsigned int count = 0;
+	};
+	float bestCost = FLT_MAX;
+	int bestAxis = -1;
+	int bestSplit = 0;
+	for (int axis = 0; axis < 3; ++axis) {
+		float extent = centroids._max[axis] - centroids._min[axis];
+		if (extent <= 0.0f) {
+			continue;
+		}
+		Bin bins[MESH_BVH_BINS];
+		float scale = MESH_BVH_BINS / extent;
+		for (unsigned int i = begin; i < end; ++i) {
+			const BuildTriangle& triangle = triangles[m_order[i]];
+			int b = std::min(static_cast<int>((triangle.centroid[axis] - centroids._min[axis]) * scale), MESH_BVH_BINS - 1);
+			++bins[b].count;
+			bins[b].bound.expandBy(triangle.min);
+			bins[b].bound.expandBy(triangle.max);
+		}
+		float rightArea[MESH_BVH_BINS - 1];
+		unsigned int rightCount[MESH_BVH_BINS - 1];
+		osg::BoundingBox side;
+		unsigned int sideCount = 0;
+		for (int b = MESH_BVH_BINS - 1; b > 0; --b) {
+			side.expandBy(bins[b].bound);
+			sideCount += bins[b].count;
+			rightArea[b - 1] = halfArea(side);
+			rightCount[b - 1] = sideCount;
+		}
+		side.init();
+		sideCount = 0;
+		for (int b = 0; b < MESH_BVH_BINS - 1; ++b) {
+			side.expandBy(bins[b].bound);
+			sideCount += bins[b].count;
+			if (sideCount == 0 || rightCount[b] == 0) {
+				continue;
+			}
+			float cost = sideCount * halfArea(side) + rightCount[b] * rightArea[b];
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestAxis = axis;
+				bestSplit = b;
+			}
+		}
+	}
+
+	// a small range stays a leaf when testing its triangles is cheaper than one more level
+	float area = halfArea(bound);
+	if (count <= MESH_BVH_LEAF_SIZE && (bestAxis < 0 || area <= 0.0f || 1.0f + bestCost / area >= count)) {
+		return;
+	}
+	unsigned int mid = begin + count / 2;
+	if (bestAxis >= 0) {
+		float min = centroids._min[bestAxis];
+		float scale = MESH_BVH_BINS / (centroids._max[bestAxis] - min);
+		auto split = std::partition(m_order.begin() + begin, m_order.begin() + end, [&](unsigned int i) {
+			return std::min(static_cast<int>((triangles[i].centroid[bestAxis] - min) * scale), MESH_BVH_BINS - 1) <= bestSplit;
+			});
+		mid = static_cast<unsigned int>(split - m_order.begin());
+	}
+	nodes[index].count = 0;
+
+	static const int parallelDepth = getParallelDepth();
+	if (count >= MESH_BVH_PARALLEL_SIZE && depth < parallelDepth) {
+		// the halves own disjoint ranges of m_order, their nodes are appended with shifted indices
+		std::vector<Node> left;
+		std::vector<Node> right;
+		auto leftBuild = std::async(std::launch::async, [&]() {
+			buildRange(triangles, begin, mid, depth + 1, left);
+			});
+		buildRange(triangles, mid, end, depth + 1, right);
+		leftBuild.get();
+		auto append = [&nodes](const std::vector<Node>& subtree) {
+			unsigned int base = static_cast<unsigned int>(nodes.size());
+			for (Node node : subtree) {
+				if (node.count == 0) {
+					node.offset += base;
+				}
+				nodes.push_back(node);
+			}
+		};
+		append(left);
+		nodes[index].offset = static_cast<unsigned int>(nodes.size());
+		append(right);
+	}
+	else {
+		buildRange(triangles, begin, mid, depth + 1, nodes);
+		nodes[index].offset = static_cast<unsigned int>(nodes.size());
+		buildRange(triangles, mid, end, depth + 1, nodes);
+	}
+}
+
+osg::BoundingBox MeshBVH::getBound() const
+{
+	build();
+	if (m_nodes.empty() || m_numTriangles == 0) {
+		return osg::BoundingBox();
+	}
+	const Node& root = m_nodes.front();
+	return osg::BoundingBox(root.min[0], root.min[1], root.min[2], root.max[0], root.max[1], root.max[2]);
+}
+
+bool MeshBVH::intersectRay(const osg::Vec3f& origin, const osg::Vec3f& direction, float tMax, MeshHit& hit) const
+{
+	build();
+	if (m_numTriangles == 0) {
+		return false;
+	}
+	RayData ray(origin, direction);
+	MeshHit nearest;
+	nearest.t = tMax;
+	bool found = false;
+	if (intersectBox(m_nodes[0].min, m_nodes[0].max, ray, tMax) == FLT_MAX) {
+		return false;
+	}
+
+	// far children still to visit with their entry distance, skipped once a nearer hit is known
+	unsigned int stack[MESH_BVH_MAX_DEPTH + 1];
+	float entries[MESH_BVH_MAX_DEPTH + 1];
+	int size = 0;
+	unsigned int current = 0;
+	osg::Vec3f corners[12];
+	while (true) {
+		const Node& node = m_nodes[current];
+		if (node.count > 0) {
+			for (unsigned int first = 0; first < node.count; first += 4) {
+				unsigned int lanes = std::min(node.count - first, 4u);
+				for (unsigned int lane = 0; lane < 4; ++lane) {
+					if (lane < lanes) {
+						getTriangle(m_order[node.offset + first + lane], corners[lane * 3], corners[lane * 3 + 1], corners[lane * 3 + 2]);
+					}
+					else {
+						corners[lane * 3] = corners[lane * 3 + 1] = corners[lane * 3 + 2] = osg::Vec3f();
+					}
+				}
+				int lane = intersectTriangles(corners, ray, nearest.t, nearest.u, nearest.v);
+				if (lane >= 0) {
+					nearest.triangle = m_order[node.offset + first + lane];
+					found = true;
+				}
+			}
+		}
+		else {
+			unsigned int nearChild = current + 1;
+			unsigned int farChild = node.offset;
+			float tNear = intersectBox(m_nodes[nearChild].min, m_nodes[nearChild].max, ray, nearest.t);
+			float tFar = intersectBox(m_nodes[farChild].min, m_nodes[farChild].max, ray, nearest.t);
+			if (tFar < tNear) {
+				std::swap(nearChild, farChild);
+				std::swap(tNear, tFar);
+			}
+			if (tNear != FLT_MAX) {
+				if (tFar != FLT_MAX) {
+					stack[size] = farChild;
+					entries[size++] = tFar;
+				}
+				current = nearChild;
+				continue;
+			}
+		}
+
+		bool next = false;
+		while (size > 0 && !next) {
+			--size;
+			next = entries[size] < nearest.t;
+			current = stack[size];
+		}
+		if (!next) {
+			break;
+		}
+	}
+	if (found) {
+		hit = nearest;
+	}
+	return found;
+}
+
+bool MeshBVH::intersectSegment(const osg::Vec3f& start, const osg::Vec3f& end, MeshHit& hit) const
+{
+	return intersectRay(start, end - start, 1.0f, hit);
+}
+
+bool MeshBVH::closestPoint(const osg::Vec3f& point, float maxDistance, osg::Vec3f& closest, unsigned int& triangle) const
+{
+	build();
+	if (m_numTriangles == 0) {
+		return false;
+	}
+	float best = maxDistance * maxDistance;
+	bool found = false;
+	if (boxDistance2(m_nodes[0].min, m_nodes[0].max, point) > best) {
+		return false;
+	}
+
+	unsigned int stack[MESH_BVH_MAX_DEPTH + 1];
+	float entries[MESH_BVH_MAX_DEPTH + 1];
+	int size = 0;
+	unsigned int current = 0;
+	osg::Vec3f v0, v1, v2;
+	while (true) {
+		const Node& node = m_nodes[current];
+		if (node.count > 0) {
+			for (unsigned int i = node.offset; i < node.offset + node.count; ++i) {
+				getTriangle(m_order[i], v0, v1, v2);
+				osg::Vec3f candidate = closestPointOnTriangle(point, v0, v1, v2);
+				float distance2 = (candidate - point).length2();
+				if (distance2 <= best) {
+					best = distance2;
+					closest = candidate;
+					triangle = m_order[i];
+					found = true;
+				}
+			}
+		}
+		else {
+			unsigned int nearChild = current + 1;
+			unsigned int farChild = node.offset;
+			float dNear = boxDistance2(m_nodes[nearChild].min, m_nodes[nearChild].max, point);
+			float dFar = boxDistance2(m_nodes[farChild].min, m_nodes[farChild].max, point);
+			if (dFar < dNear) {
+				std::swap(nearChild, farChild);
+				std::swap(dNear, dFar);
+			}
+			if (dNear <= best) {
+				if (dFar <= best) {
+					stack[size] = farChild;
+					entries[size++] = dFar;
+				}
+				current = nearChild;
+				continue;
+			}
+		}
+
+		bool next = false;
+		while (size > 0 && !next) {
+			--size;
+			next = entries[size] <= best;
+			current = stack[size];
+		}
+		if (!next) {
+			break;
+		}
+	}
+	return found;
+}
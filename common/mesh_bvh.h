@@ -0,0 +1,76 @@
+#pragma once
+
+#include "common_export.h"
+#include "model_data.h"
+#include <osg/BoundingBox>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+// triangles per leaf, tested four at a time
+#define MESH_BVH_LEAF_SIZE 8
+
+// a hit of a ray or segment, t in units of the direction (segments: 0 at start, 1 at end)
+struct COMMON_EXPORT MeshHit
+{
+	float t = 0.0f;
+	unsigned int triangle = 0;	// index of the triangle, the n-th index triple of the mesh
+	float u = 0.0f;				// barycentrics, p = (1 - u - v) * v0 + u * v1 + v * v2
+	float v = 0.0f;
+};
+
+// bounding volume hierarchy over the triangles of a ModelData for CPU ray, segment and closest point
+// queries in the mesh's local space, without a GL context. built top-down with binned SAH, the
+// subtrees of the upper levels on their own threads, and stored depth-first in one array of 32 byte
+// nodes: a left child follows its parent, so inner nodes only keep the right child's index. the
+// box and triangle tests use SSE where the target has it, four leaf triangles per test.
+// the tree references the mesh's arrays, which must not change afterwards. the first query builds
+// it, call build() from a worker right after import to have it ready.
+class COMMON_EXPORT MeshBVH
+{
+public:
+	explicit MeshBVH(const ModelData& data);
+	~MeshBVH();
+
+	// any thread, only the first call builds, later ones wait for it
+	void build() const;
+	bool isBuilt() const { return m_built; }
+
+	unsigned int getNumTriangles() const { return m_numTriangles; }
+	osg::BoundingBox getBound() const;
+
+	// nearest hit with t in [0, tMax]
+	bool intersectRay(const osg::Vec3f& origin, const osg::Vec3f& direction, float tMax, MeshHit& hit) const;
+	bool intersectSegment(const osg::Vec3f& start, const osg::Vec3f& end, MeshHit& hit) const;
+	// nearest surface point no farther than maxDistance
+	bool closestPoint(const osg::Vec3f& point, float maxDistance, osg::Vec3f& closest, unsigned int& triangle) const;
+
+protected:
+	MeshBVH(const MeshBVH&) = delete;
+	MeshBVH& operator=(const MeshBVH&) = delete;
+
+	struct Node {
+		float min[3];
+		unsigned int offset;	// inner: right child; leaf: first entry of m_order
+		float max[3];
+		unsigned int count;		// triangles of a leaf, 0 for inner nodes
+	};
+	struct BuildTriangle {
+		osg::Vec3f min;
+		osg::Vec3f max;
+		osg::Vec3f centroid;
+	};
+
+	void buildRange(const std::vector<BuildTriangle>& triangles, unsigned int begin, unsigned int end, int depth, std::vector<Node>& nodes) const;
+	void getTriangle(unsigned int triangle, osg::Vec3f& v0, osg::Vec3f& v1, osg::Vec3f& v2) const;
+
+	osg::ref_ptr<const osg::Vec3Array> m_vertices;
+	osg::ref_ptr<const osg::DrawElementsUInt> m_indices;	// null: every three vertices are a triangle
+	unsigned int m_numTriangles;
+
+	// lazily built
+	mutable std::once_flag m_buildFlag;
+	mutable std::atomic<bool> m_built;
+	mutable std::vector<Node> m_nodes;
+	mutable std::vector<unsigned int> m_order;	// triangles in leaf order
+};
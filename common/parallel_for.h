@@ -0,0 +1,24 @@
+#pragma once
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+// splits [0, count) into one contiguous range per hardware thread, the caller runs the first.
+// func(begin, end) must be safe to run on several threads at once
+template<class Index, class Func>
+void parallelFor(Index count, const Func& func)
+{
+	const Index threads = std::max(static_cast<Index>(1), std::min(static_cast<Index>(std::thread::hardware_concurrency()), count));
+	std::vector<std::thread> workers;
+	for (Index t = 1; t < threads; ++t) {
+		workers.emplace_back([&func, count, threads, t]() {
+			func(static_cast<Index>(static_cast<long long>(count) * t / threads),
+				static_cast<Index>(static_cast<long long>(count) * (t + 1) / threads));
+			});
+	}
+	func(static_cast<Index>(0), static_cast<Index>(static_cast<long long>(count) / threads));
+	for (auto& worker : workers) {
+		worker.join();
+	}
+}
@@ -0,0 +1,453 @@
+#include "software_rasterizer.h"
+#include "parallel_for.h"
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SOFTWARE_RASTER_SSE
+#include <emmintrin.h>
+#endif
+
+#define NO_TRIANGLE 0xffffffffu
+
+// PreviewMaterial constants of the mesh fragment shader, the light points from the surface to it
+static const osg::Vec3f s_previewLightDir(0.0f, 0.0f, 1.0f);
+static const float s_ambientStrength = 0.5f;
+static const float s_diffuseStrength = 0.5f;
+static const float s_specularStrength = 0.5f;
+
+struct SoftwareRasterizer::DrawState
+{
+	unsigned int vertexIndex(unsigned int triangle, int corner) const {
+		unsigned int index = triangle * 3 + corner;
+		return indices ? (*indices)[index] : index;
+	}
+
+	const osg::DrawElementsUInt* indices = nullptr;
+	std::vector<osg::Vec4f> clip;
+	std::vector<osg::Vec3f> positions;	// view space
+	std::vector<osg::Vec3f> normals;	// view space, empty when the data has none
+	osg::Vec3f baseColor;
+};
+
+// a vertex after clipping, the barycentrics refer to the source triangle
+struct ClipVertex
+{
+	osg::Vec4f position;
+	osg::Vec3f barycentric;
+};
+
+// the triangle plus one vertex per clip plane
+#define CLIP_POLYGON_SIZE 8
+// viewports the clipped triangles may extend beyond the view on every side. it bounds the window
+// coordinates, which keeps the snapped edge functions exact in double precision
+#define CLIP_GUARD_BAND 4.0f
+// window coordinates are snapped to 1/256 of a pixel
+#define SUBPIXEL_SCALE 256.0
+
+// clips against the near plane z >= -w and the guard band, a polygon of up to CLIP_POLYGON_SIZE
+// vertices, 0 when nothing is left. the far plane is left to the depth test
+static int clipTriangle(const osg::Vec4f* positions, ClipVertex* polygon)
+{
+	static const osg::Vec4f planes[5] = {
+		osg::Vec4f(0.0f, 0.0f, 1.0f, 1.0f),
+		osg::Vec4f(-1.0f, 0.0f, 0.0f, CLIP_GUARD_BAND), osg::Vec4f(1.0f, 0.0f, 0.0f, CLIP_GUARD_BAND),
+		osg::Vec4f(0.0f, -1.0f, 0.0f, CLIP_GUARD_BAND), osg::Vec4f(0.0f, 1.0f, 0.0f, CLIP_GUARD_BAND)
+	};
+	polygon[0] = { positions[0], osg::Vec3f(1.0f, 0.0f, 0.0f) };
+	polygon[1] = { positions[1], osg::Vec3f(0.0f, 1.0f, 0.0f) };
+	polygon[2] = { positions[2], osg::Vec3f(0.0f, 0.0f, 1.0f) };
+	int count = 3;
+	ClipVertex input[CLIP_POLYGON_SIZE];
+	for (const osg::Vec4f& plane : planes) {
+		int inputCount = count;
+		std::copy(polygon, polygon + inputCount, input);
+		count = 0;
+		for (int i = 0; i < inputCount; ++i) {
+			const ClipVertex& a = input[i];
+			const ClipVertex& b = input[(i + 1) % inputCount];
+			float da = plane * a.position;
+			float db = plane * b.position;
+			if (da >= 0.0f) {
+				polygon[count++] = a;
+			}
+			if ((da >= 0.0f) != (db >= 0.0f)) {
+				// always from the inside vertex, so an edge two triangles share is cut at the same point
+				const ClipVertex& from = da >= 0.0f ? a : b;
+				const ClipVertex& to = da >= 0.0f ? b : a;
+				float df = da >= 0.0f ? da : db;
+				float dt = da >= 0.0f ? db : da;
+				float t = df / (df - dt);
+				polygon[count++] = { from.position + (to.position - from.position) * t, from.barycentric + (to.barycentric - from.barycentric) * t };
+			}
+		}
+		if (count < 3) {
+			return 0;
+		}
+	}
+	return count;
+}
+
+// entirely outside one of the side or far planes
+static bool isOutside(const osg::Vec4f* p)
+{
+	for (int axis = 0; axis < 3; ++axis) {
+		if (p[0][axis] > p[0].w() && p[1][axis] > p[1].w() && p[2][axis] > p[2].w()) {
+			return true;
+		}
+		if (axis < 2 && p[0][axis] < -p[0].w() && p[1][axis] < -p[1].w() && p[2][axis] < -p[2].w()) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static double snap(float coordinate)
+{
+	return std::floor(coordinate * SUBPIXEL_SCALE + 0.5) / SUBPIXEL_SCALE;
+}
+
+SoftwareRasterizer::SoftwareRasterizer(int width, int height) :
+	m_width(std::max(width, 1)),
+	m_height(std::max(height, 1))
+{
+	m_tilesX = (m_width + SOFTWARE_RASTER_TILE - 1) / SOFTWARE_RASTER_TILE;
+	m_tilesY = (m_height + SOFTWARE_RASTER_TILE - 1) / SOFTWARE_RASTER_TILE;
+	m_color.resize(static_cast<size_t>(m_width) * m_height * 4);
+	m_depth.resize(static_cast<size_t>(m_width) * m_height);
+	clear(osg::Vec4(0.0f, 0.0f, 0.0f, 0.0f));
+}
+
+SoftwareRasterizer::~SoftwareRasterizer()
+{
+
+}
+
+void SoftwareRasterizer::setCamera(const osg::Matrixd& view, const osg::Matrixd& projection)
+{
+	m_view = view;
+	m_projection = projection;
+}
+
+void SoftwareRasterizer::setCamera(const osg::Camera* camera)
+{
+	setCamera(camera->getViewMatrix(), camera->getProjectionMatrix());
+}
+
+void SoftwareRasterizer::clear(const osg::Vec4& color, float depth)
+{
+	unsigned char rgba[4];
+	for (int i = 0; i < 4; ++i) {
+		rgba[i] = static_cast<unsigned char>(std::min(std::max(color[i], 0.0f), 1.0f) * 255.0f + 0.5f);
+	}
+	for (size_t pixel = 0; pixel < m_depth.size(); ++pixel) {
+		memcpy(&m_color[pixel * 4], rgba, 4);
+	}
+	std::fill(m_depth.begin(), m_depth.end(), depth);
+}
+
+osg::ref_ptr<osg::Image> SoftwareRasterizer::createImage() const
+{
+	osg::ref_ptr<osg::Image> image = new osg::Image;
+	image->allocateImage(m_width, m_height, 1, GL_RGBA, GL_UNSIGNED_BYTE);
+	memcpy(image->data(), m_color.data(), m_color.size());
+	return image;
+}
+
+void SoftwareRasterizer::draw(const ModelData& data, const osg::Matrixd& model, const osg::Vec3f& baseColor)
+{
+	if (!data.m_vertexArray.valid() || (data.m_drawElement.valid() && data.m_drawElement->getMode() != GL_TRIANGLES)) {
+		return;
+	}
+	const osg::Vec3Array& vertices = *data.m_vertexArray;
+	const osg::Vec3Array* normals = data.m_normalArray.get();
+	const bool hasNormals = normals != nullptr && normals->size() == vertices.size();
+	const unsigned int vertexCount = static_cast<unsigned int>(vertices.size());
+
+	DrawState state;
+	state.indices = data.m_drawElement.get();
+	state.baseColor = baseColor;
+	const unsigned int triangles = static_cast<unsigned int>((state.indices ? state.indices->size() : vertices.size()) / 3);
+	if (triangles == 0) {
+		return;
+	}
+
+	// vertex stage
+	const osg::Matrixf modelView = model * m_view;
+	const osg::Matrixf modelViewProjection = model * m_view * m_projection;
+	const osg::Matrixf normalMatrix = osg::Matrixf::inverse(modelView);
+	state.clip.resize(vertexCount);
+	state.positions.resize(vertexCount);
+	state.normals.resize(hasNormals ? vertexCount : 0);
+	parallelFor(vertexCount, [&](unsigned int begin, unsigned int end) {
+		for (unsigned int i = begin; i < end; ++i) {
+			state.clip[i] = osg::Vec4f(vertices[i], 1.0f) * modelViewProjection;
+			state.positions[i] = vertices[i] * modelView;
+			if (hasNormals) {
+				state.normals[i] = osg::Matrixf::transform3x3(normalMatrix, (*normals)[i]);
+			}
+		}
+		});
+
+	// binning, chunks of consecutive triangles into their own lists
+	const unsigned int chunks = std::max(1u, std::thread::hardware_concurrency());
+	const int tiles = m_tilesX * m_tilesY;
+	m_bins.resize(chunks);
+	for (auto& bins : m_bins) {
+		bins.resize(tiles);
+		for (auto& bin : bins) {
+			bin.clear();
+		}
+	}
+	parallelFor(chunks, [&](unsigned int chunkBegin, unsigned int chunkEnd) {
+		ClipVertex polygon[CLIP_POLYGON_SIZE];
+		osg::Vec4f clip[3];
+		for (unsigned int chunk = chunkBegin; chunk < chunkEnd; ++chunk) {
+			auto& bins = m_bins[chunk];
+			unsigned int end = static_cast<unsigned int>(static_cast<unsigned long long>(triangles) * (chunk + 1) / chunks);
+			for (unsigned int triangle = static_cast<unsigned int>(static_cast<unsigned long long>(triangles) * chunk / chunks); triangle < end; ++triangle) {
+				for (int corner = 0; corner < 3; ++corner) {
+					clip[corner] = state.clip[state.vertexIndex(triangle, corner)];
+				}
+				if (isOutside(clip)) {
+					continue;
+				}
+				int count = clipTriangle(clip, polygon);
+				if (count == 0) {
+					continue;
+				}
+				float minX = FLT_MAX, minY = FLT_MAX, maxX = -FLT_MAX, maxY = -FLT_MAX;
+				for (int i = 0; i < count; ++i) {
+					float invW = 1.0f / polygon[i].position.w();
+					float x = (polygon[i].position.x() * invW * 0.5f + 0.5f) * m_width;
+					float y = (polygon[i].position.y() * invW * 0.5f + 0.5f) * m_height;
+					minX = std::min(minX, x);
+					maxX = std::max(maxX, x);
+					minY = std::min(minY, y);
+					maxY = std::max(maxY, y);
+				}
+				int tx0 = std::max(static_cast<int>(std::floor(minX)), 0) / SOFTWARE_RASTER_TILE;
+				int ty0 = std::max(static_cast<int>(std::floor(minY)), 0) / SOFTWARE_RASTER_TILE;
+				int tx1 = std::min(static_cast<int>(std::ceil(std::min(maxX, static_cast<float>(m_width)))), m_width - 1) / SOFTWARE_RASTER_TILE;
+				int ty1 = std::min(static_cast<int>(std::ceil(std::min(maxY, static_cast<float>(m_height)))), m_height - 1) / SOFTWARE_RASTER_TILE;
+				if (maxX < 0.0f || maxY < 0.0f || minX >= m_width || minY >= m_height) {
+					continue;
+				}
+				for (int ty = ty0; ty <= ty1; ++ty) {
+					for (int tx = tx0; tx <= tx1; ++tx) {
+						bins[ty * m_tilesX + tx].push_back(triangle);
+					}
+				}
+			}
+		}
+		});
+
+	// tiles are taken by whichever thread is free
+	std::atomic<int> nextTile(0);
+	parallelFor(chunks, [&](unsigned int, unsigned int) {
+		for (int tile = nextTile++; tile < tiles; tile = nextTile++) {
+			rasterizeTile(state, tile);
+		}
+		});
+}
+
+void SoftwareRasterizer::rasterizeTile(const DrawState& state, int tile)
+{
+	const int x0 = (tile % m_tilesX) * SOFTWARE_RASTER_TILE;
+	const int y0 = (tile / m_tilesX) * SOFTWARE_RASTER_TILE;
+	const int x1 = std::min(x0 + SOFTWARE_RASTER_TILE, m_width);
+	const int y1 = std::min(y0 + SOFTWARE_RASTER_TILE, m_height);
+
+	// nearest triangle of this draw per pixel and its barycentrics, shaded once all are in
+	unsigned int ids[SOFTWARE_RASTER_TILE * SOFTWARE_RASTER_TILE];
+	float barycentrics[SOFTWARE_RASTER_TILE * SOFTWARE_RASTER_TILE][2];
+	std::fill(ids, ids + SOFTWARE_RASTER_TILE * SOFTWARE_RASTER_TILE, NO_TRIANGLE);
+	bool covered = false;
+
+	ClipVertex polygon[CLIP_POLYGON_SIZE];
+	osg::Vec4f clip[3];
+	double sx[CLIP_POLYGON_SIZE], sy[CLIP_POLYGON_SIZE];
+	float sz[CLIP_POLYGON_SIZE], invW[CLIP_POLYGON_SIZE];
+	for (const auto& bins : m_bins) {
+		for (unsigned int triangle : bins[tile]) {
+			for (int corner = 0; corner < 3; ++corner) {
+				clip[corner] = state.clip[state.vertexIndex(triangle, corner)];
+			}
+			int count = clipTriangle(clip, polygon);
+			for (int i = 0; i < count; ++i) {
+				invW[i] = 1.0f / polygon[i].position.w();
+				sx[i] = snap((polygon[i].position.x() * invW[i] * 0.5f + 0.5f) * m_width);
+				sy[i] = snap((polygon[i].position.y() * invW[i] * 0.5f + 0.5f) * m_height);
+				sz[i] = polygon[i].position.z() * invW[i] * 0.5f + 0.5f;
+			}
+
+			// the polygon as a fan
+			for (int fan = 1; fan + 1 < count; ++fan) {
+				int v[3] = { 0, fan, fan + 1 };
+				double area = (sx[v[1]] - sx[v[0]]) * (sy[v[2]] - sy[v[0]]) - (sy[v[1]] - sy[v[0]]) * (sx[v[2]] - sx[v[0]]);
+				if (area == 0.0) {
+					continue;
+				}
+				// both windings are drawn, counter clockwise from here on
+				if (area < 0.0) {
+					std::swap(v[1], v[2]);
+					area = -area;
+				}
+				int minX = std::max(x0, static_cast<int>(std::floor(std::min(std::min(sx[v[0]], sx[v[1]]), sx[v[2]]))));
+				int maxX = std::min(x1 - 1, static_cast<int>(std::ceil(std::max(std::max(sx[v[0]], sx[v[1]]), sx[v[2]]))));
+				int minY = std::max(y0, static_cast<int>(std::floor(std::min(std::min(sy[v[0]], sy[v[1]]), sy[v[2]]))));
+				int maxY = std::min(y1 - 1, static_cast<int>(std::ceil(std::max(std::max(sy[v[0]], sy[v[1]]), sy[v[2]]))));
+				if (minX > maxX || minY > maxY) {
+					continue;
+				}
+
+				// edge k is opposite vertex k, positive inside. on the snapped coordinates the edge
+				// functions are exact in double, pixel centres exactly on an edge belong to its top or
+				// left triangle only, so shared edges are drawn once without gaps
+				double a[3], b[3], ex[3], ey[3];
+				bool topLeft[3];
+				for (int k = 0; k < 3; ++k) {
+					int from = v[(k + 1) % 3], to = v[(k + 2) % 3];
+					a[k] = -(sy[to] - sy[from]);
+					b[k] = sx[to] - sx[from];
+					ex[k] = sx[from];
+					ey[k] = sy[from];
+					topLeft[k] = a[k] > 0.0 || (a[k] == 0.0 && b[k] < 0.0);
+				}
+				const double invArea = 1.0 / area;
+				float z[3], w[3];
+				for (int k = 0; k < 3; ++k) {
+					z[k] = sz[v[k]];
+					w[k] = invW[v[k]];
+				}
+
+				// the nearest pixels of a group of up to four, lanes set in mask
+				auto store = [&](int x, int y, const float* lambda0, const float* lambda1, const float* lambda2, int mask) {
+					for (int lane = 0; lane < 4; ++lane) {
+						if (!(mask & (1 << lane))) {
+							continue;
+						}
+						float depth = lambda0[lane] * z[0] + lambda1[lane] * z[1] + lambda2[lane] * z[2];
+						size_t pixel = static_cast<size_t>(y) * m_width + x + lane;
+						if (!(depth < m_depth[pixel])) {
+							continue;
+						}
+						m_depth[pixel] = depth;
+						// perspective correct, back to the source triangle
+						float q0 = lambda0[lane] * w[0], q1 = lambda1[lane] * w[1], q2 = lambda2[lane] * w[2];
+						float invSum = 1.0f / (q0 + q1 + q2);
+						osg::Vec3f barycentric = (polygon[v[0]].barycentric * q0 + polygon[v[1]].barycentric * q1 + polygon[v[2]].barycentric * q2) * invSum;
+						int local = (y - y0) * SOFTWARE_RASTER_TILE + (x + lane - x0);
+						ids[local] = triangle;
+						barycentrics[local][0] = barycentric.y();
+						barycentrics[local][1] = barycentric.z();
+						covered = true;
+					}
+				};
+
+				alignas(16) float lambda[3][4];
+				for (int y = minY; y <= maxY; ++y) {
+					const double py = y + 0.5;
+					double rowStart[3];
+					for (int k = 0; k < 3; ++k) {
+						rowStart[k] = a[k] * (minX + 0.5 - ex[k]) + b[k] * (py - ey[k]);
+					}
+					for (int x = minX; x <= maxX; x += 4) {
+#ifdef SOFTWARE_RASTER_SSE
+						// four pixels as two pairs of doubles
+						const __m128d zero = _mm_setzero_pd();
+						const __m128d last = _mm_set1_pd(static_cast<double>(maxX - minX));
+						__m128d dxLow = _mm_add_pd(_mm_set1_pd(static_cast<double>(x - minX)), _mm_setr_pd(0.0, 1.0));
+						__m128d dxHigh = _mm_add_pd(dxLow, _mm_set1_pd(2.0));
+						__m128d insideLow = _mm_cmple_pd(dxLow, last);
+						__m128d insideHigh = _mm_cmple_pd(dxHigh, last);
+						__m128 l[3];
+						for (int k = 0; k < 3; ++k) {
+							__m128d start = _mm_set1_pd(rowStart[k]), step = _mm_set1_pd(a[k]);
+							__m128d eLow = _mm_add_pd(start, _mm_mul_pd(step, dxLow));
+							__m128d eHigh = _mm_add_pd(start, _mm_mul_pd(step, dxHigh));
+							__m128d edgeLow = _mm_cmpgt_pd(eLow, zero);
+							__m128d edgeHigh = _mm_cmpgt_pd(eHigh, zero);
+							if (topLeft[k]) {
+								edgeLow = _mm_or_pd(edgeLow, _mm_cmpeq_pd(eLow, zero));
+								edgeHigh = _mm_or_pd(edgeHigh, _mm_cmpeq_pd(eHigh, zero));
+							}
+							insideLow = _mm_and_pd(insideLow, edgeLow);
+							insideHigh = _mm_and_pd(insideHigh, edgeHigh);
+							__m128d scale = _mm_set1_pd(invArea);
+							l[k] = _mm_movelh_ps(_mm_cvtpd_ps(_mm_mul_pd(eLow, scale)), _mm_cvtpd_ps(_mm_mul_pd(eHigh, scale)));
+						}
+						int mask = _mm_movemask_pd(insideLow) | (_mm_movemask_pd(insideHigh) << 2);
+						if (mask == 0) {
+							continue;
+						}
+						for (int k = 0; k < 3; ++k) {
+							_mm_store_ps(lambda[k], l[k]);
+						}
+#else
+						int mask = 0;
+						for (int lane = 0; lane < 4; ++lane) {
+							double dx = static_cast<double>(x - minX + lane);
+							bool inside = x + lane <= maxX;
+							for (int k = 0; k < 3; ++k) {
+								double e = rowStart[k] + a[k] * dx;
+								inside = inside && (e > 0.0 || (e == 0.0 && topLeft[k]));
+								lambda[k][lane] = static_cast<float>(e * invArea);
+							}
+							mask |= inside ? 1 << lane : 0;
+						}
+						if (mask == 0) {
+							continue;
+						}
+#endif
+						store(x, y, lambda[0], lambda[1], lambda[2], mask);
+					}
+				}
+			}
+		}
+	}
+	if (!covered) {
+		return;
+	}
+
+	// PreviewMaterial shading of the visible pixels
+	const bool hasNormals = !state.normals.empty();
+	for (int y = y0; y < y1; ++y) {
+		for (int x = x0; x < x1; ++x) {
+			int local = (y - y0) * SOFTWARE_RASTER_TILE + (x - x0);
+			unsigned int triangle = ids[local];
+			if (triangle == NO_TRIANGLE) {
+				continue;
+			}
+			unsigned int i0 = state.vertexIndex(triangle, 0), i1 = state.vertexIndex(triangle, 1), i2 = state.vertexIndex(triangle, 2);
+			float c1 = barycentrics[local][0], c2 = barycentrics[local][1], c0 = 1.0f - c1 - c2;
+			osg::Vec3f position = state.positions[i0] * c0 + state.positions[i1] * c1 + state.positions[i2] * c2;
+			osg::Vec3f normal;
+			if (hasNormals) {
+				normal = state.normals[i0] * c0 + state.normals[i1] * c1 + state.normals[i2] * c2;
+			}
+			else {
+				// the face's, towards the eye
+				normal = (state.positions[i1] - state.positions[i0]) ^ (state.positions[i2] - state.positions[i0]);
+				if (normal * position > 0.0f) {
+					normal = -normal;
+				}
+			}
+			normal.normalize();
+			osg::Vec3f viewDir = -position;
+			viewDir.normalize();
+			osg::Vec3f reflectDir = -s_previewLightDir + normal * (2.0f * (normal * s_previewLightDir));
+			float spec = std::pow(std::max(viewDir * reflectDir, 0.0f), 32.0f);
+			float strength = s_ambientStrength + s_diffuseStrength * std::max(normal * s_previewLightDir, 0.0f) + s_specularStrength * spec;
+
+			unsigned char* rgba = &m_color[(static_cast<size_t>(y) * m_width + x) * 4];
+			for (int channel = 0; channel < 3; ++channel) {
+				rgba[channel] = static_cast<unsigned char>(std::min(state.baseColor[channel] * strength, 1.0f) * 255.0f + 0.5f);
+			}
+			rgba[3] = 255;
+		}
+	}
+}
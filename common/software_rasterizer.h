@@ -0,0 +1,63 @@
+#pragma once
+
+#include "common_export.h"
+#include "model_data.h"
+#include <osg/Camera>
+#include <osg/Image>
+#include <osg/Matrixd>
+#include <vector>
+
+// pixels per side of the screen tiles triangles are binned into
+#define SOFTWARE_RASTER_TILE 64
+
+// renders ModelData on the CPU, no GL context involved. shading follows the PreviewMaterial mode of
+// the mesh shaders: a head light along the view direction, ambient, diffuse and specular of 0.5.
+// every draw transforms the vertices on all cores, bins the triangles into the screen tiles they
+// overlap, then rasterizes whole tiles in parallel with edge functions evaluated four pixels at a
+// time (SSE2 where available). window coordinates are snapped to subpixels and the edge functions
+// are exact, so meshes have no gaps or double pixels along shared edges. a tile first keeps the
+// nearest triangle per pixel and shades each pixel once afterwards. one thread owns a tile and
+// walks its triangles in submission order, so the output is the same for any thread count.
+// like GL, rows are stored bottom up and depth is the window depth in [0, 1]
+class COMMON_EXPORT SoftwareRasterizer
+{
+public:
+	SoftwareRasterizer(int width, int height);
+	~SoftwareRasterizer();
+
+	int getWidth() const { return m_width; }
+	int getHeight() const { return m_height; }
+
+	void setCamera(const osg::Matrixd& view, const osg::Matrixd& projection);
+	// the view and projection of a camera, e.g. the main view's
+	void setCamera(const osg::Camera* camera);
+
+	void clear(const osg::Vec4& color, float depth = 1.0f);
+	// triangles of the data, drawn with baseColor like the uniform of the mesh program
+	void draw(const ModelData& data, const osg::Matrixd& model, const osg::Vec3f& baseColor = osg::Vec3f(0.5f, 0.5f, 0.5f));
+
+	// RGBA8
+	const std::vector<unsigned char>& getColor() const { return m_color; }
+	const std::vector<float>& getDepth() const { return m_depth; }
+	// a copy of the colour buffer
+	osg::ref_ptr<osg::Image> createImage() const;
+
+protected:
+	SoftwareRasterizer(const SoftwareRasterizer&) = delete;
+	SoftwareRasterizer& operator=(const SoftwareRasterizer&) = delete;
+
+	struct DrawState;
+	void rasterizeTile(const DrawState& state, int tile);
+
+	int m_width;
+	int m_height;
+	int m_tilesX;
+	int m_tilesY;
+	osg::Matrixd m_view;
+	osg::Matrixd m_projection;
+
+	std::vector<unsigned char> m_color;
+	std::vector<float> m_depth;
+	// triangles overlapping each tile, one list per binning thread so they stay in order
+	std::vector<std::vector<std::vector<unsigned int>>> m_bins;
+};
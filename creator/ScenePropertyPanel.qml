@@ -58,6 +58,93 @@ ScrollView {
             }
         }
 
+        Rectangle {
+            color: "green"
+            width: parent.width
+            height: 18
+            border.width: 1
+            border.color: "black"
+            Text {
+                text: qsTr("enableDepthPrePass")
+            }
+
+            Switch {
+                width: 50
+                height: parent.height
+                anchors.right: parent.right
+                checkable: true
+                checked: false
+                onCheckedChanged: {
+                    $Interface.enableDepthPrePass(checked);
+                }
+            }
+        }
+
+        Rectangle {
+            color: "green"
+            width: parent.width
+            height: 18
+            border.width: 1
+            border.color: "black"
+            Text {
+                text: qsTr("enableInstancing")
+            }
+
+            Switch {
+                width: 50
+                height: parent.height
+                anchors.right: parent.right
+                checkable: true
+                checked: false
+                onCheckedChanged: {
+                    console.log("switch enableInstancing")
+                    $Interface.enableInstancing(checked);
+                }
+            }
+        }
+
+        Rectangle {
+            color: "green"
+            width: parent.width
+            height: 18
+            border.width: 1
+            border.color: "black"
+            Text {
+                text: qsTr("enableBatching")
+            }
+
+            Switch {
+                width: 50
+                height: parent.height
+                anchors.right: parent.right
+                checkable: true
+                checked: false
+                onCheckedChanged: {
+                    console.log("switch enableBatching")
+                    $Interface.enableBatching(checked);
+                }
+            }
+        }
+
+        Button {
+            background: Rectangle {
+                color: "lightgrey"
+                border.width: 1
+                border.color: "black"
+            }
+
+            width: parent.width
+            height: 18
+
+            Text {
+                text: qsTr("batchStaticNodes")
+            }
+
+            onClicked: {
+                $Interface.batchStaticNodes();
+            }
+        }
+
         Button {
             background: Rectangle {
                 color: "lightgrey"
@@ -97,6 +184,28 @@ ScrollView {
             }
         }
 
+        Rectangle {
+            color: "green"
+            width: parent.width
+            height: 18
+            border.width: 1
+            border.color: "black"
+            Text {
+                text: qsTr("enableIdPicking")
+            }
+
+            Switch {
+                width: 50
+                height: parent.height
+                anchors.right: parent.right
+                checkable: true
+                checked: false
+                onCheckedChanged: {
+                    $Interface.enableIdPicking(checked);
+                }
+            }
+        }
+
         Button {
             background: Rectangle {
                 color: parent.checked ? "green" : "grey"
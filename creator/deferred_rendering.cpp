@@ -1,5 +1,13 @@
 #include "deferred_rendering.h"
+#include "lights.h"
+#include "render_graph.h"
 #include <render_info.h>
+#include <shader_manager.h>
+#include <osg/ColorMask>
+#include <osg/Depth>
+#include <osg/Geode>
+#include <osgUtil/CullVisitor>
+#include <algorithm>
 
 osg::Texture2D* createTexture(int width, int height)
 {
@@ -11,45 +19,45 @@ osg::Texture2D* createTexture(int width, int height)
 	return texture;
 }
 
-osg::Texture2D* createDepthTexture(int width, int height)
+osg::Texture2D* createTexture(int width, int height, GLint internalFormat, GLenum sourceFormat, GLenum sourceType)
 {
 	osg::Texture2D* texture = new osg::Texture2D;
 	texture->setTextureSize(width, height);
-	texture->setInternalFormat(GL_DEPTH_COMPONENT32F);
-	texture->setSourceFormat(GL_DEPTH_COMPONENT);
-	texture->setSourceType(GL_FLOAT);
-	texture->setFilter(osg::Texture::FilterParameter::MIN_FILTER, osg::Texture::FilterMode::LINEAR);
+	texture->setInternalFormat(internalFormat);
+	texture->setSourceFormat(sourceFormat);
+	texture->setSourceType(sourceType);
+	texture->setFilter(osg::Texture::FilterParameter::MIN_FILTER, osg::Texture::FilterMode::NEAREST);
 	texture->setFilter(osg::Texture::FilterParameter::MAG_FILTER, osg::Texture::FilterMode::NEAREST);
+	texture->setWrap(osg::Texture::WRAP_S, osg::Texture::CLAMP_TO_EDGE);
+	texture->setWrap(osg::Texture::WRAP_T, osg::Texture::CLAMP_TO_EDGE);
 	return texture;
 }
 
-osg::TextureCubeMap* createCubeMapColorTexture(int width, int height)
+osg::Texture2D* createDepthTexture(int width, int height)
 {
-	osg::TextureCubeMap* texture = new osg::TextureCubeMap;
+	osg::Texture2D* texture = new osg::Texture2D;
 	texture->setTextureSize(width, height);
-	texture->setInternalFormat(GL_RGBA32F_ARB);
-	texture->setSourceFormat(GL_RGBA);
+	texture->setInternalFormat(GL_DEPTH_COMPONENT32F);
+	texture->setSourceFormat(GL_DEPTH_COMPONENT);
 	texture->setSourceType(GL_FLOAT);
 	texture->setFilter(osg::Texture::FilterParameter::MIN_FILTER, osg::Texture::FilterMode::LINEAR);
 	texture->setFilter(osg::Texture::FilterParameter::MAG_FILTER, osg::Texture::FilterMode::NEAREST);
-	texture->setWrap(osg::Texture::WRAP_S, osg::Texture::CLAMP_TO_EDGE);
-	texture->setWrap(osg::Texture::WRAP_T, osg::Texture::CLAMP_TO_EDGE);
-	texture->setWrap(osg::Texture::WRAP_R, osg::Texture::CLAMP_TO_EDGE);
 	return texture;
 }
 
-osg::TextureCubeMap* createCubeMapDepthTexture(int width, int height)
+osg::Texture2DArray* createDepthTextureArray(int width, int height, int layers)
 {
-	osg::TextureCubeMap* texture = new osg::TextureCubeMap;
-	texture->setTextureSize(width, height);
+	osg::Texture2DArray* texture = new osg::Texture2DArray;
+	texture->setTextureSize(width, height, layers);
 	texture->setInternalFormat(GL_DEPTH_COMPONENT32F);
 	texture->setSourceFormat(GL_DEPTH_COMPONENT);
 	texture->setSourceType(GL_FLOAT);
 	texture->setFilter(osg::Texture::FilterParameter::MIN_FILTER, osg::Texture::FilterMode::LINEAR);
 	texture->setFilter(osg::Texture::FilterParameter::MAG_FILTER, osg::Texture::FilterMode::NEAREST);
-	texture->setWrap(osg::Texture::WRAP_S, osg::Texture::CLAMP_TO_EDGE);
-	texture->setWrap(osg::Texture::WRAP_T, osg::Texture::CLAMP_TO_EDGE);
-	texture->setWrap(osg::Texture::WRAP_R, osg::Texture::CLAMP_TO_EDGE);
+	// outside of a cascade counts as lit
+	texture->setWrap(osg::Texture::WRAP_S, osg::Texture::CLAMP_TO_BORDER);
+	texture->setWrap(osg::Texture::WRAP_T, osg::Texture::CLAMP_TO_BORDER);
+	texture->setBorderColor(osg::Vec4d(1.0, 1.0, 1.0, 1.0));
 	return texture;
 }
 
@@ -96,7 +104,58 @@ osg::Camera* createRTTCamera(int width, int height)
 	return camera;
 }
 
-osg::Geometry* createRectForTexture(osg::Texture2D* baseColorTexture, osg::Texture2D* normalTexture, osg::Texture2D* depthTexture)
+class DeferredPassCullCallback : public osg::NodeCallback
+{
+public:
+	DeferredPassCullCallback(osg::Camera* gBufferCamera, RenderGraph* graph, osg::Uniform* projectionInverse) :
+		m_gBufferCamera(gBufferCamera),
+		m_graph(graph),
+		m_projectionInverse(projectionInverse)
+	{}
+
+	virtual void operator()(osg::Node* node, osg::NodeVisitor* nv) override {
+		auto cv = nv->asCullVisitor();
+		osg::Camera* mainCamera = cv != nullptr ? cv->getCurrentCamera() : nullptr;
+		if (mainCamera == nullptr || mainCamera->getViewport() == nullptr) {
+			traverse(node, nv);
+			return;
+		}
+
+		const osg::Viewport* viewport = mainCamera->getViewport();
+		m_graph->resize(static_cast<int>(viewport->width()), static_cast<int>(viewport->height()));
+
+		// the main camera computes near/far after this, so the G-buffer fits its own range to the models
+		osg::Matrix viewMatrix = mainCamera->getViewMatrix();
+		osg::Matrix projection = mainCamera->getProjectionMatrix();
+		const osg::BoundingSphere& bs = m_gBufferCamera->getChild(0)->getBound();
+		double fovy, aspect, zNear, zFar;
+		if (bs.valid() && projection.getPerspective(fovy, aspect, zNear, zFar)) {
+			double distance = -(bs.center() * viewMatrix).z();
+			zFar = std::max(distance + bs.radius(), 1.0);
+			zNear = std::max(distance - bs.radius(), zFar * 0.0005);
+			projection.makePerspective(fovy, aspect, zNear, zFar);
+		}
+		m_gBufferCamera->setViewMatrix(viewMatrix);
+		m_gBufferCamera->setProjectionMatrix(projection);
+		m_projectionInverse->set(osg::Matrixf::inverse(projection));
+
+		traverse(node, nv);
+
+		// the models are only drawn into the G-buffer, keep them inside the main camera's depth range
+		if (bs.valid()) {
+			osg::BoundingBox bb;
+			bb.expandBy(bs);
+			cv->updateCalculatedNearFar(*cv->getModelViewMatrix(), bb);
+		}
+	}
+
+private:
+	osg::ref_ptr<osg::Camera> m_gBufferCamera;
+	osg::ref_ptr<RenderGraph> m_graph;
+	osg::ref_ptr<osg::Uniform> m_projectionInverse;
+};
+
+static osg::Geometry* createLightingQuad()
 {
 	osg::Geometry* geometry = new osg::Geometry;
 	geometry->setUseDisplayList(false);
@@ -116,94 +175,91 @@ osg::Geometry* createRectForTexture(osg::Texture2D* baseColorTexture, osg::Textu
 
 	geometry->setVertexAttribArray(0, vArray, osg::Array::BIND_PER_VERTEX);
 	geometry->setVertexAttribArray(1, uvArray, osg::Array::BIND_PER_VERTEX);
+	geometry->addPrimitiveSet(new osg::DrawArrays(GL_TRIANGLE_STRIP, 0, vArray->getNumElements()));
+	geometry->setCullingActive(false);
+
+	// no bound, so the quad doesn't pull the main camera's near plane to the origin
+	class NoBoundCallback : public osg::Drawable::ComputeBoundingBoxCallback
+	{
+	public:
+		virtual osg::BoundingBox computeBound(const osg::Drawable&) const override {
+			return osg::BoundingBox();
+		}
+	};
+	geometry->setComputeBoundingBoxCallback(new NoBoundCallback);
+	return geometry;
+}
 
-	geometry->getOrCreateStateSet()->setTextureAttributeAndModes(0, baseColorTexture, osg::StateAttribute::ON);
-	osg::Uniform* baseColorTexUniform = new osg::Uniform(osg::Uniform::SAMPLER_2D, "baseColorTex");
-	baseColorTexUniform->set(0);
-	geometry->getOrCreateStateSet()->addUniform(baseColorTexUniform);
+osg::Group* createDepthPrePass(osgViewer::View* view)
+{
+	osg::Switch* modelGroup = ViewInfo::getModelGroup(view);
 
-	geometry->getOrCreateStateSet()->setTextureAttributeAndModes(1, normalTexture, osg::StateAttribute::ON);
-	osg::Uniform* normalTexUniform = new osg::Uniform(osg::Uniform::SAMPLER_2D, "normalTex");
-	normalTexUniform->set(1);
-	geometry->getOrCreateStateSet()->addUniform(normalTexUniform);
+	osg::Group* depthPass = new osg::Group;
+	osg::StateSet* depthState = depthPass->getOrCreateStateSet();
+	depthState->setAttributeAndModes(createShadowProgram(), osg::StateAttribute::ON | osg::StateAttribute::OVERRIDE);
+	// instanced and batched geodes switch these on in their own state set
+	depthState->addUniform(new osg::Uniform("useInstancing", false));
+	depthState->addUniform(new osg::Uniform("useMultiDraw", false));
+	depthState->setAttributeAndModes(new osg::ColorMask(false, false, false, false), osg::StateAttribute::ON | osg::StateAttribute::OVERRIDE);
+	depthState->setAttributeAndModes(new osg::Depth(osg::Depth::LESS, 0, 1, true), osg::StateAttribute::ON | osg::StateAttribute::OVERRIDE);
+	depthState->setRenderBinDetails(-2, "RenderBin");
+	depthPass->addChild(modelGroup);
 
-	geometry->getOrCreateStateSet()->setTextureAttributeAndModes(2, depthTexture, osg::StateAttribute::ON);
-	osg::Uniform* depthTexUniform = new osg::Uniform(osg::Uniform::SAMPLER_2D, "depthTex");
-	depthTexUniform->set(2);
-	geometry->getOrCreateStateSet()->addUniform(depthTexUniform);
+	osg::Group* colorPass = new osg::Group;
+	colorPass->getOrCreateStateSet()->setAttributeAndModes(new osg::Depth(osg::Depth::EQUAL, 0, 1, false), osg::StateAttribute::ON | osg::StateAttribute::OVERRIDE);
+	colorPass->addChild(modelGroup);
 
-	geometry->setCullingActive(false);
-	geometry->getOrCreateStateSet()->setMode(GL_DEPTH_TEST, osg::StateAttribute::OFF);
-	geometry->addPrimitiveSet(new osg::DrawArrays(GL_TRIANGLE_STRIP, 0, vArray->getNumElements()));
+	osg::Group* pass = new osg::Group;
+	pass->setName("depthPrePass");
+	pass->addChild(depthPass);
+	pass->addChild(colorPass);
+	return pass;
+}
 
+osg::Group* createDeferredPass(osgViewer::View* view, RenderGraph* graph)
+{
+	const osg::Viewport* viewport = view->getCamera()->getViewport();
+	int width = static_cast<int>(viewport->width());
+	int height = static_cast<int>(viewport->height());
 
-	const char* vs = R"(
-#version 330 core
-layout(location = 0) in vec4 vPosition;
-layout(location = 1) in vec2 vUV;
+	graph->resize(width, height);
 
-out vec2 uv;
+	osg::Camera* camera = createRTTCamera(width, height);
+	camera->setReferenceFrame(osg::Camera::ABSOLUTE_RF);
+	camera->setComputeNearFarMode(osg::CullSettings::DO_NOT_COMPUTE_NEAR_FAR);
+	camera->addChild(ViewInfo::getModelGroup(view));
+	// 4 + 4 + 2 + 4 bytes per pixel
+	int gBuffer = graph->addPass("gBuffer", camera);
+	graph->write(gBuffer, "albedo", { GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE });
+	graph->write(gBuffer, "normal", { GL_RG16, GL_RG, GL_UNSIGNED_SHORT });
+	graph->write(gBuffer, "material", { GL_R16UI, GL_RED_INTEGER, GL_UNSIGNED_SHORT });
+	graph->write(gBuffer, "depth", { GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT });
 
-void main()
-{
-	gl_Position = vPosition;
-	uv = vUV;
-}
-)";
-	const char* fs = R"(
-#version 330 core
-uniform sampler2D baseColorTex;
-uniform sampler2D normalTex;
-uniform sampler2D depthTex;
-uniform mat4 osg_ProjectionMatrix;
-uniform vec4 viewport;
-
-in vec2 uv;
-out vec4 FragColor;
-const vec3 lightDir = vec3(0.0, 0.0, 1.0);
-const vec3 lightColor = vec3(1.0, 1.0, 1.0);
-const float diffStrengh = 0.5;
-const float ambientStrengh = 0.5;
-const float specularStrength = 0.5;
-void main()
-{
-	float depth = texture(depthTex, uv).r;
-	if(depth == 1.0) discard;
-
-	vec4 baseColor = texture(baseColorTex, uv).rgba;
-	vec3 normal = texture(normalTex, uv).rgb;
-	vec4 pos_ndc = vec4((gl_FragCoord.xy - viewport.xy) / viewport.zw * 2.0 - 1.0,
-		depth * 2.0 - 1,
-		1.0);
-	vec4 pos_view_tmp = inverse(osg_ProjectionMatrix) * pos_ndc;
-	vec3 pos_view = pos_view_tmp.xyz /= pos_view_tmp.w;
-
-	// ambient color
-	vec3 ambient = ambientStrengh * lightColor;
-	
-	// diffuse color
-	float diff = max(0.0, dot(normal, lightDir));
-	vec3 diffuse = diff * diffStrengh * lightColor;
-
-	// specular color
-	vec3 viewDir = normalize(-pos_view);
-	vec3 reflectDir = reflect(-lightDir, normal);
-	float spec = pow(max(dot(viewDir, reflectDir), 0.0), 32);
-	vec3 specular = specularStrength * spec * lightColor;
-
-	// final color
-	vec3 resultColor = baseColor.rgb * (ambient + diffuse + specular);
-
-	FragColor = pos_view_tmp;
-	FragColor = vec4(resultColor, baseColor.a);
-	//FragColor = vec4(0.0, 1.0, 0.0, 1.0);
-	gl_FragDepth = depth;
-}
-)";
-	osg::Program* program = new osg::Program;
-	program->setName("deferedLighting");
-	program->addShader(new osg::Shader(osg::Shader::VERTEX, vs));
-	program->addShader(new osg::Shader(osg::Shader::FRAGMENT, fs));
-	geometry->getOrCreateStateSet()->setAttributeAndModes(program, osg::StateAttribute::ON);
-	return geometry;
+	// shares the model group's state, so the shadow maps bound there reach the lighting pass too
+	osg::Geode* lightingQuad = new osg::Geode;
+	lightingQuad->addDrawable(createLightingQuad());
+	lightingQuad->setStateSet(ViewInfo::getModelGroup(view)->getOrCreateStateSet());
+	osg::StateSet* stateSet = lightingQuad->getDrawable(0)->getOrCreateStateSet();
+	stateSet->setAttributeAndModes(ShaderMgr::instance()->getShader(ShaderMgr::s_deferedLightingProgram), osg::StateAttribute::ON);
+	osg::Uniform* projectionInverse = new osg::Uniform("gBufferProjectionInverse", osg::Matrixf());
+	stateSet->addUniform(projectionInverse);
+	// depth is rewritten by the pass, drawn before the rest of the view so helpers test against it
+	stateSet->setAttributeAndModes(new osg::Depth(osg::Depth::ALWAYS), osg::StateAttribute::ON);
+	stateSet->setRenderBinDetails(-1, "RenderBin");
+
+	osg::Group* lighting = new osg::Group;
+	lighting->addChild(lightingQuad);
+	int lightingPass = graph->addPass("lighting", lighting, true);
+	// units 0 and 1 hold the shadow atlas
+	graph->read(lightingPass, "albedo", 2, "gAlbedoTex");
+	graph->read(lightingPass, "normal", 3, "gNormalTex");
+	graph->read(lightingPass, "material", 4, "gMaterialTex");
+	graph->read(lightingPass, "depth", 5, "gDepthTex");
+
+	osg::Group* pass = graph->compile();
+	pass->setName("deferredPass");
+	// the G-buffer is sized and fitted for the main camera during cull
+	pass->setNodeMask(MAIN_VIEW_ONLY_MASK);
+	pass->setCullCallback(new DeferredPassCullCallback(camera, graph, projectionInverse));
+	return pass;
 }
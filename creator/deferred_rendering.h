@@ -2,21 +2,36 @@
 #define DEFERRED_RENDERING_H
 
 #include <osg/Texture2D>
-#include <osg/TextureCubeMap>
+#include <osg/Texture2DArray>
 #include <osg/Camera>
 #include <osg/Geometry>
+#include <osgViewer/View>
+
+class RenderGraph;
 
 extern osg::Texture2D* createTexture(int width, int height);
 
-extern osg::Texture2D* createDepthTexture(int width, int height);
+// render target with nearest filtering, for buffers read back per texel
+extern osg::Texture2D* createTexture(int width, int height, GLint internalFormat, GLenum sourceFormat, GLenum sourceType);
 
-extern osg::TextureCubeMap* createCubeMapColorTexture(int width, int height);
+extern osg::Texture2D* createDepthTexture(int width, int height);
 
-extern osg::TextureCubeMap* createCubeMapDepthTexture(int width, int height);
+extern osg::Texture2DArray* createDepthTextureArray(int width, int height, int layers);
 
 extern osg::Camera* createRTTCamera(int width, int height);
 
-extern osg::Geometry* createRectForTexture(osg::Texture2D* baseColorTexture,
-	osg::Texture2D* normalTexture, osg::Texture2D* depthTexture);
+// depth pre-pass over the view's model group: a depth only pass with the shadow program, then the
+// colour pass with GL_EQUAL and depth writes off, so every pixel is shaded once however deep the
+// overlap. add the returned group to the root in place of the model group, render thread only
+extern osg::Group* createDepthPrePass(osgViewer::View* view);
+
+// deferred shading of the view's model group. a pre-render camera fills a packed G-buffer
+// (RGBA8 albedo, RG16 octahedral normal, R16UI material index, 24 bit depth, position is rebuilt
+// from depth), then a full screen pass shades it with the clustered lights and writes the depth
+// back so the other group still composites. the two passes go through graph, which owns the
+// targets and keeps them at the view's viewport size. the lighting pass reads all four at once, so
+// none of them share a texture.
+// add the returned group to the root in place of the model group, render thread only
+extern osg::Group* createDeferredPass(osgViewer::View* view, RenderGraph* graph);
 
 #endif
\ No newline at end of file
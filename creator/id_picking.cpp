@@ -0,0 +1,284 @@
+#include "id_picking.h"
+#include "deferred_rendering.h"
+#include <render_info.h>
+#include <osg/GLExtensions>
+#include <algorithm>
+#include <climits>
+
+static osg::Program* createIdProgram()
+{
+	const char* vs = R"(
+#version 430 core
+#extension GL_ARB_shader_draw_parameters : require
+layout(location = 0) in vec4 Position;
+uniform mat4 osg_ModelViewProjectionMatrix;
+uniform bool useInstancing;
+uniform bool useMultiDraw;
+uniform int nodeMaterialIndex;
+struct InstanceData {
+	mat4 model;
+	mat4 normal;
+	ivec4 index;
+};
+layout(std430, binding = 1) buffer InstanceBuffer {
+	InstanceData instances[];
+};
+flat out int materialIndex;
+flat out int instanceIndex;
+void main()
+{
+	vec4 localPosition = Position;
+	materialIndex = nodeMaterialIndex;
+	instanceIndex = 0;
+	if (useMultiDraw) {
+		instanceIndex = gl_DrawIDARB;
+	}
+	else if (useInstancing) {
+		instanceIndex = gl_InstanceID;
+	}
+	if (useMultiDraw || useInstancing) {
+		localPosition = instances[instanceIndex].model * Position;
+		materialIndex = instances[instanceIndex].index.x;
+	}
+	gl_Position = osg_ModelViewProjectionMatrix * localPosition;
+}
+)";
+	const char* fs = R"(
+#version 430 core
+flat in int materialIndex;
+flat in int instanceIndex;
+layout(location = 0) out uvec4 pickId;
+void main()
+{
+	pickId = uvec4(uint(materialIndex + 1), uint(gl_PrimitiveID), uint(instanceIndex), 1u);
+}
+)";
+	osg::Program* program = new osg::Program;
+	program->addShader(new osg::Shader(osg::Shader::VERTEX, vs));
+	program->addShader(new osg::Shader(osg::Shader::FRAGMENT, fs));
+	return program;
+}
+
+// on the pass: aims the pick camera before it is culled, its model group is only traversed for a pick
+class IdPickCullCallback : public osg::NodeCallback
+{
+public:
+	IdPickCullCallback(IdPicker* picker) : m_picker(picker) {}
+
+	virtual void operator()(osg::Node* node, osg::NodeVisitor* nv) override {
+		auto cv = nv->asCullVisitor();
+		m_picker->m_drawing = cv != nullptr && m_picker->aim(cv);
+		// the camera is culled either way, its draw callback polls the copy in flight
+		traverse(node, nv);
+		m_picker->m_drawing = false;
+	}
+
+private:
+	IdPicker* m_picker;
+};
+
+// on the pick camera's child, skips the models unless a pick is being drawn
+class IdPickModelsCullCallback : public osg::NodeCallback
+{
+public:
+	IdPickModelsCullCallback(IdPicker* picker) : m_picker(picker) {}
+
+	virtual void operator()(osg::Node* node, osg::NodeVisitor* nv) override {
+		if (m_picker->m_drawing) {
+			traverse(node, nv);
+		}
+	}
+
+private:
+	IdPicker* m_picker;
+};
+
+class IdPickDrawCallback : public osg::Camera::DrawCallback
+{
+public:
+	IdPickDrawCallback(IdPicker* picker) : m_picker(picker) {}
+
+	virtual void operator () (osg::RenderInfo& renderInfo) const override {
+		m_picker->readBack(renderInfo);
+	}
+
+private:
+	IdPicker* m_picker;
+};
+
+IdPicker::IdPicker(osgViewer::View* view) :
+	m_state(Idle),
+	m_drawing(false),
+	m_pbo(0),
+	m_fence(nullptr)
+{
+	m_target = createTexture(ID_PICK_REGION, ID_PICK_REGION, GL_RGBA32UI, GL_RGBA_INTEGER, GL_UNSIGNED_INT);
+
+	m_camera = createRTTCamera(ID_PICK_REGION, ID_PICK_REGION);
+	m_camera->setReferenceFrame(osg::Camera::ABSOLUTE_RF);
+	m_camera->setComputeNearFarMode(osg::CullSettings::DO_NOT_COMPUTE_NEAR_FAR);
+	// 0 is no hit, slots are stored + 1
+	m_camera->setClearColor(osg::Vec4(0.0f, 0.0f, 0.0f, 0.0f));
+	m_camera->attach(osg::Camera::COLOR_BUFFER0, m_target);
+	m_camera->attach(osg::Camera::DEPTH_BUFFER, GL_DEPTH_COMPONENT24);
+	m_camera->setFinalDrawCallback(new IdPickDrawCallback(this));
+	osg::StateSet* stateSet = m_camera->getOrCreateStateSet();
+	stateSet->setAttributeAndModes(createIdProgram(), osg::StateAttribute::ON | osg::StateAttribute::OVERRIDE);
+	// instanced and batched geodes switch these on in their own state set, nodes set their slot
+	stateSet->addUniform(new osg::Uniform("useInstancing", false));
+	stateSet->addUniform(new osg::Uniform("useMultiDraw", false));
+	stateSet->addUniform(new osg::Uniform("nodeMaterialIndex", -1));
+
+	osg::ref_ptr<osg::Group> models = new osg::Group;
+	models->addChild(ViewInfo::getModelGroup(view));
+	models->setCullCallback(new IdPickModelsCullCallback(this));
+	m_camera->addChild(models);
+
+	m_pass = new osg::Group;
+	m_pass->setName("idPickPass");
+	m_pass->setNodeMask(MAIN_VIEW_ONLY_MASK);
+	m_pass->addChild(m_camera);
+	m_pass->setCullCallback(new IdPickCullCallback(this));
+}
+
+IdPicker::~IdPicker()
+{
+
+}
+
+void IdPicker::pick(double x, double y, const Callback& callback)
+{
+	std::lock_guard<std::mutex> locker(m_mutex);
+	m_pending.push_back({ x, y, callback });
+}
+
+bool IdPicker::aim(osgUtil::CullVisitor* cv)
+{
+	osg::Camera* mainCamera = cv->getCurrentCamera();
+	if (mainCamera == nullptr || mainCamera->getViewport() == nullptr) {
+		return false;
+	}
+	{
+		std::lock_guard<std::mutex> locker(m_mutex);
+		if (m_state != Idle || m_pending.empty()) {
+			return false;
+		}
+		m_current = m_pending.front();
+		m_pending.pop_front();
+		m_state = Culled;
+	}
+
+	// near/far fitted to the models like the G-buffer pass, the main camera computes its own later
+	osg::Matrix viewMatrix = mainCamera->getViewMatrix();
+	const osg::BoundingSphere& bs = m_camera->getChild(0)->getBound();
+	double left, right, bottom, top, zNear, zFar;
+	bool perspective = mainCamera->getProjectionMatrix().getFrustum(left, right, bottom, top, zNear, zFar);
+	if (!perspective && !mainCamera->getProjectionMatrix().getOrtho(left, right, bottom, top, zNear, zFar)) {
+		return true;
+	}
+	if (bs.valid()) {
+		double distance = -(bs.center() * viewMatrix).z();
+		double fittedFar = std::max(distance + bs.radius(), 1.0);
+		double fittedNear = perspective ? std::max(distance - bs.radius(), fittedFar * 0.0005) : distance - bs.radius();
+		if (perspective) {
+			// the frustum's sides are given at the near plane
+			double scale = fittedNear / zNear;
+			left *= scale;
+			right *= scale;
+			bottom *= scale;
+			top *= scale;
+		}
+		zNear = fittedNear;
+		zFar = fittedFar;
+	}
+
+	// the ID_PICK_REGION pixels around the cursor
+	const osg::Viewport* viewport = mainCamera->getViewport();
+	double half = ID_PICK_REGION * 0.5;
+	double x0 = (m_current.x - viewport->x() - half) / viewport->width();
+	double x1 = (m_current.x - viewport->x() + half) / viewport->width();
+	double y0 = (m_current.y - viewport->y() - half) / viewport->height();
+	double y1 = (m_current.y - viewport->y() + half) / viewport->height();
+	double width = right - left, height = top - bottom;
+	osg::Matrix projection = perspective ?
+		osg::Matrix::frustum(left + width * x0, left + width * x1, bottom + height * y0, bottom + height * y1, zNear, zFar) :
+		osg::Matrix::ortho(left + width * x0, left + width * x1, bottom + height * y0, bottom + height * y1, zNear, zFar);
+	m_camera->setViewMatrix(viewMatrix);
+	m_camera->setProjectionMatrix(projection);
+	return true;
+}
+
+void IdPicker::readBack(osg::RenderInfo& renderInfo)
+{
+	osg::State* state = renderInfo.getState();
+	osg::GLExtensions* ext = state->get<osg::GLExtensions>();
+	Request done;
+	PickResult result;
+	{
+		std::lock_guard<std::mutex> locker(m_mutex);
+		if (m_state == Culled) {
+			osg::Texture::TextureObject* textureObject = m_target->getTextureObject(state->getContextID());
+			if (textureObject == nullptr) {
+				m_state = Idle;
+				m_pending.push_front(m_current);
+				return;
+			}
+			if (m_pbo == 0) {
+				ext->glGenBuffers(1, &m_pbo);
+				ext->glBindBuffer(GL_PIXEL_PACK_BUFFER_ARB, m_pbo);
+				ext->glBufferData(GL_PIXEL_PACK_BUFFER_ARB, ID_PICK_REGION * ID_PICK_REGION * 4 * sizeof(GLuint), nullptr, GL_STREAM_READ_ARB);
+			}
+			ext->glBindBuffer(GL_PIXEL_PACK_BUFFER_ARB, m_pbo);
+			textureObject->bind();
+			glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA_INTEGER, GL_UNSIGNED_INT, nullptr);
+			state->haveAppliedTextureAttribute(state->getActiveTextureUnit(), osg::StateAttribute::TEXTURE);
+			ext->glBindBuffer(GL_PIXEL_PACK_BUFFER_ARB, 0);
+			m_fence = ext->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			m_state = InFlight;
+			return;
+		}
+		if (m_state != InFlight) {
+			return;
+		}
+		GLenum wait = ext->glClientWaitSync(m_fence, 0, 0);
+		if (wait != GL_ALREADY_SIGNALED && wait != GL_CONDITION_SATISFIED) {
+			return;
+		}
+		ext->glDeleteSync(m_fence);
+		m_fence = nullptr;
+		ext->glBindBuffer(GL_PIXEL_PACK_BUFFER_ARB, m_pbo);
+		auto ids = static_cast<const GLuint*>(ext->glMapBuffer(GL_PIXEL_PACK_BUFFER_ARB, GL_READ_ONLY_ARB));
+		if (ids != nullptr) {
+			result = decode(ids);
+			ext->glUnmapBuffer(GL_PIXEL_PACK_BUFFER_ARB);
+		}
+		ext->glBindBuffer(GL_PIXEL_PACK_BUFFER_ARB, 0);
+		done = m_current;
+		m_current = Request();
+		m_state = Idle;
+	}
+	if (done.callback) {
+		done.callback(result);
+	}
+}
+
+PickResult IdPicker::decode(const GLuint* ids) const
+{
+	PickResult result;
+	int center = ID_PICK_REGION / 2;
+	int nearest = INT_MAX;
+	for (int y = 0; y < ID_PICK_REGION; ++y) {
+		for (int x = 0; x < ID_PICK_REGION; ++x) {
+			const GLuint* id = ids + (y * ID_PICK_REGION + x) * 4;
+			int distance = (x - center) * (x - center) + (y - center) * (y - center);
+			if (id[3] == 0 || distance >= nearest) {
+				continue;
+			}
+			nearest = distance;
+			result.materialIndex = static_cast<int>(id[0]) - 1;
+			result.primitive = static_cast<int>(id[1]);
+			result.instance = static_cast<int>(id[2]);
+		}
+	}
+	return result;
+}
@@ -0,0 +1,74 @@
+#ifndef ID_PICKING_H
+#define ID_PICKING_H
+
+#include <osg/Camera>
+#include <osg/Texture2D>
+#include <osgUtil/CullVisitor>
+#include <osgViewer/View>
+#include <deque>
+#include <functional>
+#include <mutex>
+
+// pixels per side of the region drawn and read back around the cursor
+#define ID_PICK_REGION 5
+
+struct PickResult
+{
+	int materialIndex = -1;		// material slot of the picked node, every node owns one. -1: nothing hit
+	int primitive = -1;			// triangle within the node's geometry or batch draw
+	int instance = -1;			// instance of an instanced mesh or draw of a batch, 0 otherwise
+};
+
+// GPU picking of the view's model group. a pick draws only the ID_PICK_REGION square around the
+// cursor (a sub-frustum of the main camera) into an RGBA32UI target holding material slot + 1,
+// gl_PrimitiveID and the instance or draw index, then copies it into a pixel buffer object.
+// the result is mapped once its fence has signalled, a frame or two later, so the cost doesn't
+// depend on the scene's triangle count and the draw never stalls. all methods on the render thread
+class IdPicker : public osg::Referenced
+{
+public:
+	typedef std::function<void(const PickResult&)> Callback;
+
+	IdPicker(osgViewer::View* view);
+
+	// add to the view's root
+	osg::Node* getPass() { return m_pass.get(); }
+
+	// window coordinates of the view, callback runs on the render thread with the hit nearest to them
+	void pick(double x, double y, const Callback& callback);
+
+protected:
+	~IdPicker();
+
+	struct Request {
+		double x;
+		double y;
+		Callback callback;
+	};
+
+	// takes the next request and aims the pick camera at it, false when there is nothing to draw
+	bool aim(osgUtil::CullVisitor* cv);
+	// after the pick camera has drawn: starts this frame's copy or maps the one in flight
+	void readBack(osg::RenderInfo& renderInfo);
+	PickResult decode(const GLuint* ids) const;
+
+	osg::ref_ptr<osg::Group> m_pass;
+	osg::ref_ptr<osg::Camera> m_camera;
+	osg::ref_ptr<osg::Texture2D> m_target;
+
+	std::mutex m_mutex;
+	std::deque<Request> m_pending;
+	Request m_current;
+	enum { Idle, Culled, InFlight } m_state;
+	// cull traversal only, set while the pass is culled for a pick
+	bool m_drawing;
+
+	GLuint m_pbo;
+	GLsync m_fence;
+
+	friend class IdPickCullCallback;
+	friend class IdPickModelsCullCallback;
+	friend class IdPickDrawCallback;
+};
+
+#endif
@@ -2,6 +2,7 @@
 #include "deferred_rendering.h"
 #include <drawable.h>
 #include <shader_manager.h>
+#include <material_table.h>
 #include <operation.h>
 #include <common/io/read_model_file.h>
 #include <engine/physical/pnode.h>
@@ -17,8 +18,12 @@
 #include <osgManipulator/Translate1DDragger>
 #include <osgManipulator/RotateCylinderDragger>
 #include <osgManipulator/Scale1DDragger>
+#include <random>
 
 #include <QImage>
+#include <QFileInfo>
+#include <QDir>
+#include <QUrl>
 #include <QOpenGLFunctions_4_5_Core>
 #if QT_VERSION > QT_VERSION_CHECK(6, 0, 0)
 #include <QQuickOpenGLUtils>
@@ -71,154 +76,117 @@ void Interface::addMap(const QString& filePath)
 
 }
 
-osg::Geometry* createBillboardRectForTexture(osg::Texture2D* texture)
+void Interface::addBillboard(const QString& filePath)
 {
-	osg::Geometry* geometry = new osg::Geometry;
-	geometry->setUseDisplayList(false);
-	geometry->setUseVertexBufferObjects(true);
-
-	osg::Vec3Array* vArray = new osg::Vec3Array;
-	vArray->push_back(osg::Vec3(0, 0, 0));
-
-	class MyComputeBoundCallback : public osg::Geometry::ComputeBoundingBoxCallback
-	{
-	public:
-		virtual osg::BoundingBox computeBound(const osg::Drawable&) const override {
-			osg::BoundingSphere bs;
-			bs.set(osg::Vec3(0, 0, 0), 3);
-			osg::BoundingBox bb;
-			bb.expandBy(bs);
-			return bb;
-		}
-	};
-	geometry->setComputeBoundingBoxCallback(new MyComputeBoundCallback);
-
-	geometry->setVertexAttribArray(0, vArray, osg::Array::BIND_PER_VERTEX);
-
-	geometry->getOrCreateStateSet()->setTextureAttributeAndModes(0, texture, osg::StateAttribute::ON);
-	osg::Uniform* texUniform = new osg::Uniform(osg::Uniform::SAMPLER_2D, "tex");
-	texUniform->set(0);
-	geometry->getOrCreateStateSet()->addUniform(texUniform);
-
-	geometry->setCullingActive(false);
-	geometry->addPrimitiveSet(new osg::DrawArrays(GL_POINTS, 0, vArray->getNumElements()));
+	osg::ref_ptr<BillboardMesh> billboards = getBillboardMesh();
+	m_renderInfo->addOperation(new LambdaOperation([billboards]() {
+		billboards->addBillboard(osg::Vec3(), 1.0f);
+		}));
+}
 
-	class MyDrawCallback : public osg::Drawable::DrawCallback
-	{
-	public:
-		virtual void drawImplementation(osg::RenderInfo& renderInfo, const osg::Drawable* drawable) const override {
-			auto camera = renderInfo.getCurrentCamera();
-			osg::Matrixf vp = camera->getViewMatrix() * camera->getProjectionMatrix();
-			auto view = dynamic_cast<osgViewer::View*>(renderInfo.getView());
-			auto cm = dynamic_cast<osgGA::OrbitManipulator*>(view->getCameraManipulator());
-			osg::Vec3d eye;
-			osg::Quat rotation;
-			cm->getTransformation(eye, rotation);
-
-			osg::StateSet* ss = const_cast<osg::StateSet*>(drawable->getStateSet());
-			ss->getUniform("vp")->set(vp);
-			ss->getUniform("cameraPos")->set(osg::Vec3(eye));
+void Interface::scatterBillboards(int count, double radius)
+{
+	if (count <= 0) {
+		return;
+	}
+	// uniform over the disk, generated here so the render thread only copies
+	std::vector<osg::Vec3> positions(count);
+	std::mt19937 random(std::random_device{}());
+	std::uniform_real_distribution<double> unit(0.0, 1.0);
+	for (auto& position : positions) {
+		double r = radius * std::sqrt(unit(random));
+		double angle = 2.0 * osg::PI * unit(random);
+		position.set(r * std::cos(angle), r * std::sin(angle), 0.0);
+	}
 
-			drawable->drawImplementation(renderInfo);
+	osg::ref_ptr<BillboardMesh> billboards = getBillboardMesh();
+	m_renderInfo->addOperation(new LambdaOperation([billboards, positions]() {
+		billboards->reserve(billboards->getNumBillboards() + positions.size());
+		for (const auto& position : positions) {
+			billboards->addBillboard(position, 1.0f);
 		}
-	};
-	osg::Uniform* vpUniform = new osg::Uniform("vp", osg::Matrixf());
-	osg::Uniform* cameraPosUniform = new osg::Uniform("cameraPos", osg::Vec3f());
-	geometry->getOrCreateStateSet()->addUniform(vpUniform);
-	geometry->getOrCreateStateSet()->addUniform(cameraPosUniform);
-	geometry->setDrawCallback(new MyDrawCallback);
-
-
-	const char* vs = R"(
-#version 330 core
-layout(location = 0) in vec3 vPosition;
+		}));
+}
 
-void main()
+BillboardMesh* Interface::getBillboardMesh()
 {
-	gl_Position = vec4(vPosition, 1.0);
+	if (!m_billboardMesh.valid()) {
+		osg::Image* image = osgDB::readImageFile("C:/Users/Administrator/Desktop/NewFolder/osgcmaketest/res/image/tree.png");
+		m_billboardMesh = new BillboardMesh(image ? new osg::Texture2D(image) : nullptr);
+		// outside the model group, sprites cast no shadow and skip the G-buffer
+		osg::ref_ptr<osg::Geode> geode = m_billboardMesh->getGeode();
+		auto view = m_renderInfo->m_mainView;
+		m_renderInfo->addOperationAfterCompile(geode, new LambdaOperation([geode, view]() {
+			ViewInfo::getOtherGroup(view)->addChild(geode);
+			}));
+	}
+	return m_billboardMesh;
 }
-)";
-	const char* gs = R"(
-#version 330 core
-
-layout(points) in; 
-layout(triangle_strip) out;                                                                                                                           
-layout(max_vertices = 4) out;  
-
-uniform mat4 vp;
-uniform vec3 cameraPos;
 
-out vec2 texCoord;
-
-void main()
+void Interface::enableInstancing(bool enable)
 {
-	vec3 pos = gl_in[0].gl_Position.xyz;
-	vec3 cameraToPos = normalize(pos - cameraPos);
-	vec3 up = vec3(0.0, 0.0, 1.0);
-	vec3 right = cross(up, cameraToPos);
-
-	// bottom left
-	gl_Position = vp * vec4(pos, 1.0);
-	texCoord = vec2(0.0, 0.0);
-	EmitVertex();	
-
-	// top left
-	pos.z += 1;
-	gl_Position = vp * vec4(pos, 1.0);
-	texCoord = vec2(0.0, 1.0);
-	EmitVertex();
-
-	// bottom right
-	pos.z -= 1;
-	pos += right;
-	gl_Position = vp * vec4(pos, 1.0);
-	texCoord = vec2(1.0, 0.0);
-	EmitVertex();
-
-	// top right
-	pos.z += 1;
-	gl_Position = vp * vec4(pos, 1.0);
-	texCoord = vec2(1.0, 1.0);
-	EmitVertex();
-
-	EndPrimitive();
+	m_bInstancingEnabled = enable;
 }
-)";
-
-	const char* fs = R"(
-#version 330 core
-uniform sampler2D colorMap;                                                        
-                                                                                    
-in vec2 texCoord;                                                                   
-out vec4 FragColor;  
 
-void main()
+void Interface::enableBatching(bool enable)
 {
-	FragColor = texture2D(colorMap, texCoord); 
-}
-)";
-	osg::Program* program = new osg::Program;
-	program->addShader(new osg::Shader(osg::Shader::VERTEX, vs));
-	program->addShader(new osg::Shader(osg::Shader::GEOMETRY, gs));
-	program->addShader(new osg::Shader(osg::Shader::FRAGMENT, fs));
-	geometry->getOrCreateStateSet()->setAttributeAndModes(program, osg::StateAttribute::ON);
-	return geometry;
+	m_bBatchingEnabled = enable;
 }
 
-void Interface::addBillboard(const QString& filePath)
+// the tree is built on the thread pool right after import, a query before it is done waits for it
+static std::shared_ptr<MeshBVH> createMeshBVH(const ModelData& data)
 {
-	osg::Image* image = osgDB::readImageFile("C:/Users/Administrator/Desktop/NewFolder/osgcmaketest/res/image/tree.png");
-	osg::Texture2D* tex = new osg::Texture2D(image);
-	auto geom = createBillboardRectForTexture(tex);
-
-	Node* node = createObject<Node>();
-	node->setObjectName("tree");
-	node->addGeometry(geom);
-	node->addToScene();
+	auto bvh = std::make_shared<MeshBVH>(data);
+	QThreadPool::globalInstance()->start([bvh]() {
+		bvh->build();
+		});
+	return bvh;
 }
 
 void Interface::addModel(const QString& filePath)
 {
+	if (m_bInstancingEnabled) {
+		auto finder = m_instancedModels.find(filePath);
+		if (finder == m_instancedModels.end()) {
+			ReadModelFile modelFile(filePath);
+			modelFile.read();
+
+			InstancedModel model;
+			model.m_data = modelFile.getModelData();
+			model.m_name = modelFile.getModelFileName();
+			Mesh mesh;
+			mesh.setModelData(model.m_data);
+			auto geom = mesh.createGeometry();
+			model.m_bb = geom->getBoundingBox();
+			model.m_mesh = new InstancedMesh(geom, ShaderMgr::instance()->getShader(ShaderMgr::s_instancedMeshProgram));
+			model.m_bvh = createMeshBVH(model.m_data);
+
+			osg::ref_ptr<osg::Geode> geode = model.m_mesh->getGeode();
+			auto view = m_renderInfo->m_mainView;
+			m_renderInfo->addOperationAfterCompile(geode, new LambdaOperation([geode, view]() {
+				ViewInfo::getModelGroup(view)->addChild(geode);
+				}));
+			finder = m_instancedModels.insert(filePath, model);
+		}
+		const InstancedModel& model = finder.value();
+
+		Node* node = createObject<Node>();
+		node->setObjectName(model.m_name);
+		node->setInstancedMesh(model.m_mesh);
+		node->setMeshBVH(model.m_bvh);
+		node->setMaterial({
+			osg::Vec3(0.5, 0.5, 0.5),
+			osg::Vec3(0.5, 0.5, 0.5),
+			osg::Vec3(0.5, 0.5, 0.5),
+			32.0f
+			});
+		node->addToScene();
+		attachPhysicalObject(node, model.m_data, model.m_bb);
+
+		addNode(node);
+		return;
+	}
+
 	ReadModelFile modelFile(filePath);
 	modelFile.read();
 
@@ -227,6 +195,33 @@ void Interface::addModel(const QString& filePath)
 	mesh.setModelData(data);
 	auto geom = mesh.createGeometry();
 
+	if (m_bBatchingEnabled) {
+		if (!m_batchedMesh.valid()) {
+			m_batchedMesh = new BatchedMesh(ShaderMgr::instance()->getShader(ShaderMgr::s_batchedMeshProgram));
+			osg::ref_ptr<osg::Geode> geode = m_batchedMesh->getGeode();
+			auto view = m_renderInfo->m_mainView;
+			m_renderInfo->addOperationAfterCompile(geode, new LambdaOperation([geode, view]() {
+				ViewInfo::getModelGroup(view)->addChild(geode);
+				}));
+		}
+
+		Node* node = createObject<Node>();
+		node->setObjectName(modelFile.getModelFileName());
+		node->setBatchedMesh(m_batchedMesh, data);
+		node->setMeshBVH(createMeshBVH(data));
+		node->setMaterial({
+			osg::Vec3(0.5, 0.5, 0.5),
+			osg::Vec3(0.5, 0.5, 0.5),
+			osg::Vec3(0.5, 0.5, 0.5),
+			32.0f
+			});
+		node->addToScene();
+		attachPhysicalObject(node, data, geom->getBoundingBox());
+
+		addNode(node);
+		return;
+	}
+
 	class TestDrawCallback : public osg::Drawable::DrawCallback
 	{
 	public:
@@ -257,6 +252,7 @@ void Interface::addModel(const QString& filePath)
 	Node* node = createObject<Node>();
 	node->setObjectName(modelFile.getModelFileName());
 	node->addGeometry(geom);
+	node->setMeshBVH(createMeshBVH(data));
 	node->setMaterial({
 		osg::Vec3(0.5, 0.5, 0.5),
 		osg::Vec3(0.5, 0.5, 0.5),
@@ -265,11 +261,45 @@ void Interface::addModel(const QString& filePath)
 		});
 
 	node->addToScene();
+	attachPhysicalObject(node, data, geom->getBoundingBox());
+
+	addNode(node);
+}
+
+void Interface::addNode(Node* node)
+{
+	m_nodes.push_back(QSharedPointer<Node>(node));
+	m_nodesByMaterial.insert(node->getMaterialIndex(), node);
+	emit nodeAdded(node);
+}
+
+void Interface::intersectNodes(const osg::Vec3d& start, const osg::Vec3d& end)
+{
+	Node* nearest = nullptr;
+	MeshHit nearestHit;
+	nearestHit.t = 1.0f;
+	for (const auto& node : m_nodes) {
+		const std::shared_ptr<MeshBVH>& bvh = node->getMeshBVH();
+		if (!bvh || !node->isVisible()) {
+			continue;
+		}
+		// the segment's parameter is the same in the node's local space
+		osg::Matrixd inverse = osg::Matrixd::inverse(node->getMatrix());
+		MeshHit hit;
+		if (bvh->intersectSegment(start * inverse, end * inverse, hit) && hit.t < nearestHit.t) {
+			nearest = node.get();
+			nearestHit = hit;
+		}
+	}
+	qDebug() << "intersect node:" << nearest << "triangle:" << nearestHit.triangle << "ratio:" << nearestHit.t;
+	emit nodePicked(nearest, nearest ? static_cast<int>(nearestHit.triangle) : -1, nearest ? 0 : -1);
+}
 
+void Interface::attachPhysicalObject(Node* node, const ModelData& data, const osg::BoundingBox& osgBB)
+{
 	std::shared_ptr<Physical::Mesh> pmesh(new Physical::Mesh);
 	pmesh->m_pVec3 = data.m_vertexArray->asVector().data();
 	pmesh->m_numPoints = data.m_vertexArray->getNumElements();
-	const auto& osgBB = geom->getBoundingBox();
 	pmesh->m_box.m_min = osgBB._min;// = Physical::Box(osgBB._min, osgBB._max);
 	pmesh->m_box.m_max = osgBB._max;// = Physical::Box(osgBB._min, osgBB._max);
 	qDebug() << "model's bound sphere:" << osgBB.center() << osgBB.radius();
@@ -284,9 +314,6 @@ void Interface::addModel(const QString& filePath)
 		phyNode->m_collideDetectLevel = Physical::CollideDetectLevel::Primitive;
 	}
 	s_index++;
-
-	m_nodes.push_back(QSharedPointer<Node>(node));
-	emit nodeAdded(node);
 }
 
 osg::Program* createSimpleProgram()
@@ -323,132 +350,30 @@ void main()
 	return program;
 }
 
-osg::Program* createGeomProgram()
-{
-	const char* vs = R"(
-#version 430 core
-layout(location = 0) in vec4 Position;
-layout(location = 1) in vec3 Normal;
-uniform mat4 osg_ModelViewProjectionMatrix;
-uniform mat3 osg_NormalMatrix;
-
-out VS_OUT {
-	vec3 vNormal;
-} vs_out;
-
-void main()
-{
-	gl_Position = osg_ModelViewProjectionMatrix * Position;
-	vs_out.vNormal = osg_NormalMatrix * Normal;
-}
-)";
-	const char* gs = R"(
-#version 430 core
-layout(triangles) in;
-layout(triangle_strip, max_vertices = 3) out;
-
-in VS_OUT {
-	vec3 vNormal;
-} gs_in[];
-
-out vec3 vNormal;
-
-void main() {
-	vNormal = gs_in[0].vNormal;
-	gl_Position = gl_in[0].gl_Position;
-	EmitVertex();
-
-	vNormal = gs_in[1].vNormal;
-	gl_Position = gl_in[1].gl_Position;
-	EmitVertex();
-
-	vNormal = gs_in[2].vNormal;
-	gl_Position = gl_in[2].gl_Position;
-	EmitVertex();
-
-	EndPrimitive();
-}
-)";
-
-	const char* fs = R"(
-#version 430 core
-in vec3 vNormal;
-out vec4 FragColor;
-void main()
-{
-	vec3 lightColor = vec3(1.0, 0.5, 0.5) * (0.3 + dot(vNormal, vec3(0, 0, 1)));
-	FragColor = vec4(lightColor, 1.0);
-}
-)";
-	osg::Program* program = new osg::Program;
-	program->addShader(new osg::Shader(osg::Shader::VERTEX, vs));
-	program->addShader(new osg::Shader(osg::Shader::GEOMETRY, gs));
-	program->addShader(new osg::Shader(osg::Shader::FRAGMENT, fs));
-	return program;
-}
-
 void Interface::addCustomized()
 {
-	osg::Geometry* geom = new osg::Geometry;
-	geom->setUseDisplayList(false);
-	geom->setUseVertexBufferObjects(true);
-
-	osg::Vec3Array* vArray = new osg::Vec3Array;
-	osg::Vec3Array* nArray = new osg::Vec3Array;
-	int width = 4500;
-	int height = 3000;
-	int depth = 1;
-	for (int z = 0; z < depth; ++z) {
-
-		osg::ref_ptr<osg::Vec3Array> tmpVArray = new osg::Vec3Array;
-		const auto& vecTmpV = tmpVArray->asVector();
-
-		for (int j = 0; j < height; ++j) {
-			for (int i = 0; i < width; ++i) {
-				osg::Vec3 pos(i, j, z);
-				tmpVArray->push_back(pos);
-			}
-		}
-
-		for (int j = 0; j < (height - 1); ++j) {
-			for (int i = 0; i < (width - 1); ++i) {
-				vArray->push_back(vecTmpV[j * width + i]);
-				vArray->push_back(vecTmpV[j * width + (i + 1)]);
-				vArray->push_back(vecTmpV[(j + 1) * width + i]);
-
-				vArray->push_back(vecTmpV[(j + 1) * width + i]);
-				vArray->push_back(vecTmpV[j * width + (i + 1)]);
-				vArray->push_back(vecTmpV[(j + 1) * width + (i + 1)]);
-
-				nArray->push_back(osg::Vec3(0, 0, 1));
-				nArray->push_back(osg::Vec3(0, 0, 1));
-				nArray->push_back(osg::Vec3(0, 0, 1));
-				nArray->push_back(osg::Vec3(0, 0, 1));
-				nArray->push_back(osg::Vec3(0, 0, 1));
-				nArray->push_back(osg::Vec3(0, 0, 1));
-			}
-		}
-
+	if (m_terrain.valid()) {
+		return;
 	}
-	geom->setVertexAttribArray(0, vArray, osg::Array::BIND_PER_VERTEX);
-	geom->setVertexAttribArray(1, nArray, osg::Array::BIND_PER_VERTEX);
-	geom->addPrimitiveSet(new osg::DrawArrays(GL_TRIANGLES, 0, vArray->getNumElements()));
-
-	//geom->getOrCreateStateSet()->setAttributeAndModes(createSimpleProgram());
-	geom->getOrCreateStateSet()->setAttributeAndModes(createGeomProgram());
-	//geom->getOrCreateStateSet()->setAttributeAndModes(
-	//	new osg::PolygonMode(osg::PolygonMode::Face::BACK, osg::PolygonMode::Mode::LINE));
 	auto view = m_renderInfo->m_mainView;
-	m_renderInfo->addOperation(new LambdaOperation([view, geom]() {
-		auto modelGroup = ViewInfo::getModelGroup(view);
-		modelGroup->addChild(geom);
+	m_terrain = new Terrain(4500, 3000, 1.0f, Terrain::createDefaultHeightFunc(200.0f),
+		ShaderMgr::instance()->getShader(ShaderMgr::s_terrainProgram));
+	int materialIndex = ViewInfo::getMaterialTable(view)->allocate();
+	m_terrain->setMaterialIndex(materialIndex);
+
+	// outside the model group so the shadow and G-buffer passes, which expect vertex arrays, skip it.
+	// it still shares the model group's state for the lights and shadow maps
+	osg::ref_ptr<osg::Group> root = m_terrain->getRoot();
+	m_renderInfo->addOperationAfterCompile(root, new LambdaOperation([view, root, materialIndex]() {
+		ViewInfo::getMaterialTable(view)->set(materialIndex, MaterialTable::defaultMaterial());
+		root->setStateSet(ViewInfo::getModelGroup(view)->getOrCreateStateSet());
+		ViewInfo::getOtherGroup(view)->addChild(root);
 		view->home();
 
 		auto cm = dynamic_cast<osgGA::OrbitManipulator*>(view->getCameraManipulator());
 		cm->setRotation(osg::Quat(osg::PI_2f, osg::X_AXIS));
 		cm->setRotation(osg::Quat());
 		}));
-
 }
 
 void Interface::setCameraFollowNode(Node* node)
@@ -463,6 +388,45 @@ static osg::Vec3d s_defaultFrontDir = osg::Vec3d(0.0, -1.0, 0.0);
 static osg::Vec3d s_defaultLeftDir = osg::Vec3d(1.0, 0.0, 0.0);
 static osg::Vec3d s_defaultUpDir = osg::Vec3d(0.0, 0.0, 1.0);
 
+// vertices, normals and triangles of a node's own geometry as built by Mesh::createGeometry
+static bool getModelData(osg::Geometry* geometry, ModelData& data)
+{
+	if (geometry == nullptr || geometry->getNumPrimitiveSets() == 0) {
+		return false;
+	}
+	data.m_vertexArray = dynamic_cast<osg::Vec3Array*>(geometry->getVertexAttribArray(Drawable::Vertex));
+	data.m_normalArray = dynamic_cast<osg::Vec3Array*>(geometry->getVertexAttribArray(Drawable::Normal));
+	osg::PrimitiveSet* primitiveSet = geometry->getPrimitiveSet(0);
+	data.m_drawElement = dynamic_cast<osg::DrawElementsUInt*>(primitiveSet);
+	if (!data.m_vertexArray.valid() || primitiveSet->getMode() != GL_TRIANGLES) {
+		return false;
+	}
+	return data.m_drawElement.valid() || primitiveSet->getType() == osg::PrimitiveSet::DrawArraysPrimitiveType;
+}
+
+void Interface::batchStaticNodes()
+{
+	for (auto& node : m_nodes) {
+		if (node->isInstanced() || node->isBatched() || node->isStaticBatched() || node->isGravityEnabled()) {
+			continue;
+		}
+		ModelData data;
+		if (!getModelData(node->getGeometry(), data)) {
+			continue;
+		}
+		if (!m_staticBatch.valid()) {
+			m_staticBatch = new BatchedMesh(ShaderMgr::instance()->getShader(ShaderMgr::s_batchedMeshProgram));
+			osg::ref_ptr<osg::Geode> geode = m_staticBatch->getGeode();
+			auto view = m_renderInfo->m_mainView;
+			// queued ahead of the nodes, the batch shows up in the same update that hides them
+			m_renderInfo->addOperation(new LambdaOperation([geode, view]() {
+				ViewInfo::getModelGroup(view)->addChild(geode);
+				}));
+		}
+		node->addToStaticBatch(m_staticBatch, data);
+	}
+}
+
 void Interface::enableManipulate(Node* node)
 {
 	class ManipulateNodeEventHandler : public osgGA::GUIEventHandler
@@ -577,6 +541,7 @@ void Interface::enableManipulate(Node* node)
 		std::shared_ptr<Physical::PhysicalEngine> m_phyEngine;
 	};
 
+	node->removeFromStaticBatch();
 	auto mt = node->getMatrixTransform();
 	auto phyNode = node->getPhysicalObject();
 	auto phyEngine = m_physicalEngine;
@@ -639,68 +604,92 @@ osg::Geode* createZUnitAxisWithArrow(const osg::Vec4& color, bool useLineForCyli
 }
 
 
+static void removeHolder(osgViewer::View* view, osg::Group* holder)
+{
+	if (holder != nullptr) {
+		ViewInfo::getRoot(view)->removeChild(holder);
+		holder->removeChildren(0, holder->getNumChildren());
+	}
+}
+
+// puts the model group back at the front of the root for forward rendering, wrapped in the
+// depth pre-pass when one is given
+static void insertForwardModelGroup(osgViewer::View* view, osg::Group* depthPrePass)
+{
+	osg::ref_ptr<osg::Switch> modelGroup = ViewInfo::getModelGroup(view);
+	auto root = ViewInfo::getRoot(view);
+	// the shadow and picking cameras keep their own reference to the model group
+	root->removeChild(modelGroup);
+	if (depthPrePass != nullptr) {
+		removeHolder(view, depthPrePass);
+		depthPrePass->addChild(createDepthPrePass(view));
+		root->insertChild(0, depthPrePass);
+	}
+	else {
+		root->insertChild(0, modelGroup);
+	}
+}
+
 void Interface::setDeferredRendering()
 {
+	if (m_deferredPass.valid()) {
+		return;
+	}
 	auto view = m_renderInfo->m_mainView;
 	std::vector<osg::ref_ptr<osg::Geometry>> geoms;
 	for (auto node : m_nodes) {
+		// instanced and batched geometry keeps its own program
+		if (node->isInstanced() || node->isBatched()) {
+			continue;
+		}
 		geoms.push_back(node->getGeometry());
 	}
 
-	m_renderInfo->addOperation(new LambdaOperation([view, geoms]() {
-		osg::Camera* viewCamera = view->getCamera();
-		osg::Viewport* viewport = viewCamera->getViewport();
-
-		osg::ref_ptr<osg::Camera> camera = createRTTCamera(viewport->width(), viewport->height());
-		osg::ref_ptr<osg::Texture2D> baseColorTex = createTexture(viewport->width(), viewport->height());
-		osg::ref_ptr<osg::Texture2D> normalTex = createTexture(viewport->width(), viewport->height());
-		osg::ref_ptr<osg::Texture2D> posTex = createTexture(viewport->width(), viewport->height());
-		osg::ref_ptr<osg::Texture2D> testTex = createTexture(viewport->width(), viewport->height());
-		osg::ref_ptr<osg::Texture2D> depthTex = createDepthTexture(viewport->width(), viewport->height());
-		camera->attach(osg::Camera::BufferComponent::COLOR_BUFFER0, baseColorTex);
-		camera->attach(osg::Camera::BufferComponent::COLOR_BUFFER1, normalTex);
-		camera->attach(osg::Camera::BufferComponent::COLOR_BUFFER2, posTex);
-		camera->attach(osg::Camera::BufferComponent::COLOR_BUFFER3, testTex);
-		camera->attach(osg::Camera::BufferComponent::DEPTH_BUFFER, depthTex);
-
-		osg::Geometry* rectGeometry = createRectForTexture(baseColorTex, normalTex, depthTex);
-
+	m_deferredPass = new osg::Group;
+	m_renderGraph = new RenderGraph;
+	osg::ref_ptr<osg::Group> holder = m_deferredPass;
+	osg::ref_ptr<RenderGraph> graph = m_renderGraph;
+	osg::ref_ptr<osg::Group> depthPrePass = m_depthPrePass;
+	m_renderInfo->addOperation(new LambdaOperation([view, geoms, holder, graph, depthPrePass]() {
 		osg::ref_ptr<osg::Switch> modelGroup = ViewInfo::getModelGroup(view);
 		auto root = ViewInfo::getRoot(view);
+		// the G-buffer pass has no overdraw worth a pre-pass
+		removeHolder(view, depthPrePass.get());
 		root->removeChild(modelGroup);
-
-		camera->addChild(modelGroup);
-		root->addChild(camera);
-		root->addChild(rectGeometry);
+		holder->addChild(createDeferredPass(view, graph.get()));
+		root->insertChild(0, holder);
 
 		auto deferedProgram = ShaderMgr::instance()->getShader(ShaderMgr::s_deferedMeshProgram);
 		for (auto& geom : geoms) {
 			geom->getOrCreateStateSet()->setAttributeAndModes(deferedProgram, osg::StateAttribute::ON);
 		}
-
 		}));
 
 }
 
 void Interface::setForwardRendering()
 {
+	if (!m_deferredPass.valid()) {
+		return;
+	}
 	auto view = m_renderInfo->m_mainView;
 	std::vector<osg::ref_ptr<osg::Geometry>> geoms;
 	for (auto node : m_nodes) {
+		// instanced and batched geometry keeps its own program
+		if (node->isInstanced() || node->isBatched()) {
+			continue;
+		}
 		geoms.push_back(node->getGeometry());
 	}
 
-	m_renderInfo->addOperation(new LambdaOperation([view, geoms]() {
-		osg::Camera* viewCamera = view->getCamera();
-		osg::Viewport* viewport = viewCamera->getViewport();
-
-		osg::ref_ptr<osg::Switch> modelGroup = ViewInfo::getModelGroup(view);
-		auto root = ViewInfo::getRoot(view);
-
-		while (root->getNumChildren() > 0) {
-			root->removeChild(0, 1);
-		}
-		root->addChild(modelGroup);
+	osg::ref_ptr<osg::Group> holder = m_deferredPass;
+	osg::ref_ptr<osg::Group> depthPrePass = m_depthPrePass;
+	m_deferredPass = nullptr;
+	m_renderGraph = nullptr;
+	m_renderInfo->addOperation(new LambdaOperation([view, geoms, holder, depthPrePass]() {
+		// the G-buffer targets are released with the pass
+		removeHolder(view, holder.get());
+		insertForwardModelGroup(view, depthPrePass.get());
 
 		auto program = ShaderMgr::instance()->getShader(ShaderMgr::s_meshProgram);
 		for (auto& geom : geoms) {
@@ -710,6 +699,40 @@ void Interface::setForwardRendering()
 	
 }
 
+QVariantMap Interface::getRenderGraphStats() const
+{
+	QVariantMap stats;
+	if (m_renderGraph.valid()) {
+		RenderGraph::Stats s = m_renderGraph->getStats();
+		stats["passes"] = s.passes;
+		stats["culled"] = s.culled;
+		stats["resources"] = s.resources;
+		stats["textures"] = s.textures;
+		stats["bytes"] = static_cast<qulonglong>(s.bytes);
+		stats["unaliasedBytes"] = static_cast<qulonglong>(s.unaliasedBytes);
+	}
+	return stats;
+}
+
+void Interface::enableDepthPrePass(bool enable)
+{
+	if (enable == m_depthPrePass.valid()) {
+		return;
+	}
+	auto view = m_renderInfo->m_mainView;
+	osg::ref_ptr<osg::Group> oldPrePass = m_depthPrePass;
+	m_depthPrePass = enable ? new osg::Group : nullptr;
+	// deferred rendering keeps it off, the switch back to forward puts it in
+	if (m_deferredPass.valid()) {
+		return;
+	}
+	osg::ref_ptr<osg::Group> depthPrePass = m_depthPrePass;
+	m_renderInfo->addOperation(new LambdaOperation([view, oldPrePass, depthPrePass]() {
+		removeHolder(view, oldPrePass.get());
+		insertForwardModelGroup(view, depthPrePass.get());
+		}));
+}
+
 
 #define VIEW_DATUM_NODE_NAME "viewDatumNode"
 osg::Group* createViewDatumNode()
@@ -774,6 +797,8 @@ void Interface::enableViewDatum()
 		}
 		auto viewDatumNode = createViewDatumNode();
 		viewDatumNode->setName(VIEW_DATUM_NODE_NAME);
+		// its camera follows the main camera's rotation during cull
+		viewDatumNode->setNodeMask(MAIN_VIEW_ONLY_MASK);
 		otherGroup->addChild(viewDatumNode);
 		}));
 }
@@ -783,34 +808,32 @@ void Interface::enableIntersect(bool enable)
 	class IntersectEventHandler : public osgGA::GUIEventHandler
 	{
 	public:
-		virtual bool handle(const osgGA::GUIEventAdapter& ea, osgGA::GUIActionAdapter& aa, osg::Object* obj, osg::NodeVisitor* nv) {
-			if (ea.getEventType() == osgGA::GUIEventAdapter::PUSH) {
-				osgUtil::LineSegmentIntersector* intersector = new osgUtil::LineSegmentIntersector(
-					osgUtil::Intersector::CoordinateFrame::WINDOW, ea.getX(), ea.getY());
-				class MyIntersectionVisitor : public osgUtil::IntersectionVisitor
-				{
-				public:
-					MyIntersectionVisitor(osgUtil::Intersector* intersector = 0, ReadCallback* readCallback = 0):
-						osgUtil::IntersectionVisitor(intersector, readCallback) {}
-					void apply(osg::Camera* camera);
-				};
-				MyIntersectionVisitor iv(intersector);
-				aa.asView()->getCamera()->accept(iv);
-				if (intersector->containsIntersections()) {
-					osgUtil::LineSegmentIntersector::Intersection firstIntersectoin =  intersector->getFirstIntersection();
-					qDebug() << "intersect drawable:" << firstIntersectoin.drawable;
-					qDebug() << "intersect primitiveIndex:" << firstIntersectoin.primitiveIndex;
-				}
+		IntersectEventHandler(Interface* itf) : m_interface(itf) {}
 
+		virtual bool handle(const osgGA::GUIEventAdapter& ea, osgGA::GUIActionAdapter& aa, osg::Object* obj, osg::NodeVisitor* nv) {
+			osg::Camera* camera = aa.asView()->getCamera();
+			if (ea.getEventType() == osgGA::GUIEventAdapter::PUSH && camera->getViewport()) {
+				osg::Matrixd inverseVPW = osg::Matrixd::inverse(camera->getViewMatrix() * camera->getProjectionMatrix() *
+					camera->getViewport()->computeWindowMatrix());
+				osg::Vec3d start = osg::Vec3d(ea.getX(), ea.getY(), 0.0) * inverseVPW;
+				osg::Vec3d end = osg::Vec3d(ea.getX(), ea.getY(), 1.0) * inverseVPW;
+				// the nodes belong to the gui thread
+				Interface* itf = m_interface;
+				QMetaObject::invokeMethod(itf, [itf, start, end]() {
+					itf->intersectNodes(start, end);
+					}, Qt::QueuedConnection);
 			}
 
 			return false;
 		}
+
+	protected:
+		Interface* m_interface;
 	};
 	auto view = m_renderInfo->m_mainView;
-	m_renderInfo->addOperation(new LambdaOperation([enable, view]() {
+	m_renderInfo->addOperation(new LambdaOperation([this, enable, view]() {
 		if (enable) {
-			view->addEventHandler(new IntersectEventHandler);
+			view->addEventHandler(new IntersectEventHandler(this));
 		}
 		else {
 			const auto handlers = view->getEventHandlers();
@@ -824,6 +847,102 @@ void Interface::enableIntersect(bool enable)
 		}));
 }
 
+void Interface::enableIdPicking(bool enable)
+{
+	class IdPickEventHandler : public osgGA::GUIEventHandler
+	{
+	public:
+		IdPickEventHandler(IdPicker* picker, const IdPicker::Callback& callback) : m_picker(picker), m_callback(callback) {}
+
+		virtual bool handle(const osgGA::GUIEventAdapter& ea, osgGA::GUIActionAdapter& aa, osg::Object* obj, osg::NodeVisitor* nv) {
+			if (ea.getEventType() == osgGA::GUIEventAdapter::PUSH && ea.getButton() == osgGA::GUIEventAdapter::LEFT_MOUSE_BUTTON) {
+				m_picker->pick(ea.getX(), ea.getY(), m_callback);
+			}
+			return false;
+		}
+
+	protected:
+		osg::ref_ptr<IdPicker> m_picker;
+		IdPicker::Callback m_callback;
+	};
+
+	auto view = m_renderInfo->m_mainView;
+	if (!m_idPicker.valid()) {
+		m_idPicker = new IdPicker(view);
+		osg::ref_ptr<osg::Node> pass = m_idPicker->getPass();
+		m_renderInfo->addOperation(new LambdaOperation([view, pass]() {
+			ViewInfo::getRoot(view)->addChild(pass);
+			}));
+	}
+
+	// results arrive on the render thread, the node is looked up on this one
+	IdPicker::Callback callback = [this](const PickResult& result) {
+		QMetaObject::invokeMethod(this, [this, result]() {
+			Node* node = result.materialIndex >= 0 ? m_nodesByMaterial.value(result.materialIndex, nullptr) : nullptr;
+			qDebug() << "picked node:" << node << "triangle:" << result.primitive << "instance:" << result.instance;
+			emit nodePicked(node, result.primitive, result.instance);
+			}, Qt::QueuedConnection);
+	};
+	osg::ref_ptr<IdPicker> picker = m_idPicker;
+	m_renderInfo->addOperation(new LambdaOperation([enable, view, picker, callback]() {
+		const auto handlers = view->getEventHandlers();
+		for (auto& handler : handlers) {
+			auto pickHandler = dynamic_cast<IdPickEventHandler*>(handler.get());
+			if (pickHandler) {
+				view->removeEventHandler(pickHandler);
+			}
+		}
+		if (enable) {
+			view->addEventHandler(new IdPickEventHandler(picker, callback));
+		}
+		}));
+}
+
+FrameCapture* Interface::getFrameCapture()
+{
+	if (!m_frameCapture.valid()) {
+		m_frameCapture = new FrameCapture(m_renderInfo->m_mainView);
+		osg::ref_ptr<FrameCapture> capture = m_frameCapture;
+		auto view = m_renderInfo->m_mainView;
+		m_renderInfo->addOperation(new LambdaOperation([view, capture]() {
+			capture->attach(view->getCamera());
+			}));
+	}
+	return m_frameCapture.get();
+}
+
+// file dialogs hand over urls
+static QString toLocalPath(const QString& path)
+{
+	QUrl url(path);
+	return url.isLocalFile() ? url.toLocalFile() : path;
+}
+
+void Interface::captureFrame(const QString& filePath, int width, int height)
+{
+	getFrameCapture()->captureFrame(toLocalPath(filePath), width, height, [this](const QString& path, bool saved) {
+		QMetaObject::invokeMethod(this, [this, path, saved]() {
+			qDebug() << "frame captured:" << path << saved;
+			emit frameCaptured(path, saved);
+			}, Qt::QueuedConnection);
+		});
+}
+
+void Interface::captureSequence(const QString& filePattern, int frameCount, int width, int height)
+{
+	QString pattern = toLocalPath(filePattern);
+	if (!pattern.contains("%1")) {
+		QFileInfo info(pattern);
+		QString suffix = info.suffix().isEmpty() ? QString("png") : info.suffix();
+		pattern = info.dir().filePath(info.completeBaseName() + "_%1." + suffix);
+	}
+	getFrameCapture()->captureSequence(pattern, frameCount, width, height, [this](const QString& path, bool saved) {
+		QMetaObject::invokeMethod(this, [this, path, saved]() {
+			emit frameCaptured(path, saved);
+			}, Qt::QueuedConnection);
+		});
+}
+
 osg::Image* convertQImage2OsgImage(const QString& filePath)
 {
 	QImage qImage(filePath);
@@ -1121,9 +1240,33 @@ void Interface::addDirectionalLight()
 	light->addToScene();
 
 	m_lights.push_back(QSharedPointer<Light>(light));
+
+	if (!m_shaderVariant.directionalLights) {
+		m_shaderVariant.directionalLights = true;
+		applyShaderVariant();
+	}
+
 	emit lightAdded(light);
 }
 
+void Interface::setShadowCascadeCount(int count)
+{
+	for (auto& light : m_lights) {
+		auto directionalLight = dynamic_cast<DirectionalLight*>(light.get());
+		if (directionalLight) {
+			directionalLight->setCascadeCount(count);
+		}
+	}
+}
+
+void Interface::setShadowFilter(Object* obj, int filter)
+{
+	auto light = dynamic_cast<Light*>(obj);
+	if (light) {
+		light->setShadowFilter(static_cast<Light::ShadowFilter>(filter));
+	}
+}
+
 void Interface::addPointLight()
 {
 	PointLight* light = createObject<PointLight>();
@@ -1132,6 +1275,12 @@ void Interface::addPointLight()
 	light->addToScene();
 
 	m_lights.push_back(QSharedPointer<Light>(light));
+
+	if (!m_shaderVariant.pointLights) {
+		m_shaderVariant.pointLights = true;
+		applyShaderVariant();
+	}
+
 	emit lightAdded(light);
 }
 
@@ -1143,6 +1292,12 @@ void Interface::addSpotLight()
 	light->addToScene();
 
 	m_lights.push_back(QSharedPointer<Light>(light));
+
+	if (!m_shaderVariant.spotLights) {
+		m_shaderVariant.spotLights = true;
+		applyShaderVariant();
+	}
+
 	emit lightAdded(light);
 }
 
@@ -1301,6 +1456,7 @@ void Interface::enableDrag(Object* obj)
 
 	auto node = dynamic_cast<Node*>(obj);
 	if (node) {
+		node->removeFromStaticBatch();
 		osg::MatrixTransform* mt = node->getMatrixTransform();
 		NodeDragger* nodeDragger = new NodeDragger(mt);
 
@@ -1323,7 +1479,7 @@ void Interface::enableDrag(Object* obj)
 		osg::BoundingBox bb = light->getBoundingBox();
 		osg::BoundingSphere bs;
 		bs.expandBy(bb);
-		osg::Vec3 transCenter = bs.center() * mt->getMatrix();
+		osg::Vec3 transCenter = bs.center() * light->getMatrix();
 		bs.set(transCenter, bs.radius());
 		bb.init();
 		bb.expandBy(bs);
@@ -1369,9 +1525,16 @@ void Interface::enableDrag(Object* obj)
 
 void Interface::setShaderMode(int mode)
 {
-	auto view = m_renderInfo->m_mainView;
-	m_renderInfo->addOperation(new LambdaOperation([mode, view]() {
-		view->getCamera()->getOrCreateStateSet()->getUniform("shaderMode")->set(mode);
+	m_shaderVariant.shadingMode = mode;
+	applyShaderVariant();
+}
+
+void Interface::applyShaderVariant()
+{
+	// the new permutation is compiled in the background, the old one draws until it is ready
+	ShaderVariant variant = m_shaderVariant;
+	m_renderInfo->addOperationAfterCompile(ShaderMgr::instance()->createWarmUpNode(variant), new LambdaOperation([variant]() {
+		ShaderMgr::instance()->setVariant(variant);
 		}));
 }
 
@@ -1383,7 +1546,7 @@ void Interface::showFrustum()
 	if (!m_lights.empty()) {
 		auto directionalLight = dynamic_cast<DirectionalLight*>(m_lights.front().get());
 		if (directionalLight) {
-			auto lightMatrix = directionalLight->getMatrixTransform()->getMatrix();
+			auto lightMatrix = directionalLight->getMatrix();
 			auto rot = lightMatrix.getRotate();
 			lightDir = osg::Vec3d(0.0, 0.0, -1.0) * osg::Matrix::rotate(rot);
 			pos = lightMatrix.getTrans();
@@ -1542,8 +1705,6 @@ void Interface::showFrustum()
 
 void Interface::useShadow(bool bUsed)
 {
-	auto view = m_renderInfo->m_mainView;
-	m_renderInfo->addOperation(new LambdaOperation([bUsed, view]() {
-		view->getCamera()->getOrCreateStateSet()->getUniform("useShadow")->set(bUsed);
-		}));
+	m_shaderVariant.shadow = bUsed;
+	applyShaderVariant();
 }
\ No newline at end of file
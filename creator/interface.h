@@ -9,8 +9,18 @@
 #include <memory>
 
 #include <render_info.h>
+#include <instanced_mesh.h>
+#include <batched_mesh.h>
+#include <billboard_mesh.h>
+#include <terrain.h>
+#include <frame_capture.h>
+#include <shader_manager.h>
+#include <common/model_data.h>
+#include <common/mesh_bvh.h>
 #include "node.h"
 #include "lights.h"
+#include "id_picking.h"
+#include "render_graph.h"
 
 namespace Physical {
 	class PhysicalEngine;
@@ -39,22 +49,46 @@ public:
 	Q_INVOKABLE void addMap(const QString& filePath);
 	Q_INVOKABLE void addModel(const QString& filePath);
 	Q_INVOKABLE void addBillboard(const QString& filePath);
+	// count sprites spread over a disk of radius around the origin, all in one instanced draw
+	Q_INVOKABLE void scatterBillboards(int count, double radius);
 
 	Q_INVOKABLE void addCustomized();
 
+	Q_INVOKABLE void enableInstancing(bool enable);
+	Q_INVOKABLE void enableBatching(bool enable);
+	// merges the nodes drawing their own geometry into one static multi-draw batch
+	Q_INVOKABLE void batchStaticNodes();
+
 	Q_INVOKABLE void setCameraFollowNode(Node* node);
 	Q_INVOKABLE void enableManipulate(Node* node);
 
 	Q_INVOKABLE void enableViewDatum();
 
+	// click picking against the nodes' triangle trees on the CPU, reported by nodePicked
 	Q_INVOKABLE void enableIntersect(bool enable);
+	// click picking through an ID buffer, reported by nodePicked
+	Q_INVOKABLE void enableIdPicking(bool enable);
+
+	// saves the next frame without stalling the view, png or exr by suffix, at width x height
+	// (0: the view's size). reported by frameCaptured
+	Q_INVOKABLE void captureFrame(const QString& filePath, int width = 0, int height = 0);
+	// the next frameCount frames, numbered through %1 in filePattern or appended to its base name
+	Q_INVOKABLE void captureSequence(const QString& filePattern, int frameCount, int width = 0, int height = 0);
 
 	Q_INVOKABLE void setDeferredRendering();
 	Q_INVOKABLE void setForwardRendering();
+	// passes, culled passes, resources and textures of the deferred pass' graph, with the texture
+	// bytes after aliasing and with one texture per resource. empty in forward rendering
+	Q_INVOKABLE QVariantMap getRenderGraphStats() const;
+	// depth only pass before the forward colour pass, fragments are shaded once per pixel
+	Q_INVOKABLE void enableDepthPrePass(bool enable);
 
 	Q_INVOKABLE void addCubeMap();
 
 	Q_INVOKABLE void addDirectionalLight();
+	Q_INVOKABLE void setShadowCascadeCount(int count);
+	// Light::ShadowFilter of one light
+	Q_INVOKABLE void setShadowFilter(Object* obj, int filter);
 	Q_INVOKABLE void addPointLight();
 	Q_INVOKABLE void addSpotLight();
 
@@ -67,12 +101,63 @@ public:
 
 signals:
 	void nodeAdded(Node* node);
+	// node is null when the click hit nothing pickable
+	void nodePicked(Node* node, int triangle, int instance);
+	void frameCaptured(const QString& filePath, bool saved);
 	void lightAdded(Light* light);
 
 protected:
+	void attachPhysicalObject(Node* node, const ModelData& data, const osg::BoundingBox& bb);
+	void addNode(Node* node);
+	// nearest node hit by the world space segment, waits for trees that are still building
+	void intersectNodes(const osg::Vec3d& start, const osg::Vec3d& end);
+	// mesh programs follow the shading mode, the light types in the scene and the shadow switch
+	void applyShaderVariant();
+	// created with the first sprite
+	BillboardMesh* getBillboardMesh();
+	// created and attached to the main camera with the first capture
+	FrameCapture* getFrameCapture();
+
+	// geometry shared by every node imported from the same file while instancing is enabled
+	struct InstancedModel
+	{
+		ModelData m_data;
+		osg::BoundingBox m_bb;
+		QString m_name;
+		osg::ref_ptr<InstancedMesh> m_mesh;
+		std::shared_ptr<MeshBVH> m_bvh;
+	};
+
 	std::shared_ptr<RenderInfo> m_renderInfo;
 	QVector<QSharedPointer<Node>> m_nodes;
+	// picked ids carry the node's material slot
+	QHash<int, Node*> m_nodesByMaterial;
 	QVector<QSharedPointer<Light>> m_lights;
 
+	bool m_bInstancingEnabled = false;
+	QHash<QString, InstancedModel> m_instancedModels;
+
+	// static meshes imported while batching is enabled share one multi-draw batch
+	bool m_bBatchingEnabled = false;
+	osg::ref_ptr<BatchedMesh> m_batchedMesh;
+	// nodes merged by batchStaticNodes, they leave it again once moved
+	osg::ref_ptr<BatchedMesh> m_staticBatch;
+
+	osg::ref_ptr<BillboardMesh> m_billboardMesh;
+	// addCustomized, heightmap chunks with quadtree lod
+	osg::ref_ptr<Terrain> m_terrain;
+
+	// holds the G-buffer pass in place of the model group while deferred rendering is on
+	osg::ref_ptr<osg::Group> m_deferredPass;
+	// built into m_deferredPass, kept for getRenderGraphStats
+	osg::ref_ptr<RenderGraph> m_renderGraph;
+	// holds the depth pre-pass in place of the model group while it is enabled in forward rendering
+	osg::ref_ptr<osg::Group> m_depthPrePass;
+
+	osg::ref_ptr<IdPicker> m_idPicker;
+	osg::ref_ptr<FrameCapture> m_frameCapture;
+
 	std::shared_ptr<Physical::PhysicalEngine> m_physicalEngine;
+
+	ShaderVariant m_shaderVariant;
 };
\ No newline at end of file
@@ -1,11 +1,23 @@
 #include "lights.h"
 #include "deferred_rendering.h"
+#include "shadow_atlas.h"
 #include <operation.h>
+#include <light_clusters.h>
 #include <osg/ShapeDrawable>
 #include <osg/BufferIndexBinding>
 #include <osg/PolygonMode>
+#include <osgUtil/CullVisitor>
+#include <algorithm>
 
-Light::Light(Type type) : m_type(type)
+// keys of the render commands that replace their predecessors still waiting in the queue
+enum LightCommand
+{
+	LightCascadeCountCommand,
+	LightShadowDistanceCommand,
+	LightShadowFilterCommand
+};
+
+Light::Light(Type type) : m_type(type), m_stateSlot(-1), m_shadowFilter(ShadowPCF)
 {
 	m_mt = new osg::MatrixTransform;
 	m_proxyGeode = new osg::Geode;
@@ -24,7 +36,23 @@ void Light::addToScene()
 		}));
 	m_bAddedToScene = true;
 
+	// the shader data follows the front buffer of the scene state, a drag updates it once per frame
+	SceneStateTarget target;
+	target.transform = m_mt;
+	target.light = createLightSync();
+	m_stateSlot = ViewInfo::getSceneState(view)->allocate(target, m_mt->getMatrix(), true);
 	updateShader();
+	if (m_shadowFilter != ShadowPCF) {
+		setShadowFilter(m_shadowFilter);
+	}
+}
+
+osg::Matrix Light::getMatrix() const
+{
+	if (m_stateSlot < 0) {
+		return m_mt->getMatrix();
+	}
+	return ViewInfo::getSceneState(const_cast<Light*>(this)->getRenderInfo()->m_mainView)->getTransform(m_stateSlot);
 }
 
 void Light::setEmissionColor(const osg::Vec3& color)
@@ -52,124 +80,424 @@ int DirectionalLight::s_count = 0;
 //		updateShader();
 //	}
 //}
-class UpdateDirectionalLightCallback : public osg::Camera::DrawCallback
+// directional light parameters live in a float array bound as a uniform buffer on the view camera,
+// point and spot lights in the view's light clusters
+static osg::FloatArray* getLightBufferData(osgViewer::View* view, unsigned int binding)
 {
-public:
-	virtual void operator () (osg::RenderInfo& renderInfo) const override {
-		auto rttCamera = renderInfo.getCurrentCamera();
-		auto view = dynamic_cast<osgViewer::View*>(renderInfo.getView());
-		auto modelGroup = ViewInfo::getModelGroup(view);
-		auto mainCamera = view->getCamera();
+	osg::StateAttribute* sa = view->getCamera()->getOrCreateStateSet()->getAttribute(osg::StateAttribute::UNIFORMBUFFERBINDING, binding);
+	auto uBuffer = dynamic_cast<osg::UniformBufferBinding*>(sa);
+	return dynamic_cast<osg::FloatArray*>(uBuffer->getBufferData());
+}
 
-		osg::Vec3d lightUp = osg::X_AXIS;
-		lightUp = lightUp ^ m_lightDir;
-		lightUp.normalize();
-		osg::Matrix rotMatrix;
-		auto bb = getLightSpaceBoundingBoxOfMainCameraViewFrustum(mainCamera, m_lightDir, lightUp, rotMatrix);
+template<typename T>
+static T* getLightBuffer(osg::FloatArray* bd)
+{
+	return reinterpret_cast<T*>(bd->asVector().data());
+}
 
-		osg::Vec3d bb_diff = bb._max - bb._min;
-		double halfWidth = bb_diff.x() * 0.5;
-		double halfHeight = bb_diff.y() * 0.5;
-		double halfDepth = bb_diff.z() * 0.5;
+// atlas pixel tile to the uv rect sampled by the shaders
+static osg::Vec4 getAtlasRect(const osg::Vec3i& tile)
+{
+	float scale = 1.0f / SHADOW_ATLAS_SIZE;
+	return osg::Vec4(tile.x() * scale, tile.y() * scale, tile.z() * scale, tile.z() * scale);
+}
 
-		osg::Vec3d center = bb.center() * rotMatrix;
-		osg::Vec3d eye = center - m_lightDir * halfDepth * 1.01;
-		osg::Matrix viewMatrix = osg::Matrix::lookAt(eye, center, lightUp);
-		osg::Matrix projMatrix = osg::Matrix::ortho(-halfWidth, halfWidth, -halfHeight, halfHeight, 0, halfDepth * (2 + 0.01));
-		rttCamera->setViewMatrix(viewMatrix);
-		rttCamera->setProjectionMatrix(projMatrix);
+// cull callback of the group holding a light's shadow RTT cameras. the cameras are only traversed, and so
+// only rendered, when the light, a shadow caster, the granted atlas space or (for camera fitted maps)
+// the main camera moved beyond the threshold since the cached map was drawn
+class ShadowCacheCallback : public osg::NodeCallback, public ShadowAtlasClient
+{
+public:
+	ShadowCacheCallback(osg::MatrixTransform* lightMT, osgViewer::View* view, int index, bool followCamera) :
+		m_lightMT(lightMT),
+		m_view(view),
+		m_index(index),
+		m_brightness(1.0f),
+		m_bFollowCamera(followCamera),
+		m_bDirty(true),
+		m_bVariance(false),
+		m_sceneRevision(0),
+		m_numModels(0),
+		m_moveThreshold(0.5),
+		m_angleThreshold(osg::DegreesToRadians(1.0)) {}
+
+	virtual void operator()(osg::Node* node, osg::NodeVisitor* nv) override {
+		auto cv = nv->asCullVisitor();
+		if (cv == nullptr || cv->getCurrentCamera() == nullptr) {
+			traverse(node, nv);
+			return;
+		}
+		auto mainCamera = cv->getCurrentCamera();
+		auto view = dynamic_cast<osgViewer::View*>(mainCamera->getView());
+		if (view == nullptr) {
+			traverse(node, nv);
+			return;
+		}
+		if (!needsUpdate(mainCamera, view)) {
+			return;
+		}
+		updateShadowCameras(node->asGroup(), mainCamera, view);
+		traverse(node, nv);
+	}
 
-		osg::Matrixf VP = viewMatrix * projMatrix;
-		modelGroup->getOrCreateStateSet()->getUniform("dLightShadowVP")->set(VP);
+	void dirty() { m_bDirty = true; }
+	void setCameraThreshold(double distance, double angleDegrees) {
+		m_moveThreshold = distance;
+		m_angleThreshold = osg::DegreesToRadians(angleDegrees);
+	}
+	// largest channel of the emission color, weights the light's importance in the atlas
+	void setBrightness(float brightness) { m_brightness = brightness; }
+	// atlas lights switch their cameras between depth only and moments followed by their blur
+	void setShadowFilter(osg::Group* shadowGroup, Light::ShadowFilter filter) {
+		bool variance = filter == Light::ShadowVariance && getNumShadowTiles() > 0;
+		if (variance == m_bVariance || !m_view.valid()) {
+			return;
+		}
+		m_bVariance = variance;
+		auto atlas = ShadowAtlas::get(m_view.get());
+		if (!m_momentProgram.valid()) {
+			m_momentProgram = createMomentShadowProgram();
+		}
+		for (unsigned int i = 0; i < shadowGroup->getNumChildren(); ++i) {
+			auto rttCamera = shadowGroup->getChild(i)->asCamera();
+			osg::StateSet* stateSet = rttCamera->getOrCreateStateSet();
+			if (variance) {
+				if (!m_depthProgram.valid()) {
+					m_depthProgram = dynamic_cast<osg::Program*>(stateSet->getAttribute(osg::StateAttribute::PROGRAM));
+				}
+				rttCamera->attach(osg::Camera::COLOR_BUFFER0, atlas->getMomentTexture());
+				rttCamera->setDrawBuffer(GL_COLOR_ATTACHMENT0);
+				rttCamera->setReadBuffer(GL_COLOR_ATTACHMENT0);
+				// the far plane where nothing was drawn
+				rttCamera->setClearColor(osg::Vec4(1.0f, 1.0f, 1.0f, 1.0f));
+				stateSet->setAttributeAndModes(m_momentProgram, osg::StateAttribute::ON | osg::StateAttribute::OVERRIDE);
+				rttCamera->addChild(new MomentBlur(atlas));
+			}
+			else {
+				rttCamera->detach(osg::Camera::COLOR_BUFFER0);
+				rttCamera->setDrawBuffer(GL_NONE);
+				rttCamera->setReadBuffer(GL_NONE);
+				stateSet->setAttributeAndModes(m_depthProgram, osg::StateAttribute::ON | osg::StateAttribute::OVERRIDE);
+				for (int child = static_cast<int>(rttCamera->getNumChildren()) - 1; child >= 0; --child) {
+					if (dynamic_cast<MomentBlur*>(rttCamera->getChild(child))) {
+						rttCamera->removeChild(child);
+					}
+				}
+			}
+			rttCamera->dirtyAttachmentMap();
+		}
+		dirty();
 	}
-	void setLightDir(const osg::Vec3d& dir) { m_lightDir = dir; }
+
 protected:
-	osg::BoundingBoxd getLightSpaceBoundingBoxOfMainCameraViewFrustum(osg::Camera* camera,
-		const osg::Vec3d& lightDir, const osg::Vec3d& lightUp, osg::Matrix& rotMatrix) const
-	{
-		osg::BoundingBoxd bb;
-		osg::Vec3d eye, center, up;
-		camera->getViewMatrixAsLookAt(eye, center, up);
-		osg::Vec3d lookDir = center - eye;
-		lookDir.normalize();
-		osg::Vec3d left = up ^ lookDir;
-		left.normalize();
+	// fits the shadow cameras right before they are culled, so the maps and the matrices sampling them always match
+	virtual void updateShadowCameras(osg::Group* shadowGroup, osg::Camera* mainCamera, osgViewer::View* view) {}
+
+	bool needsUpdate(osg::Camera* mainCamera, osgViewer::View* view) {
+		bool update = m_bDirty;
+		if (m_lightMT.valid() && m_lightMT->getMatrix() != m_lightMatrix) {
+			m_lightMatrix = m_lightMT->getMatrix();
+			update = true;
+		}
+		unsigned int revision = ViewInfo::getSceneRevision(view);
+		unsigned int numModels = ViewInfo::getModelGroup(view)->getNumChildren();
+		if (revision != m_sceneRevision || numModels != m_numModels) {
+			m_sceneRevision = revision;
+			m_numModels = numModels;
+			update = true;
+		}
+		if (m_bFollowCamera) {
+			osg::Vec3d eye, center, up;
+			mainCamera->getViewMatrixAsLookAt(eye, center, up);
+			osg::Vec3d lookDir = center - eye;
+			lookDir.normalize();
+			double cosAngle = osg::clampBetween(lookDir * m_lookDir, -1.0, 1.0);
+			if ((eye - m_eye).length() > m_moveThreshold || acos(cosAngle) > m_angleThreshold
+				|| mainCamera->getProjectionMatrix() != m_projection) {
+				update = true;
+			}
+			if (update) {
+				m_eye = eye;
+				m_lookDir = lookDir;
+				m_projection = mainCamera->getProjectionMatrix();
+			}
+		}
+		m_bDirty = false;
+		return update;
+	}
 
-		double fovy, aspect, zNear, zFar;
-		if (camera->getProjectionMatrixAsPerspective(fovy, aspect, zNear, zFar)) {
-			// compute frustum vertex
-			double dis = zFar - zNear;
-			osg::Vec3d nearCenter = eye + lookDir * zNear;
-			osg::Vec3d farCenter = eye + lookDir * zFar;
+	osg::observer_ptr<osg::MatrixTransform> m_lightMT;
+	osg::observer_ptr<osgViewer::View> m_view;
+	int m_index;
+	float m_brightness;
+	bool m_bFollowCamera;
+	bool m_bDirty;
+	bool m_bVariance;
+	osg::ref_ptr<osg::Program> m_depthProgram;
+	osg::ref_ptr<osg::Program> m_momentProgram;
+	osg::Matrix m_lightMatrix;
+	unsigned int m_sceneRevision;
+	unsigned int m_numModels;
+
+	double m_moveThreshold;
+	double m_angleThreshold;
+	osg::Vec3d m_eye;
+	osg::Vec3d m_lookDir;
+	osg::Matrixd m_projection;
+};
 
-			double nearHalfHeight = zNear * tan(osg::DegreesToRadians(fovy) * 0.5);
-			double nearHalfWidth = nearHalfHeight * aspect;
+void Light::setShadowFilter(ShadowFilter filter)
+{
+	m_shadowFilter = filter;
+	if (!m_shadowGroup.valid()) {
+		return;
+	}
+	auto shadowGroup = m_shadowGroup;
+	getRenderInfo()->m_commandQueue->submit(this, LightShadowFilterCommand, [shadowGroup, filter]() {
+		auto cb = dynamic_cast<ShadowCacheCallback*>(shadowGroup->getCullCallback());
+		cb->setShadowFilter(shadowGroup, filter);
+		});
+}
 
-			osg::Vec3d nearLeftBottom(nearCenter + left * nearHalfWidth + -up * nearHalfHeight);	// nearLeftBottom
-			osg::Vec3d nearLeftUp(nearCenter + left * nearHalfWidth + up * nearHalfHeight);			// nearLeftUp
-			osg::Vec3d nearRightBottom(nearCenter + -left * nearHalfWidth + -up * nearHalfHeight);	// nearRightBottom;
-			osg::Vec3d nearRightUp(nearCenter + -left * nearHalfWidth + up * nearHalfHeight);		// nearRightUp
+// keeps the blur of a variance shadow camera on the camera's tile
+static void setMomentBlurTile(osg::Camera* rttCamera, const osg::Vec3i& tile)
+{
+	for (unsigned int i = 0; i < rttCamera->getNumChildren(); ++i) {
+		auto blur = dynamic_cast<MomentBlur*>(rttCamera->getChild(i));
+		if (blur) {
+			blur->setTile(tile);
+		}
+	}
+}
 
-			double ratio = zFar / zNear;
-			osg::Vec3d farLeftBottom = eye + (nearLeftBottom - eye) * ratio;
-			osg::Vec3d farLeftUp = eye + (nearLeftUp - eye) * ratio;
-			osg::Vec3d farRightBottom = eye + (nearRightBottom - eye) * ratio;
-			osg::Vec3d farRightUp = eye + (nearRightUp - eye) * ratio;
+// fits one orthographic shadow camera per cascade of the main camera frustum. splits follow the
+// practical scheme (blend of logarithmic and uniform), each cascade is fitted to the bounding sphere
+// of its slice and snapped to whole shadow texels so the map doesn't shimmer while the camera moves.
+// every cascade camera culls the casters against its own frustum and renders into its atlas tile
+class UpdateDirectionalLightCallback : public ShadowCacheCallback
+{
+public:
+	UpdateDirectionalLightCallback(osg::MatrixTransform* lightMT, osgViewer::View* view, int index) :
+		ShadowCacheCallback(lightMT, view, index, true),
+		m_cascadeCount(DIRECTIONAL_CASCADES_MAX),
+		m_shadowDistance(200.0),
+		m_splitLambda(0.75) {}
+
+	// covers the whole view, always served before local lights
+	virtual float getShadowImportance(osg::Camera* mainCamera) const override { return 2.0f; }
+	virtual int getNumShadowTiles() const override { return m_cascadeCount; }
+	virtual void setShadowTiles(const std::vector<osg::Vec3i>& tiles) override {
+		m_tiles = tiles;
+		dirty();
+		if (m_tiles.empty() && m_view.valid()) {
+			auto bd = getLightBufferData(m_view.get(), 0);
+			getLightBuffer<DirectionalLightUBuffer>(bd)->mats[m_index].shadow = osg::Vec4i(0, 0, 0, 0);
+			bd->dirty();
+		}
+	}
 
-			std::vector<osg::Vec3d> verts;
-			verts.push_back(nearLeftBottom);
-			verts.push_back(nearLeftUp);
-			verts.push_back(nearRightBottom);
-			verts.push_back(nearRightUp);
-			verts.push_back(farLeftBottom);
-			verts.push_back(farLeftUp);
-			verts.push_back(farRightBottom);
-			verts.push_back(farRightUp);
+	virtual void updateShadowCameras(osg::Group* shadowGroup, osg::Camera* mainCamera, osgViewer::View* view) override {
+		auto modelGroup = ViewInfo::getModelGroup(view);
 
-			// compute bounding box for frustum from lightDir direction
-			osg::Vec3d lightLeft = lightUp ^ lightDir;
-			lightLeft.normalize();
-			rotMatrix = osg::Matrix(lightLeft.x(), lightLeft.y(), lightLeft.z(), 0.0,
-				lightUp.x(), lightUp.y(), lightUp.z(), 0.0,
-				lightDir.x(), lightDir.y(), lightDir.z(), 0.0,
-				0, 0, 0, 1.0
-			);
-			osg::Vec3d tmpX = osg::X_AXIS * rotMatrix;
-			osg::Vec3d tmpY = osg::Y_AXIS * rotMatrix;
-			osg::Vec3d tmpZ = osg::Z_AXIS * rotMatrix;
+		double fovy, aspect, zNear, zFar;
+		if (!mainCamera->getProjectionMatrixAsPerspective(fovy, aspect, zNear, zFar)) {
+			qWarning() << "main camera's projection matrix isn't perspective";
+			return;
+		}
+		double shadowFar = std::min(zFar, m_shadowDistance);
+		int count = std::min<int>(m_cascadeCount, shadowGroup->getNumChildren());
+		count = std::min<int>(count, m_tiles.size());
+		if (count == 0) {
+			return;
+		}
+		double resolution = m_tiles[0].z();
+
+		// practical split scheme
+		std::vector<double> splits(count + 1);
+		splits[0] = zNear;
+		for (int i = 1; i <= count; ++i) {
+			double t = static_cast<double>(i) / count;
+			double logSplit = zNear * pow(shadowFar / zNear, t);
+			double uniformSplit = zNear + (shadowFar - zNear) * t;
+			splits[i] = m_splitLambda * logSplit + (1.0 - m_splitLambda) * uniformSplit;
+		}
 
-			osg::Matrix rotMatrix_inv = osg::Matrix::inverse(rotMatrix);
-			for (const auto& v : verts) {
-				osg::Vec3d sv = v * rotMatrix_inv;
-				bb.expandBy(sv);
-			}
+		osg::Vec3d eye, center, up;
+		mainCamera->getViewMatrixAsLookAt(eye, center, up);
+		osg::Vec3d lookDir = center - eye;
+		lookDir.normalize();
+		osg::Vec3d left = up ^ lookDir;
+		left.normalize();
+		up = lookDir ^ left;
+		double tanHalfFovy = tan(osg::DegreesToRadians(fovy) * 0.5);
 
+		osg::Vec3d lightUp = osg::X_AXIS;
+		lightUp = lightUp ^ m_lightDir;
+		lightUp.normalize();
+		// light view rotation with a fixed origin, the texel grid is snapped in this space
+		osg::Matrix lightRotation = osg::Matrix::lookAt(osg::Vec3d(), m_lightDir, lightUp);
+		osg::Matrix lightRotationInv = osg::Matrix::inverse(lightRotation);
+		const osg::BoundingSphere& sceneBS = modelGroup->getBound();
+
+		auto bd = getLightBufferData(view, 0);
+		DirectionalLightMaterial& material = getLightBuffer<DirectionalLightUBuffer>(bd)->mats[m_index];
+		osg::Vec4 splitDistances;
+		for (int i = 0; i < count; ++i) {
+			double sliceNear = splits[i];
+			double sliceFar = splits[i + 1];
+			std::vector<osg::Vec3d> corners;
+			for (double dist : { sliceNear, sliceFar }) {
+				double halfHeight = dist * tanHalfFovy;
+				double halfWidth = halfHeight * aspect;
+				osg::Vec3d sliceCenter = eye + lookDir * dist;
+				corners.push_back(sliceCenter + left * halfWidth + up * halfHeight);
+				corners.push_back(sliceCenter + left * halfWidth - up * halfHeight);
+				corners.push_back(sliceCenter - left * halfWidth + up * halfHeight);
+				corners.push_back(sliceCenter - left * halfWidth - up * halfHeight);
+			}
+			osg::Vec3d sphereCenter;
+			for (const auto& corner : corners) {
+				sphereCenter += corner;
+			}
+			sphereCenter /= corners.size();
+			double radius = 0.0;
+			for (const auto& corner : corners) {
+				radius = std::max(radius, (corner - sphereCenter).length());
+			}
+			// quantize the radius so the texel size stays constant while the camera turns
+			radius = ceil(radius * 16.0) / 16.0;
+
+			double texelSize = radius * 2.0 / resolution;
+			osg::Vec3d lightSpaceCenter = sphereCenter * lightRotation;
+			lightSpaceCenter.x() = floor(lightSpaceCenter.x() / texelSize) * texelSize;
+			lightSpaceCenter.y() = floor(lightSpaceCenter.y() / texelSize) * texelSize;
+			osg::Vec3d snappedCenter = lightSpaceCenter * lightRotationInv;
+
+			// pull the near plane back to the farthest caster towards the light
+			double backDistance = radius;
+			if (sceneBS.valid()) {
+				backDistance = std::max(backDistance, (snappedCenter - osg::Vec3d(sceneBS.center())) * m_lightDir + sceneBS.radius());
+			}
+			osg::Matrix viewMatrix = osg::Matrix::lookAt(snappedCenter - m_lightDir * backDistance, snappedCenter, lightUp);
+			osg::Matrix projMatrix = osg::Matrix::ortho(-radius, radius, -radius, radius, 0.0, backDistance + radius);
+
+			const osg::Vec3i& tile = m_tiles[i];
+			auto rttCamera = shadowGroup->getChild(i)->asCamera();
+			rttCamera->setViewport(tile.x(), tile.y(), tile.z(), tile.z());
+			rttCamera->setViewMatrix(viewMatrix);
+			rttCamera->setProjectionMatrix(projMatrix);
+			rttCamera->getOrCreateStateSet()->getUniform("shadowDepthRange")->set(osg::Vec2(0.0f, static_cast<float>(backDistance + radius)));
+			setMomentBlurTile(rttCamera, tile);
+			material.cascadeVPs[i] = osg::Matrixf(viewMatrix * projMatrix);
+			material.cascadeRects[i] = getAtlasRect(tile);
+			splitDistances[i] = sliceFar;
 		}
-		else {
-			qWarning() << "main camera's projection matrix isn't perspective";
+		for (unsigned int i = 0; i < shadowGroup->getNumChildren(); ++i) {
+			shadowGroup->getChild(i)->setNodeMask(static_cast<int>(i) < count ? ~0u : 0u);
 		}
-
-		return bb;
+		material.cascadeSplits = splitDistances;
+		material.shadow = osg::Vec4i(count, m_bVariance ? Light::ShadowVariance : Light::ShadowPCF, 0, 0);
+		bd->dirty();
 	}
+	void setLightDir(const osg::Vec3d& dir) { m_lightDir = dir; dirty(); }
+	void setCascadeCount(int count) { m_cascadeCount = count; dirty(); }
+	void setShadowDistance(double distance) { m_shadowDistance = distance; dirty(); }
+
 protected:
 	osg::Vec3d m_lightDir;
+	std::vector<osg::Vec3i> m_tiles;
+	int m_cascadeCount;
+	double m_shadowDistance;
+	double m_splitLambda;
 };
 
 osg::Program* createShadowProgram()
 {
 	const char* vs = R"(
+#version 430 core
+#extension GL_ARB_shader_draw_parameters : require
+layout(location = 0) in vec4 Position;
+invariant gl_Position; // the depth pre-pass relies on matching the mesh program's depth exactly
+uniform mat4 osg_ModelViewProjectionMatrix;
+uniform bool useInstancing;
+uniform bool useMultiDraw;
+struct InstanceData {
+	mat4 model;
+	mat4 normal;
+	ivec4 index;
+};
+layout(std430, binding = 1) buffer InstanceBuffer {
+	InstanceData instances[];
+};
+void main()
+{
+	vec4 localPosition = Position;
+	if (useMultiDraw) {
+		localPosition = instances[gl_DrawIDARB].model * Position;
+	}
+	else if (useInstancing) {
+		localPosition = instances[gl_InstanceID].model * Position;
+	}
+	gl_Position = osg_ModelViewProjectionMatrix * localPosition;
+}
+)";
+	const char* fs = R"(
 #version 330 core
+void main()
+{
+}
+)";
+	osg::Program* program = new osg::Program;
+	program->addShader(new osg::Shader(osg::Shader::VERTEX, vs));
+	program->addShader(new osg::Shader(osg::Shader::FRAGMENT, fs));
+	return program;
+}
+
+osg::Program* createMomentShadowProgram()
+{
+	const char* vs = R"(
+#version 430 core
+#extension GL_ARB_shader_draw_parameters : require
 layout(location = 0) in vec4 Position;
+uniform mat4 osg_ModelViewMatrix;
 uniform mat4 osg_ModelViewProjectionMatrix;
+uniform bool useInstancing;
+uniform bool useMultiDraw;
+struct InstanceData {
+	mat4 model;
+	mat4 normal;
+	ivec4 index;
+};
+layout(std430, binding = 1) buffer InstanceBuffer {
+	InstanceData instances[];
+};
+out float viewDepth;
 void main()
 {
-	gl_Position = osg_ModelViewProjectionMatrix * Position;
+	vec4 localPosition = Position;
+	if (useMultiDraw) {
+		localPosition = instances[gl_DrawIDARB].model * Position;
+	}
+	else if (useInstancing) {
+		localPosition = instances[gl_InstanceID].model * Position;
+	}
+	viewDepth = -vec4(osg_ModelViewMatrix * localPosition).z;
+	gl_Position = osg_ModelViewProjectionMatrix * localPosition;
 }
 )";
 	const char* fs = R"(
 #version 330 core
+uniform vec2 shadowDepthRange;
+in float viewDepth;
+layout(location = 0) out vec2 moments;
 void main()
 {
+	// linear, so the receivers of orthographic and perspective maps compare the same way
+	float depth = clamp((viewDepth - shadowDepthRange.x) / (shadowDepthRange.y - shadowDepthRange.x), 0.0, 1.0);
+	// the slope within the texel widens the variance, so a tilted plane doesn't shadow itself
+	float dx = dFdx(depth);
+	float dy = dFdy(depth);
+	moments = vec2(depth, depth * depth + 0.25 * (dx * dx + dy * dy));
 }
 )";
 	osg::Program* program = new osg::Program;
@@ -197,40 +525,74 @@ void DirectionalLight::addToScene()
 	m_proxyGeode->addDrawable(line);
 	m_proxyGeode->addDrawable(cone);
 
-	int texWidth = 1024, texHeight = 1024;
-	osg::ref_ptr<osg::Texture2D> depthTexture = createDepthTexture(texWidth, texHeight);
-	auto rttCamera = createRTTCamera(texWidth, texHeight);
-	rttCamera->setReferenceFrame(osg::Transform::ABSOLUTE_RF);
-	rttCamera->setRenderOrder(osg::Camera::RenderOrder::PRE_RENDER, -1);
-	rttCamera->setPreDrawCallback(new UpdateDirectionalLightCallback);
-	rttCamera->setComputeNearFarMode(osg::CullSettings::DO_NOT_COMPUTE_NEAR_FAR);
-	rttCamera->attach(osg::Camera::DEPTH_BUFFER, depthTexture);
-	rttCamera->setDrawBuffer(GL_NONE);
-	rttCamera->setReadBuffer(GL_NONE);
-	auto shadowProgram = createShadowProgram();
-	rttCamera->getOrCreateStateSet()->setAttributeAndModes(shadowProgram, osg::StateAttribute::ON | osg::StateAttribute::OVERRIDE);
-
+	// one atlas tile per cascade, granted by the shadow atlas
 	auto view = getRenderInfo()->m_mainView;
-	getRenderInfo()->addOperation(new LambdaOperation([rttCamera, depthTexture, view]() {
-		auto model = ViewInfo::getModelGroup(view);
-		auto other = ViewInfo::getOtherGroup(view);
-		rttCamera->addChild(model);
-		other->addChild(rttCamera);
+	m_index = s_count++;
+	auto shadowProgram = createShadowProgram();
 
-		model->getOrCreateStateSet()->setTextureAttributeAndModes(0, depthTexture, osg::StateAttribute::ON);
-		osg::Uniform* shadowMapUniform = new osg::Uniform(osg::Uniform::SAMPLER_2D, "directionalLightShadowMap");
-		shadowMapUniform->set(0);
-		model->getOrCreateStateSet()->addUniform(shadowMapUniform);
+	auto cascadeCallback = new UpdateDirectionalLightCallback(m_mt, view, m_index);
+	cascadeCallback->setCascadeCount(m_cascadeCount);
+	cascadeCallback->setShadowDistance(m_shadowDistance);
+	osg::ref_ptr<osg::Group> shadowGroup = new osg::Group;
+	shadowGroup->setCullCallback(cascadeCallback);
+	for (int i = 0; i < DIRECTIONAL_CASCADES_MAX; ++i) {
+		auto rttCamera = createRTTCamera(SHADOW_TILE_SIZE_MAX, SHADOW_TILE_SIZE_MAX);
+		rttCamera->setReferenceFrame(osg::Transform::ABSOLUTE_RF);
+		rttCamera->setRenderOrder(osg::Camera::RenderOrder::PRE_RENDER, -1);
+		rttCamera->setComputeNearFarMode(osg::CullSettings::DO_NOT_COMPUTE_NEAR_FAR);
+		rttCamera->setDrawBuffer(GL_NONE);
+		rttCamera->setReadBuffer(GL_NONE);
+		rttCamera->getOrCreateStateSet()->setAttributeAndModes(shadowProgram, osg::StateAttribute::ON | osg::StateAttribute::OVERRIDE);
+		// instanced and batched geodes switch these on in their own state set
+		rttCamera->getOrCreateStateSet()->addUniform(new osg::Uniform("useInstancing", false));
+		rttCamera->getOrCreateStateSet()->addUniform(new osg::Uniform("useMultiDraw", false));
+		rttCamera->getOrCreateStateSet()->addUniform(new osg::Uniform("shadowDepthRange", osg::Vec2(0.0f, 1.0f)));
+		shadowGroup->addChild(rttCamera);
+	}
 
-		osg::Uniform* shadowVPUniform = new osg::Uniform("dLightShadowVP", osg::Matrixf());
-		model->getOrCreateStateSet()->addUniform(shadowVPUniform);
+	getRenderInfo()->addOperation(new LambdaOperation([shadowGroup, cascadeCallback, view]() {
+		auto atlas = ShadowAtlas::get(view);
+		auto model = ViewInfo::getModelGroup(view);
+		for (unsigned int i = 0; i < shadowGroup->getNumChildren(); ++i) {
+			auto rttCamera = shadowGroup->getChild(i)->asCamera();
+			rttCamera->attach(osg::Camera::DEPTH_BUFFER, atlas->getAtlasTexture());
+			rttCamera->addChild(model);
+		}
+		atlas->addLight(shadowGroup, cascadeCallback);
 		}));
 
-	m_shadowRTTCamera = rttCamera;
-	m_index = s_count++;
+	m_shadowRTTCamera = shadowGroup->getChild(0)->asCamera();
+	m_shadowGroup = shadowGroup;
 	Light::addToScene();
 }
 
+void DirectionalLight::setCascadeCount(int count)
+{
+	m_cascadeCount = osg::clampBetween(count, 1, DIRECTIONAL_CASCADES_MAX);
+	if (!m_shadowGroup.valid()) {
+		return;
+	}
+	auto shadowGroup = m_shadowGroup;
+	int cascadeCount = m_cascadeCount;
+	getRenderInfo()->m_commandQueue->submit(this, LightCascadeCountCommand, [shadowGroup, cascadeCount]() {
+		auto cb = dynamic_cast<UpdateDirectionalLightCallback*>(shadowGroup->getCullCallback());
+		cb->setCascadeCount(cascadeCount);
+		});
+}
+
+void DirectionalLight::setShadowDistance(float distance)
+{
+	m_shadowDistance = distance;
+	if (!m_shadowGroup.valid()) {
+		return;
+	}
+	auto shadowGroup = m_shadowGroup;
+	getRenderInfo()->m_commandQueue->submit(this, LightShadowDistanceCommand, [shadowGroup, distance]() {
+		auto cb = dynamic_cast<UpdateDirectionalLightCallback*>(shadowGroup->getCullCallback());
+		cb->setShadowDistance(distance);
+		});
+}
+
 osg::BoundingBox DirectionalLight::getBoundingBox() const
 {
 	osg::BoundingSphere bs(osg::Vec3(), 5);
@@ -241,34 +603,46 @@ osg::BoundingBox DirectionalLight::getBoundingBox() const
 
 void DirectionalLight::updateShader()
 {
-	auto renderInfo = getRenderInfo();
-	auto view = renderInfo->m_mainView;
+	SceneLight light;
+	light.color = osg::Vec4(m_emissionColor, 1.0);
+	light.param = osg::Vec4(s_count, 0.0, 0.0, 0.0);
+	ViewInfo::getSceneState(getRenderInfo()->m_mainView)->setLight(m_stateSlot, light);
+}
+
+SceneStateTarget::LightSync DirectionalLight::createLightSync()
+{
+	// the view owns the scene state holding this function
+	osg::observer_ptr<osgViewer::View> observedView = getRenderInfo()->m_mainView.get();
 	int index = m_index;
-	int count = s_count;
-	DirectionalLightMaterial material;
-	material.color = osg::Vec4(m_emissionColor, 1.0);
-	auto matrix = getMatrixTransform()->getMatrix();
-	osg::Vec3 dir = s_defaultDir * osg::Matrix::rotate(matrix.getRotate());
-	dir.normalize();
-	material.direction = osg::Vec4(dir, 1.0);
-	auto rttCamera = m_shadowRTTCamera;
-	renderInfo->addOperation(new LambdaOperation([material, index, count, rttCamera, view]() {
-		osg::StateAttribute* sa = view->getCamera()->getOrCreateStateSet()->getAttribute(osg::StateAttribute::UNIFORMBUFFERBINDING);
-		auto uBuffer = dynamic_cast<osg::UniformBufferBinding*>(sa);
-		auto bd = dynamic_cast<osg::FloatArray*>(uBuffer->getBufferData());
-		auto data = reinterpret_cast<DirectionalLightUBuffer*>(bd->asVector().data());
+	auto shadowGroup = m_shadowGroup;
+	return [observedView, index, shadowGroup](const osg::Matrix& matrix, const SceneLight& light) {
+		osg::ref_ptr<osgViewer::View> view;
+		if (!observedView.lock(view)) {
+			return;
+		}
+		DirectionalLightMaterial material;
+		material.color = light.color;
+		osg::Vec3 dir = s_defaultDir * osg::Matrix::rotate(matrix.getRotate());
+		dir.normalize();
+		material.direction = osg::Vec4(dir, 1.0);
+		int count = static_cast<int>(light.param.x());
+
+		// the shadow fields belong to the atlas callback
+		auto bd = getLightBufferData(view, 0);
+		auto data = getLightBuffer<DirectionalLightUBuffer>(bd);
 		data->count = osg::Vec4i(count, 0, 0, 0);
-		data->mats[index] = material;
+		data->mats[index].color = material.color;
+		data->mats[index].direction = material.direction;
 		bd->dirty();
 
-		auto cb = dynamic_cast<UpdateDirectionalLightCallback*>(rttCamera->getPreDrawCallback());
+		auto cb = dynamic_cast<UpdateDirectionalLightCallback*>(shadowGroup->getCullCallback());
 		osg::Vec3 lightDir(
 			material.direction.x(),
 			material.direction.y(),
 			material.direction.z()
 		);
 		cb->setLightDir(lightDir);
-		}));
+	};
 }
 
 int PointLight::s_count = 0;
@@ -278,51 +652,121 @@ int PointLight::s_count = 0;
 //	m_position = pos;
 //}
 
+// renders the six faces of a point light into its slot of the atlas' cube face array. each face is a
+// regular 90 degree camera, so casters are culled per face instead of being replicated by a geometry shader
+class UpdatePointLightCallback : public ShadowCacheCallback
+{
+public:
+	UpdatePointLightCallback(osg::MatrixTransform* lightMT, osgViewer::View* view, int index) :
+		ShadowCacheCallback(lightMT, view, index, false),
+		m_radius(1.0),
+		m_slot(-1),
+		m_bSlotChanged(false) {}
+
+	virtual float getShadowImportance(osg::Camera* mainCamera) const override {
+		return ShadowAtlas::getScreenCoverage(mainCamera, osg::BoundingSphere(m_lightPosition, m_radius)) * m_brightness;
+	}
+	virtual void setShadowCubeSlot(int slot) override {
+		m_slot = slot;
+		m_bSlotChanged = true;
+		dirty();
+		if (m_slot < 0 && m_view.valid()) {
+			auto clusters = ViewInfo::getLightClusters(m_view.get());
+			clusters->getPointLight(m_index).shadow = osg::Vec4(-1.0, 0.0, 0.0, 0.0);
+			clusters->dirtyPointLights();
+		}
+	}
+
+	virtual void updateShadowCameras(osg::Group* shadowGroup, osg::Camera* mainCamera, osgViewer::View* view) override {
+		if (m_slot < 0) {
+			return;
+		}
+		// same face order and up vectors as the shaders' cubeFaceDirs/cubeFaceUps
+		static const osg::Vec3d faceDirs[6] = {
+			osg::Vec3d(1.0, 0.0, 0.0), osg::Vec3d(-1.0, 0.0, 0.0), osg::Vec3d(0.0, 1.0, 0.0),
+			osg::Vec3d(0.0, -1.0, 0.0), osg::Vec3d(0.0, 0.0, 1.0), osg::Vec3d(0.0, 0.0, -1.0)
+		};
+		static const osg::Vec3d faceUps[6] = {
+			osg::Vec3d(0.0, -1.0, 0.0), osg::Vec3d(0.0, -1.0, 0.0), osg::Vec3d(0.0, 0.0, 1.0),
+			osg::Vec3d(0.0, 0.0, -1.0), osg::Vec3d(0.0, -1.0, 0.0), osg::Vec3d(0.0, -1.0, 0.0)
+		};
+		osg::Texture2DArray* cubeFaces = ShadowAtlas::get(view)->getCubeFaceTexture();
+		osg::Matrix projMatrix = osg::Matrix::perspective(90, 1.0, 0.1, m_radius);
+		for (unsigned int face = 0; face < 6 && face < shadowGroup->getNumChildren(); ++face) {
+			auto rttCamera = shadowGroup->getChild(face)->asCamera();
+			if (m_bSlotChanged) {
+				rttCamera->attach(osg::Camera::DEPTH_BUFFER, cubeFaces, 0, m_slot * 6 + face);
+				rttCamera->dirtyAttachmentMap();
+			}
+			rttCamera->setViewMatrix(osg::Matrix::lookAt(m_lightPosition, m_lightPosition + faceDirs[face], faceUps[face]));
+			rttCamera->setProjectionMatrix(projMatrix);
+		}
+		m_bSlotChanged = false;
+		shadowGroup->getOrCreateStateSet()->getUniform("pointLightRadius")->set(static_cast<float>(m_radius));
+
+		auto clusters = ViewInfo::getLightClusters(view);
+		clusters->getPointLight(m_index).shadow = osg::Vec4(m_slot, m_radius, 0.0, 0.0);
+		clusters->dirtyPointLights();
+	}
+	void setLight(const osg::Vec3d& position, double radius) {
+		m_lightPosition = position;
+		m_radius = radius;
+		dirty();
+	}
+
+protected:
+	osg::Vec3d m_lightPosition;
+	double m_radius;
+	int m_slot;
+	bool m_bSlotChanged;
+};
+
 osg::Program* createPointLightShadowProgram()
 {
 	const char* vs = R"(
-#version 330 core
+#version 430 core
+#extension GL_ARB_shader_draw_parameters : require
 layout(location = 0) in vec4 Position;
 uniform mat4 osg_ModelViewMatrix;
+uniform mat4 osg_ModelViewProjectionMatrix;
+uniform bool useInstancing;
+uniform bool useMultiDraw;
+struct InstanceData {
+	mat4 model;
+	mat4 normal;
+	ivec4 index;
+};
+layout(std430, binding = 1) buffer InstanceBuffer {
+	InstanceData instances[];
+};
+out vec3 viewPos;
 void main()
 {
-	gl_Position = osg_ModelViewMatrix * Position;
-}
-)";
-	const char* gs = R"(
-#version 330 core
-layout(triangles) in;
-layout(triangle_strip, max_vertices = 18) out;
-uniform mat4 pLightShadowVPs[6];
-out vec3 worldPos;
-void main()
-{
-	for(int face = 0; face < 6; ++face) {
-		gl_Layer = face;
-		for(int i = 0; i < 3; ++i) {
-			worldPos = gl_in[i].gl_Position.xyz;
-			gl_Position = pLightShadowVPs[face] * vec4(worldPos, 1.0);
-			EmitVertex();
-		}
-		EndPrimitive();
+	vec4 localPosition = Position;
+	if (useMultiDraw) {
+		localPosition = instances[gl_DrawIDARB].model * Position;
+	}
+	else if (useInstancing) {
+		localPosition = instances[gl_InstanceID].model * Position;
 	}
+	// the face camera sits at the light, so the view space length is the distance to the light
+	viewPos = vec4(osg_ModelViewMatrix * localPosition).xyz;
+	gl_Position = osg_ModelViewProjectionMatrix * localPosition;
 }
 )";
 	const char* fs = R"(
 #version 330 core
-uniform vec3 lightPosition;
 uniform float pointLightRadius;
-in vec3 worldPos;
+in vec3 viewPos;
 void main()
 {
-	float lightDistance = length(worldPos - lightPosition);
+	float lightDistance = length(viewPos);
 	lightDistance = lightDistance / pointLightRadius;
 	gl_FragDepth = lightDistance;
 }
 )";
 	osg::Program* program = new osg::Program;
 	program->addShader(new osg::Shader(osg::Shader::VERTEX, vs));
-	program->addShader(new osg::Shader(osg::Shader::GEOMETRY, gs));
 	program->addShader(new osg::Shader(osg::Shader::FRAGMENT, fs));
 	return program;
 }
@@ -335,47 +779,44 @@ void PointLight::addToScene()
 
 	m_proxyGeode->addDrawable(sphere);
 
-	int texWidth = 1024, texHeight = 1024;
-	osg::ref_ptr<osg::TextureCubeMap> depthTexture = createCubeMapDepthTexture(texWidth, texHeight);
-	osg::ref_ptr<osg::TextureCubeMap> colorTexture = createCubeMapColorTexture(texWidth, texHeight);
-	auto rttCamera = createRTTCamera(texWidth, texHeight);
-	rttCamera->setReferenceFrame(osg::Transform::ABSOLUTE_RF);
-	rttCamera->setRenderOrder(osg::Camera::RenderOrder::PRE_RENDER, -1);
-	rttCamera->setComputeNearFarMode(osg::CullSettings::DO_NOT_COMPUTE_NEAR_FAR);
-	rttCamera->setCullingMode(osg::CullSettings::NO_CULLING);
-	rttCamera->attach(osg::Camera::COLOR_BUFFER, colorTexture, 0, osg::Camera::FACE_CONTROLLED_BY_GEOMETRY_SHADER);
-	rttCamera->attach(osg::Camera::DEPTH_BUFFER, depthTexture, 0, osg::Camera::FACE_CONTROLLED_BY_GEOMETRY_SHADER);
-	rttCamera->setDrawBuffer(GL_NONE);
-	rttCamera->setReadBuffer(GL_NONE);
-	auto shadowProgram = createPointLightShadowProgram();
-	rttCamera->getOrCreateStateSet()->setAttributeAndModes(shadowProgram, osg::StateAttribute::ON | osg::StateAttribute::OVERRIDE);
-
+	// six face cameras, attached to a slot of the cube face array once the atlas grants one
 	auto view = getRenderInfo()->m_mainView;
-	getRenderInfo()->addOperation(new LambdaOperation([rttCamera, depthTexture, view]() {
-		auto model = ViewInfo::getModelGroup(view);
-		auto other = ViewInfo::getOtherGroup(view);
-		rttCamera->addChild(model);
-		other->addChild(rttCamera);
-
-		model->getOrCreateStateSet()->setTextureAttributeAndModes(0, depthTexture, osg::StateAttribute::ON);
-		osg::Uniform* shadowMapUniform = new osg::Uniform(osg::Uniform::SAMPLER_2D, "pointLightShadowMap");
-		shadowMapUniform->set(0);
-		model->getOrCreateStateSet()->addUniform(shadowMapUniform);
-
-		osg::Uniform* shadowVPArray = new osg::Uniform(osg::Uniform::Type::FLOAT_MAT4, "pLightShadowVPs", 6);
-		model->getOrCreateStateSet()->addUniform(shadowVPArray);
-
-		osg::Uniform* lightPosUniform = new osg::Uniform("lightPosition", osg::Vec3());
-		model->getOrCreateStateSet()->addUniform(lightPosUniform);
+	m_index = s_count++;
+	auto shadowProgram = createPointLightShadowProgram();
 
-		osg::Uniform* radiusUniform = new osg::Uniform("pointLightRadius", 0.0f);
-		model->getOrCreateStateSet()->addUniform(radiusUniform);
+	auto pointCallback = new UpdatePointLightCallback(m_mt, view, m_index);
+	osg::ref_ptr<osg::Group> shadowGroup = new osg::Group;
+	shadowGroup->setCullCallback(pointCallback);
+	shadowGroup->getOrCreateStateSet()->addUniform(new osg::Uniform("pointLightRadius", 1.0f));
+	for (int face = 0; face < 6; ++face) {
+		auto rttCamera = createRTTCamera(POINT_SHADOW_SIZE, POINT_SHADOW_SIZE);
+		rttCamera->setReferenceFrame(osg::Transform::ABSOLUTE_RF);
+		rttCamera->setRenderOrder(osg::Camera::RenderOrder::PRE_RENDER, -1);
+		rttCamera->setComputeNearFarMode(osg::CullSettings::DO_NOT_COMPUTE_NEAR_FAR);
+		rttCamera->setDrawBuffer(GL_NONE);
+		rttCamera->setReadBuffer(GL_NONE);
+		rttCamera->getOrCreateStateSet()->setAttributeAndModes(shadowProgram, osg::StateAttribute::ON | osg::StateAttribute::OVERRIDE);
+		// instanced and batched geodes switch these on in their own state set
+		rttCamera->getOrCreateStateSet()->addUniform(new osg::Uniform("useInstancing", false));
+		rttCamera->getOrCreateStateSet()->addUniform(new osg::Uniform("useMultiDraw", false));
+		shadowGroup->addChild(rttCamera);
+	}
 
+	int index = m_index;
+	getRenderInfo()->addOperation(new LambdaOperation([shadowGroup, pointCallback, index, view]() {
+		auto model = ViewInfo::getModelGroup(view);
+		for (unsigned int i = 0; i < shadowGroup->getNumChildren(); ++i) {
+			shadowGroup->getChild(i)->asGroup()->addChild(model);
+		}
+		// no shadow until a slot is granted
+		auto clusters = ViewInfo::getLightClusters(view);
+		clusters->getPointLight(index).shadow = osg::Vec4(-1.0, 0.0, 0.0, 0.0);
+		clusters->dirtyPointLights();
+		ShadowAtlas::get(view)->addLight(shadowGroup, pointCallback);
 		}));
 
-	m_shadowRTTCamera = rttCamera;
-
-	m_index = s_count++;
+	m_shadowRTTCamera = shadowGroup->getChild(0)->asCamera();
+	m_shadowGroup = shadowGroup;
 	Light::addToScene();
 }
 
@@ -389,34 +830,39 @@ osg::BoundingBox PointLight::getBoundingBox() const
 
 void PointLight::updateShader()
 {
-	auto renderInfo = getRenderInfo();
-	auto view = renderInfo->m_mainView;
+	SceneLight light;
+	light.color = osg::Vec4(m_emissionColor, 1.0);
+	light.param = m_param;
+	ViewInfo::getSceneState(getRenderInfo()->m_mainView)->setLight(m_stateSlot, light);
+}
+
+SceneStateTarget::LightSync PointLight::createLightSync()
+{
+	osg::observer_ptr<osgViewer::View> observedView = getRenderInfo()->m_mainView.get();
 	int index = m_index;
-	int count = s_count;
-	PointLightMaterial material;
-	material.color = osg::Vec4(m_emissionColor, 1.0);
-	auto matrix = getMatrixTransform()->getMatrix();
-	material.position = osg::Vec4(matrix.getTrans(), 1.0);
-	material.param = m_param;
-	auto rttCamera = m_shadowRTTCamera;
-	renderInfo->addOperation(new LambdaOperation([material, index, count, rttCamera, view]() {
-		osg::StateAttribute* sa = view->getCamera()->getOrCreateStateSet()->getAttribute(osg::StateAttribute::UNIFORMBUFFERBINDING, 1);
-		auto uBuffer = dynamic_cast<osg::UniformBufferBinding*>(sa);
-		auto bd = dynamic_cast<osg::FloatArray*>(uBuffer->getBufferData());
-		auto data = reinterpret_cast<PointLightUBuffer*>(bd->asVector().data());
-		data->count = osg::Vec4i(count, 0, 0, 0);
-		data->mats[index] = material;
-		bd->dirty();
+	auto shadowGroup = m_shadowGroup;
+	return [observedView, index, shadowGroup](const osg::Matrix& matrix, const SceneLight& light) {
+		osg::ref_ptr<osgViewer::View> view;
+		if (!observedView.lock(view)) {
+			return;
+		}
+		PointLightMaterial material;
+		material.color = light.color;
+		material.position = osg::Vec4(matrix.getTrans(), 1.0);
+		material.param = light.param;
+
+		// the shadow fields belong to the atlas callback
+		auto clusters = ViewInfo::getLightClusters(view);
+		PointLightMaterial& lightData = clusters->getPointLight(index);
+		lightData.color = material.color;
+		lightData.position = material.position;
+		lightData.param = material.param;
+		clusters->dirtyPointLights();
 
 		double constant = material.param.x();
 		double linear = material.param.y();
 		double exp = material.param.z();
-		double distance = -linear + sqrt(linear * linear - 4 * exp * (constant - 256)) / (2 * exp);
-		qDebug() << "point light valid distance:" << distance;
-
-
-		double Fatt = 1.0 / (1 + 0.09 * 50 + 0.032 * 50 * 50);
-		qDebug() << "Fatt" << Fatt;
+		double distance = (-linear + sqrt(linear * linear - 4 * exp * (constant - 256))) / (2 * exp);
 
 		osg::Vec3 lightPosition(
 			material.position.x(),
@@ -424,27 +870,10 @@ void PointLight::updateShader()
 			material.position.z()
 		);
 
-		osg::Matrix projMatrix = osg::Matrix::perspective(90, 1.0, 0.1, distance);
-		rttCamera->setViewMatrix(osg::Matrix::identity());
-		rttCamera->setProjectionMatrix(projMatrix);
-
-		auto model = ViewInfo::getModelGroup(view);
-		model->getOrCreateStateSet()->getUniform("lightPosition")->set(lightPosition);
-		model->getOrCreateStateSet()->getUniform("pointLightRadius")->set(static_cast<float>(distance));
-		auto vpUniform = model->getOrCreateStateSet()->getUniform("pLightShadowVPs");
-		vpUniform->setElement(0,
-			osg::Matrix::lookAt(lightPosition, lightPosition + osg::Vec3(1.0, 0.0, 0.0), osg::Vec3(0.0, -1.0, 0.0)) * projMatrix);
-		vpUniform->setElement(1,
-			osg::Matrix::lookAt(lightPosition, lightPosition + osg::Vec3(-1.0, 0.0, 0.0), osg::Vec3(0.0, -1.0, 0.0)) * projMatrix);
-		vpUniform->setElement(2,
-			osg::Matrix::lookAt(lightPosition, lightPosition + osg::Vec3(0.0, 1.0, 0.0), osg::Vec3(0.0, 0.0, 1.0)) * projMatrix);
-		vpUniform->setElement(3,
-			osg::Matrix::lookAt(lightPosition, lightPosition + osg::Vec3(0.0, -1.0, 0.0), osg::Vec3(0.0, 0.0, -1.0)) * projMatrix);
-		vpUniform->setElement(4,
-			osg::Matrix::lookAt(lightPosition, lightPosition + osg::Vec3(0.0, 0.0, 1.0), osg::Vec3(0.0, -1.0, 0.0)) * projMatrix);
-		vpUniform->setElement(5,
-			osg::Matrix::lookAt(lightPosition, lightPosition + osg::Vec3(0.0, 0.0, -1.0), osg::Vec3(0.0, -1.0, 0.0)) * projMatrix);
-		}));
+		auto cb = dynamic_cast<UpdatePointLightCallback*>(shadowGroup->getCullCallback());
+		cb->setLight(lightPosition, distance);
+		cb->setBrightness(std::max(material.color.x(), std::max(material.color.y(), material.color.z())));
+	};
 }
 
 int SpotLight::s_count = 0;
@@ -465,14 +894,33 @@ osg::Vec3 SpotLight::s_defaultDir = osg::Vec3(0, 0, -1);
 //	m_radius = radius;
 //}
 
-class UpdateSpotLightCallback : public osg::Camera::DrawCallback
+class UpdateSpotLightCallback : public ShadowCacheCallback
 {
 public:
-	virtual void operator () (osg::RenderInfo& renderInfo) const override {
-		auto rttCamera = renderInfo.getCurrentCamera();
-		auto view = dynamic_cast<osgViewer::View*>(renderInfo.getView());
-		auto modelGroup = ViewInfo::getModelGroup(view);
-		auto mainCamera = view->getCamera();
+	UpdateSpotLightCallback(osg::MatrixTransform* lightMT, osgViewer::View* view, int index) :
+		ShadowCacheCallback(lightMT, view, index, true) {}
+
+	// spot lights have no attenuation, a nominal reach stands in for the lit volume
+	virtual float getShadowImportance(osg::Camera* mainCamera) const override {
+		osg::BoundingSphere bs(m_lightPosition + m_lightDir * (m_range * 0.5), m_range * 0.5);
+		return ShadowAtlas::getScreenCoverage(mainCamera, bs) * m_brightness;
+	}
+	virtual int getNumShadowTiles() const override { return 1; }
+	virtual void setShadowTiles(const std::vector<osg::Vec3i>& tiles) override {
+		m_tiles = tiles;
+		dirty();
+		if (m_tiles.empty() && m_view.valid()) {
+			auto clusters = ViewInfo::getLightClusters(m_view.get());
+			clusters->getSpotLight(m_index).shadow = osg::Vec4();
+			clusters->dirtySpotLights();
+		}
+	}
+
+	virtual void updateShadowCameras(osg::Group* shadowGroup, osg::Camera* mainCamera, osgViewer::View* view) override {
+		if (m_tiles.empty()) {
+			return;
+		}
+		auto rttCamera = shadowGroup->getChild(0)->asCamera();
 
 		osg::Vec3d lightUp = osg::X_AXIS;
 		lightUp = lightUp ^ m_lightDir;
@@ -490,17 +938,23 @@ public:
 		osg::Matrix viewMatrix = osg::Matrix::lookAt(m_lightPosition, center, lightUp);
 		//osg::Matrix projMatrix = osg::Matrix::ortho(-farRadius, farRadius, -farRadius, farRadius, 0, farLength);
 		osg::Matrix projMatrix = osg::Matrix::perspective(m_outerCutOffAngle * 2, 1, 0.1, farLength);
+		const osg::Vec3i& tile = m_tiles[0];
+		rttCamera->setViewport(tile.x(), tile.y(), tile.z(), tile.z());
 		rttCamera->setViewMatrix(viewMatrix);
 		rttCamera->setProjectionMatrix(projMatrix);
-
-		osg::Matrixf VP = viewMatrix * projMatrix;
-		modelGroup->getOrCreateStateSet()->getUniform("sLightShadowVP")->set(VP);
-		modelGroup->getOrCreateStateSet()->getUniform("spot_near_plane")->set(0.1f);
-		modelGroup->getOrCreateStateSet()->getUniform("spot_far_plane")->set(static_cast<float>(farLength));
+		rttCamera->getOrCreateStateSet()->getUniform("shadowDepthRange")->set(osg::Vec2(0.1f, static_cast<float>(farLength)));
+		setMomentBlurTile(rttCamera, tile);
+
+		auto clusters = ViewInfo::getLightClusters(view);
+		SpotLightMaterial& material = clusters->getSpotLight(m_index);
+		material.shadowVP = osg::Matrixf(viewMatrix * projMatrix);
+		material.shadowRect = getAtlasRect(tile);
+		material.shadow = osg::Vec4(1.0, 0.1, farLength, m_bVariance ? Light::ShadowVariance : Light::ShadowPCF);
+		clusters->dirtySpotLights();
 	}
-	void setLightDir(const osg::Vec3d& dir) { m_lightDir = dir; }
-	void setLightPosition(const osg::Vec3d& pos) { m_lightPosition = pos; }
-	void setOuterCutOffAngle(double angle) { m_outerCutOffAngle = angle; }
+	void setLightDir(const osg::Vec3d& dir) { m_lightDir = dir; dirty(); }
+	void setLightPosition(const osg::Vec3d& pos) { m_lightPosition = pos; dirty(); }
+	void setOuterCutOffAngle(double angle) { m_outerCutOffAngle = angle; dirty(); }
 protected:
 	osg::BoundingBoxd getLightSpaceBoundingBoxOfMainCameraViewFrustum(osg::Camera* camera,
 		const osg::Vec3d& lightDir, const osg::Vec3d& lightUp, osg::Matrix& rotMatrix) const
@@ -573,6 +1027,8 @@ protected:
 	osg::Vec3d m_lightDir;
 	osg::Vec3d m_lightPosition;
 	double m_outerCutOffAngle = 0.0;
+	double m_range = 50.0;
+	std::vector<osg::Vec3i> m_tiles;
 };
 
 void SpotLight::addToScene()
@@ -604,42 +1060,36 @@ void SpotLight::addToScene()
 	m_proxyGeode->addDrawable(cone);
 	m_proxyGeode->addDrawable(sphere);
 
-	int texWidth = 1024, texHeight = 1024;
-	osg::ref_ptr<osg::Texture2D> depthTexture = createDepthTexture(texWidth, texHeight);
-	auto rttCamera = createRTTCamera(texWidth, texHeight);
+	// a single atlas tile, granted by the shadow atlas
+	auto view = getRenderInfo()->m_mainView;
+	m_index = s_count++;
+	auto rttCamera = createRTTCamera(SHADOW_TILE_SIZE_MAX, SHADOW_TILE_SIZE_MAX);
 	rttCamera->setReferenceFrame(osg::Transform::ABSOLUTE_RF);
 	rttCamera->setRenderOrder(osg::Camera::RenderOrder::PRE_RENDER, -1);
-	rttCamera->setPreDrawCallback(new UpdateSpotLightCallback);
 	rttCamera->setComputeNearFarMode(osg::CullSettings::DO_NOT_COMPUTE_NEAR_FAR);
-	rttCamera->attach(osg::Camera::DEPTH_BUFFER, depthTexture);
 	rttCamera->setDrawBuffer(GL_NONE);
 	rttCamera->setReadBuffer(GL_NONE);
 	auto shadowProgram = createShadowProgram();
 	rttCamera->getOrCreateStateSet()->setAttributeAndModes(shadowProgram, osg::StateAttribute::ON | osg::StateAttribute::OVERRIDE);
-
-	auto view = getRenderInfo()->m_mainView;
-	getRenderInfo()->addOperation(new LambdaOperation([rttCamera, depthTexture, view]() {
-		auto model = ViewInfo::getModelGroup(view);
-		auto other = ViewInfo::getOtherGroup(view);
-		rttCamera->addChild(model);
-		other->addChild(rttCamera);
-
-		model->getOrCreateStateSet()->setTextureAttributeAndModes(1, depthTexture, osg::StateAttribute::ON);
-		osg::Uniform* shadowMapUniform = new osg::Uniform(osg::Uniform::SAMPLER_2D, "spotLightShadowMap");
-		shadowMapUniform->set(1);
-		model->getOrCreateStateSet()->addUniform(shadowMapUniform);
-		model->getOrCreateStateSet()->setTextureMode(0, GL_TEXTURE_2D, osg::StateAttribute::ON);
-		model->getOrCreateStateSet()->setTextureMode(1, GL_TEXTURE_2D, osg::StateAttribute::ON);
-
-		osg::Uniform* shadowVPUniform = new osg::Uniform("sLightShadowVP", osg::Matrixf());
-		model->getOrCreateStateSet()->addUniform(shadowVPUniform);
-		model->getOrCreateStateSet()->addUniform(new osg::Uniform("spot_near_plane", 0.0f));
-		model->getOrCreateStateSet()->addUniform(new osg::Uniform("spot_far_plane", 0.0f));
+	// instanced and batched geodes switch these on in their own state set
+	rttCamera->getOrCreateStateSet()->addUniform(new osg::Uniform("useInstancing", false));
+	rttCamera->getOrCreateStateSet()->addUniform(new osg::Uniform("useMultiDraw", false));
+	rttCamera->getOrCreateStateSet()->addUniform(new osg::Uniform("shadowDepthRange", osg::Vec2(0.1f, 1.0f)));
+
+	auto spotCallback = new UpdateSpotLightCallback(m_mt, view, m_index);
+	osg::ref_ptr<osg::Group> shadowGroup = new osg::Group;
+	shadowGroup->setCullCallback(spotCallback);
+	shadowGroup->addChild(rttCamera);
+
+	getRenderInfo()->addOperation(new LambdaOperation([rttCamera, shadowGroup, spotCallback, view]() {
+		auto atlas = ShadowAtlas::get(view);
+		rttCamera->attach(osg::Camera::DEPTH_BUFFER, atlas->getAtlasTexture());
+		rttCamera->addChild(ViewInfo::getModelGroup(view));
+		atlas->addLight(shadowGroup, spotCallback);
 		}));
 
 	m_shadowRTTCamera = rttCamera;
-
-	m_index = s_count++;
+	m_shadowGroup = shadowGroup;
 
 	Light::addToScene();
 }
@@ -654,29 +1104,41 @@ osg::BoundingBox SpotLight::getBoundingBox() const
 
 void SpotLight::updateShader()
 {
-	auto renderInfo = getRenderInfo();
-	auto view = renderInfo->m_mainView;
-	int index = m_index;
-	int count = s_count;
-	SpotLightMaterial material;
-	material.color = osg::Vec4(m_emissionColor, 1.0);
-	auto matrix = getMatrixTransform()->getMatrix();
-	material.position = osg::Vec4(matrix.getTrans(), 1.0);
-	auto dir = s_defaultDir * osg::Matrix::rotate(matrix.getRotate());
-	material.direction = osg::Vec4(dir, 1.0);
-	material.cutOff = osg::Vec4(cosf(osg::DegreesToRadians(m_cutOffAngle)), osg::DegreesToRadians(m_outerCutOffAngle), 0.0, 1.0);
-	auto rttCamera = m_shadowRTTCamera;
-	auto outerCutOffAngle = m_outerCutOffAngle;
-	renderInfo->addOperation(new LambdaOperation([material, index, count, rttCamera, outerCutOffAngle, view]() {
-		osg::StateAttribute* sa = view->getCamera()->getOrCreateStateSet()->getAttribute(osg::StateAttribute::UNIFORMBUFFERBINDING, 2);
-		auto uBuffer = dynamic_cast<osg::UniformBufferBinding*>(sa);
-		auto bd = dynamic_cast<osg::FloatArray*>(uBuffer->getBufferData());
-		auto data = reinterpret_cast<SpotLightUBuffer*>(bd->asVector().data());
-		data->count = osg::Vec4i(count, 0, 0, 0);
-		data->mats[index] = material;
-		bd->dirty();
+	SceneLight light;
+	light.color = osg::Vec4(m_emissionColor, 1.0);
+	light.param = osg::Vec4(m_cutOffAngle, m_outerCutOffAngle, 0.0, 0.0);
+	ViewInfo::getSceneState(getRenderInfo()->m_mainView)->setLight(m_stateSlot, light);
+}
 
-		auto cb = dynamic_cast<UpdateSpotLightCallback*>(rttCamera->getPreDrawCallback());
+SceneStateTarget::LightSync SpotLight::createLightSync()
+{
+	osg::observer_ptr<osgViewer::View> observedView = getRenderInfo()->m_mainView.get();
+	int index = m_index;
+	auto shadowGroup = m_shadowGroup;
+	return [observedView, index, shadowGroup](const osg::Matrix& matrix, const SceneLight& light) {
+		osg::ref_ptr<osgViewer::View> view;
+		if (!observedView.lock(view)) {
+			return;
+		}
+		float cutOffAngle = light.param.x();
+		float outerCutOffAngle = light.param.y();
+		SpotLightMaterial material;
+		material.color = light.color;
+		material.position = osg::Vec4(matrix.getTrans(), 1.0);
+		auto dir = s_defaultDir * osg::Matrix::rotate(matrix.getRotate());
+		material.direction = osg::Vec4(dir, 1.0);
+		material.cutOff = osg::Vec4(cosf(osg::DegreesToRadians(cutOffAngle)), osg::DegreesToRadians(outerCutOffAngle), 0.0, 1.0);
+
+		// the shadow fields belong to the atlas callback
+		auto clusters = ViewInfo::getLightClusters(view);
+		SpotLightMaterial& lightData = clusters->getSpotLight(index);
+		lightData.color = material.color;
+		lightData.position = material.position;
+		lightData.direction = material.direction;
+		lightData.cutOff = material.cutOff;
+		clusters->dirtySpotLights();
+
+		auto cb = dynamic_cast<UpdateSpotLightCallback*>(shadowGroup->getCullCallback());
 		osg::Vec3 lightDir(
 			material.direction.x(),
 			material.direction.y(),
@@ -690,5 +1152,6 @@ void SpotLight::updateShader()
 		cb->setLightDir(lightDir);
 		cb->setLightPosition(lightPosition);
 		cb->setOuterCutOffAngle(outerCutOffAngle);
-		}));
+		cb->setBrightness(std::max(material.color.x(), std::max(material.color.y(), material.color.z())));
+	};
 }
\ No newline at end of file
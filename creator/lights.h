@@ -2,9 +2,16 @@
 #define LIGHTS_H
 
 #include "object.h"
+#include <scene_state.h>
 #include <osg/MatrixTransform>
 #include <osg/Geode>
 #include <osg/Camera>
+#include <osg/Program>
+
+// depth only program of the shadow passes, instanced and batched geometry set useInstancing/useMultiDraw
+extern osg::Program* createShadowProgram();
+// shadow pass program writing (depth, depth²) of the linear depth over shadowDepthRange (near, far)
+extern osg::Program* createMomentShadowProgram();
 
 class Light : public Object
 {
@@ -14,28 +21,47 @@ public:
 		Point,
 		Spot
 	};
+	// hardware compared PCF, 4 fetches per light. variance blurs and mipmaps (depth, depth²) and takes
+	// a single fetch, softer and steady at a distance but with some light bleeding between occluders;
+	// directional and spot lights only, point lights always compare
+	enum ShadowFilter {
+		ShadowPCF,
+		ShadowVariance
+	};
 
 	Light(Type type);
 
 	virtual void addToScene() override;
 
 	osg::ref_ptr<osg::MatrixTransform> getMatrixTransform() { return m_mt; }
+	// the light's transform as the scene state last saw it, safe to read on the UI thread
+	osg::Matrix getMatrix() const;
 
 	virtual osg::BoundingBox getBoundingBox() const = 0;
 
 	void setEmissionColor(const osg::Vec3& color);
 
+	void setShadowFilter(ShadowFilter filter);
+	ShadowFilter getShadowFilter() const { return m_shadowFilter; }
+
 	virtual void updateInfoByNode();
 
 protected:
+	// hands the light parameters to the scene state
 	virtual void updateShader() = 0;
+	// writes the light's shader data and shadow callback on the render thread
+	virtual SceneStateTarget::LightSync createLightSync() = 0;
 
 protected:
 	Type m_type;
+	int m_stateSlot;
 
 	osg::ref_ptr<osg::Geode> m_proxyGeode;
 	osg::ref_ptr<osg::MatrixTransform> m_mt;
 	osg::Vec3 m_emissionColor;
+	ShadowFilter m_shadowFilter;
+	// holds the shadow RTT camera, its cull callback skips the pass while the cached map is valid
+	osg::ref_ptr<osg::Group> m_shadowGroup;
 };
 
 class LightNotifier : public QObject
@@ -57,21 +83,31 @@ public:
 		osg::Vec3 diffuse;
 		osg::Vec3 specular;
 	};
-	DirectionalLight() : Light(Type::Directional),/* m_dir(s_defaultDir),*/ m_index(-1) {}
+	DirectionalLight() : Light(Type::Directional),/* m_dir(s_defaultDir),*/ m_cascadeCount(3), m_shadowDistance(200.0f), m_index(-1) {}
 
 	//void setDir(const osg::Vec3& dir);
 	//const osg::Vec3& getDir() const { return m_dir; }
 
+	// number of shadow cascades, 1 to DIRECTIONAL_CASCADES_MAX
+	void setCascadeCount(int count);
+	int getCascadeCount() const { return m_cascadeCount; }
+	// view distance covered by the cascades, clamped by the main camera's far plane
+	void setShadowDistance(float distance);
+	float getShadowDistance() const { return m_shadowDistance; }
+
 	virtual void addToScene() override;
 	virtual osg::BoundingBox getBoundingBox() const override;
 
 protected:
 	virtual void updateShader() override;
+	virtual SceneStateTarget::LightSync createLightSync() override;
 
 protected:
 	//osg::Vec3 m_dir;
 	static osg::Vec3 s_defaultDir;
 	osg::ref_ptr<osg::Camera> m_shadowRTTCamera;
+	int m_cascadeCount;
+	float m_shadowDistance;
 private:
 	static int s_count;
 	int m_index;
@@ -90,6 +126,7 @@ public:
 
 protected:
 	virtual void updateShader() override;
+	virtual SceneStateTarget::LightSync createLightSync() override;
 
 protected:
 	//QVector3D m_position;
@@ -120,6 +157,7 @@ public:
 
 protected:
 	virtual void updateShader() override;
+	virtual SceneStateTarget::LightSync createLightSync() override;
 
 protected:
 	//osg::Vec3 m_position;
@@ -21,6 +21,21 @@ ApplicationWindow {
         }
     }
 
+    FileDialog {
+        id: captureDialog
+        property int frameCount: 1
+        fileMode: FileDialog.SaveFile
+        nameFilters: ["PNG (*.png)", "OpenEXR (*.exr)"]
+        onAccepted: {
+            if (frameCount > 1) {
+                $Interface.captureSequence(selectedFile, frameCount, 1920, 1080);
+            }
+            else {
+                $Interface.captureFrame(selectedFile, 1920, 1080);
+            }
+        }
+    }
+
     menuBar: MenuBar {
         //Menu {
         //    title: qsTr("Project")
@@ -81,6 +96,12 @@ ApplicationWindow {
                         $Interface.addBillboard(fileDialog.selectedFile);
                     }
                 }
+                Action {
+                    text: qsTr("billboards x100k")
+                    onTriggered: {
+                        $Interface.scatterBillboards(100000, 500.0);
+                    }
+                }
 
                 Action {
                     text: qsTr("cubemap")
@@ -119,6 +140,23 @@ ApplicationWindow {
             //    text: qsTr("hide")
             //}
         }
+        Menu {
+            title: qsTr("Capture")
+            Action {
+                text: qsTr("frame 1920x1080")
+                onTriggered: {
+                    captureDialog.frameCount = 1;
+                    captureDialog.open();
+                }
+            }
+            Action {
+                text: qsTr("sequence 240 frames")
+                onTriggered: {
+                    captureDialog.frameCount = 240;
+                    captureDialog.open();
+                }
+            }
+        }
         //Menu {
         //    title: qsTr("View")
         //    Action {
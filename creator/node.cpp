@@ -1,6 +1,19 @@
 #include "node.h"
 #include <operation.h>
+#include <instanced_mesh.h>
+#include <batched_mesh.h>
+#include <material_table.h>
+#include <scene_state.h>
 #include <osg/PolygonMode>
+#include <atomic>
+
+// keys of the render commands that replace their predecessors still waiting in the queue
+enum NodeCommand
+{
+	NodeGravityCommand,
+	NodeQualityCommand,
+	NodeLineCommand
+};
 
 class ForceCallback : public osg::NodeCallback
 {
@@ -107,7 +120,86 @@ protected:
 
 
 
+// watches the node's transform after the update traversal moved it. a change invalidates cached
+// shadow maps, is published to the node's scene state slot and copied into the node's instance or
+// draw slot when it has one
+class TransformWatchCallback : public osg::NodeCallback
+{
+public:
+	typedef std::function<void(const osg::Matrixf&)> SyncFunc;
+
+	TransformWatchCallback(osg::MatrixTransform* mt, osgViewer::View* view) :
+		m_mt(mt), m_view(view), m_matrix(mt->getMatrix()) {}
+
+	static TransformWatchCallback* get(osg::Switch* sw, osg::MatrixTransform* mt, osgViewer::View* view) {
+		auto cb = dynamic_cast<TransformWatchCallback*>(sw->getUpdateCallback());
+		if (cb == nullptr) {
+			cb = new TransformWatchCallback(mt, view);
+			sw->setUpdateCallback(cb);
+		}
+		return cb;
+	}
+
+	void setSyncFunc(SyncFunc func) { m_func = func; }
+	void setStateSlot(int slot) { m_stateSlot = slot; }
+
+	virtual void operator()(osg::Node* node, osg::NodeVisitor* nv) override {
+		traverse(node, nv);
+		const osg::Matrix& matrix = m_mt->getMatrix();
+		if (matrix != m_matrix) {
+			m_matrix = matrix;
+			if (m_func) {
+				m_func(matrix);
+			}
+			if (m_stateSlot >= 0) {
+				ViewInfo::getSceneState(m_view.get())->publishTransform(m_stateSlot, matrix);
+			}
+			ViewInfo::dirtySceneRevision(m_view.get());
+		}
+	}
+
+protected:
+	osg::ref_ptr<osg::MatrixTransform> m_mt;
+	osg::observer_ptr<osgViewer::View> m_view;
+	SyncFunc m_func;
+	int m_stateSlot = -1;
+	osg::Matrix m_matrix;
+};
+
+// a node's draw in a static batch, id is set once the render thread has added it
+struct StaticBatchSlot
+{
+	osg::ref_ptr<BatchedMesh> mesh;
+	std::atomic<bool> batched{ true };
+	std::atomic<int> id{ -1 };
+	bool visible = true;
+
+	// render thread
+	void unbatch(osg::Switch* sw) {
+		batched = false;
+		int drawId = id.exchange(-1);
+		if (drawId < 0) {
+			return;
+		}
+		mesh->removeDraw(drawId);
+		mesh = nullptr;
+		if (visible) {
+			sw->setAllChildrenOn();
+		}
+	}
+};
+
+// what the render thread knows of a node, written by its scene state sync and its operations
+struct NodeRenderState
+{
+	bool visible = true;
+	std::shared_ptr<StaticBatchSlot> batch;
+};
+
 Node::Node() :
+	m_materialIndex(-1),
+	m_stateSlot(-1),
+	m_bVisible(true),
 	m_quality(1.0),
 	m_bGravityEnabled(false),
 	m_gravity(9.8),
@@ -118,24 +210,54 @@ Node::Node() :
 	m_mt->setUpdateCallback(new ForceCallback(m_quality));
 	m_geode = new osg::Geode;
 
-	m_geode->getOrCreateStateSet()->addUniform(new osg::Uniform("material.ambient", m_material.m_ambient));
-	m_geode->getOrCreateStateSet()->addUniform(new osg::Uniform("material.diffuse", m_material.m_diffuse));
-	m_geode->getOrCreateStateSet()->addUniform(new osg::Uniform("material.specular", m_material.m_specular));
-	m_geode->getOrCreateStateSet()->addUniform(new osg::Uniform("material.shininess", m_material.m_shininess));
-
-	m_geode->getOrCreateStateSet()->addUniform(new osg::Uniform("metallic", m_pbrMaterial.mentallic));
-	m_geode->getOrCreateStateSet()->addUniform(new osg::Uniform("roughness", m_pbrMaterial.roughness));
-	m_geode->getOrCreateStateSet()->addUniform(new osg::Uniform("ao", m_pbrMaterial.ao));
-
 	m_mt->addChild(m_geode);
 	m_switch->addChild(m_mt);
 
 	m_gravityForce.reset(new osg::Vec3d);
+	m_renderState = std::make_shared<NodeRenderState>();
 }
 
 Node::~Node()
 {
+	if (m_stateSlot >= 0 && getRenderInfo()) {
+		ViewInfo::getSceneState(getRenderInfo()->m_mainView)->release(m_stateSlot);
+	}
+	if (m_materialIndex >= 0 && getRenderInfo()) {
+		ViewInfo::getMaterialTable(getRenderInfo()->m_mainView)->release(m_materialIndex);
+	}
+}
 
+int Node::getStateSlot()
+{
+	if (m_stateSlot >= 0) {
+		return m_stateSlot;
+	}
+	auto renderState = m_renderState;
+	auto sw = m_switch;
+	// the view owns the scene state, which holds on to the target
+	osg::observer_ptr<osgViewer::View> observedView = getRenderInfo()->m_mainView.get();
+	SceneStateTarget target;
+	target.transform = m_mt;
+	target.visible = [renderState, sw, observedView](bool visible) {
+		renderState->visible = visible;
+		auto slot = renderState->batch;
+		if (slot && slot->id >= 0) {
+			slot->visible = visible;
+			slot->mesh->setVisible(slot->id, visible);
+		}
+		else if (visible) {
+			sw->setAllChildrenOn();
+		}
+		else {
+			sw->setAllChildrenOff();
+		}
+		osg::ref_ptr<osgViewer::View> view;
+		if (observedView.lock(view)) {
+			ViewInfo::dirtySceneRevision(view);
+		}
+	};
+	m_stateSlot = ViewInfo::getSceneState(getRenderInfo()->m_mainView)->allocate(target, m_mt->getMatrix(), m_bVisible);
+	return m_stateSlot;
 }
 
 void Node::addGeometry(osg::Geometry* geometry)
@@ -144,17 +266,152 @@ void Node::addGeometry(osg::Geometry* geometry)
 		auto geode = m_geode;
 		m_geometry = geometry;
 		osg::ref_ptr<osg::Geometry> geom = geometry;
-		getRenderInfo()->addOperation(new LambdaOperation([geode, geom]() {
+		auto view = getRenderInfo()->m_mainView;
+		getRenderInfo()->addOperation(new LambdaOperation([geode, geom, view]() {
 			geode->addDrawable(geom);
+			ViewInfo::dirtySceneRevision(view);
 			}));
 	}
 }
 
+void Node::setInstancedMesh(InstancedMesh* mesh)
+{
+	if (mesh == nullptr || m_instancedMesh.valid()) {
+		return;
+	}
+	m_instancedMesh = mesh;
+	m_geometry = mesh->getGeometry();
+	updateMaterial();
+
+	osg::ref_ptr<InstancedMesh> instancedMesh = mesh;
+	auto sw = m_switch;
+	auto mt = m_mt;
+	auto view = getRenderInfo()->m_mainView;
+	int materialIndex = m_materialIndex;
+	getRenderInfo()->addOperation(new LambdaOperation([instancedMesh, sw, mt, view, materialIndex]() {
+		int id = instancedMesh->addInstance(mt->getMatrix(), materialIndex);
+		TransformWatchCallback::get(sw, mt, view)->setSyncFunc([instancedMesh, id](const osg::Matrixf& matrix) {
+			instancedMesh->setMatrix(id, matrix);
+			});
+		ViewInfo::dirtySceneRevision(view);
+		}));
+}
+
+void Node::setBatchedMesh(BatchedMesh* mesh, const ModelData& data)
+{
+	if (mesh == nullptr || m_batchedMesh.valid() || m_instancedMesh.valid()) {
+		return;
+	}
+	m_batchedMesh = mesh;
+	updateMaterial();
+
+	osg::ref_ptr<BatchedMesh> batchedMesh = mesh;
+	auto sw = m_switch;
+	auto mt = m_mt;
+	auto view = getRenderInfo()->m_mainView;
+	int materialIndex = m_materialIndex;
+	getRenderInfo()->addOperation(new LambdaOperation([batchedMesh, data, sw, mt, view, materialIndex]() {
+		int id = batchedMesh->addDraw(data, mt->getMatrix(), materialIndex);
+		TransformWatchCallback::get(sw, mt, view)->setSyncFunc([batchedMesh, id](const osg::Matrixf& matrix) {
+			batchedMesh->setMatrix(id, matrix);
+			});
+		ViewInfo::dirtySceneRevision(view);
+		}));
+}
+
+void Node::addToStaticBatch(BatchedMesh* mesh, const ModelData& data)
+{
+	if (mesh == nullptr || isStaticBatched() || m_batchedMesh.valid() || m_instancedMesh.valid()) {
+		return;
+	}
+	if (m_materialIndex < 0) {
+		updateMaterial();
+	}
+	auto slot = std::make_shared<StaticBatchSlot>();
+	m_staticBatch = slot;
+
+	osg::ref_ptr<BatchedMesh> batchedMesh = mesh;
+	auto sw = m_switch;
+	auto mt = m_mt;
+	auto view = getRenderInfo()->m_mainView;
+	int materialIndex = m_materialIndex;
+	auto renderState = m_renderState;
+	getRenderInfo()->addOperation(new LambdaOperation([slot, batchedMesh, data, sw, mt, view, materialIndex, renderState]() {
+		int id = batchedMesh->addDraw(data, mt->getMatrix(), materialIndex);
+		if (id < 0) {
+			slot->batched = false;
+			return;
+		}
+		bool visible = renderState->visible;
+		batchedMesh->setVisible(id, visible);
+		slot->mesh = batchedMesh;
+		slot->visible = visible;
+		slot->id = id;
+		renderState->batch = slot;
+		sw->setAllChildrenOff();
+		osg::observer_ptr<osg::Switch> observedSwitch = sw.get();
+		TransformWatchCallback::get(sw, mt, view)->setSyncFunc([slot, observedSwitch](const osg::Matrixf&) {
+			osg::ref_ptr<osg::Switch> sw;
+			if (observedSwitch.lock(sw)) {
+				slot->unbatch(sw);
+			}
+			});
+		ViewInfo::dirtySceneRevision(view);
+		}));
+}
+
+void Node::removeFromStaticBatch()
+{
+	if (!m_staticBatch) {
+		return;
+	}
+	auto slot = m_staticBatch;
+	m_staticBatch.reset();
+	auto sw = m_switch;
+	auto mt = m_mt;
+	auto view = getRenderInfo()->m_mainView;
+	auto renderState = m_renderState;
+	getRenderInfo()->addOperation(new LambdaOperation([slot, sw, mt, view, renderState]() {
+		if (renderState->batch == slot) {
+			renderState->batch.reset();
+		}
+		slot->unbatch(sw);
+		TransformWatchCallback::get(sw, mt, view)->setSyncFunc(nullptr);
+		ViewInfo::dirtySceneRevision(view);
+		}));
+}
+
+bool Node::isStaticBatched() const
+{
+	// the render thread may have un-batched the node already
+	return m_staticBatch && m_staticBatch->batched;
+}
+
+void Node::setVisible(bool visible)
+{
+	if (m_bVisible == visible) {
+		return;
+	}
+	m_bVisible = visible;
+	int slot = getStateSlot();
+	ViewInfo::getSceneState(getRenderInfo()->m_mainView)->setVisible(slot, visible);
+	emit visibleChanged();
+}
+
 osg::ref_ptr<osg::MatrixTransform> Node::getMatrixTransform()
 {
 	return m_mt;
 }
 
+osg::Matrix Node::getMatrix() const
+{
+	if (m_stateSlot < 0) {
+		// never handed to the render thread
+		return m_mt->getMatrix();
+	}
+	return ViewInfo::getSceneState(const_cast<Node*>(this)->getRenderInfo()->m_mainView)->getTransform(m_stateSlot);
+}
+
 osg::ref_ptr<osg::Geometry> Node::getGeometry()
 {
 	return m_geometry;
@@ -165,11 +422,19 @@ void Node::addToScene()
 	auto renderInfo = getRenderInfo();
 	auto view = renderInfo->m_mainView;
 	auto sw = m_switch;
-	renderInfo->addOperation(new LambdaOperation([sw, view]() {
+	auto mt = m_mt;
+	int slot = getStateSlot();
+	// switched on in the model group once its buffers are uploaded
+	renderInfo->addOperationAfterCompile(sw, new LambdaOperation([sw, mt, view, slot]() {
 		auto modelGroup = ViewInfo::getModelGroup(view);
 		modelGroup->addChild(sw);
+		TransformWatchCallback::get(sw, mt, view)->setStateSlot(slot);
+		ViewInfo::dirtySceneRevision(view);
 		view->home();
 		}));
+	if (m_materialIndex < 0) {
+		updateMaterial();
+	}
 	m_bAddedToScene = true;
 }
 
@@ -182,6 +447,7 @@ void Node::enableGravity(bool enable)
 	auto mt = m_mt;
 
 	if (enable) {
+		removeFromStaticBatch();
 		auto gravityForce = m_gravityForce;
 		auto gravity = m_gravity;
 		auto quality = m_quality;
@@ -211,11 +477,11 @@ void Node::setGravity(double gravity)
 	if (m_bGravityEnabled) {
 		auto gravityForce = m_gravityForce;
 		auto quality = m_quality;
-		getRenderInfo()->addOperation(new LambdaOperation([mt, gravityForce, gravity, quality]() {
+		getRenderInfo()->m_commandQueue->submit(this, NodeGravityCommand, [mt, gravityForce, gravity, quality]() {
 			auto forceCallback = dynamic_cast<ForceCallback*>(mt->getUpdateCallback());
 			*gravityForce = osg::Vec3d(0.0, 0.0, -quality) * gravity;
 			forceCallback->updateForce(gravityForce);
-			}));
+			});
 	}
 	m_gravity = gravity;
 	emit gravityChanged();
@@ -230,12 +496,12 @@ void Node::setQuality(double quality)
 	auto gravityForce = m_gravityForce;
 	auto gravity = m_gravity;
 	m_quality = quality;
-	getRenderInfo()->addOperation(new LambdaOperation([mt, gravityForce, gravity, quality]() {
+	getRenderInfo()->m_commandQueue->submit(this, NodeQualityCommand, [mt, gravityForce, gravity, quality]() {
 		auto forceCallback = dynamic_cast<ForceCallback*>(mt->getUpdateCallback());
 		*gravityForce = osg::Vec3d(0.0, 0.0, -quality) * gravity;
 		forceCallback->updateForce(gravityForce);
 		forceCallback->setQuality(quality);
-		}));
+		});
 	emit qualityChanged();
 }
 
@@ -246,7 +512,7 @@ void Node::showLine(bool line)
 	}
 	m_bShowLine = line;
 	auto mt = m_mt;
-	getRenderInfo()->addOperation(new LambdaOperation([mt, line]() {
+	getRenderInfo()->m_commandQueue->submit(this, NodeLineCommand, [mt, line]() {
 		auto ss = mt->getOrCreateStateSet();
 		if (line) {
 			ss->setAttributeAndModes(new osg::PolygonMode(osg::PolygonMode::Face::FRONT, osg::PolygonMode::Mode::LINE));
@@ -255,7 +521,7 @@ void Node::showLine(bool line)
 			ss->removeAttribute(osg::StateAttribute::POLYGONMODE);
 		}
 
-		}));
+		});
 
 	emit showLineChanged();
 }
@@ -270,27 +536,41 @@ std::shared_ptr<Physical::Object>& Node::getPhysicalObject()
 	return m_physicalObj;
 }
 
+MaterialData Node::getMaterialData() const
+{
+	MaterialData material;
+	material.ambient = osg::Vec4(m_material.m_ambient, m_material.m_shininess);
+	material.diffuse = osg::Vec4(m_material.m_diffuse, 1.0);
+	material.specular = osg::Vec4(m_material.m_specular, 1.0);
+	material.pbr = osg::Vec4(m_pbrMaterial.mentallic, m_pbrMaterial.roughness, m_pbrMaterial.ao, 0.0);
+	return material;
+}
+
+void Node::updateMaterial()
+{
+	auto view = getRenderInfo()->m_mainView;
+	if (m_materialIndex < 0) {
+		m_materialIndex = ViewInfo::getMaterialTable(view)->allocate();
+		// own geometry picks its slot through this uniform, instanced and batched draws store it per draw
+		auto geode = m_geode;
+		int materialIndex = m_materialIndex;
+		getRenderInfo()->addOperation(new LambdaOperation([geode, materialIndex]() {
+			geode->getOrCreateStateSet()->addUniform(new osg::Uniform("nodeMaterialIndex", materialIndex));
+			}));
+	}
+	ViewInfo::getSceneState(view)->setMaterial(getStateSlot(), m_materialIndex, getMaterialData());
+}
+
 void Node::setMaterial(Material mat)
 {
 	m_material = mat;
-	auto geode = m_geode;
-	getRenderInfo()->addOperation(new LambdaOperation([mat, geode]() {
-		geode->getOrCreateStateSet()->getUniform("material.ambient")->set(mat.m_ambient);
-		geode->getOrCreateStateSet()->getUniform("material.diffuse")->set(mat.m_diffuse);
-		geode->getOrCreateStateSet()->getUniform("material.specular")->set(mat.m_specular);
-		geode->getOrCreateStateSet()->getUniform("material.shininess")->set(mat.m_shininess);
-		}));
+	updateMaterial();
 }
 
 void Node::setPBRMaterial(PBRMaterial mat)
 {
 	m_pbrMaterial = mat;
-	auto geode = m_geode;
-	getRenderInfo()->addOperation(new LambdaOperation([mat, geode]() {
-		geode->getOrCreateStateSet()->addUniform(new osg::Uniform("metallic", mat.mentallic));
-		geode->getOrCreateStateSet()->addUniform(new osg::Uniform("roughness", mat.roughness));
-		geode->getOrCreateStateSet()->addUniform(new osg::Uniform("ao", mat.ao));
-		}));
+	updateMaterial();
 	emit metallicChanged();
 	emit roughnessChanged();
 }
@@ -11,7 +11,15 @@ namespace Physical {
 	class Object;
 }
 
+class InstancedMesh;
+class BatchedMesh;
+class MeshBVH;
+struct MaterialData;
+struct ModelData;
+
 typedef std::shared_ptr<osg::Vec3d> Force;
+struct StaticBatchSlot;
+struct NodeRenderState;
 
 
 class Node : public Object
@@ -23,6 +31,7 @@ class Node : public Object
 	Q_PROPERTY(double isShowLine READ isShowLine WRITE showLine NOTIFY showLineChanged)
 	Q_PROPERTY(float metallic READ metallic WRITE setMetallic NOTIFY metallicChanged)
 	Q_PROPERTY(float roughness READ roughness WRITE setRoughness NOTIFY roughnessChanged)
+	Q_PROPERTY(bool visible READ isVisible WRITE setVisible NOTIFY visibleChanged)
 public:
 	Node();
 	~Node();
@@ -30,7 +39,32 @@ public:
 	void addGeometry(osg::Geometry* geometry);
 	osg::ref_ptr<osg::Geometry> getGeometry();
 
+	// draw this node as one instance of a shared mesh instead of its own geometry
+	void setInstancedMesh(InstancedMesh* mesh);
+	bool isInstanced() const { return m_instancedMesh.valid(); }
+
+	// draw this node as one command of a multi-draw batch instead of its own geometry
+	void setBatchedMesh(BatchedMesh* mesh, const ModelData& data);
+	bool isBatched() const { return m_batchedMesh.valid(); }
+
+	// static nodes are merged into a shared batch and their own geometry is switched off. the first
+	// transform change (gravity, dragger, manipulator) moves the node back to its own geometry
+	void addToStaticBatch(BatchedMesh* mesh, const ModelData& data);
+	void removeFromStaticBatch();
+	bool isStaticBatched() const;
+
+	bool isVisible() const { return m_bVisible; }
+	void setVisible(bool visible);
+
+	// triangle tree of the node's mesh for CPU ray queries in its local space, shared by instances
+	void setMeshBVH(const std::shared_ptr<MeshBVH>& bvh) { m_meshBVH = bvh; }
+	const std::shared_ptr<MeshBVH>& getMeshBVH() const { return m_meshBVH; }
+
 	osg::ref_ptr<osg::MatrixTransform> getMatrixTransform();
+	// the node's transform as the scene state last saw it, safe to read on the UI thread
+	osg::Matrix getMatrix() const;
+	// slot in the scene material table, owned by this node alone, -1 before the first material is set
+	int getMaterialIndex() const { return m_materialIndex; }
 
 	virtual void addToScene() override;
 
@@ -69,6 +103,13 @@ public:
 	float roughness() const { return m_pbrMaterial.roughness; }
 	void setRoughness(float roughness);
 
+protected:
+	// slot of the node in the view's scene state, allocated on first use
+	int getStateSlot();
+	MaterialData getMaterialData() const;
+	// writes the current material into the node's slot of the scene material table
+	void updateMaterial();
+
 signals:
 	void gravityEnabledChanged();
 	void gravityChanged();
@@ -76,12 +117,23 @@ signals:
 	void showLineChanged();
 	void metallicChanged();
 	void roughnessChanged();
+	void visibleChanged();
 
 protected:
 	osg::ref_ptr<osg::Switch> m_switch;
 	osg::ref_ptr<osg::MatrixTransform> m_mt;
 	osg::ref_ptr<osg::Geode> m_geode;
 	osg::ref_ptr<osg::Geometry> m_geometry;
+	osg::ref_ptr<InstancedMesh> m_instancedMesh;
+	osg::ref_ptr<BatchedMesh> m_batchedMesh;
+	int m_materialIndex;
+	// shared with the render thread, which un-batches on its own when the transform changes
+	std::shared_ptr<StaticBatchSlot> m_staticBatch;
+	// render thread
+	std::shared_ptr<NodeRenderState> m_renderState;
+	int m_stateSlot;
+	bool m_bVisible;
+	std::shared_ptr<MeshBVH> m_meshBVH;
 
 	bool m_bGravityEnabled;
 	bool m_bShowLine;
@@ -0,0 +1,307 @@
+#include "render_graph.h"
+#include "deferred_rendering.h"
+#include <algorithm>
+
+static bool isDepthFormat(GLint internalFormat)
+{
+	switch (internalFormat) {
+	case GL_DEPTH_COMPONENT:
+	case GL_DEPTH_COMPONENT16:
+	case GL_DEPTH_COMPONENT24:
+	case GL_DEPTH_COMPONENT32:
+	case GL_DEPTH_COMPONENT32F:
+	case GL_DEPTH24_STENCIL8:
+	case GL_DEPTH32F_STENCIL8:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// as allocated by the driver, depth 24 is padded
+static size_t getBytesPerPixel(GLint internalFormat)
+{
+	switch (internalFormat) {
+	case GL_R8:
+		return 1;
+	case GL_RG8:
+	case GL_R16:
+	case GL_R16F:
+	case GL_R16UI:
+	case GL_DEPTH_COMPONENT16:
+		return 2;
+	case GL_RGBA16F:
+	case GL_RGBA16:
+	case GL_RG32F:
+	case GL_DEPTH32F_STENCIL8:
+		return 8;
+	case GL_RGBA32F:
+	case GL_RGBA32UI:
+		return 16;
+	default:
+		return 4;
+	}
+}
+
+static bool isSameDesc(const RenderResourceDesc& a, const RenderResourceDesc& b)
+{
+	return a.internalFormat == b.internalFormat && a.sourceFormat == b.sourceFormat && a.sourceType == b.sourceType
+		&& a.scale == b.scale && a.width == b.width && a.height == b.height;
+}
+
+RenderGraph::RenderGraph() :
+	m_width(1),
+	m_height(1)
+{
+
+}
+
+RenderGraph::~RenderGraph()
+{
+
+}
+
+int RenderGraph::addPass(const std::string& name, osg::Node* node, bool present)
+{
+	Pass pass;
+	pass.name = name;
+	pass.node = node;
+	pass.present = present;
+	pass.culled = false;
+	m_passes.push_back(pass);
+	return static_cast<int>(m_passes.size()) - 1;
+}
+
+void RenderGraph::write(int pass, const std::string& resource, const RenderResourceDesc& desc)
+{
+	m_passes[pass].writes.push_back(Write{ resource, desc });
+}
+
+void RenderGraph::read(int pass, const std::string& resource, int unit, const std::string& sampler)
+{
+	m_passes[pass].reads.push_back(Read{ resource, unit, sampler });
+}
+
+int RenderGraph::findResource(const std::string& name) const
+{
+	for (size_t i = 0; i < m_resources.size(); ++i) {
+		if (m_resources[i].name == name) {
+			return static_cast<int>(i);
+		}
+	}
+	return -1;
+}
+
+void RenderGraph::getSize(const RenderResourceDesc& desc, int& width, int& height) const
+{
+	if (desc.width > 0 && desc.height > 0) {
+		width = desc.width;
+		height = desc.height;
+		return;
+	}
+	width = std::max(1, static_cast<int>(m_width * desc.scale));
+	height = std::max(1, static_cast<int>(m_height * desc.scale));
+}
+
+osg::Group* RenderGraph::compile()
+{
+	m_resources.clear();
+	m_textures.clear();
+
+	// each resource has one writer, a later write of the same name is ignored
+	for (size_t p = 0; p < m_passes.size(); ++p) {
+		for (const Write& write : m_passes[p].writes) {
+			if (findResource(write.resource) >= 0) {
+				OSG_WARN << "render graph: " << write.resource << " is written twice, by " << m_passes[p].name << std::endl;
+				continue;
+			}
+			Resource resource;
+			resource.name = write.resource;
+			resource.desc = write.desc;
+			resource.writer = static_cast<int>(p);
+			m_resources.push_back(resource);
+		}
+	}
+
+	// keep what the present passes need
+	std::vector<int> needed;
+	for (size_t p = 0; p < m_passes.size(); ++p) {
+		m_passes[p].culled = !m_passes[p].present;
+		if (m_passes[p].present) {
+			needed.push_back(static_cast<int>(p));
+		}
+	}
+	while (!needed.empty()) {
+		int p = needed.back();
+		needed.pop_back();
+		for (const Read& read : m_passes[p].reads) {
+			int r = findResource(read.resource);
+			if (r < 0) {
+				OSG_WARN << "render graph: " << m_passes[p].name << " reads " << read.resource << " nobody writes" << std::endl;
+				continue;
+			}
+			Pass& writer = m_passes[m_resources[r].writer];
+			if (writer.culled) {
+				writer.culled = false;
+				needed.push_back(m_resources[r].writer);
+			}
+		}
+	}
+
+	// lifetimes over the kept passes
+	for (Resource& resource : m_resources) {
+		resource.lastReader = resource.writer;
+	}
+	for (size_t p = 0; p < m_passes.size(); ++p) {
+		if (m_passes[p].culled) {
+			continue;
+		}
+		for (const Read& read : m_passes[p].reads) {
+			int r = findResource(read.resource);
+			if (r >= 0 && static_cast<int>(p) > m_resources[r].writer) {
+				m_resources[r].lastReader = std::max(m_resources[r].lastReader, static_cast<int>(p));
+			}
+		}
+	}
+
+	// resources in order of their writers take a texture of the same format freed by an earlier pass
+	std::vector<int> order;
+	for (size_t r = 0; r < m_resources.size(); ++r) {
+		if (!m_passes[m_resources[r].writer].culled) {
+			order.push_back(static_cast<int>(r));
+		}
+	}
+	std::stable_sort(order.begin(), order.end(), [this](int a, int b) {
+		return m_resources[a].writer < m_resources[b].writer;
+		});
+	for (int r : order) {
+		Resource& resource = m_resources[r];
+		for (size_t t = 0; t < m_textures.size(); ++t) {
+			if (m_textures[t].freeAfter < resource.writer && isSameDesc(m_textures[t].desc, resource.desc)) {
+				resource.texture = static_cast<int>(t);
+				break;
+			}
+		}
+		if (resource.texture < 0) {
+			Texture texture;
+			texture.desc = resource.desc;
+			int width, height;
+			getSize(resource.desc, width, height);
+			texture.texture = createTexture(width, height, resource.desc.internalFormat, resource.desc.sourceFormat, resource.desc.sourceType);
+			m_textures.push_back(texture);
+			resource.texture = static_cast<int>(m_textures.size()) - 1;
+		}
+		m_textures[resource.texture].freeAfter = resource.lastReader;
+	}
+
+	unsigned int culled = 0;
+	osg::Group* group = new osg::Group;
+	for (size_t p = 0; p < m_passes.size(); ++p) {
+		Pass& pass = m_passes[p];
+		if (pass.culled) {
+			++culled;
+			continue;
+		}
+		osg::Camera* camera = pass.node->asCamera();
+		if (camera) {
+			int colorBuffer = 0;
+			for (const Write& write : pass.writes) {
+				int r = findResource(write.resource);
+				if (r < 0 || m_resources[r].writer != static_cast<int>(p)) {
+					continue;
+				}
+				osg::Texture2D* texture = m_textures[m_resources[r].texture].texture.get();
+				if (isDepthFormat(write.desc.internalFormat)) {
+					camera->attach(osg::Camera::DEPTH_BUFFER, texture);
+				}
+				else {
+					camera->attach(static_cast<osg::Camera::BufferComponent>(osg::Camera::COLOR_BUFFER0 + colorBuffer++), texture);
+				}
+			}
+		}
+		for (const Read& read : pass.reads) {
+			int r = findResource(read.resource);
+			if (r < 0) {
+				continue;
+			}
+			osg::StateSet* stateSet = pass.node->getOrCreateStateSet();
+			stateSet->setTextureAttributeAndModes(read.unit, m_textures[m_resources[r].texture].texture.get(), osg::StateAttribute::ON);
+			stateSet->addUniform(new osg::Uniform(read.sampler.c_str(), read.unit));
+		}
+		group->addChild(pass.node);
+	}
+
+	{
+		std::lock_guard<std::mutex> locker(m_statsMutex);
+		m_stats.passes = static_cast<unsigned int>(m_passes.size());
+		m_stats.culled = culled;
+		m_stats.resources = static_cast<unsigned int>(order.size());
+		m_stats.textures = static_cast<unsigned int>(m_textures.size());
+	}
+	resize(m_width, m_height);
+	return group;
+}
+
+void RenderGraph::resize(int width, int height)
+{
+	bool resized = m_width != width || m_height != height;
+	m_width = std::max(1, width);
+	m_height = std::max(1, height);
+
+	size_t bytes = 0;
+	for (Texture& texture : m_textures) {
+		int w, h;
+		getSize(texture.desc, w, h);
+		if (texture.texture->getTextureWidth() != w || texture.texture->getTextureHeight() != h) {
+			texture.texture->setTextureSize(w, h);
+			texture.texture->dirtyTextureObject();
+		}
+		bytes += static_cast<size_t>(w) * h * getBytesPerPixel(texture.desc.internalFormat);
+	}
+	size_t unaliasedBytes = 0;
+	for (const Resource& resource : m_resources) {
+		if (resource.texture >= 0) {
+			int w, h;
+			getSize(resource.desc, w, h);
+			unaliasedBytes += static_cast<size_t>(w) * h * getBytesPerPixel(resource.desc.internalFormat);
+		}
+	}
+	{
+		std::lock_guard<std::mutex> locker(m_statsMutex);
+		m_stats.bytes = bytes;
+		m_stats.unaliasedBytes = unaliasedBytes;
+	}
+
+	// camera passes render at the size of their outputs
+	for (size_t p = 0; p < m_passes.size(); ++p) {
+		osg::Camera* camera = m_passes[p].node->asCamera();
+		if (m_passes[p].culled || camera == nullptr || m_passes[p].writes.empty()) {
+			continue;
+		}
+		int w, h;
+		getSize(m_passes[p].writes.front().desc, w, h);
+		const osg::Viewport* viewport = camera->getViewport();
+		if (viewport == nullptr || viewport->width() != w || viewport->height() != h) {
+			camera->setViewport(0, 0, w, h);
+			resized = true;
+		}
+		if (resized) {
+			camera->dirtyAttachmentMap();
+		}
+	}
+}
+
+osg::Texture2D* RenderGraph::getTexture(const std::string& resource) const
+{
+	int r = findResource(resource);
+	if (r < 0 || m_resources[r].texture < 0) {
+		return nullptr;
+	}
+	return m_textures[m_resources[r].texture].texture.get();
+}
+
+RenderGraph::Stats RenderGraph::getStats() const
+{
+	std::lock_guard<std::mutex> locker(m_statsMutex);
+	return m_stats;
+}
@@ -0,0 +1,103 @@
+#ifndef RENDER_GRAPH_H
+#define RENDER_GRAPH_H
+
+#include <osg/Camera>
+#include <osg/Group>
+#include <osg/Texture2D>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// a texture written by one pass and read by later ones. sized by the viewport times scale, or fixed
+// when width and height are set
+struct RenderResourceDesc
+{
+	GLint internalFormat = GL_RGBA8;
+	GLenum sourceFormat = GL_RGBA;
+	GLenum sourceType = GL_UNSIGNED_BYTE;
+	float scale = 1.0f;
+	int width = 0;
+	int height = 0;
+};
+
+// passes declare the textures they write and read, compile turns them into a group of osg nodes.
+// passes whose outputs never reach a present pass are dropped, and resources whose lifetimes (from
+// the writing pass to the last reading one) don't overlap share one texture when their formats and
+// sizes match. camera passes get their outputs attached, depth formats to the depth buffer and the
+// others to COLOR_BUFFER0 up in declaration order; readers get them bound to a unit with a sampler
+// uniform. viewport sized textures are reallocated by resize. render thread only after compile,
+// except getStats
+class RenderGraph : public osg::Referenced
+{
+public:
+	struct Stats {
+		unsigned int passes = 0;
+		unsigned int culled = 0;
+		unsigned int resources = 0;
+		unsigned int textures = 0;		// after aliasing
+		size_t bytes = 0;				// of the textures
+		size_t unaliasedBytes = 0;		// one texture per resource
+	};
+
+	RenderGraph();
+
+	// a camera pass renders into its outputs, any other node draws into the view. present passes
+	// (the view, a readback) are kept however their outputs are used
+	int addPass(const std::string& name, osg::Node* node, bool present = false);
+	void write(int pass, const std::string& resource, const RenderResourceDesc& desc);
+	void read(int pass, const std::string& resource, int unit, const std::string& sampler);
+
+	// the kept passes in declaration order
+	osg::Group* compile();
+	// textures and camera viewports follow the viewport size
+	void resize(int width, int height);
+
+	osg::Texture2D* getTexture(const std::string& resource) const;
+	Stats getStats() const;
+
+protected:
+	~RenderGraph();
+
+	struct Write {
+		std::string resource;
+		RenderResourceDesc desc;
+	};
+	struct Read {
+		std::string resource;
+		int unit;
+		std::string sampler;
+	};
+	struct Pass {
+		std::string name;
+		osg::ref_ptr<osg::Node> node;
+		bool present;
+		bool culled;
+		std::vector<Write> writes;
+		std::vector<Read> reads;
+	};
+	struct Resource {
+		std::string name;
+		RenderResourceDesc desc;
+		int writer = -1;
+		int lastReader = -1;
+		int texture = -1;
+	};
+	struct Texture {
+		RenderResourceDesc desc;
+		osg::ref_ptr<osg::Texture2D> texture;
+		int freeAfter;		// last pass using it so far
+	};
+
+	int findResource(const std::string& name) const;
+	void getSize(const RenderResourceDesc& desc, int& width, int& height) const;
+
+	std::vector<Pass> m_passes;
+	std::vector<Resource> m_resources;
+	std::vector<Texture> m_textures;
+	int m_width;
+	int m_height;
+	mutable std::mutex m_statsMutex;
+	Stats m_stats;
+};
+
+#endif
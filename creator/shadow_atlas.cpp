@@ -0,0 +1,407 @@
+#include "shadow_atlas.h"
+#include "deferred_rendering.h"
+#include <render_info.h>
+#include <osg/Geode>
+#include <osg/Geometry>
+#include <osgUtil/CullVisitor>
+#include <algorithm>
+
+// below this the light doesn't get a shadow at all
+static const float s_importanceCutOff = 0.01f;
+
+// grants the tiles right before the shadow groups below are culled
+class ShadowAtlasCullCallback : public osg::NodeCallback
+{
+public:
+	virtual void operator()(osg::Node* node, osg::NodeVisitor* nv) override {
+		auto cv = nv->asCullVisitor();
+		if (cv != nullptr && cv->getCurrentCamera() != nullptr) {
+			static_cast<ShadowAtlas*>(node)->allocate(cv->getCurrentCamera());
+		}
+		traverse(node, nv);
+	}
+};
+
+static osg::Program* createMomentBlurProgram()
+{
+	const char* vs = R"(
+#version 330 core
+uniform vec4 blurRect; // uv rect of the source
+out vec2 uv;
+void main()
+{
+	// a strip of four corners, no vertex arrays
+	vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);
+	uv = blurRect.xy + corner * blurRect.zw;
+	gl_Position = vec4(corner * 2.0 - 1.0, 0.0, 1.0);
+}
+)";
+	const char* fs = R"(
+#version 330 core
+uniform sampler2D blurSource;
+uniform vec4 blurRect;
+uniform vec2 blurStep; // one source texel along the blur direction
+in vec2 uv;
+layout(location = 0) out vec2 moments;
+// 9 texel gaussian in 5 bilinear fetches, clamped to the rect so the neighbouring tiles don't bleed in
+const float offsets[3] = float[](0.0, 1.3846153846, 3.2307692308);
+const float weights[3] = float[](0.2270270270, 0.3162162162, 0.0702702703);
+void main()
+{
+	vec2 halfTexel = 0.5 / vec2(textureSize(blurSource, 0));
+	vec2 minUV = blurRect.xy + halfTexel;
+	vec2 maxUV = blurRect.xy + blurRect.zw - halfTexel;
+	moments = textureLod(blurSource, uv, 0.0).rg * weights[0];
+	for (int i = 1; i < 3; ++i) {
+		moments += textureLod(blurSource, clamp(uv + blurStep * offsets[i], minUV, maxUV), 0.0).rg * weights[i];
+		moments += textureLod(blurSource, clamp(uv - blurStep * offsets[i], minUV, maxUV), 0.0).rg * weights[i];
+	}
+}
+)";
+	osg::Program* program = new osg::Program;
+	program->addShader(new osg::Shader(osg::Shader::VERTEX, vs));
+	program->addShader(new osg::Shader(osg::Shader::FRAGMENT, fs));
+	return program;
+}
+
+static osg::Camera* createMomentBlurCamera(ShadowAtlas* atlas, osg::Texture2D* source, osg::Texture2D* target,
+	bool generateMipMaps, osg::Program* program, osg::Uniform* rect, const osg::Vec2& step)
+{
+	osg::Geometry* quad = new osg::Geometry;
+	quad->setUseDisplayList(false);
+	quad->setUseVertexBufferObjects(true);
+	quad->addPrimitiveSet(new osg::DrawArrays(GL_TRIANGLE_STRIP, 0, 4));
+	quad->setCullingActive(false);
+	// no vertex arrays to compute it from
+	quad->setInitialBound(osg::BoundingBox(-1.0f, -1.0f, 0.0f, 1.0f, 1.0f, 0.0f));
+	osg::Geode* geode = new osg::Geode;
+	geode->addDrawable(quad);
+
+	osg::Camera* camera = createRTTCamera(SHADOW_TILE_SIZE_MAX, SHADOW_TILE_SIZE_MAX);
+	camera->setRenderOrder(osg::Camera::POST_RENDER);
+	camera->setReferenceFrame(osg::Transform::ABSOLUTE_RF);
+	camera->setComputeNearFarMode(osg::CullSettings::DO_NOT_COMPUTE_NEAR_FAR);
+	camera->setClearMask(0);
+	camera->attach(osg::Camera::COLOR_BUFFER0, target, 0, 0, generateMipMaps);
+	// stands in for the depth buffer the fbo would otherwise allocate at the first viewport's size,
+	// the blur neither tests nor writes it
+	camera->attach(osg::Camera::DEPTH_BUFFER, atlas->getAtlasTexture());
+	camera->addChild(geode);
+
+	// protected against the shadow camera's overridden depth program
+	osg::StateSet* stateSet = camera->getOrCreateStateSet();
+	stateSet->setAttributeAndModes(program, osg::StateAttribute::ON | osg::StateAttribute::PROTECTED);
+	stateSet->setMode(GL_DEPTH_TEST, osg::StateAttribute::OFF | osg::StateAttribute::PROTECTED);
+	stateSet->setTextureAttributeAndModes(0, source, osg::StateAttribute::ON | osg::StateAttribute::PROTECTED);
+	stateSet->addUniform(new osg::Uniform("blurSource", 0));
+	stateSet->addUniform(rect);
+	stateSet->addUniform(new osg::Uniform("blurStep", step));
+	return camera;
+}
+
+// sampled through shadow samplers, each fetch compares and bilinearly filters 2x2 texels
+static void setDepthCompare(osg::Texture* texture)
+{
+	texture->setShadowComparison(true);
+	texture->setShadowCompareFunc(osg::Texture::LEQUAL);
+	texture->setShadowTextureMode(osg::Texture::LUMINANCE);
+	texture->setFilter(osg::Texture::MAG_FILTER, osg::Texture::LINEAR);
+}
+
+MomentBlur::MomentBlur(ShadowAtlas* atlas)
+{
+	osg::Texture2D* moments = atlas->getMomentTexture();
+	osg::Texture2D* scratch = atlas->getMomentScratchTexture();
+	osg::Program* program = createMomentBlurProgram();
+	m_horizontalRect = new osg::Uniform("blurRect", osg::Vec4());
+	m_verticalRect = new osg::Uniform("blurRect", osg::Vec4());
+	m_horizontal = createMomentBlurCamera(atlas, moments, scratch, false, program, m_horizontalRect,
+		osg::Vec2(1.0f / SHADOW_ATLAS_SIZE, 0.0f));
+	m_vertical = createMomentBlurCamera(atlas, scratch, moments, true, program, m_verticalRect,
+		osg::Vec2(0.0f, 1.0f / SHADOW_TILE_SIZE_MAX));
+	addChild(m_horizontal);
+	addChild(m_vertical);
+}
+
+void MomentBlur::setTile(const osg::Vec3i& tile)
+{
+	float atlasScale = 1.0f / SHADOW_ATLAS_SIZE;
+	float scratchScale = 1.0f / SHADOW_TILE_SIZE_MAX;
+	// the tile into the scratch texture's corner, and back
+	m_horizontal->setViewport(0, 0, tile.z(), tile.z());
+	m_horizontalRect->set(osg::Vec4(tile.x() * atlasScale, tile.y() * atlasScale, tile.z() * atlasScale, tile.z() * atlasScale));
+	m_vertical->setViewport(tile.x(), tile.y(), tile.z(), tile.z());
+	m_verticalRect->set(osg::Vec4(0.0f, 0.0f, tile.z() * scratchScale, tile.z() * scratchScale));
+}
+
+ShadowAtlas::ShadowAtlas()
+{
+	m_atlas = createDepthTexture(SHADOW_ATLAS_SIZE, SHADOW_ATLAS_SIZE);
+	m_cubeFaces = createDepthTextureArray(POINT_SHADOW_SIZE, POINT_SHADOW_SIZE, POINT_SHADOW_SLOTS * 6);
+	setDepthCompare(m_atlas.get());
+	setDepthCompare(m_cubeFaces.get());
+	setCullCallback(new ShadowAtlasCullCallback);
+	// tiles are granted and fitted for the main camera, linked views sample the same maps
+	setNodeMask(MAIN_VIEW_ONLY_MASK);
+}
+
+ShadowAtlas* ShadowAtlas::get(osgViewer::View* view)
+{
+	auto existing = static_cast<ShadowAtlas*>(ViewInfo::getShadowAtlas(view));
+	if (existing) {
+		return existing;
+	}
+
+	osg::ref_ptr<ShadowAtlas> atlas = new ShadowAtlas;
+	ViewInfo::getOtherGroup(view)->addChild(atlas);
+
+	auto stateSet = ViewInfo::getModelGroup(view)->getOrCreateStateSet();
+	stateSet->setTextureAttributeAndModes(0, atlas->getAtlasTexture(), osg::StateAttribute::ON);
+	osg::Uniform* atlasUniform = new osg::Uniform(osg::Uniform::SAMPLER_2D_SHADOW, "shadowAtlas");
+	atlasUniform->set(0);
+	stateSet->addUniform(atlasUniform);
+	stateSet->setTextureAttributeAndModes(1, atlas->getCubeFaceTexture(), osg::StateAttribute::ON);
+	osg::Uniform* cubeFacesUniform = new osg::Uniform(osg::Uniform::SAMPLER_2D_ARRAY_SHADOW, "pointShadowFaces");
+	cubeFacesUniform->set(1);
+	stateSet->addUniform(cubeFacesUniform);
+	// set before the texture exists, so the sampler never defaults onto the shadow unit 0
+	osg::Uniform* momentsUniform = new osg::Uniform(osg::Uniform::SAMPLER_2D, "shadowMoments");
+	momentsUniform->set(SHADOW_MOMENTS_UNIT);
+	stateSet->addUniform(momentsUniform);
+	atlas->m_modelStateSet = stateSet;
+
+	ViewInfo::setShadowAtlas(view, atlas);
+	return atlas.get();
+}
+
+osg::Texture2D* ShadowAtlas::getMomentTexture()
+{
+	if (m_moments.valid()) {
+		return m_moments.get();
+	}
+	// unorm keeps the precision even over [0, 1], which the depth is mapped to
+	m_moments = createTexture(SHADOW_ATLAS_SIZE, SHADOW_ATLAS_SIZE, GL_RG16, GL_RG, GL_UNSIGNED_SHORT);
+	m_moments->setFilter(osg::Texture::MIN_FILTER, osg::Texture::LINEAR_MIPMAP_LINEAR);
+	m_moments->setFilter(osg::Texture::MAG_FILTER, osg::Texture::LINEAR);
+	// allocated up front, complete before the first blur generates them
+	m_moments->setNumMipmapLevels(SHADOW_MOMENTS_LEVELS);
+	m_momentScratch = createTexture(SHADOW_TILE_SIZE_MAX, SHADOW_TILE_SIZE_MAX, GL_RG16, GL_RG, GL_UNSIGNED_SHORT);
+	m_momentScratch->setFilter(osg::Texture::MIN_FILTER, osg::Texture::LINEAR);
+	m_momentScratch->setFilter(osg::Texture::MAG_FILTER, osg::Texture::LINEAR);
+	if (m_modelStateSet.valid()) {
+		m_modelStateSet->setTextureAttributeAndModes(SHADOW_MOMENTS_UNIT, m_moments.get(), osg::StateAttribute::ON);
+	}
+	return m_moments.get();
+}
+
+void ShadowAtlas::addLight(osg::Group* shadowGroup, ShadowAtlasClient* client)
+{
+	Entry entry;
+	entry.client = client;
+	entry.shadowGroup = shadowGroup;
+	entry.importance = 0.0f;
+	entry.tileSize = 0;
+	entry.cubeSlot = -1;
+	m_entries.push_back(entry);
+
+	// hidden until the first allocation grants it something
+	shadowGroup->setNodeMask(0);
+	addChild(shadowGroup);
+}
+
+void ShadowAtlas::allocate(osg::Camera* mainCamera)
+{
+	for (auto& entry : m_entries) {
+		entry.importance = entry.client->getShadowImportance(mainCamera);
+	}
+	allocateTiles();
+	allocateCubeSlots();
+}
+
+float ShadowAtlas::getScreenCoverage(osg::Camera* mainCamera, const osg::BoundingSphere& bs)
+{
+	if (!bs.valid()) {
+		return 0.0f;
+	}
+	osg::Vec3d eye, center, up;
+	mainCamera->getViewMatrixAsLookAt(eye, center, up);
+	osg::Vec3d toCenter = osg::Vec3d(bs.center()) - eye;
+	double distance = toCenter.length();
+	if (distance <= bs.radius()) {
+		return 1.0f;
+	}
+	osg::Vec3d lookDir = center - eye;
+	lookDir.normalize();
+	if (toCenter * lookDir < -bs.radius()) {
+		return 0.0f;
+	}
+	double fovy, aspect, zNear, zFar;
+	if (!mainCamera->getProjectionMatrixAsPerspective(fovy, aspect, zNear, zFar)) {
+		return 1.0f;
+	}
+	double coverage = bs.radius() / (distance * tan(osg::DegreesToRadians(fovy) * 0.5));
+	return static_cast<float>(std::min(coverage, 1.0));
+}
+
+int ShadowAtlas::tileSizeForImportance(float importance)
+{
+	if (importance < s_importanceCutOff) {
+		return 0;
+	}
+	if (importance >= 0.5f) {
+		return SHADOW_TILE_SIZE_MAX;
+	}
+	if (importance >= 0.25f) {
+		return SHADOW_TILE_SIZE_MAX / 2;
+	}
+	if (importance >= 0.1f) {
+		return SHADOW_TILE_SIZE_MAX / 4;
+	}
+	return SHADOW_TILE_SIZE_MIN;
+}
+
+void ShadowAtlas::allocateTiles()
+{
+	std::vector<Entry*> entries;
+	for (auto& entry : m_entries) {
+		if (entry.client->getNumShadowTiles() > 0) {
+			entries.push_back(&entry);
+		}
+	}
+	std::stable_sort(entries.begin(), entries.end(), [](const Entry* a, const Entry* b) {
+		return a->importance > b->importance;
+		});
+
+	std::vector<int> sizes(entries.size());
+	for (size_t i = 0; i < entries.size(); ++i) {
+		sizes[i] = tileSizeForImportance(entries[i]->importance);
+	}
+
+	// shrink the least important shadows until everything fits, drop them once they are at the minimum
+	std::vector<std::vector<osg::Vec3i>> tiles;
+	while (!pack(entries, sizes, tiles)) {
+		int shrink = -1;
+		for (int i = static_cast<int>(entries.size()) - 1; i >= 0; --i) {
+			if (sizes[i] > SHADOW_TILE_SIZE_MIN) {
+				shrink = i;
+				break;
+			}
+		}
+		if (shrink >= 0) {
+			sizes[shrink] /= 2;
+			continue;
+		}
+		for (int i = static_cast<int>(entries.size()) - 1; i >= 0; --i) {
+			if (sizes[i] > 0) {
+				sizes[i] = 0;
+				break;
+			}
+		}
+	}
+
+	// same sizes as last frame, the current rects stay so no cached map is invalidated
+	bool changed = false;
+	for (size_t i = 0; i < entries.size(); ++i) {
+		if (sizes[i] != entries[i]->tileSize || tiles[i].size() != entries[i]->tiles.size()) {
+			changed = true;
+			break;
+		}
+	}
+	if (!changed) {
+		return;
+	}
+	for (size_t i = 0; i < entries.size(); ++i) {
+		Entry* entry = entries[i];
+		entry->tileSize = sizes[i];
+		if (tiles[i] != entry->tiles) {
+			entry->tiles = tiles[i];
+			entry->client->setShadowTiles(entry->tiles);
+		}
+		entry->shadowGroup->setNodeMask(entry->tiles.empty() ? 0u : ~0u);
+	}
+}
+
+// shelf packing of power-of-two squares in descending size, which leaves no holes inside a shelf
+bool ShadowAtlas::pack(const std::vector<Entry*>& entries, const std::vector<int>& sizes, std::vector<std::vector<osg::Vec3i>>& tiles) const
+{
+	struct Item {
+		size_t entry;
+		int size;
+	};
+	std::vector<Item> items;
+	tiles.assign(entries.size(), std::vector<osg::Vec3i>());
+	for (size_t i = 0; i < entries.size(); ++i) {
+		if (sizes[i] <= 0) {
+			continue;
+		}
+		int numTiles = entries[i]->client->getNumShadowTiles();
+		for (int t = 0; t < numTiles; ++t) {
+			items.push_back({ i, sizes[i] });
+		}
+	}
+	std::stable_sort(items.begin(), items.end(), [](const Item& a, const Item& b) {
+		return a.size > b.size;
+		});
+
+	int x = 0, y = 0, shelfHeight = 0;
+	for (const auto& item : items) {
+		if (x + item.size > SHADOW_ATLAS_SIZE) {
+			x = 0;
+			y += shelfHeight;
+			shelfHeight = 0;
+		}
+		if (y + item.size > SHADOW_ATLAS_SIZE) {
+			return false;
+		}
+		tiles[item.entry].push_back(osg::Vec3i(x, y, item.size));
+		x += item.size;
+		shelfHeight = std::max(shelfHeight, item.size);
+	}
+	return true;
+}
+
+void ShadowAtlas::allocateCubeSlots()
+{
+	std::vector<Entry*> entries;
+	for (auto& entry : m_entries) {
+		if (entry.client->getNumShadowTiles() == 0) {
+			entries.push_back(&entry);
+		}
+	}
+	std::stable_sort(entries.begin(), entries.end(), [](const Entry* a, const Entry* b) {
+		return a->importance > b->importance;
+		});
+
+	size_t numGranted = 0;
+	while (numGranted < entries.size() && numGranted < POINT_SHADOW_SLOTS
+		&& entries[numGranted]->importance >= s_importanceCutOff) {
+		++numGranted;
+	}
+
+	// lights that stay among the most important keep their slot, so their cached faces stay valid
+	std::vector<int> slots(entries.size(), -1);
+	std::vector<bool> used(POINT_SHADOW_SLOTS, false);
+	for (size_t i = 0; i < numGranted; ++i) {
+		if (entries[i]->cubeSlot >= 0) {
+			slots[i] = entries[i]->cubeSlot;
+			used[slots[i]] = true;
+		}
+	}
+	for (size_t i = 0; i < numGranted; ++i) {
+		if (slots[i] >= 0) {
+			continue;
+		}
+		auto freeSlot = std::find(used.begin(), used.end(), false);
+		slots[i] = static_cast<int>(freeSlot - used.begin());
+		*freeSlot = true;
+	}
+
+	for (size_t i = 0; i < entries.size(); ++i) {
+		Entry* entry = entries[i];
+		if (slots[i] != entry->cubeSlot) {
+			entry->cubeSlot = slots[i];
+			entry->client->setShadowCubeSlot(entry->cubeSlot);
+		}
+		entry->shadowGroup->setNodeMask(entry->cubeSlot < 0 ? 0u : ~0u);
+	}
+}
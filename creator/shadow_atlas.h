@@ -0,0 +1,107 @@
+#ifndef SHADOW_ATLAS_H
+#define SHADOW_ATLAS_H
+
+#include <osg/Group>
+#include <osg/Texture2D>
+#include <osg/Texture2DArray>
+#include <osg/Vec3i>
+#include <osgViewer/View>
+#include <vector>
+
+#define SHADOW_ATLAS_SIZE 4096
+#define SHADOW_TILE_SIZE_MAX 1024
+#define SHADOW_TILE_SIZE_MIN 128
+#define POINT_SHADOW_SLOTS 8
+#define POINT_SHADOW_SIZE 512
+// texture unit of the variance moments, 0 and 1 hold the atlas and the cube faces
+#define SHADOW_MOMENTS_UNIT 7
+// mip levels of the moment atlas, one more than the shaders' SHADOW_MOMENTS_LOD_MAX
+#define SHADOW_MOMENTS_LEVELS 4
+
+// a shadowed light as seen by the atlas, implemented by the lights' shadow callbacks
+class ShadowAtlasClient
+{
+public:
+	virtual ~ShadowAtlasClient() {}
+	// screen coverage weighted by brightness, lights below the cut-off lose their shadow
+	virtual float getShadowImportance(osg::Camera* mainCamera) const = 0;
+	// number of atlas tiles wanted, 0 for point lights which take a cube slot instead
+	virtual int getNumShadowTiles() const { return 0; }
+	// granted tiles as (x, y, size) in atlas pixels, empty when the shadow is dropped
+	virtual void setShadowTiles(const std::vector<osg::Vec3i>& tiles) {}
+	// slot in the cube face array (layers slot * 6 to slot * 6 + 5), -1 when the shadow is dropped
+	virtual void setShadowCubeSlot(int slot) {}
+};
+
+class ShadowAtlas;
+
+// separable blur of one tile of the moment atlas, ping-ponged through a scratch texture of the
+// largest tile size. a child of the shadow camera rendering the tile: its two POST_RENDER cameras
+// run right after that camera, the second one regenerates the moment atlas' mipmaps
+class MomentBlur : public osg::Group
+{
+public:
+	MomentBlur(ShadowAtlas* atlas);
+
+	void setTile(const osg::Vec3i& tile);
+
+protected:
+	osg::ref_ptr<osg::Camera> m_horizontal;
+	osg::ref_ptr<osg::Camera> m_vertical;
+	osg::ref_ptr<osg::Uniform> m_horizontalRect;
+	osg::ref_ptr<osg::Uniform> m_verticalRect;
+};
+
+// hosts the shadow passes of every light of a view. directional cascades and spot lights render into
+// square tiles of one large depth texture, point lights render their six faces into layers of a depth
+// texture array. both compare in hardware (sampler2DShadow, sampler2DArrayShadow). lights filtered by
+// variance also write (depth, depth²) into a moment atlas with the same layout, which is only
+// allocated once the first such light asks for it. tiles are re-granted by importance each frame
+// before the shadow groups are culled, clients only see a change (and re-render) when their tile size
+// or slot actually changes. render thread only
+class ShadowAtlas : public osg::Group
+{
+public:
+	// created and added to the view on first use
+	static ShadowAtlas* get(osgViewer::View* view);
+
+	// shadowGroup becomes a child of the atlas and is hidden while the light has no tile
+	void addLight(osg::Group* shadowGroup, ShadowAtlasClient* client);
+
+	osg::Texture2D* getAtlasTexture() { return m_atlas.get(); }
+	osg::Texture2DArray* getCubeFaceTexture() { return m_cubeFaces.get(); }
+	// RG16 moments, mipmapped, created and bound to the model group on first use
+	osg::Texture2D* getMomentTexture();
+	osg::Texture2D* getMomentScratchTexture() { return m_momentScratch.get(); }
+
+	void allocate(osg::Camera* mainCamera);
+
+	// fraction of the screen height covered by the sphere's radius, 1 when the eye is inside
+	static float getScreenCoverage(osg::Camera* mainCamera, const osg::BoundingSphere& bs);
+
+protected:
+	ShadowAtlas();
+
+	struct Entry {
+		ShadowAtlasClient* client;
+		osg::ref_ptr<osg::Group> shadowGroup;
+		float importance;
+		int tileSize;		// 0 when the shadow is dropped
+		std::vector<osg::Vec3i> tiles;
+		int cubeSlot;
+	};
+
+	void allocateTiles();
+	void allocateCubeSlots();
+	bool pack(const std::vector<Entry*>& entries, const std::vector<int>& sizes, std::vector<std::vector<osg::Vec3i>>& tiles) const;
+	static int tileSizeForImportance(float importance);
+
+	std::vector<Entry> m_entries;
+	osg::ref_ptr<osg::Texture2D> m_atlas;
+	osg::ref_ptr<osg::Texture2DArray> m_cubeFaces;
+	osg::ref_ptr<osg::Texture2D> m_moments;
+	osg::ref_ptr<osg::Texture2D> m_momentScratch;
+	osg::ref_ptr<osg::StateSet> m_modelStateSet;
+};
+
+#endif
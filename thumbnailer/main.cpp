@@ -0,0 +1,53 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QDirIterator>
+#include <QElapsedTimer>
+#include <algorithm>
+#include "thumbnail_renderer.h"
+
+// Thumbnailer [--size 256] [--recursive] [--software] <input directory> <output directory>
+// software GL works too, e.g. mesa's llvmpipe with LIBGL_ALWAYS_SOFTWARE=1. --software needs no GL at all
+int main(int argc, char** argv)
+{
+	QCoreApplication app(argc, argv);
+	QCommandLineParser parser;
+	parser.setApplicationDescription("renders a png thumbnail of every stl / step file of a directory");
+	parser.addHelpOption();
+	QCommandLineOption sizeOption("size", "thumbnail width and height in pixels", "pixels", "256");
+	QCommandLineOption recursiveOption("recursive", "include sub directories");
+	QCommandLineOption softwareOption("software", "rasterize on the CPU instead of a GL context");
+	parser.addOption(sizeOption);
+	parser.addOption(recursiveOption);
+	parser.addOption(softwareOption);
+	parser.addPositionalArgument("input", "directory of model files");
+	parser.addPositionalArgument("output", "directory the thumbnails are written to");
+	parser.process(app);
+
+	const QStringList arguments = parser.positionalArguments();
+	if (arguments.size() != 2) {
+		parser.showHelp(1);
+	}
+
+	QStringList files;
+	QDirIterator it(arguments[0], { "*.stl", "*.stp", "*.step" }, QDir::Files,
+		parser.isSet(recursiveOption) ? QDirIterator::Subdirectories : QDirIterator::NoIteratorFlags);
+	while (it.hasNext()) {
+		files.push_back(it.next());
+	}
+	if (files.isEmpty()) {
+		qWarning() << "no model files in" << arguments[0];
+		return 1;
+	}
+
+	ThumbnailRenderer renderer(std::max(parser.value(sizeOption).toInt(), 16), parser.isSet(softwareOption));
+	if (!renderer.init()) {
+		return 1;
+	}
+	QElapsedTimer timer;
+	timer.start();
+	int written = renderer.render(files, arguments[1]);
+	double seconds = timer.elapsed() / 1000.0;
+	qInfo() << written << "of" << files.size() << "thumbnails in" << seconds << "s,"
+		<< (seconds > 0.0 ? written * 60.0 / seconds : 0.0) << "per minute";
+	return written == files.size() ? 0 : 1;
+}
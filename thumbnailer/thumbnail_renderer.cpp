@@ -0,0 +1,236 @@
+#include "thumbnail_renderer.h"
+#include <common/io/read_model_file.h>
+#include <drawable.h>
+#include <shader_manager.h>
+#include <osg/Geode>
+#include <QFileInfo>
+#include <QImage>
+#include <QtConcurrent>
+#include <algorithm>
+#include <deque>
+
+// materials and cached program binaries, as the view's initial draw callback does in Creator
+class ThumbnailInitialDrawCallback : public osg::Camera::DrawCallback
+{
+public:
+	ThumbnailInitialDrawCallback(MaterialTable* table) : m_table(table) {}
+
+	virtual void operator () (osg::RenderInfo& renderInfo) const override {
+		m_table->upload(*renderInfo.getState());
+		ShaderMgr::instance()->updateProgramBinaries(*renderInfo.getState());
+	}
+
+private:
+	osg::ref_ptr<MaterialTable> m_table;
+};
+
+ThumbnailRenderer::ThumbnailRenderer(int size, bool software) :
+	m_size(size),
+	m_software(software),
+	m_written(0)
+{
+
+}
+
+ThumbnailRenderer::~ThumbnailRenderer()
+{
+	m_decodePool.waitForDone();
+	QThreadPool::globalInstance()->waitForDone();
+}
+
+bool ThumbnailRenderer::init()
+{
+	if (m_software) {
+		return true;
+	}
+	osg::ref_ptr<osg::GraphicsContext::Traits> traits = new osg::GraphicsContext::Traits;
+	traits->x = 0;
+	traits->y = 0;
+	traits->width = m_size;
+	traits->height = m_size;
+	traits->pbuffer = true;
+	traits->doubleBuffer = false;
+	traits->windowDecoration = false;
+	traits->glContextVersion = "4.5";
+	osg::ref_ptr<osg::GraphicsContext> gc = osg::GraphicsContext::createGraphicsContext(traits);
+	if (!gc.valid()) {
+		qWarning() << "can't create an offscreen GL 4.5 context";
+		return false;
+	}
+	gc->getState()->setUseModelViewAndProjectionUniforms(true);
+
+	m_target = new osg::Texture2D;
+	m_target->setTextureSize(m_size, m_size);
+	m_target->setInternalFormat(GL_RGBA8);
+	m_target->setFilter(osg::Texture::MIN_FILTER, osg::Texture::NEAREST);
+	m_target->setFilter(osg::Texture::MAG_FILTER, osg::Texture::NEAREST);
+
+	m_viewer = new osgViewer::Viewer;
+	m_viewer->setThreadingModel(osgViewer::ViewerBase::SingleThreaded);
+	osg::Camera* camera = m_viewer->getCamera();
+	camera->setGraphicsContext(gc);
+	camera->setViewport(0, 0, m_size, m_size);
+	camera->setRenderTargetImplementation(osg::Camera::FRAME_BUFFER_OBJECT);
+	camera->attach(osg::Camera::COLOR_BUFFER0, m_target);
+	camera->attach(osg::Camera::DEPTH_BUFFER, GL_DEPTH_COMPONENT24);
+	// transparent around the model
+	camera->setClearColor(osg::Vec4(0.0f, 0.0f, 0.0f, 0.0f));
+	camera->setComputeNearFarMode(osg::CullSettings::DO_NOT_COMPUTE_NEAR_FAR);
+
+	m_materialTable = new MaterialTable;
+	camera->setInitialDrawCallback(new ThumbnailInitialDrawCallback(m_materialTable));
+	osg::StateSet* stateSet = camera->getOrCreateStateSet();
+	stateSet->setAttributeAndModes(m_materialTable->getBinding());
+	stateSet->setAttributeAndModes(ShaderMgr::instance()->getShader(ShaderMgr::s_meshProgram));
+	// slot 0 holds the default material
+	stateSet->addUniform(new osg::Uniform("nodeMaterialIndex", 0));
+
+	m_model = new osg::Group;
+	m_viewer->setSceneData(m_model);
+	m_viewer->realize();
+	if (!m_viewer->isRealized()) {
+		qWarning() << "can't realize the offscreen context";
+		return false;
+	}
+
+	m_capture = new FrameCapture(m_viewer.get());
+	m_capture->setSource(m_target);
+	m_capture->attach(camera);
+	return true;
+}
+
+ThumbnailRenderer::Decoded ThumbnailRenderer::decode(const QString& filePath)
+{
+	ReadModelFile modelFile(filePath);
+	modelFile.read();
+	return { filePath, modelFile.getModelData() };
+}
+
+bool ThumbnailRenderer::show(const ModelData& data)
+{
+	m_model->removeChildren(0, m_model->getNumChildren());
+	if (!data.m_vertexArray.valid() || data.m_vertexArray->empty()) {
+		return false;
+	}
+
+	Mesh mesh;
+	mesh.setModelData(data);
+	osg::ref_ptr<osg::Geode> geode = new osg::Geode;
+	geode->addDrawable(mesh.createGeometry());
+	m_model->addChild(geode);
+
+	osg::Matrixd view, projection;
+	fitCamera(geode->getBound(), view, projection);
+	m_viewer->getCamera()->setViewMatrix(view);
+	m_viewer->getCamera()->setProjectionMatrix(projection);
+	return true;
+}
+
+void ThumbnailRenderer::fitCamera(const osg::BoundingSphere& bs, osg::Matrixd& view, osg::Matrixd& projection)
+{
+	// from the front right and above
+	osg::Vec3d direction(1.0, -1.0, 0.8);
+	direction.normalize();
+	double radius = std::max(static_cast<double>(bs.radius()), 1e-6);
+	double distance = radius / std::sin(osg::DegreesToRadians(THUMBNAIL_FOV * 0.5));
+	view.makeLookAt(bs.center() + direction * distance, bs.center(), osg::Vec3d(0.0, 0.0, 1.0));
+	projection.makePerspective(THUMBNAIL_FOV, 1.0, std::max(distance - radius, distance * 0.001), distance + radius);
+}
+
+int ThumbnailRenderer::render(const QStringList& files, const QString& outputDirectory)
+{
+	QDir output(outputDirectory);
+	output.mkpath(".");
+	m_written = 0;
+	if (m_software) {
+		return renderSoftware(files, output);
+	}
+	FrameCapture::Callback callback = [this](const QString& filePath, bool saved) {
+		if (saved) {
+			++m_written;
+		}
+		else {
+			qWarning() << "can't write" << filePath;
+		}
+	};
+
+	// decoding runs a bounded number of files ahead of the renderer
+	const int lookAhead = std::max(2, m_decodePool.maxThreadCount() * 2);
+	std::deque<QFuture<Decoded>> decoding;
+	int next = 0;
+	auto decodeAhead = [&]() {
+		while (next < files.size() && static_cast<int>(decoding.size()) < lookAhead) {
+			decoding.push_back(QtConcurrent::run(&m_decodePool, &ThumbnailRenderer::decode, files[next++]));
+		}
+	};
+	decodeAhead();
+
+	while (!decoding.empty() || !m_capture->isIdle()) {
+		// a new model only goes in once the last one's copy was issued, a pending request would
+		// otherwise capture it. with no copy left to poll, waiting for the decoder costs nothing
+		if (!decoding.empty() && m_capture->getPendingCount() == 0 &&
+			(decoding.front().isFinished() || m_capture->isIdle())) {
+			Decoded decoded = decoding.front().result();
+			decoding.pop_front();
+			decodeAhead();
+			if (!show(decoded.data)) {
+				qWarning() << "nothing to render in" << decoded.filePath;
+				continue;
+			}
+			m_capture->captureFrame(output.filePath(QFileInfo(decoded.filePath).fileName() + ".png"), 0, 0, callback);
+		}
+		m_viewer->frame();
+		// frames that only poll the copies in flight draw nothing
+		if (m_capture->getPendingCount() == 0) {
+			m_model->removeChildren(0, m_model->getNumChildren());
+		}
+	}
+
+	QThreadPool::globalInstance()->waitForDone();
+	return m_written;
+}
+
+int ThumbnailRenderer::renderSoftware(const QStringList& files, const QDir& output)
+{
+	SoftwareRasterizer rasterizer(m_size, m_size);
+	const int lookAhead = std::max(2, m_decodePool.maxThreadCount() * 2);
+	std::deque<QFuture<Decoded>> decoding;
+	int next = 0;
+	while (next < files.size() || !decoding.empty()) {
+		while (next < files.size() && static_cast<int>(decoding.size()) < lookAhead) {
+			decoding.push_back(QtConcurrent::run(&m_decodePool, &ThumbnailRenderer::decode, files[next++]));
+		}
+		Decoded decoded = decoding.front().result();
+		decoding.pop_front();
+		if (!decoded.data.m_vertexArray.valid() || decoded.data.m_vertexArray->empty()) {
+			qWarning() << "nothing to render in" << decoded.filePath;
+			continue;
+		}
+
+		// the bound the drawable would have
+		osg::BoundingBox bb;
+		for (const osg::Vec3f& vertex : *decoded.data.m_vertexArray) {
+			bb.expandBy(vertex);
+		}
+		osg::Matrixd view, projection;
+		fitCamera(osg::BoundingSphere(bb), view, projection);
+		rasterizer.setCamera(view, projection);
+		rasterizer.clear(osg::Vec4(0.0f, 0.0f, 0.0f, 0.0f));
+		rasterizer.draw(decoded.data, osg::Matrixd());
+
+		// encoded on the pool while the next model is drawn, rows flipped to top down
+		QImage image(rasterizer.getColor().data(), m_size, m_size, QImage::Format_RGBA8888);
+		QString filePath = output.filePath(QFileInfo(decoded.filePath).fileName() + ".png");
+		QThreadPool::globalInstance()->start([this, image = image.mirrored(), filePath]() {
+			if (image.save(filePath)) {
+				++m_written;
+			}
+			else {
+				qWarning() << "can't write" << filePath;
+			}
+			});
+	}
+
+	QThreadPool::globalInstance()->waitForDone();
+	return m_written;
+}
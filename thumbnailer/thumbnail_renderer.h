@@ -0,0 +1,58 @@
+#ifndef THUMBNAIL_RENDERER_H
+#define THUMBNAIL_RENDERER_H
+
+#include <common/model_data.h>
+#include <common/software_rasterizer.h>
+#include <frame_capture.h>
+#include <material_table.h>
+#include <osg/Texture2D>
+#include <osgViewer/Viewer>
+#include <QDir>
+#include <QStringList>
+#include <QThreadPool>
+#include <atomic>
+
+// vertical field of view of the fixed thumbnail camera, degrees
+#define THUMBNAIL_FOV 30.0
+
+// renders model files into square png thumbnails without a window. a pbuffer context draws every
+// model with the mesh program from one fixed direction into a render target, FrameCapture copies it
+// out asynchronously and encodes on the thread pool. files are decoded on worker threads ahead of
+// the renderer, so decoding, drawing and the readback of the previous files overlap.
+// in software mode SoftwareRasterizer draws the same view on the CPU and no context is created
+class ThumbnailRenderer
+{
+public:
+	ThumbnailRenderer(int size, bool software = false);
+	~ThumbnailRenderer();
+
+	// creates the offscreen context, false without one. nothing to do in software mode
+	bool init();
+	// writes outputDirectory/<file name>.png for every file, returns how many were written
+	int render(const QStringList& files, const QString& outputDirectory);
+
+protected:
+	struct Decoded {
+		QString filePath;
+		ModelData data;
+	};
+	static Decoded decode(const QString& filePath);
+	// swaps the drawn model and fits the camera to it, false for an empty model
+	bool show(const ModelData& data);
+	// the fixed view direction, far enough for the bounding sphere to fill the view
+	static void fitCamera(const osg::BoundingSphere& bs, osg::Matrixd& view, osg::Matrixd& projection);
+	int renderSoftware(const QStringList& files, const QDir& output);
+
+	int m_size;
+	bool m_software;
+	osg::ref_ptr<osgViewer::Viewer> m_viewer;
+	osg::ref_ptr<osg::Group> m_model;
+	osg::ref_ptr<osg::Texture2D> m_target;
+	osg::ref_ptr<MaterialTable> m_materialTable;
+	osg::ref_ptr<FrameCapture> m_capture;
+
+	QThreadPool m_decodePool;
+	std::atomic<int> m_written;
+};
+
+#endif